@@ -40,6 +40,9 @@
 #include <linux/signal.h>
 #include <linux/ioctl.h>
 #include <linux/skbuff.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <net/bluetooth/bluetooth.h>
 #include <net/bluetooth/hci_core.h>
@@ -49,11 +52,41 @@
 
 #define VERSION "1.2"
 
+/* Take whole SCO frames in one copy into preallocated buffers, next to
+ * the regular frame reassembly which still handles everything else */
+#define H4_SCO_FASTPATH
+
+/* Largest SCO frame, dlen is a single byte */
+#define H4_SCO_SKB_SIZE	(HCI_SCO_HDR_SIZE + 255)
+
+static int sco_ring_size = 8;
+static struct dentry *h4_debugfs_root;
+
 struct h4_struct {
 	unsigned long rx_state;
 	unsigned long rx_count;
 	struct sk_buff *rx_skb;
 	struct sk_buff_head txq;
+
+	/* SCO rx buffers, refilled from process context so the receive
+	 * path does not allocate while a voice link is up */
+	struct sk_buff_head sco_ring;
+	struct work_struct sco_refill;
+
+	/* Position in the stream handed to the reassembly: bytes left of
+	 * the current packet, or its header while that is incomplete */
+	int frag_left;
+	u8 frag_hdr[1 + HCI_ACL_HDR_SIZE];
+	int frag_hdr_len;
+
+	struct {
+		u32 sco_fast;		/* Frames taken in one copy */
+		u32 sco_split;		/* Frames spread over several reads */
+		u32 ring_empty;		/* Ring exhausted, fell back to alloc */
+		u32 ring_low;		/* Fewest buffers left in the ring */
+	} stats;
+
+	struct dentry *debugfs;
 };
 
 /* H4 receiver States */
@@ -63,6 +96,64 @@ struct h4_struct {
 #define H4_W4_SCO_HDR		3
 #define H4_W4_DATA		4
 
+static void h4_sco_refill(struct work_struct *work)
+{
+	struct h4_struct *h4 = container_of(work, struct h4_struct, sco_refill);
+	struct sk_buff *skb;
+
+	while (skb_queue_len(&h4->sco_ring) < sco_ring_size) {
+		skb = bt_skb_alloc(H4_SCO_SKB_SIZE, GFP_KERNEL);
+		if (!skb)
+			break;
+		skb_queue_tail(&h4->sco_ring, skb);
+	}
+}
+
+/* Take a SCO rx buffer, topping the ring up once it is half drained */
+static struct sk_buff *h4_sco_skb(struct h4_struct *h4)
+{
+	struct sk_buff *skb = skb_dequeue(&h4->sco_ring);
+	u32 left = skb_queue_len(&h4->sco_ring);
+
+	if (left < h4->stats.ring_low)
+		h4->stats.ring_low = left;
+	if (left < sco_ring_size / 2)
+		schedule_work(&h4->sco_refill);
+
+	if (skb)
+		return skb;
+
+	h4->stats.ring_empty++;
+	return bt_skb_alloc(H4_SCO_SKB_SIZE, GFP_ATOMIC);
+}
+
+static int h4_stats_show(struct seq_file *m, void *v)
+{
+	struct h4_struct *h4 = m->private;
+
+	seq_printf(m, "sco_ring:   %u/%d\n", skb_queue_len(&h4->sco_ring),
+		   sco_ring_size);
+	seq_printf(m, "sco_fast:   %u\n", h4->stats.sco_fast);
+	seq_printf(m, "sco_split:  %u\n", h4->stats.sco_split);
+	seq_printf(m, "ring_empty: %u\n", h4->stats.ring_empty);
+	seq_printf(m, "ring_low:   %u\n", h4->stats.ring_low);
+
+	return 0;
+}
+
+static int h4_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, h4_stats_show, inode->i_private);
+}
+
+static const struct file_operations h4_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= h4_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 /* Initialize protocol */
 static int h4_open(struct hci_uart *hu)
 {
@@ -76,6 +167,17 @@ static int h4_open(struct hci_uart *hu)
 
 	skb_queue_head_init(&h4->txq);
 
+	skb_queue_head_init(&h4->sco_ring);
+	INIT_WORK(&h4->sco_refill, h4_sco_refill);
+	h4->stats.ring_low = sco_ring_size;
+	schedule_work(&h4->sco_refill);
+
+	/* One stats file per tty, e.g. /sys/kernel/debug/hci_h4/ttyS1 */
+	if (!IS_ERR_OR_NULL(h4_debugfs_root))
+		h4->debugfs = debugfs_create_file(hu->tty->name, 0444,
+						  h4_debugfs_root, h4,
+						  &h4_stats_fops);
+
 	hu->priv = h4;
 	return 0;
 }
@@ -105,6 +207,10 @@ static int h4_close(struct hci_uart *hu)
 
 	kfree_skb(h4->rx_skb);
 
+	cancel_work_sync(&h4->sco_refill);
+	skb_queue_purge(&h4->sco_ring);
+	debugfs_remove(h4->debugfs);
+
 	hu->priv = NULL;
 	kfree(h4);
 
@@ -157,13 +263,37 @@ static inline int h4_check_data_len(struct hci_dev *hdev, struct h4_struct *h4,
 	return 0;
 }
 
+#ifdef H4_SCO_FASTPATH
+/* Pass up a SCO frame that arrived whole, header and payload in one copy */
+static void h4_recv_sco(struct hci_uart *hu, struct h4_struct *h4,
+			const char *frame, int len)
+{
+	struct sk_buff *skb = h4_sco_skb(h4);
+
+	if (!skb) {
+		BT_ERR("Can't allocate mem for SCO packet");
+		hu->hdev->stat.err_rx++;
+		return;
+	}
+
+	skb->dev = (void *) hu->hdev;
+	bt_cb(skb)->pkt_type = HCI_SCODATA_PKT;
+	memcpy(skb_put(skb, len), frame, len);
+	h4->stats.sco_fast++;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+	hci_recv_frame(skb);
+#else
+	hci_recv_frame(hu->hdev, skb);
+#endif
+}
+#endif
+
 /* Recv data */
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 35)
 
-static int h4_recv(struct hci_uart *hu, void *data, int count)
+static int h4_recv_stream(struct hci_uart *hu, void *data, int count)
 {
-
-
 	int ret;
 
 	ret = hci_recv_stream_fragment(hu->hdev, data, count);
@@ -175,7 +305,115 @@ static int h4_recv(struct hci_uart *hu, void *data, int count)
 	return count;
 }
 
+#ifdef H4_SCO_FASTPATH
+
+/* Header size of a packet type, without the type byte */
+static int h4_hdr_size(u8 type)
+{
+	switch (type) {
+	case HCI_EVENT_PKT:
+		return HCI_EVENT_HDR_SIZE;
+	case HCI_ACLDATA_PKT:
+		return HCI_ACL_HDR_SIZE;
+	case HCI_SCODATA_PKT:
+		return HCI_SCO_HDR_SIZE;
+	}
+	return -1;
+}
+
+/* Payload length from a complete header, including the type byte */
+static int h4_data_len(const u8 *hdr)
+{
+	switch (hdr[0]) {
+	case HCI_EVENT_PKT:
+		return hdr[2];
+	case HCI_ACLDATA_PKT:
+		return hdr[3] | hdr[4] << 8;
+	}
+	return hdr[3];
+}
+
+/*
+ * Only SCO frames which arrive whole are taken aside. Everything else,
+ * including SCO frames split across reads, is handed to the stream
+ * reassembly as before. The frame boundaries are followed here, so a SCO
+ * frame is never taken out of the middle of a packet being reassembled.
+ */
+static int h4_recv(struct hci_uart *hu, void *data, int count)
+{
+	struct h4_struct *h4 = hu->priv;
+	u8 *ptr = data;
+	int left = count;
+	int hlen, len, ret;
+
+	BT_DBG("hu %p count %d", hu, count);
+
+	while (left) {
+		if (h4->frag_hdr_len) {
+			/* Header split across reads */
+			hlen = 1 + h4_hdr_size(h4->frag_hdr[0]);
+			len = min_t(int, hlen - h4->frag_hdr_len, left);
+			memcpy(h4->frag_hdr + h4->frag_hdr_len, ptr, len);
+			h4->frag_hdr_len += len;
+			if (h4->frag_hdr_len == hlen) {
+				h4->frag_left = h4_data_len(h4->frag_hdr);
+				h4->frag_hdr_len = 0;
+			}
+		} else if (h4->frag_left) {
+			len = min_t(int, h4->frag_left, left);
+			h4->frag_left -= len;
+		} else if ((hlen = h4_hdr_size(*ptr)) < 0) {
+			/* Skip it like the manual parser, the reassembly
+			 * would drop the rest of the buffer */
+			BT_ERR("Unknown HCI packet type %2.2x", *ptr);
+			hu->hdev->stat.err_rx++;
+			ptr++; left--;
+			continue;
+		} else if (left > hlen) {
+			len = 1 + hlen + h4_data_len(ptr);
+			if (*ptr == HCI_SCODATA_PKT) {
+				if (left >= len) {
+					h4_recv_sco(hu, h4, (char *) ptr + 1, len - 1);
+					ptr += len; left -= len;
+					continue;
+				}
+				h4->stats.sco_split++;
+			}
+			if (len > left) {
+				h4->frag_left = len - left;
+				len = left;
+			}
+		} else {
+			if (*ptr == HCI_SCODATA_PKT)
+				h4->stats.sco_split++;
+			memcpy(h4->frag_hdr, ptr, left);
+			h4->frag_hdr_len = left;
+			len = left;
+		}
+
+		ret = h4_recv_stream(hu, ptr, len);
+		if (ret < 0) {
+			h4->frag_left = 0;
+			h4->frag_hdr_len = 0;
+			return ret;
+		}
+		ptr += len; left -= len;
+	}
+
+	return count;
+}
+
 #else
+
+static int h4_recv(struct hci_uart *hu, void *data, int count)
+{
+	return h4_recv_stream(hu, data, count);
+}
+
+#endif
+
+#else
+
 static int h4_recv(struct hci_uart *hu, void *data, int count)
 {
 	struct h4_struct *h4 = hu->priv;
@@ -220,7 +458,7 @@ static int h4_recv(struct hci_uart *hu, void *data, int count)
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 				h4_check_data_len(h4, eh->plen);
 #else
-				h4_check_data_len(hu->dev, h4, eh->plen);
+				h4_check_data_len(hu->hdev, h4, eh->plen);
 #endif
 				continue;
 
@@ -233,7 +471,7 @@ static int h4_recv(struct hci_uart *hu, void *data, int count)
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 				h4_check_data_len(h4, dlen);
 #else
-				h4_check_data_len(hu->dev, h4, dlen);
+				h4_check_data_len(hu->hdev, h4, dlen);
 #endif
 				continue;
 
@@ -245,7 +483,7 @@ static int h4_recv(struct hci_uart *hu, void *data, int count)
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 				h4_check_data_len(h4, sh->dlen);
 #else
-				h4_check_data_len(hu->dev, h4, sh->dlen);
+				h4_check_data_len(hu->hdev, h4, sh->dlen);
 #endif
 				continue;
 			}
@@ -269,6 +507,17 @@ static int h4_recv(struct hci_uart *hu, void *data, int count)
 
 		case HCI_SCODATA_PKT:
 			BT_DBG("SCO packet");
+#ifdef H4_SCO_FASTPATH
+			if (count > HCI_SCO_HDR_SIZE) {
+				len = HCI_SCO_HDR_SIZE + (__u8) ptr[3];
+				if (count > len) {
+					h4_recv_sco(hu, h4, ptr + 1, len);
+					ptr += len + 1; count -= len + 1;
+					continue;
+				}
+			}
+			h4->stats.sco_split++;
+#endif
 			h4->rx_state = H4_W4_SCO_HDR;
 			h4->rx_count = HCI_SCO_HDR_SIZE;
 			type = HCI_SCODATA_PKT;
@@ -284,6 +533,11 @@ static int h4_recv(struct hci_uart *hu, void *data, int count)
 		ptr++; count--;
 
 		/* Allocate packet */
+#ifdef H4_SCO_FASTPATH
+		if (type == HCI_SCODATA_PKT)
+			h4->rx_skb = h4_sco_skb(h4);
+		else
+#endif
 		h4->rx_skb = bt_skb_alloc(HCI_MAX_FRAME_SIZE, GFP_ATOMIC);
 		if (!h4->rx_skb) {
 			BT_ERR("Can't allocate mem for new packet");
@@ -321,9 +575,10 @@ int __init h4_init(void)
 {
 	int err = hci_uart_register_proto(&h4p);
 
-	if (!err)
+	if (!err) {
 		BT_INFO("HCI H4 protocol initialized");
-	else
+		h4_debugfs_root = debugfs_create_dir("hci_h4", NULL);
+	} else
 		BT_ERR("HCI H4 protocol registration failed");
 
 	return err;
@@ -331,5 +586,10 @@ int __init h4_init(void)
 
 int __exit h4_deinit(void)
 {
+	debugfs_remove_recursive(h4_debugfs_root);
+	h4_debugfs_root = NULL;
 	return hci_uart_unregister_proto(&h4p);
 }
+
+module_param(sco_ring_size, int, 0644);
+MODULE_PARM_DESC(sco_ring_size, "Preallocated H4 SCO receive buffers per device");
@@ -40,6 +40,10 @@
 #include <linux/signal.h>
 #include <linux/ioctl.h>
 #include <linux/skbuff.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <net/bluetooth/bluetooth.h>
 #include <net/bluetooth/hci_core.h>
@@ -62,6 +66,111 @@ static int reset = 0;
 
 static struct hci_uart_proto *hup[HCI_UART_MAX_PROTO];
 
+/* ------- TX scheduler ------ */
+/* Frames from the HCI core wait in one queue per class and are handed to
+ * the protocol one at a time, so SCO never sits behind a burst of ACL that
+ * was already given to H4/H5. Each class may write at most its budget of
+ * bytes per wakeup (0 = unlimited), which bounds how much ACL can be
+ * queued in the tty ahead of the next voice frame. */
+enum {
+	HCI_UART_TXQ_SCO,
+	HCI_UART_TXQ_CMD,
+	HCI_UART_TXQ_ACL,
+	HCI_UART_TXQ_NUM
+};
+
+static const char *const hci_uart_txq_name[HCI_UART_TXQ_NUM] = {
+	"sco", "cmd", "acl"
+};
+
+static int sco_budget = 0;
+static int cmd_budget = 1024;
+static int acl_budget = 1024;
+
+/* Small frames are copied into one buffer and written together, up to what
+ * the tty can take right now */
+static bool tx_coalesce = 1;
+#define HCI_UART_WBUF_SIZE	4096
+#define HCI_UART_WBUF_FRAMES	64
+
+/* Bucket n counts waits of [2^(n-1), 2^n) usecs, the last one the rest */
+#define HCI_UART_LAT_BUCKETS	16
+
+/* Only ever updated from one context at a time (tx under HCI_UART_SENDING,
+ * rx under rx_lock), debugfs reads it without locking */
+struct hci_uart_lat {
+	u32 hist[HCI_UART_LAT_BUCKETS];
+	u32 max_us;
+};
+
+struct hci_uart_txq {
+	struct sk_buff_head q;
+	u32 pkts;
+	u64 bytes;
+	struct hci_uart_lat wait;	/* Enqueue to handed to the protocol */
+	struct hci_uart_lat sent;	/* Enqueue to taken by the tty */
+};
+
+/* hci_uart.h is shared with the stock driver, so the scheduler state
+ * lives in a wrapper allocated around each hci_uart. */
+struct hci_uart_ldisc {
+	struct hci_uart hu;
+	struct hci_uart_txq txq[HCI_UART_TXQ_NUM];
+	u32 budget_stops;		/* Wakeups ended on a byte budget */
+
+	/* Coalesced bytes not yet taken by the tty are at wbuf[woff..wlen) */
+	u8 wbuf[HCI_UART_WBUF_SIZE];
+	unsigned int woff, wlen;
+
+	/* Frames in wbuf, wframe[wdone..wframes) still wait for the tty to
+	 * take their last byte */
+	struct {
+		unsigned int end;
+		int pkt_type;
+		ktime_t tstamp;
+	} wframe[HCI_UART_WBUF_FRAMES];
+	unsigned int wdone, wframes;
+
+	struct {
+		u64 bytes;		/* Bytes accepted by the tty */
+		u32 writes;		/* tty->ops->write calls */
+		u32 frames;		/* Frames fully written */
+		u32 batched;		/* Frames that went out in a batch */
+		u32 batches;		/* Writes carrying more than one frame */
+		ktime_t start;
+	} wstats;
+
+	/* Time the protocol spends on one chunk from the tty, frame
+	 * reassembly and the hand over to the HCI core included */
+	struct hci_uart_lat rx_recv;
+	u32 rx_chunks;
+
+	struct dentry *debugfs;
+};
+
+#define to_ldisc(h)	container_of(h, struct hci_uart_ldisc, hu)
+
+static struct dentry *hci_uart_debugfs_root;
+
+static inline void hci_uart_lat_add(struct hci_uart_lat *lat, s64 us)
+{
+	if (us < 0)
+		us = 0;
+	lat->hist[min_t(int, fls64(us), HCI_UART_LAT_BUCKETS - 1)]++;
+	lat->max_us = max_t(u32, lat->max_us, us);
+}
+
+static void hci_uart_lat_show(struct seq_file *m, const char *name,
+			      const struct hci_uart_lat *lat)
+{
+	int i;
+
+	seq_printf(m, "%s_us:", name);
+	for (i = 0; i < HCI_UART_LAT_BUCKETS; i++)
+		seq_printf(m, " %u", lat->hist[i]);
+	seq_puts(m, "\n");
+}
+
 int hci_uart_register_proto(struct hci_uart_proto *p)
 {
 	if (p->id >= HCI_UART_MAX_PROTO)
@@ -116,23 +225,215 @@ static inline void hci_uart_tx_complete(struct hci_uart *hu, int pkt_type)
 	}
 }
 
-static inline struct sk_buff *hci_uart_dequeue(struct hci_uart *hu)
+static inline int hci_uart_txq_class(int pkt_type)
+{
+	switch (pkt_type) {
+	case HCI_SCODATA_PKT:
+		return HCI_UART_TXQ_SCO;
+	case HCI_ACLDATA_PKT:
+		return HCI_UART_TXQ_ACL;
+	default:
+		/* Commands and protocol frames such as H5 acks */
+		return HCI_UART_TXQ_CMD;
+	}
+}
+
+/* The protocol carries the enqueue time over to the frame it writes, own
+ * frames (acks, link control) have none */
+static inline void hci_uart_tx_sent(struct hci_uart *hu, int pkt_type,
+				    ktime_t tstamp)
+{
+	int class = hci_uart_txq_class(pkt_type);
+
+	if (ktime_to_ns(tstamp))
+		hci_uart_lat_add(&to_ldisc(hu)->txq[class].sent,
+				 ktime_us_delta(ktime_get(), tstamp));
+}
+
+static inline int hci_uart_txq_budget(int class)
+{
+	switch (class) {
+	case HCI_UART_TXQ_SCO:
+		return sco_budget;
+	case HCI_UART_TXQ_CMD:
+		return cmd_budget;
+	default:
+		return acl_budget;
+	}
+}
+
+static void hci_uart_txq_enqueue(struct hci_uart *hu, struct sk_buff *skb)
+{
+	struct hci_uart_ldisc *hul = to_ldisc(hu);
+
+	skb->tstamp = ktime_get();
+	skb_queue_tail(&hul->txq[hci_uart_txq_class(bt_cb(skb)->pkt_type)].q,
+		       skb);
+}
+
+static void hci_uart_txq_purge(struct hci_uart *hu)
+{
+	struct hci_uart_ldisc *hul = to_ldisc(hu);
+	int i;
+
+	for (i = 0; i < HCI_UART_TXQ_NUM; i++)
+		skb_queue_purge(&hul->txq[i].q);
+}
+
+/* Hand the next frame to the protocol: highest class first that still has
+ * budget left in this wakeup. Returns 0 if nothing could be moved. */
+static int hci_uart_txq_feed(struct hci_uart *hu, int *sent)
+{
+	struct hci_uart_ldisc *hul = to_ldisc(hu);
+	struct hci_uart_txq *txq;
+	struct sk_buff *skb;
+	int i, budget, held = 0;
+
+	for (i = 0; i < HCI_UART_TXQ_NUM; i++) {
+		txq = &hul->txq[i];
+		if (skb_queue_empty(&txq->q))
+			continue;
+
+		budget = hci_uart_txq_budget(i);
+		if (budget > 0 && sent[i] >= budget) {
+			held = 1;
+			continue;
+		}
+
+		skb = skb_dequeue(&txq->q);
+		if (!skb)
+			continue;
+
+		hci_uart_lat_add(&txq->wait,
+				 ktime_us_delta(ktime_get(), skb->tstamp));
+		txq->pkts++;
+		txq->bytes += skb->len;
+
+		hu->proto->enqueue(hu, skb);
+		return 1;
+	}
+
+	if (held)
+		hul->budget_stops++;
+
+	return 0;
+}
+
+static inline struct sk_buff *hci_uart_dequeue(struct hci_uart *hu, int *sent)
 {
 	struct sk_buff *skb = hu->tx_skb;
 
-	if (!skb)
-		skb = hu->proto->dequeue(hu);
-	else
+	if (skb) {
 		hu->tx_skb = NULL;
+		return skb;
+	}
+
+	skb = hu->proto->dequeue(hu);
+
+	/* The protocol has nothing of its own left (or is waiting for acks,
+	 * then one more frame just waits inside it) */
+	if (!skb && hci_uart_txq_feed(hu, sent))
+		skb = hu->proto->dequeue(hu);
 
 	return skb;
 }
 
+static int hci_uart_tty_send(struct hci_uart *hu, const u8 *data, int count)
+{
+	struct hci_uart_ldisc *hul = to_ldisc(hu);
+	struct tty_struct *tty = hu->tty;
+	int len;
+
+	set_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
+	len = tty->ops->write(tty, data, count);
+	hu->hdev->stat.byte_tx += len;
+	hul->wstats.writes++;
+	hul->wstats.bytes += len;
+
+	return len;
+}
+
+/* Push out what the tty did not take of the last batch, a frame counts
+ * as sent once the tty has taken all of it. Returns 0 once the buffer is
+ * empty. */
+static int hci_uart_wbuf_flush(struct hci_uart *hu)
+{
+	struct hci_uart_ldisc *hul = to_ldisc(hu);
+
+	if (hul->woff < hul->wlen)
+		hul->woff += hci_uart_tty_send(hu, hul->wbuf + hul->woff,
+					       hul->wlen - hul->woff);
+
+	while (hul->wdone < hul->wframes &&
+	       hul->wframe[hul->wdone].end <= hul->woff) {
+		hul->wstats.frames++;
+		hci_uart_tx_complete(hu, hul->wframe[hul->wdone].pkt_type);
+		hci_uart_tx_sent(hu, hul->wframe[hul->wdone].pkt_type,
+				 hul->wframe[hul->wdone].tstamp);
+		hul->wdone++;
+	}
+
+	if (hul->woff < hul->wlen)
+		return -EAGAIN;
+
+	hul->woff = hul->wlen = 0;
+	hul->wdone = hul->wframes = 0;
+	return 0;
+}
+
+/* Copy whole frames into wbuf while they fit in room, then write them at
+ * once. A frame that does not fit is parked in tx_skb for the per-skb
+ * path. Returns the number of frames copied. */
+static int hci_uart_write_batch(struct hci_uart *hu, int *sent, int room)
+{
+	struct hci_uart_ldisc *hul = to_ldisc(hu);
+	struct sk_buff *skb;
+	int n = 0, frames = 0;
+
+	room = min(room, HCI_UART_WBUF_SIZE);
+
+	while (frames < HCI_UART_WBUF_FRAMES &&
+	       (skb = hci_uart_dequeue(hu, sent))) {
+		if (skb->len > room - n) {
+			hu->tx_skb = skb;
+			break;
+		}
+
+		memcpy(hul->wbuf + n, skb->data, skb->len);
+		n += skb->len;
+		sent[hci_uart_txq_class(bt_cb(skb)->pkt_type)] += skb->len;
+
+		/* Completed by hci_uart_wbuf_flush() as the tty takes it */
+		hul->wframe[frames].end = n;
+		hul->wframe[frames].pkt_type = bt_cb(skb)->pkt_type;
+		hul->wframe[frames].tstamp = skb->tstamp;
+		frames++;
+
+		kfree_skb(skb);
+	}
+
+	if (!frames)
+		return 0;
+
+	hul->woff = 0;
+	hul->wlen = n;
+	hul->wdone = 0;
+	hul->wframes = frames;
+	if (frames > 1) {
+		hul->wstats.batches++;
+		hul->wstats.batched += frames;
+	}
+
+	hci_uart_wbuf_flush(hu);
+	return frames;
+}
+
 int hci_uart_tx_wakeup(struct hci_uart *hu)
 {
 	struct tty_struct *tty = hu->tty;
-	struct hci_dev *hdev = hu->hdev;
+	int sent[HCI_UART_TXQ_NUM];
 	struct sk_buff *skb;
+	int room;
 
 	if (test_and_set_bit(HCI_UART_SENDING, &hu->tx_state)) {
 		set_bit(HCI_UART_TX_WAKEUP, &hu->tx_state);
@@ -143,13 +444,26 @@ int hci_uart_tx_wakeup(struct hci_uart *hu)
 
 restart:
 	clear_bit(HCI_UART_TX_WAKEUP, &hu->tx_state);
+	memset(sent, 0, sizeof(sent));
 
-	while ((skb = hci_uart_dequeue(hu))) {
+	while (!hci_uart_wbuf_flush(hu)) {
 		int len;
 
-		set_bit(TTY_DO_WRITE_WAKEUP, &tty->flags);
-		len = tty->ops->write(tty, skb->data, skb->len);
-		hdev->stat.byte_tx += len;
+		if (tx_coalesce && tty->ops->write_room) {
+			room = tty->ops->write_room(tty);
+			if (room > 0 && hci_uart_write_batch(hu, sent, room))
+				continue;
+		}
+
+		/* No room for a batch, or the next frame is larger than the
+		 * room left: write it directly and let the tty take what it
+		 * can */
+		skb = hci_uart_dequeue(hu, sent);
+		if (!skb)
+			break;
+
+		len = hci_uart_tty_send(hu, skb->data, skb->len);
+		sent[hci_uart_txq_class(bt_cb(skb)->pkt_type)] += len;
 
 		skb_pull(skb, len);
 		if (skb->len) {
@@ -157,7 +471,9 @@ restart:
 			break;
 		}
 
+		to_ldisc(hu)->wstats.frames++;
 		hci_uart_tx_complete(hu, bt_cb(skb)->pkt_type);
+		hci_uart_tx_sent(hu, bt_cb(skb)->pkt_type, skb->tstamp);
 		kfree_skb(skb);
 	}
 
@@ -193,6 +509,10 @@ static int hci_uart_flush(struct hci_dev *hdev)
 		kfree_skb(hu->tx_skb); hu->tx_skb = NULL;
 	}
 
+	hci_uart_txq_purge(hu);
+	to_ldisc(hu)->woff = to_ldisc(hu)->wlen = 0;
+	to_ldisc(hu)->wdone = to_ldisc(hu)->wframes = 0;
+
 	/* Flush any pending characters in the driver and discipline. */
 	tty_ldisc_flush(tty);
 	tty_driver_flush_buffer(tty);
@@ -240,13 +560,67 @@ static int hci_uart_send_frame(struct hci_dev *hdev, struct sk_buff *skb)
 
 	BT_DBG("%s: type %d len %d", hdev->name, bt_cb(skb)->pkt_type, skb->len);
 
-	hu->proto->enqueue(hu, skb);
+	hci_uart_txq_enqueue(hu, skb);
 
 	hci_uart_tx_wakeup(hu);
 
 	return 0;
 }
 
+static int hci_uart_stats_show(struct seq_file *m, void *v)
+{
+	struct hci_uart_ldisc *hul = m->private;
+	struct hci_uart_txq *txq;
+	char name[16];
+	u32 secs;
+	int i;
+
+	seq_printf(m, "budget_stops: %u\n", hul->budget_stops);
+	seq_printf(m, "tx_bytes: %llu writes %u frames %u batched %u in %u batches\n",
+		   (unsigned long long) hul->wstats.bytes, hul->wstats.writes,
+		   hul->wstats.frames, hul->wstats.batched,
+		   hul->wstats.batches);
+	secs = div_s64(ktime_to_ms(ktime_sub(ktime_get(), hul->wstats.start)),
+		       MSEC_PER_SEC);
+	if (secs)
+		seq_printf(m, "per_sec: writes %u frames %u saved %u\n",
+			   hul->wstats.writes / secs, hul->wstats.frames / secs,
+			   (hul->wstats.batched - hul->wstats.batches) / secs);
+
+	for (i = 0; i < HCI_UART_TXQ_NUM; i++) {
+		txq = &hul->txq[i];
+		seq_printf(m, "%s: queued %u pkts %u bytes %llu budget %d max_us %u\n",
+			   hci_uart_txq_name[i], skb_queue_len(&txq->q),
+			   txq->pkts, (unsigned long long) txq->bytes,
+			   hci_uart_txq_budget(i), txq->wait.max_us);
+		snprintf(name, sizeof(name), "%s_lat", hci_uart_txq_name[i]);
+		hci_uart_lat_show(m, name, &txq->wait);
+		seq_printf(m, "%s_sent_max_us: %u\n", hci_uart_txq_name[i],
+			   txq->sent.max_us);
+		snprintf(name, sizeof(name), "%s_sent", hci_uart_txq_name[i]);
+		hci_uart_lat_show(m, name, &txq->sent);
+	}
+
+	seq_printf(m, "rx_chunks: %u max_us %u\n", hul->rx_chunks,
+		   hul->rx_recv.max_us);
+	hci_uart_lat_show(m, "rx_recv", &hul->rx_recv);
+
+	return 0;
+}
+
+static int hci_uart_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hci_uart_stats_show, inode->i_private);
+}
+
+static const struct file_operations hci_uart_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= hci_uart_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 4, 0)
 static void hci_uart_destruct(struct hci_dev *hdev)
 {
@@ -271,6 +645,8 @@ static void hci_uart_destruct(struct hci_dev *hdev)
 static int hci_uart_tty_open(struct tty_struct *tty)
 {
 	struct hci_uart *hu = (void *) tty->disc_data;
+	struct hci_uart_ldisc *hul;
+	int i;
 
 	BT_DBG("tty %p", tty);
 
@@ -284,10 +660,21 @@ static int hci_uart_tty_open(struct tty_struct *tty)
 	if (tty->ops->write == NULL)
 		return -EOPNOTSUPP;
 
-	if (!(hu = kzalloc(sizeof(struct hci_uart), GFP_KERNEL))) {
+	if (!(hul = kzalloc(sizeof(struct hci_uart_ldisc), GFP_KERNEL))) {
 		BT_ERR("Can't allocate control structure");
 		return -ENFILE;
 	}
+	hu = &hul->hu;
+
+	for (i = 0; i < HCI_UART_TXQ_NUM; i++)
+		skb_queue_head_init(&hul->txq[i].q);
+	hul->wstats.start = ktime_get();
+
+	/* e.g. /sys/kernel/debug/hci_uart/ttyS1 */
+	if (!IS_ERR_OR_NULL(hci_uart_debugfs_root))
+		hul->debugfs = debugfs_create_file(tty->name, 0444,
+						   hci_uart_debugfs_root, hul,
+						   &hci_uart_stats_fops);
 
 	tty->disc_data = hu;
 	hu->tty = tty;
@@ -335,7 +722,9 @@ static void hci_uart_tty_close(struct tty_struct *tty)
 			}
 			hu->proto->close(hu);
 		}
-		kfree(hu);
+		hci_uart_txq_purge(hu);
+		debugfs_remove(to_ldisc(hu)->debugfs);
+		kfree(to_ldisc(hu));
 	}
 }
 
@@ -380,6 +769,7 @@ static void hci_uart_tty_wakeup(struct tty_struct *tty)
 static void hci_uart_tty_receive(struct tty_struct *tty, const u8 *data, char *flags, int count)
 {
 	struct hci_uart *hu = (void *)tty->disc_data;
+	ktime_t start;
 
 	if (!hu || tty != hu->tty)
 		return;
@@ -388,7 +778,11 @@ static void hci_uart_tty_receive(struct tty_struct *tty, const u8 *data, char *f
 		return;
 
 	spin_lock(&hu->rx_lock);
+	start = ktime_get();
 	hu->proto->recv(hu, (void *) data, count);
+	hci_uart_lat_add(&to_ldisc(hu)->rx_recv,
+			 ktime_us_delta(ktime_get(), start));
+	to_ldisc(hu)->rx_chunks++;
 	hu->hdev->stat.byte_rx += count;
 	spin_unlock(&hu->rx_lock);
 
@@ -602,6 +996,8 @@ static int __init hci_uart_init(void)
 		return err;
 	}
 
+	hci_uart_debugfs_root = debugfs_create_dir("hci_uart", NULL);
+
 #ifdef CONFIG_BT_HCIUART_H4
 	h4_init();
 #endif
@@ -649,6 +1045,8 @@ static void __exit hci_uart_exit(void)
 	h5_deinit();
 //#endif
 
+	debugfs_remove_recursive(hci_uart_debugfs_root);
+
 	/* Release tty registration of line discipline */
 	if ((err = tty_unregister_ldisc(N_HCI)))
 		BT_ERR("Can't unregister HCI line discipline (%d)", err);
@@ -663,6 +1061,16 @@ module_param(reset, bool, 0644);
 MODULE_PARM_DESC(reset, "Send HCI reset command on initialization");
 #endif
 
+module_param(sco_budget, int, 0644);
+MODULE_PARM_DESC(sco_budget, "SCO bytes written per tx wakeup, 0 for no limit");
+module_param(cmd_budget, int, 0644);
+MODULE_PARM_DESC(cmd_budget, "Command bytes written per tx wakeup, 0 for no limit");
+module_param(acl_budget, int, 0644);
+MODULE_PARM_DESC(acl_budget, "ACL bytes written per tx wakeup, 0 for no limit");
+
+module_param(tx_coalesce, bool, 0644);
+MODULE_PARM_DESC(tx_coalesce, "Gather small frames into one tty write");
+
 MODULE_AUTHOR("Marcel Holtmann <marcel@holtmann.org>");
 MODULE_DESCRIPTION("Bluetooth HCI UART driver ver " VERSION);
 MODULE_VERSION(VERSION);
@@ -39,12 +39,16 @@
 #include <linux/ioctl.h>
 #include <linux/skbuff.h>
 #include <linux/bitrev.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <asm/unaligned.h>
 
 #include <net/bluetooth/bluetooth.h>
 #include <net/bluetooth/hci_core.h>
 
 #include "hci_uart.h"
+#include "../../tools/rtk_hciattach/h5_codec.h"
 #include <linux/version.h>
 #define VERSION "1.0"
 
@@ -52,10 +56,37 @@ static int txcrc = 1;
 //static int hciextn = 1;
 
 #define H5_TXWINSIZE	4
+#define H5_MAX_TXWINSIZE	7	/* 3 bit sequence numbers */
+#define H5_RTO_INIT_US	(USEC_PER_SEC / 4)
+
+/* Encoded frames are built in buffers preallocated per device. Payloads
+ * above H5_POOL_MTU (only large ACL) still get their own skb. */
+#define H5_POOL_SIZE	16
+#define H5_POOL_MTU	1028
+#define H5_POOL_FRAME	((H5_POOL_MTU + 6) * 2 + 2)
+
+/* Defaults for a device, rtk_hciattach writes the window it negotiated
+ * with the controller into txwinsize before attaching the line discipline.
+ */
+static int txwinsize = H5_TXWINSIZE;
+static int rto_min_ms = 20;
+static int rto_max_ms = 1000;
+
+static struct dentry *h5_debugfs_root;
 #define H5_ACK_PKT	0x00
 #define H5_LE_PKT	    0x0F
 #define H5_VDRSPEC_PKT	0x0E
 
+/* Bucket n counts frames of [2^(n-1), 2^n) usecs, the last one the rest */
+#define H5_LAT_BUCKETS	16
+
+enum {
+	H5_RX_SCO,
+	H5_RX_ACL,
+	H5_RX_EVT,
+	H5_RX_NUM
+};
+
 struct h5_struct {
 	struct sk_buff_head unack;	/* Unack'ed packets queue */
 	struct sk_buff_head rel;	/* Reliable packets queue */
@@ -86,38 +117,59 @@ struct h5_struct {
 
 	/* Reliable packet sequence number - used to assign seq to each rel pkt. */
 	u8	msgq_txseq;
+
+	u8	tx_win;			/* Reliable packets allowed in flight */
+	u8	tx_retrans;		/* Seqnos sent more than once, no RTT sample */
+	ktime_t	tx_stamp[8];		/* Last send time of each seqno */
+	u32	srtt_us;		/* Smoothed ack round trip time */
+	u32	rttvar_us;		/* Round trip time variation */
+	u32	rto_us;			/* Current retransmit timeout */
+
+	/* Time from the first byte of a frame to its hand over to the HCI
+	 * core, mostly the time the frame spends on the wire. Updated under
+	 * the ldisc rx_lock, read without locking. */
+	ktime_t	rx_start;
+	struct {
+		u32 hist[H5_LAT_BUCKETS];
+		u32 max_us;
+	} rx_lat[H5_RX_NUM];
+
+	/* The pool holds one reference to each frame, the ldisc holds another
+	 * while it writes it out. A frame whose src is set still carries the
+	 * encoding of that unacked packet and is resent as is. */
+	struct h5_frame {
+		struct sk_buff *skb;
+		struct sk_buff *src;	/* Reliable packet encoded here */
+		unsigned int len;	/* Encoded length */
+		u8 seq;
+		u8 ack;			/* Ack number carried in the header */
+	} pool[H5_POOL_SIZE];
+
+	struct {
+		u32 tx_rel;		/* Reliable packets sent */
+		u32 retrans;		/* Reliable packets sent again */
+		u32 timeouts;		/* Retransmit timer expiries */
+		u32 rtt_samples;
+		u32 rtt_min_us;
+		u32 rtt_max_us;
+		u32 cached;		/* Retransmits sent from the cached frame */
+		u32 pool_miss;		/* Frames that needed alloc_skb */
+	} stats;
+
+	struct dentry *debugfs;
 };
 
 /* ---- H5 CRC calculation ---- */
 
-/* Table for calculating CRC for polynomial 0x1021, LSB processed first,
-initial value 0xffff, bits shifted in reverse order. */
-
-static const u16 crc_table[] = {
-	0x0000, 0x1081, 0x2102, 0x3183,
-	0x4204, 0x5285, 0x6306, 0x7387,
-	0x8408, 0x9489, 0xa50a, 0xb58b,
-	0xc60c, 0xd68d, 0xe70e, 0xf78f
-};
+/* The tables live in h5_codec.h, shared with rtk_hciattach. */
 
 /* Initialise the crc calculator */
 #define H5_CRC_INIT(x) x = 0xffff
 
-/*
-   Update crc with next data byte
-
-   Implementation note
-        The data byte is treated as two nibbles.  The crc is generated
-        in reverse, i.e., bits are fed into the register from the top.
-*/
+/* Update crc with next data byte */
 static void h5_crc_update(u16 *crc, u8 d)
 {
-	u16 reg = *crc;
-
-	reg = (reg >> 4) ^ crc_table[(reg ^ d) & 0x000f];
-	reg = (reg >> 4) ^ crc_table[(reg ^ (d >> 4)) & 0x000f];
-
-	*crc = reg;
+	*crc = h5_crc_byte(*crc, d);
 }
 
 /* ---- H5 core ---- */
@@ -129,29 +181,10 @@ static void h5_slip_msgdelim(struct sk_buff *skb)
 	memcpy(skb_put(skb, 1), &pkt_delim, 1);
 }
 
-static void h5_slip_one_byte(struct sk_buff *skb, u8 c)
+/* SLIP encode len bytes at the tail of skb */
+static void h5_slip_buf(struct sk_buff *skb, const u8 *p, int len)
 {
-	const char esc_c0[2] = { 0xdb, 0xdc };
-	const char esc_db[2] = { 0xdb, 0xdd };
-	const char esc_11[2] = { 0xdb, 0xde };
-	const char esc_13[2] = { 0xdb, 0xdf };
-	
-	switch (c) {
-	case 0xc0:
-		memcpy(skb_put(skb, 2), &esc_c0, 2);
-		break;
-	case 0xdb:
-		memcpy(skb_put(skb, 2), &esc_db, 2);
-		break;
-	case 0x11:
-		memcpy(skb_put(skb, 2), &esc_11, 2);
-		break;
-	case 0x13:
-		memcpy(skb_put(skb, 2), &esc_13, 2);
-		break;
-	default:
-		memcpy(skb_put(skb, 1), &c, 1);
-	}
+	skb_put(skb, h5_slip_encode(skb_tail_pointer(skb), p, len));
 }
 
 static int h5_enqueue(struct hci_uart *hu, struct sk_buff *skb)
@@ -188,13 +221,110 @@ static int h5_enqueue(struct hci_uart *hu, struct sk_buff *skb)
 	return 0;
 }
 
+/* Rewind a pool frame to its first len bytes, the ldisc pulls the data
+ * pointer as it writes but leaves the bytes themselves alone. */
+static void h5_frame_reset(struct sk_buff *skb, unsigned int len)
+{
+	skb->data = skb->head;
+	skb_reset_tail_pointer(skb);
+	skb->len = 0;
+	if (len)
+		skb_put(skb, len);
+}
+
+/* Frames are only taken from h5_dequeue, which the ldisc serialises. The
+ * caller holds unack.lock, which guards the slot owner against the ack
+ * path clearing it in h5_pkt_cull. */
+static struct sk_buff *h5_frame_get(struct h5_struct *h5, int len)
+{
+	struct h5_frame *f;
+	int i;
+
+	lockdep_assert_held(&h5->unack.lock);
+
+	if (len <= H5_POOL_MTU) {
+		for (i = 0; i < H5_POOL_SIZE; i++) {
+			f = &h5->pool[i];
+			if (!f->skb || f->src || skb_shared(f->skb))
+				continue;
+			h5_frame_reset(f->skb, 0);
+			return skb_get(f->skb);
+		}
+	}
+
+	h5->stats.pool_miss++;
+	return alloc_skb((len + 6) * 2 + 2, GFP_ATOMIC);
+}
+
+static struct h5_frame *h5_frame_find(struct h5_struct *h5,
+				      struct sk_buff *skb, struct sk_buff *src)
+{
+	int i;
+
+	for (i = 0; i < H5_POOL_SIZE; i++) {
+		if (skb ? h5->pool[i].skb == skb : h5->pool[i].src == src)
+			return &h5->pool[i];
+	}
+
+	return NULL;
+}
+
+/* Remember that frame nskb holds the encoding of reliable packet skb */
+static void h5_frame_bind(struct h5_struct *h5, struct sk_buff *nskb,
+			  struct sk_buff *skb)
+{
+	struct h5_frame *f = h5_frame_find(h5, nskb, NULL);
+
+	if (!f)
+		return;
+
+	f->src = skb;
+	f->len = nskb->len;
+	f->seq = (h5->msgq_txseq - 1) & 0x07;
+	f->ack = h5->rxseq_txack;
+}
+
+static void h5_frame_unbind(struct h5_struct *h5, struct sk_buff *skb)
+{
+	struct h5_frame *f = h5_frame_find(h5, NULL, skb);
+
+	if (f)
+		f->src = NULL;
+}
+
+/* Hand out the cached frame of a packet being retransmitted. The header
+ * carries our ack number, so it is only reusable while that is unchanged,
+ * else the packet is encoded again from scratch. */
+static struct sk_buff *h5_frame_resend(struct h5_struct *h5,
+				       struct sk_buff *skb)
+{
+	struct h5_frame *f = h5_frame_find(h5, NULL, skb);
+
+	if (!f)
+		return NULL;
+
+	if (f->seq != h5->msgq_txseq || f->ack != h5->rxseq_txack ||
+			skb_shared(f->skb)) {
+		f->src = NULL;
+		return NULL;
+	}
+
+	h5_frame_reset(f->skb, f->len);
+	h5->msgq_txseq = (h5->msgq_txseq + 1) & 0x07;
+	h5->txack_req = 0;
+	h5->stats.cached++;
+
+	return skb_get(f->skb);
+}
+
 static struct sk_buff *h5_prepare_pkt(struct h5_struct *h5, u8 *data,
 		int len, int pkt_type)
 {
 	struct sk_buff *nskb;
 	u8 hdr[4], chan;
+	u8 crc[2];
 	u16 H5_CRC_INIT(h5_txmsg_crc);
-	int rel, i;
+	int rel;
 
 	switch (pkt_type) {
 	case HCI_ACLDATA_PKT:
@@ -236,11 +366,13 @@ static struct sk_buff *h5_prepare_pkt(struct h5_struct *h5, u8 *data,
 	   when the packet is all made of 0xc0 and 0xdb :) )
 	   + 2 (0xc0 delimiters at start and end). */
 
-	nskb = alloc_skb((len + 6) * 2 + 2, GFP_ATOMIC);
+	nskb = h5_frame_get(h5, len);
 	if (!nskb)
 		return NULL;
 
 	bt_cb(nskb)->pkt_type = pkt_type;
+	/* Set to the enqueue time of HCI packets by h5_dequeue() */
+	nskb->tstamp = ktime_set(0, 0);
 
 	h5_slip_msgdelim(nskb);
 
@@ -261,27 +393,18 @@ static struct sk_buff *h5_prepare_pkt(struct h5_struct *h5, u8 *data,
 	hdr[2] = len >> 4;
 	hdr[3] = ~(hdr[0] + hdr[1] + hdr[2]);
 
-	/* Put H5 header */
-	for (i = 0; i < 4; i++) {
-		h5_slip_one_byte(nskb, hdr[i]);
-
-		if (h5->use_crc)
-			h5_crc_update(&h5_txmsg_crc, hdr[i]);
-	}
-
-	/* Put payload */
-	for (i = 0; i < len; i++) {
-		h5_slip_one_byte(nskb, data[i]);
-
-		if (h5->use_crc)
-			h5_crc_update(&h5_txmsg_crc, data[i]);
-	}
+	/* Put H5 header and payload */
+	h5_slip_buf(nskb, hdr, 4);
+	h5_slip_buf(nskb, data, len);
 
 	/* Put CRC */
 	if (h5->use_crc) {
+		h5_txmsg_crc = h5_crc_buf(h5_txmsg_crc, hdr, 4);
+		h5_txmsg_crc = h5_crc_buf(h5_txmsg_crc, data, len);
 		h5_txmsg_crc = bitrev16(h5_txmsg_crc);
-		h5_slip_one_byte(nskb, (u8) ((h5_txmsg_crc >> 8) & 0x00ff));
-		h5_slip_one_byte(nskb, (u8) (h5_txmsg_crc & 0x00ff));
+		crc[0] = (u8) ((h5_txmsg_crc >> 8) & 0x00ff);
+		crc[1] = (u8) (h5_txmsg_crc & 0x00ff);
+		h5_slip_buf(nskb, crc, 2);
 	}
 
 	h5_slip_msgdelim(nskb);
@@ -299,8 +422,13 @@ static struct sk_buff *h5_dequeue(struct hci_uart *hu)
 	   since they have priority */
 
 	if ((skb = skb_dequeue(&h5->unrel)) != NULL) {
-		struct sk_buff *nskb = h5_prepare_pkt(h5, skb->data, skb->len, bt_cb(skb)->pkt_type);
+		struct sk_buff *nskb;
+
+		spin_lock_irqsave_nested(&h5->unack.lock, flags, SINGLE_DEPTH_NESTING);
+		nskb = h5_prepare_pkt(h5, skb->data, skb->len, bt_cb(skb)->pkt_type);
+		spin_unlock_irqrestore(&h5->unack.lock, flags);
 		if (nskb) {
+			nskb->tstamp = skb->tstamp;
 			kfree_skb(skb);
 			return nskb;
 		} else {
@@ -315,11 +443,20 @@ static struct sk_buff *h5_dequeue(struct hci_uart *hu)
 
 	spin_lock_irqsave_nested(&h5->unack.lock, flags, SINGLE_DEPTH_NESTING);
 
-	if (h5->unack.qlen < H5_TXWINSIZE && (skb = skb_dequeue(&h5->rel)) != NULL) {
-		struct sk_buff *nskb = h5_prepare_pkt(h5, skb->data, skb->len, bt_cb(skb)->pkt_type);
+	if (h5->unack.qlen < h5->tx_win && (skb = skb_dequeue(&h5->rel)) != NULL) {
+		struct sk_buff *nskb = h5_frame_resend(h5, skb);
+
+		if (!nskb) {
+			nskb = h5_prepare_pkt(h5, skb->data, skb->len, bt_cb(skb)->pkt_type);
+			if (nskb)
+				h5_frame_bind(h5, nskb, skb);
+		}
 		if (nskb) {
+			nskb->tstamp = skb->tstamp;
 			__skb_queue_tail(&h5->unack, skb);
-			mod_timer(&h5->th5, jiffies + HZ / 4);
+			h5->tx_stamp[(h5->msgq_txseq - 1) & 0x07] = ktime_get();
+			h5->stats.tx_rel++;
+			mod_timer(&h5->th5, jiffies + usecs_to_jiffies(h5->rto_us));
 			spin_unlock_irqrestore(&h5->unack.lock, flags);
 			return nskb;
 		} else {
@@ -337,7 +474,11 @@ static struct sk_buff *h5_dequeue(struct hci_uart *hu)
 	if (h5->txack_req) {
 		/* if so, craft an empty ACK pkt and send it on H5 unreliable
 		   channel 0 */
-		struct sk_buff *nskb = h5_prepare_pkt(h5, NULL, 0, H5_ACK_PKT);
+		struct sk_buff *nskb;
+
+		spin_lock_irqsave_nested(&h5->unack.lock, flags, SINGLE_DEPTH_NESTING);
+		nskb = h5_prepare_pkt(h5, NULL, 0, H5_ACK_PKT);
+		spin_unlock_irqrestore(&h5->unack.lock, flags);
 		return nskb;
 	}
 
@@ -351,18 +492,44 @@ static int h5_flush(struct hci_uart *hu)
 	return 0;
 }
 
+/* Feed one ack round trip into the retransmit timeout, as in RFC 6298 */
+static void h5_rtt_sample(struct h5_struct *h5, u32 rtt)
+{
+	u32 err;
+
+	if (!h5->stats.rtt_samples++) {
+		h5->srtt_us = rtt;
+		h5->rttvar_us = rtt / 2;
+		h5->stats.rtt_min_us = rtt;
+		h5->stats.rtt_max_us = rtt;
+	} else {
+		err = h5->srtt_us > rtt ? h5->srtt_us - rtt : rtt - h5->srtt_us;
+		h5->rttvar_us = h5->rttvar_us - (h5->rttvar_us >> 2) + (err >> 2);
+		h5->srtt_us = h5->srtt_us - (h5->srtt_us >> 3) + (rtt >> 3);
+		h5->stats.rtt_min_us = min(h5->stats.rtt_min_us, rtt);
+		h5->stats.rtt_max_us = max(h5->stats.rtt_max_us, rtt);
+	}
+
+	/* The timer can not fire sooner than the next jiffy anyway */
+	h5->rto_us = h5->srtt_us + max_t(u32, 4 * h5->rttvar_us,
+					 jiffies_to_usecs(1));
+	h5->rto_us = clamp_t(u32, h5->rto_us, rto_min_ms * USEC_PER_MSEC,
+			     rto_max_ms * USEC_PER_MSEC);
+}
+
 /* Remove ack'ed packets */
 static void h5_pkt_cull(struct h5_struct *h5)
 {
 	struct sk_buff *skb, *tmp;
 	unsigned long flags;
-	int i, pkts_to_be_removed;
-	u8 seqno;
+	int i, n, pkts_to_be_removed;
+	u8 seqno, first;
 
 	spin_lock_irqsave(&h5->unack.lock, flags);
 
 	pkts_to_be_removed = skb_queue_len(&h5->unack);
 	seqno = h5->msgq_txseq;
+	first = (seqno - pkts_to_be_removed) & 0x07;
 
 	while (pkts_to_be_removed) {
 		if (h5->rxack == seqno)
@@ -385,9 +552,21 @@ static void h5_pkt_cull(struct h5_struct *h5)
 		i++;
 
 		__skb_unlink(skb, &h5->unack);
+		h5_frame_unbind(h5, skb);
 		kfree_skb(skb);
 	}
 
+	/* Time the newest packet acked, unless it went out more than once
+	 * and the ack can not be matched to one send (Karn's algorithm) */
+	if (i) {
+		seqno = (first + i - 1) & 0x07;
+		if (!(h5->tx_retrans & BIT(seqno)))
+			h5_rtt_sample(h5, ktime_us_delta(ktime_get(),
+							 h5->tx_stamp[seqno]));
+		for (n = 0; n < i; n++)
+			h5->tx_retrans &= ~BIT((first + n) & 0x07);
+	}
+
 	if (skb_queue_empty(&h5->unack))
 		del_timer(&h5->th5);
 
@@ -544,6 +723,52 @@ static inline void h5_unslip_one_byte(struct h5_struct *h5, unsigned char byte)
 	}
 }
 
+/* The config exchange normally happens in rtk_hciattach before we attach,
+ * but if the controller is reconfigured behind our back follow the window
+ * it grants, never going above what the module was told to use. */
+static void h5_handle_conf_rsp(struct h5_struct *h5)
+{
+	u8 *data = h5->rx_skb->data;
+	unsigned long flags;
+	u8 win;
+
+	if (h5->rx_skb->len < 7 || data[4] != 0x04 || data[5] != 0x7b)
+		return;
+
+	win = data[6] & 0x07 ? data[6] & 0x07 : 1;
+	win = min_t(u8, win, clamp(txwinsize, 1, H5_MAX_TXWINSIZE));
+
+	spin_lock_irqsave(&h5->unack.lock, flags);
+	h5->tx_win = win;
+	spin_unlock_irqrestore(&h5->unack.lock, flags);
+
+	BT_INFO("H5 sliding window %u", win);
+}
+
+static void h5_rx_lat(struct h5_struct *h5, int pkt_type)
+{
+	int i;
+	s64 us;
+
+	switch (pkt_type) {
+	case HCI_SCODATA_PKT:
+		i = H5_RX_SCO;
+		break;
+	case HCI_ACLDATA_PKT:
+		i = H5_RX_ACL;
+		break;
+	case HCI_EVENT_PKT:
+		i = H5_RX_EVT;
+		break;
+	default:
+		return;
+	}
+
+	us = max_t(s64, ktime_us_delta(ktime_get(), h5->rx_start), 0);
+	h5->rx_lat[i].hist[min_t(int, fls64(us), H5_LAT_BUCKETS - 1)]++;
+	h5->rx_lat[i].max_us = max_t(u32, h5->rx_lat[i].max_us, us);
+}
+
 static void h5_complete_rx_pkt(struct hci_uart *hu)
 {
 	struct h5_struct *h5 = hu->priv;
@@ -578,6 +803,7 @@ static void h5_complete_rx_pkt(struct hci_uart *hu)
 	} else if ((h5->rx_skb->data[1] & 0x0f) == 15 && 
 			!(h5->rx_skb->data[0] & 0x80)) {
 		//h5_handle_le_pkt(hu);//Link Establishment Pkt
+		h5_handle_conf_rsp(h5);
 		pass_up = 0;
 	} else if ((h5->rx_skb->data[1] & 0x0f) == 1 && 
 			h5->rx_skb->data[0] & 0x80) {
@@ -621,6 +847,7 @@ static void h5_complete_rx_pkt(struct hci_uart *hu)
 	} else {
 		/* Pull out H5 hdr */
 		skb_pull(h5->rx_skb, 4);
+		h5_rx_lat(h5, bt_cb(h5->rx_skb)->pkt_type);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 		hci_recv_frame(h5->rx_skb);
@@ -643,6 +870,7 @@ static int h5_recv(struct hci_uart *hu, void *data, int count)
 {
 	struct h5_struct *h5 = hu->priv;
 	register unsigned char *ptr;
+	size_t n;
 
 	BT_DBG("hu %p count %d rx_state %d rx_count %ld", 
 		hu, count, h5->rx_state, h5->rx_count);
@@ -650,6 +878,22 @@ static int h5_recv(struct hci_uart *hu, void *data, int count)
 	ptr = data;
 	while (count) {
 		if (h5->rx_count) {
+			/* Copy the run of bytes that need no unescaping at once */
+			if (h5->rx_esc_state == H5_ESCSTATE_NOESC) {
+				n = h5_unslip_span(ptr, min_t(unsigned long,
+							count, h5->rx_count));
+				if (n) {
+					memcpy(skb_put(h5->rx_skb, n), ptr, n);
+					if ((h5->rx_skb->data[0] & 0x40) != 0 &&
+							h5->rx_state != H5_W4_CRC)
+						h5->message_crc = h5_crc_buf(
+							h5->message_crc, ptr, n);
+					h5->rx_count -= n;
+					ptr += n; count -= n;
+					continue;
+				}
+			}
+
 			if (*ptr == 0xc0) {
 				BT_ERR("Short H5 packet");
 				kfree_skb(h5->rx_skb);
@@ -747,6 +991,7 @@ static int h5_recv(struct hci_uart *hu, void *data, int count)
 					return 0;
 				}
 				h5->rx_skb->dev = (void *) hu->hdev;
+				h5->rx_start = ktime_get();
 				break;
 			}
 			break;
@@ -767,8 +1012,17 @@ static void h5_timed_event(unsigned long arg)
 
 	spin_lock_irqsave_nested(&h5->unack.lock, flags, SINGLE_DEPTH_NESTING);
 
+	/* Back off until an ack gives us a fresh sample */
+	if (h5->unack.qlen) {
+		h5->stats.timeouts++;
+		h5->rto_us = min_t(u32, h5->rto_us * 2,
+				   rto_max_ms * USEC_PER_MSEC);
+	}
+
 	while ((skb = __skb_dequeue_tail(&h5->unack)) != NULL) {
 		h5->msgq_txseq = (h5->msgq_txseq - 1) & 0x07;
+		h5->tx_retrans |= BIT(h5->msgq_txseq);
+		h5->stats.retrans++;
 		skb_queue_head(&h5->rel, skb);
 	}
 
@@ -777,9 +1031,57 @@ static void h5_timed_event(unsigned long arg)
 	hci_uart_tx_wakeup(hu);
 }
 
+static int h5_stats_show(struct seq_file *m, void *v)
+{
+	static const char *const h5_rx_name[H5_RX_NUM] = { "sco", "acl", "evt" };
+	struct h5_struct *h5 = m->private;
+	unsigned long flags;
+	int i, j;
+
+	spin_lock_irqsave(&h5->unack.lock, flags);
+	seq_printf(m, "tx_win:      %u\n", h5->tx_win);
+	seq_printf(m, "unack:       %u\n", skb_queue_len(&h5->unack));
+	seq_printf(m, "tx_rel:      %u\n", h5->stats.tx_rel);
+	seq_printf(m, "retrans:     %u\n", h5->stats.retrans);
+	seq_printf(m, "timeouts:    %u\n", h5->stats.timeouts);
+	seq_printf(m, "rtt_samples: %u\n", h5->stats.rtt_samples);
+	seq_printf(m, "rtt_min_us:  %u\n", h5->stats.rtt_min_us);
+	seq_printf(m, "rtt_max_us:  %u\n", h5->stats.rtt_max_us);
+	seq_printf(m, "srtt_us:     %u\n", h5->srtt_us);
+	seq_printf(m, "rttvar_us:   %u\n", h5->rttvar_us);
+	seq_printf(m, "rto_us:      %u\n", h5->rto_us);
+	seq_printf(m, "cached:      %u\n", h5->stats.cached);
+	seq_printf(m, "pool_miss:   %u\n", h5->stats.pool_miss);
+	spin_unlock_irqrestore(&h5->unack.lock, flags);
+
+	for (i = 0; i < H5_RX_NUM; i++) {
+		seq_printf(m, "rx_%s_max_us: %u\nrx_%s_us:", h5_rx_name[i],
+			   h5->rx_lat[i].max_us, h5_rx_name[i]);
+		for (j = 0; j < H5_LAT_BUCKETS; j++)
+			seq_printf(m, " %u", h5->rx_lat[i].hist[j]);
+		seq_puts(m, "\n");
+	}
+
+	return 0;
+}
+
+static int h5_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, h5_stats_show, inode->i_private);
+}
+
+static const struct file_operations h5_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= h5_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int h5_open(struct hci_uart *hu)
 {
 	struct h5_struct *h5;
+	int i;
 
 	BT_DBG("hu %p", hu);
 	
@@ -802,12 +1104,33 @@ static int h5_open(struct hci_uart *hu)
 	if (txcrc)
 		h5->use_crc = 1;
 
+	h5->tx_win = clamp(txwinsize, 1, H5_MAX_TXWINSIZE);
+	h5->rto_us = H5_RTO_INIT_US;
+	BT_INFO("H5 sliding window %u", h5->tx_win);
+
+	/* A short pool only means more alloc_skb on the tx path */
+	for (i = 0; i < H5_POOL_SIZE; i++) {
+		h5->pool[i].skb = alloc_skb(H5_POOL_FRAME, GFP_ATOMIC);
+		if (!h5->pool[i].skb) {
+			BT_ERR("Could only preallocate %d H5 frames", i);
+			break;
+		}
+	}
+
+	/* One stats file per tty, e.g. /sys/kernel/debug/hci_rtk_h5/ttyS1 */
+	if (!IS_ERR_OR_NULL(h5_debugfs_root))
+		h5->debugfs = debugfs_create_file(hu->tty->name, 0444,
+						  h5_debugfs_root, h5,
+						  &h5_stats_fops);
+
 	return 0;
 }
 
 static int h5_close(struct hci_uart *hu)
 {
 	struct h5_struct *h5 = hu->priv;
+	int i;
+
 	hu->priv = NULL;
 
 	BT_DBG("hu %p", hu);
@@ -816,6 +1139,11 @@ static int h5_close(struct hci_uart *hu)
 	skb_queue_purge(&h5->rel);
 	skb_queue_purge(&h5->unrel);
 	del_timer(&h5->th5);
+	debugfs_remove(h5->debugfs);
+
+	/* Frames still held by the ldisc go when it drops them */
+	for (i = 0; i < H5_POOL_SIZE; i++)
+		kfree_skb(h5->pool[i].skb);
 
 	kfree(h5);
 	return 0;
@@ -835,9 +1163,10 @@ int h5_init(void)
 {
 	int err = hci_uart_register_proto(&h5);
 
-	if (!err)
+	if (!err) {
 		BT_INFO("HCI Realtek H5 protocol initialized");
-	else
+		h5_debugfs_root = debugfs_create_dir("hci_rtk_h5", NULL);
+	} else
 		BT_ERR("HCI Realtek H5 protocol registration failed");
 
 	return err;
@@ -845,9 +1174,18 @@ int h5_init(void)
 
 int h5_deinit(void)
 {
+	debugfs_remove_recursive(h5_debugfs_root);
+	h5_debugfs_root = NULL;
 	return hci_uart_unregister_proto(&h5);
 }
 
+module_param(txwinsize, int, 0644);
+MODULE_PARM_DESC(txwinsize, "H5 reliable packets in flight (1-7), used from the next attach");
+module_param(rto_min_ms, int, 0644);
+MODULE_PARM_DESC(rto_min_ms, "Lower bound of the adaptive H5 retransmit timeout");
+module_param(rto_max_ms, int, 0644);
+MODULE_PARM_DESC(rto_max_ms, "Upper bound of the adaptive H5 retransmit timeout");
+
 #if 0
 module_param(hciextn, bool, 0644);
 MODULE_PARM_DESC(hciextn, "Convert HCI Extensions into H5 packets-3wire test");
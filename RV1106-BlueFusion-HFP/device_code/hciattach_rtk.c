@@ -349,11 +349,11 @@ static __inline struct sk_buff * skb_alloc(unsigned int len)
     if ((skb = malloc(len + 8))) {
         skb->max_len= len;
         skb->data_len = 0;
+        memset(skb->data, 0, len);
     } else {
         RS_ERR("Allocate skb fails!!!");
         skb = NULL;
     }
-    memset(skb->data, 0, len);
     return skb;
 }
 /**
@@ -1013,14 +1013,15 @@ static int h5_recv(rtk_hw_cfg_t *h5, void *data, int count)
                     h5->rx_skb->data[0] & 0x07, h5->rxseq_txack);
                 h5->is_txack_req = 1;
 
-                skb_free(h5->rx_skb);
-                h5->rx_state = H5_W4_PKT_DELIMITER;
-                h5->rx_count = 0;
-
                 /* depend on weather remote will reset ack numb or not!!!!!!special */
 		        if (rtk_hw_cfg.tx_index == rtk_hw_cfg.total_num) {
 			        rtk_hw_cfg.rxseq_txack = h5->rx_skb->data[0] & 0x07;
 		        }
+
+                skb_free(h5->rx_skb);
+                h5->rx_skb = NULL;
+                h5->rx_state = H5_W4_PKT_DELIMITER;
+                h5->rx_count = 0;
                 continue;
             }
             h5->rx_state = H5_W4_DATA;
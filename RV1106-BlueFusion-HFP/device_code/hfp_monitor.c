@@ -1,32 +1,68 @@
 /*
  * HFP Connection Monitor for RV1106
  * Real-time monitoring and auto-recovery
- * 
+ *
+ * Connections are tracked from HCI events on a filtered raw socket, so
+ * nothing is sent to the controller while no SCO link is up. Link quality
+ * and RSSI are sampled only for devices with an active SCO link, the HCI
+ * device state is checked every CHECK_INTERVAL with an ioctl.
+ * BlueALSA is watched through D-Bus name owner changes when built with
+ * HAVE_DBUS, and with a low rate pidof check otherwise.
+ *
+ * Every sample is also published in the telemetry ring described in
+ * hfp_telemetry.h, -T prints what is in it.
+ *
+ * HCI commands, events and ACL data of the adapter are kept in a capture
+ * ring (hci_snoop.h, shared with rtk_hciattach) and saved in btsnoop
+ * format on SIGUSR1, on recovery and on HCI errors.
+ *
  * Compile: arm-linux-gnueabihf-gcc -O2 -o hfp_monitor hfp_monitor.c -lbluetooth
+ *   with D-Bus: add -DHAVE_DBUS $(pkg-config --cflags --libs dbus-1)
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
 #include <syslog.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 #include <bluetooth/rfcomm.h>
 #include <bluetooth/sco.h>
+#ifdef HAVE_DBUS
+#include <dbus/dbus.h>
+#endif
+
+#include "hfp_telemetry.h"
+#include "../../tools/rtk_hciattach/hci_snoop.h"
 
 #define MAX_CONNECTIONS 5
 #define CHECK_INTERVAL  5  /* seconds */
+#define STATS_INTERVAL  60 /* seconds */
+#define SAMPLE_INTERVAL 1000 /* ms, default RSSI/LQ rate during SCO */
 #define LOG_FILE       "/var/log/hfp_monitor.log"
 
+#define BLUEALSA_SERVICE "org.bluealsa"
+#define BLUEALSA_RETRY   30 /* seconds before restarting it again */
+
+#define SNOOP_RECORDS    4096 /* 80 bytes each */
+#define SNOOP_FILE       "/var/log/hfp_monitor.btsnoop"
+
 struct connection_info {
+    int      in_use;
     bdaddr_t addr;
     uint16_t handle;
-    uint8_t  type;      /* ACL or SCO */
+    uint8_t  type;      /* ACL, SCO or eSCO */
     uint8_t  link_quality;
     int8_t   rssi;
     time_t   last_seen;
@@ -45,191 +81,617 @@ static volatile int running = 1;
 static struct connection_info connections[MAX_CONNECTIONS];
 static struct monitor_stats stats = {0};
 static int hci_dev = -1;
+static int hci_failed;
+static int hci_dev_id = -1;
+static int snoop_sock = -1;
+static int snoop_records = SNOOP_RECORDS;
+static struct hci_snoop snoop;
+static volatile sig_atomic_t snoop_request;
+static int sample_interval = SAMPLE_INTERVAL;
+#ifdef HAVE_DBUS
+static DBusConnection *dbus_conn;
+#endif
+static int bluealsa_present = 1;
+static time_t bluealsa_restarted;
+static struct hfp_telemetry *telemetry;
+static uint32_t sco_rx, sco_tx;
 
 static void signal_handler(int sig)
 {
     running = 0;
 }
 
+static void snoop_signal(int sig)
+{
+    snoop_request = 1;
+}
+
 static void log_message(const char *fmt, ...)
 {
     va_list args;
     char buf[256];
     time_t now;
     struct tm *tm;
-    
+
     time(&now);
     tm = localtime(&now);
-    
+
     va_start(args, fmt);
     vsnprintf(buf, sizeof(buf), fmt, args);
     va_end(args);
-    
+
     printf("[%02d:%02d:%02d] %s\n", tm->tm_hour, tm->tm_min, tm->tm_sec, buf);
     syslog(LOG_INFO, "%s", buf);
 }
 
+static int is_sco(uint8_t type)
+{
+    return type == SCO_LINK || type == ESCO_LINK;
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t realtime_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Create the ring in /dev/shm. Readers that still map an old file keep
+ * their copy, so it is replaced rather than reused.
+ */
+static void telemetry_open(void)
+{
+    struct hfp_telemetry *t;
+    int fd;
+
+    unlink(HFP_TELEMETRY_PATH);
+    fd = open(HFP_TELEMETRY_PATH, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        log_message("Telemetry disabled: %s", strerror(errno));
+        return;
+    }
+
+    if (ftruncate(fd, sizeof(*t)) < 0) {
+        log_message("Telemetry disabled: %s", strerror(errno));
+        close(fd);
+        unlink(HFP_TELEMETRY_PATH);
+        return;
+    }
+
+    t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (t == MAP_FAILED) {
+        log_message("Telemetry disabled: %s", strerror(errno));
+        unlink(HFP_TELEMETRY_PATH);
+        return;
+    }
+
+    /* the file is zero filled, magic goes last so readers see it ready */
+    t->version = HFP_TELEMETRY_VERSION;
+    t->sample_size = sizeof(struct hfp_sample);
+    t->slots = HFP_TELEMETRY_SLOTS;
+    t->pid = getpid();
+    t->start_ms = realtime_ms();
+    __atomic_store_n(&t->magic, HFP_TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+
+    telemetry = t;
+}
+
+static void telemetry_close(void)
+{
+    if (telemetry) {
+        munmap(telemetry, sizeof(*telemetry));
+        telemetry = NULL;
+        unlink(HFP_TELEMETRY_PATH);
+    }
+}
+
+static void telemetry_push(const struct connection_info *c, uint32_t flags)
+{
+    struct hfp_sample s;
+
+    if (!telemetry) {
+        return;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.flags = flags;
+    s.time_ms = realtime_ms();
+    memcpy(s.bdaddr, &c->addr, sizeof(s.bdaddr));
+    s.handle = c->handle;
+    s.rssi = c->rssi;
+    s.link_quality = c->link_quality;
+    s.type = c->type;
+    s.failures = c->failures;
+    s.sco_rx = sco_rx;
+    s.sco_tx = sco_tx;
+    hfp_telemetry_push(telemetry, &s);
+}
+
+/* Print the samples in the ring, oldest first */
+static int telemetry_dump(void)
+{
+    const struct hfp_telemetry *t;
+    struct hfp_sample s;
+    uint64_t head, i;
+    char addr_str[18];
+    bdaddr_t addr;
+    int fd;
+
+    fd = open(HFP_TELEMETRY_PATH, O_RDONLY);
+    if (fd < 0) {
+        perror(HFP_TELEMETRY_PATH);
+        return 1;
+    }
+    t = mmap(NULL, sizeof(*t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (t == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    if (__atomic_load_n(&t->magic, __ATOMIC_ACQUIRE) != HFP_TELEMETRY_MAGIC ||
+        t->version != HFP_TELEMETRY_VERSION) {
+        fprintf(stderr, "%s: unknown format\n", HFP_TELEMETRY_PATH);
+        return 1;
+    }
+
+    head = hfp_telemetry_head(t);
+    for (i = head > HFP_TELEMETRY_SLOTS ? head - HFP_TELEMETRY_SLOTS : 0;
+         i < head; i++) {
+        if (hfp_telemetry_read(t, i, &s) < 0) {
+            continue;
+        }
+        memcpy(&addr, s.bdaddr, sizeof(s.bdaddr));
+        ba2str(&addr, addr_str);
+        printf("%llu %s handle=%d LQ=%d RSSI=%d failures=%u sco_rx=%u sco_tx=%u%s%s%s\n",
+               (unsigned long long)s.time_ms, addr_str, s.handle,
+               s.link_quality, s.rssi, s.failures, s.sco_rx, s.sco_tx,
+               s.flags & HFP_SAMPLE_POOR ? " poor" : "",
+               s.flags & HFP_SAMPLE_RECOVERY ? " recovery" : "",
+               s.flags & HFP_SAMPLE_GONE ? " gone" : "");
+    }
+
+    return 0;
+}
+
+/*
+ * A second raw socket sees the packets of the adapter in both directions,
+ * with the kernel's timestamp and direction attached. SCO data is left
+ * out: during a call it would wake us up for every voice packet and push
+ * the signalling out of the ring within seconds.
+ */
+static void snoop_open(void)
+{
+    struct sockaddr_hci addr;
+    struct hci_filter flt;
+    int opt = 1;
+
+    if (!snoop.ring) {
+        return;
+    }
+
+    snoop_sock = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                        BTPROTO_HCI);
+    if (snoop_sock < 0) {
+        log_message("HCI capture disabled: %s", strerror(errno));
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.hci_family = AF_BLUETOOTH;
+    addr.hci_dev = hci_dev_id;
+
+    hci_filter_clear(&flt);
+    hci_filter_set_ptype(HCI_COMMAND_PKT, &flt);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+    hci_filter_set_ptype(HCI_ACLDATA_PKT, &flt);
+    hci_filter_set_ptype(HCI_VENDOR_PKT, &flt);
+    hci_filter_all_events(&flt);
+
+    if (bind(snoop_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        setsockopt(snoop_sock, SOL_HCI, HCI_DATA_DIR, &opt, sizeof(opt)) < 0 ||
+        setsockopt(snoop_sock, SOL_HCI, HCI_TIME_STAMP, &opt, sizeof(opt)) < 0 ||
+        setsockopt(snoop_sock, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
+        log_message("HCI capture disabled: %s", strerror(errno));
+        close(snoop_sock);
+        snoop_sock = -1;
+    }
+}
+
+static void snoop_close(void)
+{
+    if (snoop_sock >= 0) {
+        close(snoop_sock);
+        snoop_sock = -1;
+    }
+}
+
+/* Copy whatever is queued on the capture socket into the ring */
+static void snoop_read(void)
+{
+    unsigned char buf[HCI_MAX_FRAME_SIZE + 1];
+    char ctrl[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timeval))];
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct timeval *tv;
+    int dir, len;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+
+        len = recvmsg(snoop_sock, &msg, 0);
+        if (len <= 1) {
+            return;
+        }
+
+        dir = 0;
+        tv = NULL;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_HCI) {
+                continue;
+            }
+            if (cmsg->cmsg_type == HCI_CMSG_DIR) {
+                memcpy(&dir, CMSG_DATA(cmsg), sizeof(dir));
+            } else if (cmsg->cmsg_type == HCI_CMSG_TSTAMP) {
+                tv = (struct timeval *)CMSG_DATA(cmsg);
+            }
+        }
+
+        hci_snoop_add_tv(&snoop, dir ? HCI_SNOOP_RX : HCI_SNOOP_TX, buf[0],
+                         buf + 1, len - 1, tv);
+    }
+}
+
+static void snoop_dump(const char *why)
+{
+    int n;
+
+    if (!snoop.ring) {
+        return;
+    }
+
+    n = hci_snoop_dump(&snoop, SNOOP_FILE);
+    if (n < 0) {
+        log_message("Failed to write %s: %s", SNOOP_FILE, strerror(errno));
+    } else {
+        log_message("%s: %d HCI packets saved to %s", why, n, SNOOP_FILE);
+    }
+}
+
 static int check_hci_status(void)
 {
     struct hci_dev_info di;
-    
-    if (hci_devinfo(hci_dev, &di) < 0) {
+
+    if (hci_devinfo(hci_dev_id, &di) < 0) {
         return -1;
     }
-    
+
     if (!(hci_test_bit(HCI_UP, &di.flags))) {
         log_message("HCI device is down");
         return -1;
     }
-    
+
     if (!(hci_test_bit(HCI_RUNNING, &di.flags))) {
         log_message("HCI device not running");
         return -1;
     }
-    
+
     return 0;
 }
 
-static int get_connection_list(void)
+static struct connection_info *find_connection(uint16_t handle)
 {
-    struct hci_conn_list_req *cl;
-    struct hci_conn_info *ci;
-    int i, n = 0;
-    
-    cl = malloc(10 * sizeof(*ci) + sizeof(*cl));
-    if (!cl) {
-        return -1;
+    int i;
+
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].in_use && connections[i].handle == handle) {
+            return &connections[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void add_connection(const bdaddr_t *addr, uint16_t handle, uint8_t type)
+{
+    struct connection_info *c = find_connection(handle);
+    int i;
+
+    for (i = 0; !c && i < MAX_CONNECTIONS; i++) {
+        if (!connections[i].in_use) {
+            c = &connections[i];
+        }
+    }
+
+    if (!c) {
+        log_message("Connection table full, handle %d not tracked", handle);
+        return;
+    }
+
+    memset(c, 0, sizeof(*c));
+    c->in_use = 1;
+    bacpy(&c->addr, addr);
+    c->handle = handle;
+    c->type = type;
+    c->rssi = -100;
+    c->last_seen = time(NULL);
+}
+
+static void count_connections(void)
+{
+    int i;
+
+    stats.total_connections = 0;
+    stats.sco_connections = 0;
+
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        if (!connections[i].in_use) {
+            continue;
+        }
+        stats.total_connections++;
+        if (is_sco(connections[i].type)) {
+            stats.sco_connections++;
+        }
     }
-    
-    cl->dev_id = hci_dev;
-    cl->conn_num = 10;
-    ci = cl->conn_info;
-    
-    if (ioctl(hci_dev, HCIGETCONNLIST, cl) < 0) {
-        free(cl);
+}
+
+/* Seed the table once, events keep it up to date afterwards */
+static int get_connection_list(void)
+{
+    struct {
+        struct hci_conn_list_req cl;
+        struct hci_conn_info ci[MAX_CONNECTIONS];
+    } req;
+    int i;
+
+    req.cl.dev_id = hci_dev_id;
+    req.cl.conn_num = MAX_CONNECTIONS;
+
+    if (ioctl(hci_dev, HCIGETCONNLIST, &req) < 0) {
         return -1;
     }
-    
-    /* Update connection list */
+
     memset(connections, 0, sizeof(connections));
-    
-    for (i = 0; i < cl->conn_num && i < MAX_CONNECTIONS; i++) {
-        bacpy(&connections[n].addr, &ci[i].bdaddr);
-        connections[n].handle = ci[i].handle;
-        connections[n].type = ci[i].type;
-        connections[n].last_seen = time(NULL);
+
+    for (i = 0; i < req.cl.conn_num && i < MAX_CONNECTIONS; i++) {
+        add_connection(&req.ci[i].bdaddr, req.ci[i].handle, req.ci[i].type);
+    }
+
+    count_connections();
+    return stats.total_connections;
+}
+
+/* ACL link of a device that also has a SCO/eSCO link up */
+static int has_sco(const struct connection_info *acl)
+{
+    int i;
+
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].in_use && is_sco(connections[i].type) &&
+            bacmp(&connections[i].addr, &acl->addr) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Queue the reads without waiting: the replies come back as command
+ * complete events through the main loop.
+ */
+static int sample_links(void)
+{
+    read_link_quality_cp lq;
+    read_rssi_cp rssi;
+    struct hci_dev_info di;
+    int i, n = 0;
+
+    /* adapter wide SCO counters for the samples, an ioctl */
+    if (hci_devinfo(hci_dev_id, &di) == 0) {
+        sco_rx = di.stat.sco_rx;
+        sco_tx = di.stat.sco_tx;
+    }
+
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        if (!connections[i].in_use || connections[i].type != ACL_LINK ||
+            !has_sco(&connections[i])) {
+            continue;
+        }
+
+        /* LQ and RSSI are only meaningful on the ACL handle */
+        lq.handle = htobs(connections[i].handle);
+        rssi.handle = htobs(connections[i].handle);
+        if (hci_send_cmd(hci_dev, OGF_STATUS_PARAM, OCF_READ_LINK_QUALITY,
+                         sizeof(lq), &lq) < 0 ||
+            hci_send_cmd(hci_dev, OGF_STATUS_PARAM, OCF_READ_RSSI,
+                         sizeof(rssi), &rssi) < 0) {
+            log_message("Failed to sample link: %s", strerror(errno));
+            continue;
+        }
         n++;
     }
-    
-    free(cl);
+
     return n;
 }
 
-static int get_link_quality(uint16_t handle, uint8_t *lq)
-{
-    struct hci_request rq;
-    read_link_quality_cp cp;
-    read_link_quality_rp rp;
-    
-    memset(&cp, 0, sizeof(cp));
-    cp.handle = handle;
-    
-    memset(&rq, 0, sizeof(rq));
-    rq.ogf = OGF_STATUS_PARAM;
-    rq.ocf = OCF_READ_LINK_QUALITY;
-    rq.cparam = &cp;
-    rq.clen = sizeof(cp);
-    rq.rparam = &rp;
-    rq.rlen = sizeof(rp);
-    
-    if (hci_send_req(hci_dev, &rq, 1000) < 0) {
-        return -1;
+static void check_link(struct connection_info *c)
+{
+    char addr_str[18];
+    uint32_t flags = 0;
+
+    c->last_seen = time(NULL);
+
+    /* Check for poor quality */
+    if (c->link_quality >= 200 && c->rssi >= -80) {
+        telemetry_push(c, 0);
+        return;
     }
-    
-    if (rp.status) {
-        return -1;
+
+    ba2str(&c->addr, addr_str);
+    c->failures++;
+    flags |= HFP_SAMPLE_POOR;
+    log_message("Poor link quality: %s LQ=%d RSSI=%d",
+               addr_str, c->link_quality, c->rssi);
+
+    /* Trigger recovery if too many failures */
+    if (c->failures > 3) {
+        log_message("Triggering recovery for %s", addr_str);
+        flags |= HFP_SAMPLE_RECOVERY;
+    }
+    telemetry_push(c, flags);
+
+    if (flags & HFP_SAMPLE_RECOVERY) {
+        snoop_dump("Poor link");
+        /* Recovery actions would go here */
+        c->failures = 0;
+        stats.failures_recovered++;
     }
-    
-    *lq = rp.link_quality;
-    return 0;
 }
 
-static int get_rssi(uint16_t handle, int8_t *rssi)
-{
-    struct hci_request rq;
-    read_rssi_cp cp;
-    read_rssi_rp rp;
-    
-    memset(&cp, 0, sizeof(cp));
-    cp.handle = handle;
-    
-    memset(&rq, 0, sizeof(rq));
-    rq.ogf = OGF_STATUS_PARAM;
-    rq.ocf = OCF_READ_RSSI;
-    rq.cparam = &cp;
-    rq.clen = sizeof(cp);
-    rq.rparam = &rp;
-    rq.rlen = sizeof(rp);
-    
-    if (hci_send_req(hci_dev, &rq, 1000) < 0) {
-        return -1;
+static void handle_cmd_complete(const uint8_t *ptr, int len)
+{
+    const evt_cmd_complete *cc = (const void *)ptr;
+    struct connection_info *c;
+
+    if (len < (int)EVT_CMD_COMPLETE_SIZE) {
+        return;
+    }
+    ptr += EVT_CMD_COMPLETE_SIZE;
+    len -= EVT_CMD_COMPLETE_SIZE;
+
+    switch (btohs(cc->opcode)) {
+    case cmd_opcode_pack(OGF_STATUS_PARAM, OCF_READ_LINK_QUALITY): {
+        const read_link_quality_rp *rp = (const void *)ptr;
+
+        if (len < (int)READ_LINK_QUALITY_RP_SIZE ||
+            !(c = find_connection(btohs(rp->handle)))) {
+            break;
+        }
+        c->link_quality = rp->status ? 0 : rp->link_quality;
+        break;
+    }
+    case cmd_opcode_pack(OGF_STATUS_PARAM, OCF_READ_RSSI): {
+        const read_rssi_rp *rp = (const void *)ptr;
+
+        if (len < (int)READ_RSSI_RP_SIZE ||
+            !(c = find_connection(btohs(rp->handle)))) {
+            break;
+        }
+        /* sent after the LQ read, so both values are fresh here */
+        c->rssi = rp->status ? -100 : rp->rssi;
+        check_link(c);
+        break;
     }
-    
-    if (rp.status) {
-        return -1;
     }
-    
-    *rssi = rp.rssi;
-    return 0;
 }
 
-static void monitor_connections(void)
+static void handle_event(const uint8_t *buf, int len)
 {
-    int i, n;
+    const hci_event_hdr *hdr = (const void *)(buf + 1);
+    const uint8_t *ptr = buf + 1 + HCI_EVENT_HDR_SIZE;
     char addr_str[18];
-    
-    n = get_connection_list();
-    if (n < 0) {
-        log_message("Failed to get connection list");
+
+    if (len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT) {
         return;
     }
-    
-    stats.total_connections = n;
-    stats.sco_connections = 0;
-    
-    for (i = 0; i < n; i++) {
-        ba2str(&connections[i].addr, addr_str);
-        
-        /* Get link quality */
-        if (get_link_quality(connections[i].handle, &connections[i].link_quality) < 0) {
-            connections[i].link_quality = 0;
-        }
-        
-        /* Get RSSI */
-        if (get_rssi(connections[i].handle, &connections[i].rssi) < 0) {
-            connections[i].rssi = -100;
-        }
-        
-        /* Count SCO connections */
-        if (connections[i].type == SCO_LINK) {
-            stats.sco_connections++;
+    len -= 1 + HCI_EVENT_HDR_SIZE;
+    if (len > hdr->plen) {
+        len = hdr->plen;
+    }
+
+    switch (hdr->evt) {
+    case EVT_CONN_COMPLETE: {
+        const evt_conn_complete *ev = (const void *)ptr;
+
+        if (len < (int)EVT_CONN_COMPLETE_SIZE || ev->status) {
+            break;
         }
-        
-        /* Check for poor quality */
-        if (connections[i].link_quality < 200 || connections[i].rssi < -80) {
-            connections[i].failures++;
-            log_message("Poor link quality: %s LQ=%d RSSI=%d", 
-                       addr_str, connections[i].link_quality, connections[i].rssi);
-            
-            /* Trigger recovery if too many failures */
-            if (connections[i].failures > 3) {
-                log_message("Triggering recovery for %s", addr_str);
-                /* Recovery actions would go here */
-                connections[i].failures = 0;
-                stats.failures_recovered++;
-            }
+        add_connection(&ev->bdaddr, btohs(ev->handle), ev->link_type);
+        ba2str(&ev->bdaddr, addr_str);
+        log_message("Connected: %s handle %d", addr_str, btohs(ev->handle));
+        break;
+    }
+    case EVT_SYNC_CONN_COMPLETE: {
+        const evt_sync_conn_complete *ev = (const void *)ptr;
+
+        if (len < (int)EVT_SYNC_CONN_COMPLETE_SIZE || ev->status) {
+            break;
+        }
+        add_connection(&ev->bdaddr, btohs(ev->handle), ev->link_type);
+        ba2str(&ev->bdaddr, addr_str);
+        log_message("SCO connected: %s handle %d air mode %d",
+                   addr_str, btohs(ev->handle), ev->air_mode);
+        break;
+    }
+    case EVT_SYNC_CONN_CHANGED: {
+        const evt_sync_conn_changed *ev = (const void *)ptr;
+
+        if (len < (int)EVT_SYNC_CONN_CHANGED_SIZE || ev->status) {
+            break;
         }
+        log_message("SCO handle %d changed: interval %d window %d",
+                   btohs(ev->handle), ev->trans_interval, ev->retrans_window);
+        break;
     }
+    case EVT_DISCONN_COMPLETE: {
+        const evt_disconn_complete *ev = (const void *)ptr;
+        struct connection_info *c;
+
+        if (len < (int)EVT_DISCONN_COMPLETE_SIZE || ev->status ||
+            !(c = find_connection(btohs(ev->handle)))) {
+            break;
+        }
+        ba2str(&c->addr, addr_str);
+        log_message("Disconnected: %s handle %d reason 0x%02x",
+                   addr_str, c->handle, ev->reason);
+        if (c->type == ACL_LINK) {
+            telemetry_push(c, HFP_SAMPLE_GONE);
+        }
+        c->in_use = 0;
+        break;
+    }
+    case EVT_HARDWARE_ERROR:
+        log_message("Controller hardware error 0x%02x", len ? ptr[0] : 0);
+        hci_failed = 1;
+        break;
+    case EVT_STACK_INTERNAL: {
+        const evt_stack_internal *si = (const void *)ptr;
+        const evt_si_device *sd = (const void *)si->data;
+
+        if (len < (int)(EVT_STACK_INTERNAL_SIZE + EVT_SI_DEVICE_SIZE) ||
+            btohs(si->type) != EVT_SI_DEVICE) {
+            break;
+        }
+        if (btohs(sd->event) == HCI_DEV_DOWN ||
+            btohs(sd->event) == HCI_DEV_UNREG) {
+            log_message("HCI device went down");
+            hci_failed = 1;
+        }
+        break;
+    }
+    case EVT_CMD_COMPLETE:
+        handle_cmd_complete(ptr, len);
+        break;
+    }
+
+    count_connections();
 }
 
 static void check_bluealsa(void)
@@ -237,7 +699,7 @@ static void check_bluealsa(void)
     FILE *fp;
     char buf[256];
     int bluealsa_running = 0;
-    
+
     /* Check if BlueALSA is running */
     fp = popen("pidof bluealsa", "r");
     if (fp) {
@@ -246,33 +708,97 @@ static void check_bluealsa(void)
         }
         pclose(fp);
     }
-    
-    if (!bluealsa_running) {
-        log_message("BlueALSA not running, restarting...");
-        system("/etc/init.d/bluealsa restart");
-        stats.failures_recovered++;
+
+    bluealsa_present = bluealsa_running;
+}
+
+static void restart_bluealsa(void)
+{
+    if (bluealsa_present ||
+        time(NULL) - bluealsa_restarted < BLUEALSA_RETRY) {
+        return;
+    }
+
+    log_message("BlueALSA not running, restarting...");
+    system("/etc/init.d/bluealsa restart");
+    bluealsa_restarted = time(NULL);
+    stats.failures_recovered++;
+}
+
+#ifdef HAVE_DBUS
+static int init_dbus(void)
+{
+    DBusError err;
+
+    dbus_error_init(&err);
+    dbus_conn = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
+    if (!dbus_conn) {
+        log_message("D-Bus unavailable (%s), polling BlueALSA", err.message);
+        dbus_error_free(&err);
+        return -1;
+    }
+
+    dbus_bus_add_match(dbus_conn,
+                       "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+                       "interface='" DBUS_INTERFACE_DBUS "',"
+                       "member='NameOwnerChanged',arg0='" BLUEALSA_SERVICE "'",
+                       &err);
+    if (dbus_error_is_set(&err)) {
+        log_message("D-Bus match failed (%s), polling BlueALSA", err.message);
+        dbus_error_free(&err);
+        dbus_connection_unref(dbus_conn);
+        dbus_conn = NULL;
+        return -1;
+    }
+
+    bluealsa_present = dbus_bus_name_has_owner(dbus_conn, BLUEALSA_SERVICE,
+                                               NULL);
+    return 0;
+}
+
+static void handle_dbus(void)
+{
+    DBusMessage *msg;
+    const char *name, *old_owner, *new_owner;
+
+    dbus_connection_read_write(dbus_conn, 0);
+
+    while ((msg = dbus_connection_pop_message(dbus_conn)) != NULL) {
+        if (dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS,
+                                   "NameOwnerChanged") &&
+            dbus_message_get_args(msg, NULL,
+                                  DBUS_TYPE_STRING, &name,
+                                  DBUS_TYPE_STRING, &old_owner,
+                                  DBUS_TYPE_STRING, &new_owner,
+                                  DBUS_TYPE_INVALID) &&
+            strcmp(name, BLUEALSA_SERVICE) == 0) {
+            bluealsa_present = new_owner[0] != '\0';
+            log_message("BlueALSA %s", bluealsa_present ? "appeared" : "vanished");
+        }
+        dbus_message_unref(msg);
     }
 }
+#endif
 
 static void print_statistics(void)
 {
     time_t uptime = time(NULL) - stats.start_time;
-    
+
     log_message("=== HFP Monitor Statistics ===");
     log_message("Uptime: %ld seconds", uptime);
     log_message("Total connections: %d", stats.total_connections);
     log_message("SCO connections: %d", stats.sco_connections);
     log_message("Failures recovered: %d", stats.failures_recovered);
-    
+
     if (stats.total_connections > 0) {
         int i;
         char addr_str[18];
-        
+
         log_message("Active connections:");
         for (i = 0; i < MAX_CONNECTIONS; i++) {
-            if (bacmp(&connections[i].addr, BDADDR_ANY) != 0) {
+            if (connections[i].in_use) {
                 ba2str(&connections[i].addr, addr_str);
-                log_message("  %s: Type=%s LQ=%d RSSI=%d", 
+                log_message("  %s: Type=%s LQ=%d RSSI=%d",
                            addr_str,
                            connections[i].type == ACL_LINK ? "ACL" : "SCO",
                            connections[i].link_quality,
@@ -284,29 +810,58 @@ static void print_statistics(void)
 
 static int init_monitor(void)
 {
+    struct hci_filter flt;
+
     /* Open HCI device */
     hci_dev = hci_get_route(NULL);
     if (hci_dev < 0) {
         log_message("No Bluetooth device found");
         return -1;
     }
-    
+
+    hci_dev_id = hci_dev;
     hci_dev = hci_open_dev(hci_dev);
     if (hci_dev < 0) {
         log_message("Failed to open HCI device");
         return -1;
     }
-    
+    snoop_open();
+
+    /* Only wake up for the events the monitor acts on */
+    hci_filter_clear(&flt);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+    hci_filter_set_event(EVT_CONN_COMPLETE, &flt);
+    hci_filter_set_event(EVT_DISCONN_COMPLETE, &flt);
+    hci_filter_set_event(EVT_SYNC_CONN_COMPLETE, &flt);
+    hci_filter_set_event(EVT_SYNC_CONN_CHANGED, &flt);
+    hci_filter_set_event(EVT_HARDWARE_ERROR, &flt);
+    hci_filter_set_event(EVT_STACK_INTERNAL, &flt);
+    hci_filter_set_event(EVT_CMD_COMPLETE, &flt);
+    if (setsockopt(hci_dev, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
+        log_message("Failed to set HCI filter: %s", strerror(errno));
+        return -1;
+    }
+
+    if (get_connection_list() < 0) {
+        log_message("Failed to get connection list");
+    }
+
+    hci_failed = check_hci_status() < 0;
+
     /* Initialize stats */
-    stats.start_time = time(NULL);
-    
+    if (!stats.start_time) {
+        stats.start_time = time(NULL);
+    }
+
     return 0;
 }
 
 static void cleanup(void)
 {
+    snoop_close();
     if (hci_dev >= 0) {
         hci_close_dev(hci_dev);
+        hci_dev = -1;
     }
 }
 
@@ -314,27 +869,49 @@ int main(int argc, char *argv[])
 {
     int daemon_mode = 0;
     int opt;
-    
-    while ((opt = getopt(argc, argv, "dh")) != -1) {
+    unsigned char buf[HCI_MAX_EVENT_SIZE + 1];
+    struct pollfd pfd[3];
+    int snoop_idx, dbus_idx;
+    long long next_sample = 0, next_check = 0, next_stats, now;
+    int nfds, timeout, len;
+
+    while ((opt = getopt(argc, argv, "di:S:Th")) != -1) {
         switch (opt) {
         case 'd':
             daemon_mode = 1;
             break;
+        case 'i':
+            sample_interval = atoi(optarg);
+            if (sample_interval < 100) {
+                sample_interval = 100;
+            }
+            break;
+        case 'S':
+            snoop_records = atoi(optarg);
+            break;
+        case 'T':
+            return telemetry_dump();
         case 'h':
-            printf("Usage: %s [-d] [-h]\n", argv[0]);
+            printf("Usage: %s [-d] [-i ms] [-S records] [-T] [-h]\n", argv[0]);
             printf("  -d  Run as daemon\n");
+            printf("  -i  RSSI/link quality sample interval during SCO (default %d)\n",
+                   SAMPLE_INTERVAL);
+            printf("  -S  HCI capture ring size, 0 disables (default %d)\n",
+                   SNOOP_RECORDS);
+            printf("  -T  Print the samples in %s and exit\n", HFP_TELEMETRY_PATH);
             printf("  -h  Show this help\n");
             return 0;
         }
     }
-    
+
     /* Setup signal handlers */
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
-    
+    signal(SIGUSR1, snoop_signal);
+
     /* Open syslog */
     openlog("hfp_monitor", LOG_PID, LOG_DAEMON);
-    
+
     /* Daemonize if requested */
     if (daemon_mode) {
         if (daemon(0, 0) < 0) {
@@ -342,49 +919,150 @@ int main(int argc, char *argv[])
             return 1;
         }
     }
-    
+
+    /* Allocated once, kept across HCI recoveries */
+    if (snoop_records > 0 && hci_snoop_init(&snoop, snoop_records) < 0) {
+        log_message("HCI capture disabled: out of memory");
+    }
+
     /* Initialize monitor */
     if (init_monitor() < 0) {
         return 1;
     }
-    
+#ifdef HAVE_DBUS
+    init_dbus();
+#endif
+    telemetry_open();
+
     log_message("HFP Monitor started");
-    
+    next_stats = now_ms() + STATS_INTERVAL * 1000;
+
     /* Main monitoring loop */
     while (running) {
-        /* Check HCI status */
-        if (check_hci_status() < 0) {
+        if (snoop_request) {
+            snoop_request = 0;
+            snoop_dump("SIGUSR1");
+        }
+
+        if (hci_failed) {
             log_message("HCI device error, attempting recovery...");
+            snoop_dump("HCI error");
             system("/etc/init.d/rtl8723d-bluetooth restart");
             sleep(10);
-            
+
             /* Reinitialize */
             cleanup();
             if (init_monitor() < 0) {
                 break;
             }
             stats.failures_recovered++;
+            continue;
+        }
+
+        now = now_ms();
+        if (now >= next_check) {
+            /* an ioctl, no HCI traffic */
+            if (check_hci_status() < 0) {
+                hci_failed = 1;
+                continue;
+            }
+#ifdef HAVE_DBUS
+            if (!dbus_conn)
+#endif
+                check_bluealsa();
+            next_check = now + CHECK_INTERVAL * 1000;
         }
-        
-        /* Monitor connections */
-        monitor_connections();
-        
-        /* Check BlueALSA */
-        check_bluealsa();
-        
-        /* Print statistics periodically */
-        if (time(NULL) % 60 == 0) {
+        restart_bluealsa();
+
+        if (stats.sco_connections > 0) {
+            if (!next_sample || now >= next_sample) {
+                sample_links();
+                next_sample = now + sample_interval;
+            }
+        } else {
+            next_sample = 0;
+        }
+
+        if (now >= next_stats) {
             print_statistics();
+            next_stats = now + STATS_INTERVAL * 1000;
         }
-        
-        sleep(CHECK_INTERVAL);
+
+        /* Sleep until the next event or deadline */
+        timeout = next_stats - now;
+        if (next_sample && next_sample - now < timeout) {
+            timeout = next_sample - now;
+        }
+        if (next_check - now < timeout) {
+            timeout = next_check - now;
+        }
+        if (!bluealsa_present && BLUEALSA_RETRY * 1000 < timeout) {
+            timeout = BLUEALSA_RETRY * 1000;
+        }
+
+        pfd[0].fd = hci_dev;
+        pfd[0].events = POLLIN;
+        nfds = 1;
+        snoop_idx = dbus_idx = -1;
+        if (snoop_sock >= 0) {
+            pfd[nfds].fd = snoop_sock;
+            pfd[nfds].events = POLLIN;
+            snoop_idx = nfds++;
+        }
+#ifdef HAVE_DBUS
+        if (dbus_conn) {
+            int fd;
+
+            if (dbus_connection_get_unix_fd(dbus_conn, &fd)) {
+                pfd[nfds].fd = fd;
+                pfd[nfds].events = POLLIN;
+                dbus_idx = nfds++;
+            }
+        }
+#endif
+
+        if (poll(pfd, nfds, timeout < 0 ? 0 : timeout) < 0) {
+            if (errno != EINTR) {
+                log_message("poll failed: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        if (pfd[0].revents & (POLLERR | POLLHUP)) {
+            hci_failed = 1;
+        } else if (pfd[0].revents & POLLIN) {
+            len = read(hci_dev, buf, sizeof(buf));
+            if (len > 0) {
+                handle_event(buf, len);
+            } else if (len < 0 && errno != EAGAIN && errno != EINTR) {
+                log_message("HCI read failed: %s", strerror(errno));
+                hci_failed = 1;
+            }
+        }
+
+        if (snoop_idx >= 0 && pfd[snoop_idx].revents) {
+            snoop_read();
+        }
+#ifdef HAVE_DBUS
+        if (dbus_idx >= 0 && pfd[dbus_idx].revents) {
+            handle_dbus();
+        }
+#endif
     }
-    
+
     log_message("HFP Monitor stopped");
     print_statistics();
-    
+
     cleanup();
+    hci_snoop_free(&snoop);
+    telemetry_close();
+#ifdef HAVE_DBUS
+    if (dbus_conn) {
+        dbus_connection_unref(dbus_conn);
+    }
+#endif
     closelog();
-    
+
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,101 @@
+/*
+ * HFP link telemetry ring, shared by hfp_monitor through /dev/shm
+ *
+ * hfp_monitor is the only writer. Any number of readers map the file
+ * read-only and copy samples out without locks and without system calls.
+ * The ring has a fixed size: old samples are overwritten and a reader
+ * that falls behind by more than HFP_TELEMETRY_SLOTS samples loses them.
+ *
+ * Each slot carries a sequence number that is 2 * index + 1 while the
+ * slot is written and 2 * index + 2 once sample "index" is complete, so a
+ * copy can be validated against the index it was read for.
+ */
+
+#ifndef HFP_TELEMETRY_H
+#define HFP_TELEMETRY_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HFP_TELEMETRY_PATH    "/dev/shm/hfp_telemetry"
+#define HFP_TELEMETRY_MAGIC   0x54504648 /* "HFPT" */
+#define HFP_TELEMETRY_VERSION 1
+#define HFP_TELEMETRY_SLOTS   256        /* power of two */
+
+/* hfp_sample.flags */
+#define HFP_SAMPLE_POOR     0x01  /* below the LQ/RSSI thresholds */
+#define HFP_SAMPLE_RECOVERY 0x02  /* recovery was triggered */
+#define HFP_SAMPLE_GONE     0x04  /* link disconnected, last sample */
+
+struct hfp_sample {
+    uint32_t seq;
+    uint32_t flags;
+    uint64_t time_ms;      /* CLOCK_REALTIME */
+    uint8_t  bdaddr[6];    /* little endian, as in bdaddr_t */
+    uint16_t handle;       /* ACL handle */
+    int8_t   rssi;
+    uint8_t  link_quality;
+    uint8_t  type;         /* ACL_LINK, SCO_LINK or ESCO_LINK */
+    uint8_t  pad;
+    uint32_t failures;
+    uint32_t sco_rx;       /* adapter SCO packet counters */
+    uint32_t sco_tx;
+};
+
+struct hfp_telemetry {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t sample_size;
+    uint32_t slots;
+    uint32_t pid;          /* writer */
+    uint64_t head;         /* samples written so far */
+    uint64_t start_ms;     /* CLOCK_REALTIME when the writer started */
+    uint8_t  reserved[32];
+    struct hfp_sample ring[HFP_TELEMETRY_SLOTS];
+};
+
+/* Writer side, only hfp_monitor calls this */
+static inline void hfp_telemetry_push(struct hfp_telemetry *t,
+                                      const struct hfp_sample *s)
+{
+    uint64_t n = t->head;
+    struct hfp_sample *slot = &t->ring[n & (HFP_TELEMETRY_SLOTS - 1)];
+    uint32_t seq = (uint32_t)(n * 2);
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((uint8_t *)slot + sizeof(slot->seq), (const uint8_t *)s + sizeof(s->seq),
+           sizeof(*s) - sizeof(s->seq));
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->head, n + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t hfp_telemetry_head(const struct hfp_telemetry *t)
+{
+    return __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Copy sample "index" out of the ring.
+ * Returns 0 on success, -1 if it was overwritten or is being written.
+ */
+static inline int hfp_telemetry_read(const struct hfp_telemetry *t,
+                                     uint64_t index, struct hfp_sample *out)
+{
+    const struct hfp_sample *slot = &t->ring[index & (HFP_TELEMETRY_SLOTS - 1)];
+    uint32_t seq = (uint32_t)(index * 2 + 2);
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) {
+        return -1;
+    }
+    memcpy(out, slot, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+        return -1;
+    }
+
+    out->seq = seq;
+    return 0;
+}
+
+#endif /* HFP_TELEMETRY_H */
@@ -32,5 +32,6 @@ then
 	mkdir -p /lib/firmware/rtl_bt/
 	cp rtlbt_* /lib/firmware/rtl_bt/.
 fi
-./rtk_hciattach -n -s 115200 $TTY rtk_h5 > hciattach.txt 2>&1 &
+# -f: on a restart with the patch still loaded only the baud and ldisc are set up
+./rtk_hciattach -n -f -s 115200 $TTY rtk_h5 > hciattach.txt 2>&1 &
 
@@ -107,7 +107,8 @@ build_tools() {
         
         # Build on device
         adb shell "cd /tmp/build && gcc -O2 -o rtk_hciattach rtk_hciattach.c"
-        adb shell "cd /tmp/build && gcc -O2 -o hfp_monitor hfp_monitor.c -lbluetooth"
+        # D-Bus lets hfp_monitor follow BlueALSA without polling pidof
+        adb shell "cd /tmp/build && gcc -O2 -o hfp_monitor hfp_monitor.c -lbluetooth \$(pkg-config --cflags --libs dbus-1 2>/dev/null && echo -DHAVE_DBUS)"
         
         # Pull binaries back
         adb pull /tmp/build/rtk_hciattach "$BUILD_DIR/"
@@ -170,7 +171,8 @@ init_bluetooth() {
     
     # Try rtk_hciattach first
     if [ -x "$DEVICE_DIR/bin/rtk_hciattach" ]; then
-        $DEVICE_DIR/bin/rtk_hciattach -n -s 115200 /dev/ttyS5 rtk_h5 &
+        UART_BAUD=115200
+        $DEVICE_DIR/bin/rtk_hciattach -n -s $UART_BAUD /dev/ttyS5 rtk_h5 &
         RTK_PID=$!
         sleep 3
         
@@ -184,7 +186,8 @@ init_bluetooth() {
     
     # Fallback to standard hciattach
     log "Trying standard hciattach..."
-    hciattach /dev/ttyS5 any 1500000 flow
+    UART_BAUD=1500000
+    hciattach /dev/ttyS5 any $UART_BAUD flow
     sleep 2
     
     if hciconfig hci0 2>/dev/null; then
@@ -215,6 +218,14 @@ configure_hci() {
 start_bluealsa() {
     log "Starting BlueALSA..."
     
+    # The attach tool may switch the UART to the speed of the firmware
+    # config, so the SCO links are budgeted with the current tty speed
+    UART_BAUD=$(stty -F /dev/ttyS5 speed 2>/dev/null || echo $UART_BAUD)
+
+    # One SCO I/O thread per call instead of an encoder and a decoder,
+    # with a jitter buffer smoothing the bursts of the UART
+    BLUEALSA_SCO_IO=duplex BLUEALSA_SCO_JITTER_LATENCY=20 \
+    BLUEALSA_SCO_UART_BAUD=$UART_BAUD \
     bluealsa -p hfp-hf -p a2dp-sink \
         --hfp-codec=cvsd \
         --io-thread-rt-priority=99 \
@@ -15,17 +15,93 @@
 #include <stdint.h>
 #include <strings.h>
 
+#include "sco-codec.h"
 #include "shared/defs.h"
 
-static const struct {
-	uint8_t codec_id;
-	const char *aliases[1];
-} codecs[] = {
-	{ HFP_CODEC_CVSD, { "CVSD" } },
-	{ HFP_CODEC_MSBC, { "mSBC" } },
-	{ HFP_CODEC_LC3_SWB, { "LC3-SWB" } },
+/**
+ * Supported codecs indexed by the HFP codec ID. */
+static const struct hfp_codec codecs[] = {
+	[HFP_CODEC_CVSD] = {
+		.codec_id = HFP_CODEC_CVSD,
+		.name = "CVSD",
+		.rate = 8000,
+		/* one S16LE sample */
+		.frame_size = sizeof(int16_t),
+		.transparent = false,
+		.io = &sco_codec_io_cvsd,
+	},
+	[HFP_CODEC_MSBC] = {
+		.codec_id = HFP_CODEC_MSBC,
+		.name = "mSBC",
+		.rate = 16000,
+		/* H2 header + mSBC frame + padding byte */
+		.frame_size = 2 + 57 + 1,
+		.transparent = true,
+#if ENABLE_MSBC
+		.io = &sco_codec_io_msbc,
+#endif
+	},
+	[HFP_CODEC_LC3_SWB] = {
+		.codec_id = HFP_CODEC_LC3_SWB,
+		.name = "LC3-SWB",
+		.rate = 32000,
+		/* H2 header + LC3 frame */
+		.frame_size = 2 + 58,
+		.transparent = true,
+#if ENABLE_LC3_SWB
+		.io = &sco_codec_io_lc3_swb,
+#endif
+	},
+};
+
+/**
+ * AG feature names indexed by the feature bit. */
+static const char * const ag_features[] = {
+	[__builtin_ctz(HFP_AG_FEAT_3WC)] = "three-way-calling",
+	[__builtin_ctz(HFP_AG_FEAT_ECNR)] = "echo-canceling-and-noise-reduction",
+	[__builtin_ctz(HFP_AG_FEAT_VOICE)] = "voice-recognition",
+	[__builtin_ctz(HFP_AG_FEAT_RING)] = "in-band-ring-tone",
+	[__builtin_ctz(HFP_AG_FEAT_VTAG)] = "attach-voice-tag",
+	[__builtin_ctz(HFP_AG_FEAT_REJECT)] = "reject-call",
+	[__builtin_ctz(HFP_AG_FEAT_ECS)] = "enhanced-call-status",
+	[__builtin_ctz(HFP_AG_FEAT_ECC)] = "enhanced-call-control",
+	[__builtin_ctz(HFP_AG_FEAT_EERC)] = "extended-error-codecs",
+	[__builtin_ctz(HFP_AG_FEAT_CODEC)] = "codec-negotiation",
+	[__builtin_ctz(HFP_AG_FEAT_HF_IND)] = "hf-indicators",
+	[__builtin_ctz(HFP_AG_FEAT_ESCO)] = "esco-s4-settings",
 };
 
+/**
+ * HF feature names indexed by the feature bit. */
+static const char * const hf_features[] = {
+	[__builtin_ctz(HFP_HF_FEAT_ECNR)] = "echo-canceling-and-noise-reduction",
+	[__builtin_ctz(HFP_HF_FEAT_3WC)] = "three-way-calling",
+	[__builtin_ctz(HFP_HF_FEAT_CLI)] = "cli-presentation",
+	[__builtin_ctz(HFP_HF_FEAT_VOICE)] = "voice-recognition",
+	[__builtin_ctz(HFP_HF_FEAT_VOLUME)] = "volume-control",
+	[__builtin_ctz(HFP_HF_FEAT_ECS)] = "enhanced-call-status",
+	[__builtin_ctz(HFP_HF_FEAT_ECC)] = "enhanced-call-control",
+	[__builtin_ctz(HFP_HF_FEAT_CODEC)] = "codec-negotiation",
+	[__builtin_ctz(HFP_HF_FEAT_HF_IND)] = "hf-indicators",
+	[__builtin_ctz(HFP_HF_FEAT_ESCO)] = "esco-s4-settings",
+};
+
+/**
+ * Fill the output array with names of features set in the mask, in the
+ * order of feature bits. Bits without a name are skipped. */
+static size_t features_to_strings(uint32_t features, const char * const *names,
+		size_t count, const char **out) {
+
+	size_t i = 0;
+
+	features &= (1U << count) - 1;
+	for (; features != 0; features &= features - 1)
+		if (names[__builtin_ctz(features)] != NULL)
+			out[i++] = names[__builtin_ctz(features)];
+
+	return i;
+}
+
 /**
  * Convert HFP AG features into human-readable strings.
  *
@@ -36,37 +112,10 @@ static const struct {
  *   is returned and errno is set to indicate the error. */
 ssize_t hfp_ag_features_to_strings(uint32_t features, const char **out, size_t size) {
 
-	if (size < 12)
+	if (size < ARRAYSIZE(ag_features))
 		return errno = ENOMEM, -1;
 
-	size_t i = 0;
-
-	if (features & HFP_AG_FEAT_3WC)
-		out[i++] = "three-way-calling";
-	if (features & HFP_AG_FEAT_ECNR)
-		out[i++] = "echo-canceling-and-noise-reduction";
-	if (features & HFP_AG_FEAT_VOICE)
-		out[i++] = "voice-recognition";
-	if (features & HFP_AG_FEAT_RING)
-		out[i++] = "in-band-ring-tone";
-	if (features & HFP_AG_FEAT_VTAG)
-		out[i++] = "attach-voice-tag";
-	if (features & HFP_AG_FEAT_REJECT)
-		out[i++] = "reject-call";
-	if (features & HFP_AG_FEAT_ECS)
-		out[i++] = "enhanced-call-status";
-	if (features & HFP_AG_FEAT_ECC)
-		out[i++] = "enhanced-call-control";
-	if (features & HFP_AG_FEAT_EERC)
-		out[i++] = "extended-error-codecs";
-	if (features & HFP_AG_FEAT_CODEC)
-		out[i++] = "codec-negotiation";
-	if (features & HFP_AG_FEAT_HF_IND)
-		out[i++] = "hf-indicators";
-	if (features & HFP_AG_FEAT_ESCO)
-		out[i++] = "esco-s4-settings";
-
-	return i;
+	return features_to_strings(features, ag_features, ARRAYSIZE(ag_features), out);
 }
 
 /**
@@ -79,33 +128,21 @@ ssize_t hfp_ag_features_to_strings(uint32_t features, const char **out, size_t s
  *   is returned and errno is set to indicate the error. */
 ssize_t hfp_hf_features_to_strings(uint32_t features, const char **out, size_t size) {
 
-	if (size < 10)
+	if (size < ARRAYSIZE(hf_features))
 		return errno = ENOMEM, -1;
 
-	size_t i = 0;
-
-	if (features & HFP_HF_FEAT_ECNR)
-		out[i++] = "echo-canceling-and-noise-reduction";
-	if (features & HFP_HF_FEAT_3WC)
-		out[i++] = "three-way-calling";
-	if (features & HFP_HF_FEAT_CLI)
-		out[i++] = "cli-presentation";
-	if (features & HFP_HF_FEAT_VOICE)
-		out[i++] = "voice-recognition";
-	if (features & HFP_HF_FEAT_VOLUME)
-		out[i++] = "volume-control";
-	if (features & HFP_HF_FEAT_ECS)
-		out[i++] = "enhanced-call-status";
-	if (features & HFP_HF_FEAT_ECC)
-		out[i++] = "enhanced-call-control";
-	if (features & HFP_HF_FEAT_CODEC)
-		out[i++] = "codec-negotiation";
-	if (features & HFP_HF_FEAT_HF_IND)
-		out[i++] = "hf-indicators";
-	if (features & HFP_HF_FEAT_ESCO)
-		out[i++] = "esco-s4-settings";
+	return features_to_strings(features, hf_features, ARRAYSIZE(hf_features), out);
+}
 
-	return i;
+/**
+ * Get HFP codec descriptor.
+ *
+ * @param codec_id BlueALSA HFP audio codec ID.
+ * @return Codec descriptor or NULL for unknown codec. */
+const struct hfp_codec *hfp_codec_lookup(uint8_t codec_id) {
+	if (codec_id < ARRAYSIZE(codecs) && codecs[codec_id].name != NULL)
+		return &codecs[codec_id];
+	return NULL;
 }
 
 /**
@@ -116,21 +153,34 @@ ssize_t hfp_hf_features_to_strings(uint32_t features, const char **out, size_t s
  *   match. */
 uint8_t hfp_codec_id_from_string(const char *alias) {
 	for (size_t i = 0; i < ARRAYSIZE(codecs); i++)
-		for (size_t n = 0; n < ARRAYSIZE(codecs[i].aliases); n++)
-			if (codecs[i].aliases[n] != NULL &&
-					strcasecmp(codecs[i].aliases[n], alias) == 0)
-				return codecs[i].codec_id;
+		if (codecs[i].name != NULL &&
+				strcasecmp(codecs[i].name, alias) == 0)
+			return codecs[i].codec_id;
 	return HFP_CODEC_UNDEFINED;
 }
 
+/**
+ * Get BlueALSA HFP codec IDs.
+ *
+ * @param out Array to be filled with codec IDs.
+ * @param size Size of the output array.
+ * @return This function returns the number of codec IDs stored. */
+ssize_t hfp_codec_ids(uint8_t *out, size_t size) {
+	size_t n = 0;
+	for (size_t i = 0; i < ARRAYSIZE(codecs) && n < size; i++)
+		if (codecs[i].name != NULL)
+			out[n++] = codecs[i].codec_id;
+	return n;
+}
+
 /**
  * Convert BlueALSA HFP codec ID into a human-readable string.
  *
  * @param codec BlueALSA HFP audio codec ID.
  * @return Human-readable string or NULL for unknown codec. */
 const char *hfp_codec_id_to_string(uint8_t codec_id) {
-	for (size_t i = 0; i < ARRAYSIZE(codecs); i++)
-		if (codecs[i].codec_id == codec_id)
-			return codecs[i].aliases[0];
+	const struct hfp_codec *codec;
+	if ((codec = hfp_codec_lookup(codec_id)) != NULL)
+		return codec->name;
 	return NULL;
 }
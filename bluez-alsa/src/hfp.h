@@ -17,6 +17,8 @@
 # include <config.h>
 #endif
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -164,6 +166,26 @@ enum __attribute__ ((packed)) hfp_ind {
 ssize_t hfp_ag_features_to_strings(uint32_t features, const char **out, size_t size);
 ssize_t hfp_hf_features_to_strings(uint32_t features, const char **out, size_t size);
 
+struct sco_codec_io;
+
+/**
+ * HFP audio codec descriptor */
+struct hfp_codec {
+	uint8_t codec_id;
+	const char *name;
+	/* PCM sample rate */
+	unsigned int rate;
+	/* size of the codec data unit carried by SCO packets */
+	size_t frame_size;
+	/* SCO link has to be set up with transparent air mode */
+	bool transparent;
+	/* SCO audio I/O, NULL if not enabled at build time */
+	const struct sco_codec_io *io;
+};
+
+const struct hfp_codec *hfp_codec_lookup(uint8_t codec_id);
+
+ssize_t hfp_codec_ids(uint8_t *out, size_t size);
 uint8_t hfp_codec_id_from_string(const char *alias);
 const char *hfp_codec_id_to_string(uint8_t codec_id);
 
@@ -0,0 +1,215 @@
+/*
+ * BlueALSA - sco-codec.c
+ * Copyright (c) 2016-2024 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "sco-codec.h"
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#if ENABLE_LC3_SWB
+# include "lc3-swb.h"
+#endif
+#if ENABLE_MSBC
+# include "msbc.h"
+#endif
+#include "sco-cvsd.h"
+#include "sco-lc3-swb.h"
+#include "sco-msbc.h"
+#include "shared/defs.h"
+
+/* CVSD buffer capacity in samples, twice the largest SCO packet. */
+#define SCO_CODEC_CVSD_SAMPLES 256
+
+/**
+ * CVSD is transcoded by the controller, so the SCO payload is a raw
+ * S16LE PCM stream with the very same layout. */
+struct sco_codec_cvsd {
+	ffb_t dec;
+	ffb_t enc;
+};
+
+static void *sco_codec_cvsd_init(struct sco_codec_buffers *bufs) {
+
+	struct sco_codec_cvsd *cvsd;
+	if ((cvsd = calloc(1, sizeof(*cvsd))) == NULL)
+		return NULL;
+
+	if (ffb_init_int16(&cvsd->dec, SCO_CODEC_CVSD_SAMPLES) == -1)
+		goto fail;
+	if (ffb_init_int16(&cvsd->enc, SCO_CODEC_CVSD_SAMPLES) == -1) {
+		ffb_free(&cvsd->dec);
+		goto fail;
+	}
+
+	bufs->dec_data = bufs->dec_samples = &cvsd->dec;
+	bufs->enc_data = bufs->enc_samples = &cvsd->enc;
+	return cvsd;
+
+fail:
+	free(cvsd);
+	return NULL;
+}
+
+static void sco_codec_cvsd_finish(void *ctx) {
+	struct sco_codec_cvsd *cvsd = ctx;
+	ffb_free(&cvsd->dec);
+	ffb_free(&cvsd->enc);
+	free(cvsd);
+}
+
+static ssize_t sco_codec_cvsd_decode(void *ctx) {
+	struct sco_codec_cvsd *cvsd = ctx;
+	return ffb_len_out(&cvsd->dec);
+}
+
+static ssize_t sco_codec_cvsd_encode(void *ctx) {
+	struct sco_codec_cvsd *cvsd = ctx;
+	return ffb_len_out(&cvsd->enc);
+}
+
+const struct sco_codec_io sco_codec_io_cvsd = {
+	.enc_thread = sco_cvsd_enc_thread,
+	.dec_thread = sco_cvsd_dec_thread,
+	.init = sco_codec_cvsd_init,
+	.finish = sco_codec_cvsd_finish,
+	.decode = sco_codec_cvsd_decode,
+	.encode = sco_codec_cvsd_encode,
+	.encode_frame = 1,
+};
+
+#if ENABLE_MSBC
+
+static void *sco_codec_msbc_init(struct sco_codec_buffers *bufs) {
+
+	struct esco_msbc *msbc;
+	if ((msbc = calloc(1, sizeof(*msbc))) == NULL)
+		return NULL;
+
+	if (msbc_init(msbc) != 0) {
+		free(msbc);
+		return NULL;
+	}
+
+	bufs->dec_data = &msbc->dec_data;
+	bufs->dec_samples = &msbc->dec_pcm;
+	bufs->enc_data = &msbc->enc_data;
+	bufs->enc_samples = &msbc->enc_pcm;
+	return msbc;
+}
+
+static void sco_codec_msbc_finish(void *ctx) {
+	msbc_finish(ctx);
+	free(ctx);
+}
+
+static ssize_t sco_codec_msbc_decode(void *ctx) {
+	return msbc_decode(ctx);
+}
+
+static ssize_t sco_codec_msbc_encode(void *ctx) {
+	return msbc_encode(ctx);
+}
+
+#if HAVE_SPANDSP
+static int sco_codec_msbc_conceal(void *ctx, int16_t *samples, size_t len) {
+	struct esco_msbc *msbc = ctx;
+	if (len * sizeof(int16_t) != MSBC_CODESIZE)
+		return -1;
+	plc_fillin(msbc->plc, samples, len);
+	return 0;
+}
+#endif
+
+const struct sco_codec_io sco_codec_io_msbc = {
+	.enc_thread = sco_msbc_enc_thread,
+	.dec_thread = sco_msbc_dec_thread,
+	.init = sco_codec_msbc_init,
+	.finish = sco_codec_msbc_finish,
+	.decode = sco_codec_msbc_decode,
+	.encode = sco_codec_msbc_encode,
+#if HAVE_SPANDSP
+	.conceal = sco_codec_msbc_conceal,
+#endif
+	.encode_frame = MSBC_CODESIZE / sizeof(int16_t),
+};
+
+#endif
+
+#if ENABLE_LC3_SWB
+
+static void *sco_codec_lc3_swb_init(struct sco_codec_buffers *bufs) {
+
+	struct esco_lc3_swb *lc3_swb;
+	if ((lc3_swb = calloc(1, sizeof(*lc3_swb))) == NULL)
+		return NULL;
+
+	if (lc3_swb_init(lc3_swb) != 0) {
+		free(lc3_swb);
+		return NULL;
+	}
+
+	bufs->dec_data = &lc3_swb->dec_data;
+	bufs->dec_samples = &lc3_swb->dec_pcm;
+	bufs->enc_data = &lc3_swb->enc_data;
+	bufs->enc_samples = &lc3_swb->enc_pcm;
+	return lc3_swb;
+}
+
+static void sco_codec_lc3_swb_finish(void *ctx) {
+	lc3_swb_finish(ctx);
+	free(ctx);
+}
+
+static ssize_t sco_codec_lc3_swb_decode(void *ctx) {
+	return lc3_swb_decode(ctx);
+}
+
+static ssize_t sco_codec_lc3_swb_encode(void *ctx) {
+	return lc3_swb_encode(ctx);
+}
+
+static int sco_codec_lc3_swb_conceal(void *ctx, int16_t *samples, size_t len) {
+	struct esco_lc3_swb *lc3_swb = ctx;
+	if (len * sizeof(int16_t) != LC3_SWB_CODESIZE)
+		return -1;
+	/* decoding without data runs the PLC of the LC3 decoder */
+	return lc3_decode(lc3_swb->decoder, NULL, 0,
+			LC3_PCM_FORMAT_S16, samples, 1) == -1 ? -1 : 0;
+}
+
+const struct sco_codec_io sco_codec_io_lc3_swb = {
+	.enc_thread = sco_lc3_swb_enc_thread,
+	.dec_thread = sco_lc3_swb_dec_thread,
+	.init = sco_codec_lc3_swb_init,
+	.finish = sco_codec_lc3_swb_finish,
+	.decode = sco_codec_lc3_swb_decode,
+	.encode = sco_codec_lc3_swb_encode,
+	.conceal = sco_codec_lc3_swb_conceal,
+	.encode_frame = LC3_SWB_CODESIZE / sizeof(int16_t),
+};
+
+#endif
+
+/**
+ * Get HFP codec descriptor with the SCO I/O handlers.
+ *
+ * @param codec_id BlueALSA HFP audio codec ID.
+ * @return Descriptor of the given codec, or the CVSD one, if the codec
+ *   is unknown or it was not enabled at build time. */
+const struct hfp_codec *sco_codec_lookup(uint32_t codec_id) {
+	const struct hfp_codec *codec;
+	if (codec_id <= UINT8_MAX &&
+			(codec = hfp_codec_lookup(codec_id)) != NULL && codec->io != NULL)
+		return codec;
+	return hfp_codec_lookup(HFP_CODEC_CVSD);
+}
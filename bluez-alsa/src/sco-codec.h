@@ -0,0 +1,66 @@
+/*
+ * BlueALSA - sco-codec.h
+ * Copyright (c) 2016-2024 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef BLUEALSA_SCOCODEC_H_
+#define BLUEALSA_SCOCODEC_H_
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "ba-transport-pcm.h"
+#include "hfp.h"
+#include "shared/ffb.h"
+
+/**
+ * Buffers of the codec instance used by the SCO I/O. */
+struct sco_codec_buffers {
+	/* encoded data received from and sent to the SCO socket */
+	ffb_t *dec_data;
+	ffb_t *enc_data;
+	/* decoded PCM samples and samples waiting for encoding */
+	ffb_t *dec_samples;
+	ffb_t *enc_samples;
+};
+
+/**
+ * SCO audio I/O handlers of the HFP codec. */
+struct sco_codec_io {
+	/* encoder and decoder threads of the threads I/O mode */
+	void *(*enc_thread)(struct ba_transport_pcm *);
+	void *(*dec_thread)(struct ba_transport_pcm *);
+	/* create codec instance used by the duplex I/O */
+	void *(*init)(struct sco_codec_buffers *bufs);
+	void (*finish)(void *ctx);
+	/* decode and encode buffered data, return available output */
+	ssize_t (*decode)(void *ctx);
+	ssize_t (*encode)(void *ctx);
+	/* optional packet loss concealment of exactly one codec frame */
+	int (*conceal)(void *ctx, int16_t *samples, size_t len);
+	/* number of PCM samples the encoder consumes at once */
+	size_t encode_frame;
+};
+
+extern const struct sco_codec_io sco_codec_io_cvsd;
+#if ENABLE_MSBC
+extern const struct sco_codec_io sco_codec_io_msbc;
+#endif
+#if ENABLE_LC3_SWB
+extern const struct sco_codec_io sco_codec_io_lc3_swb;
+#endif
+
+const struct hfp_codec *sco_codec_lookup(uint32_t codec_id);
+
+#endif
@@ -0,0 +1,847 @@
+/*
+ * BlueALSA - sco-duplex.c
+ * Copyright (c) 2016-2024 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "sco-duplex.h"
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <linux/sockios.h>
+
+#include "ba-config.h"
+#include "ba-transport.h"
+#include "ba-transport-pcm.h"
+#include "bluealsa-dbus.h"
+#include "hfp.h"
+#include "io.h"
+#include "sco-codec.h"
+#include "sco-gateway.h"
+#include "sco-jitter.h"
+#include "sco-latency.h"
+#include "shared/defs.h"
+#include "shared/ffb.h"
+#include "shared/log.h"
+
+/**
+ * Poll timeout used when there is no incoming SCO traffic. It bounds the
+ * latency of PCM signal handling when the remote device stays silent. */
+#define SCO_DUPLEX_IDLE_TIMEOUT 100
+
+/* Playout frame duration in microseconds, which matches the SCO
+ * packet interval of the eSCO T2 settings used by mSBC/LC3-SWB. */
+#define SCO_DUPLEX_FRAME_US 7500
+
+/* Interval between playout delay updates sent over D-Bus. */
+#define SCO_DUPLEX_DELAY_UPDATE_MS 1000
+
+/* Capacity of the codec instance table indexed by the HFP codec ID. */
+#define SCO_DUPLEX_CODECS 8
+
+/* Latency is sampled on every n-th SCO packet only, so the time stamps do
+ * not add system calls to every 7.5 ms round of the I/O loop. */
+#define SCO_DUPLEX_LATENCY_INTERVAL 8
+
+/* D-Bus interface exporting the latency histograms on the PCM object. */
+#define SCO_DUPLEX_DBUS_LATENCY_INTERFACE "org.bluealsa.SCOLatency1"
+
+/**
+ * Duplex SCO I/O context.
+ *
+ * Both directions are serviced by a single thread. Reading from the SCO
+ * socket drives the loop: every packet received is paired with a packet
+ * of the same size sent back, so the outgoing stream is paced by the
+ * controller instead of by a dedicated encoder thread. */
+struct sco_duplex {
+	struct ba_transport *t;
+	/* PCM receiving decoded audio */
+	struct ba_transport_pcm *dec_pcm;
+	/* PCM providing audio to encode */
+	struct ba_transport_pcm *enc_pcm;
+	/* SCO link currently serviced, -1 when link is down */
+	int bt_fd;
+	unsigned int bt_id;
+	/* SCO link handed over, but not picked up by the thread yet */
+	int next_fd;
+	unsigned int next_id;
+	/* wake-up notification for the SCO link handover */
+	int event_fd;
+	uint32_t codec_id;
+	/* I/O handlers and instance of the selected codec */
+	const struct sco_codec_io *codec;
+	void *codec_ctx;
+	/* codec instances indexed by the HFP codec ID */
+	struct {
+		void *ctx;
+		struct sco_codec_buffers bufs;
+	} codecs[SCO_DUPLEX_CODECS];
+	/* encoded data received from and sent to the SCO socket */
+	ffb_t *dec_data;
+	ffb_t *enc_data;
+	/* decoded PCM samples and samples waiting for encoding */
+	ffb_t *dec_samples;
+	ffb_t *enc_samples;
+	/* optional playout jitter buffer */
+	bool jitter;
+	struct sco_jitter jb;
+	int16_t *playout;
+	struct timespec ts_playout;
+	struct timespec ts_delay;
+	unsigned int delay_dms;
+	/* per-stage latency histograms of this transport */
+	struct sco_latency lat;
+	unsigned int lat_count;
+	/* time of the PCM read not yet accounted by the SCO write */
+	struct timespec ts_pcm_read;
+	/* registration ID of the D-Bus latency object */
+	unsigned int dbus_id;
+};
+
+static pthread_mutex_t sco_duplex_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* running duplex I/O threads */
+static GSList *sco_duplex_list = NULL;
+
+static void sco_duplex_cleanup(struct sco_duplex *io) {
+
+	pthread_mutex_lock(&sco_duplex_mutex);
+	sco_duplex_list = g_slist_remove(sco_duplex_list, io);
+	pthread_mutex_unlock(&sco_duplex_mutex);
+
+	for (size_t i = 0; i < ARRAYSIZE(io->codecs); i++)
+		if (io->codecs[i].ctx != NULL)
+			sco_codec_lookup(i)->io->finish(io->codecs[i].ctx);
+	if (io->jitter) {
+		debug("SCO jitter buffer stats: frames=%lu concealed=%lu underruns=%lu dropped=%lu",
+				io->jb.stats.frames, io->jb.stats.concealed,
+				io->jb.stats.underruns, io->jb.stats.dropped);
+		sco_jitter_free(&io->jb);
+		free(io->playout);
+	}
+	struct sco_latency_stats lat;
+	sco_latency_snapshot(&io->lat, &lat);
+	for (size_t i = 0; i < SCO_LATENCY_STAGES; i++)
+		debug("SCO %s latency: p50=%u us p99=%u us max=%u us",
+				sco_latency_stage_to_string(i),
+				sco_latency_percentile(&lat, i, 50),
+				sco_latency_percentile(&lat, i, 99), lat.max_us[i]);
+	if (io->dbus_id != 0)
+		g_dbus_connection_unregister_object(config.dbus, io->dbus_id);
+	if (io->event_fd != -1)
+		close(io->event_fd);
+	/* close link which has been handed over but not picked up yet */
+	if (io->next_fd != -1) {
+		close(io->next_fd);
+		sco_gateway_release(io->t, io->next_id);
+	}
+	sco_gateway_release(io->t, io->bt_id);
+	/* the encoding PCM is not owned by this thread */
+	ba_transport_pcm_state_set_idle(io->enc_pcm);
+}
+
+static void timespec_add_us(struct timespec *ts, long us) {
+	ts->tv_nsec += us * 1000;
+	while (ts->tv_nsec >= 1000000000) {
+		ts->tv_nsec -= 1000000000;
+		ts->tv_sec++;
+	}
+}
+
+static long timespec_diff_us(const struct timespec *a, const struct timespec *b) {
+	return (a->tv_sec - b->tv_sec) * 1000000 + (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+/**
+ * Conceal the frame missing in the jitter buffer with the codec PLC, which
+ * also keeps the decoder state in line with the synthesized audio. */
+static int sco_duplex_conceal(void *userdata, int16_t *samples, size_t len) {
+	struct sco_duplex *io = userdata;
+	if (io->codec->conceal == NULL)
+		return -1;
+	return io->codec->conceal(io->codec_ctx, samples, len);
+}
+
+static int sco_duplex_jitter_init(struct sco_duplex *io) {
+
+	const unsigned int rate = io->dec_pcm->rate;
+	const size_t frame = rate * SCO_DUPLEX_FRAME_US / 1000000;
+
+	if (sco_jitter_init(&io->jb, rate, frame) == -1)
+		return -1;
+	if ((io->playout = malloc(frame * sizeof(int16_t))) == NULL) {
+		sco_jitter_free(&io->jb);
+		return -1;
+	}
+
+	sco_jitter_set_plc(&io->jb, sco_duplex_conceal, io);
+
+	io->jitter = true;
+	debug("SCO jitter buffer: target=%u ms frame=%zu", sco_jitter_get_latency(), frame);
+	return 0;
+}
+
+/**
+ * Play out all frames which are due by now.
+ *
+ * @return Time in milliseconds until the next playout deadline. */
+static int sco_duplex_playout(struct sco_duplex *io) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* playout clock is started with the first received packet */
+	if (io->ts_playout.tv_sec == 0 && io->ts_playout.tv_nsec == 0)
+		return SCO_DUPLEX_IDLE_TIMEOUT;
+
+	long due;
+	while ((due = timespec_diff_us(&io->ts_playout, &now)) <= 0) {
+		sco_jitter_get(&io->jb, io->playout);
+		io_pcm_scale(io->dec_pcm, io->playout, io->jb.frame);
+		if (io_pcm_write(io->dec_pcm, io->playout, io->jb.frame) == -1)
+			error("PCM write error: %s", strerror(errno));
+		timespec_add_us(&io->ts_playout, SCO_DUPLEX_FRAME_US);
+	}
+
+	/* Report the playout delay, so clients can compensate for it. The
+	 * update is rate limited, because the buffer level varies from one
+	 * frame to the other. */
+	if (timespec_diff_us(&now, &io->ts_delay) >= SCO_DUPLEX_DELAY_UPDATE_MS * 1000) {
+		const unsigned int delay = sco_jitter_delay_dms(&io->jb);
+		if (delay / 10 != io->delay_dms / 10) {
+			pthread_mutex_lock(&io->dec_pcm->mutex);
+			io->dec_pcm->processing_delay_dms = io->delay_dms = delay;
+			pthread_mutex_unlock(&io->dec_pcm->mutex);
+			bluealsa_dbus_pcm_update(io->dec_pcm, BA_DBUS_PCM_UPDATE_DELAY);
+		}
+		io->ts_delay = now;
+	}
+
+	return MIN(SCO_DUPLEX_IDLE_TIMEOUT, (due + 999) / 1000);
+}
+
+/**
+ * Initialize codec instance, so it can be selected without delay. */
+static int sco_duplex_codec_init(struct sco_duplex *io, uint8_t codec_id) {
+
+	const struct hfp_codec *codec = sco_codec_lookup(codec_id);
+	if (codec->codec_id >= ARRAYSIZE(io->codecs))
+		return errno = EINVAL, -1;
+
+	if (io->codecs[codec->codec_id].ctx != NULL)
+		return 0;
+
+	void *ctx;
+	if ((ctx = codec->io->init(&io->codecs[codec->codec_id].bufs)) == NULL)
+		return -1;
+
+	io->codecs[codec->codec_id].ctx = ctx;
+	return 0;
+}
+
+/**
+ * Select codec instance used for the SCO link.
+ *
+ * Buffers of the selected instance are flushed, so the audio from the
+ * previous link does not leak into the new one. */
+static int sco_duplex_codec_select(struct sco_duplex *io, uint32_t codec_id) {
+
+	if (sco_duplex_codec_init(io, codec_id) == -1)
+		return -1;
+
+	const struct hfp_codec *codec = sco_codec_lookup(codec_id);
+	const struct sco_codec_buffers *bufs = &io->codecs[codec->codec_id].bufs;
+
+	io->codec = codec->io;
+	io->codec_ctx = io->codecs[codec->codec_id].ctx;
+	io->dec_data = bufs->dec_data;
+	io->dec_samples = bufs->dec_samples;
+	io->enc_data = bufs->enc_data;
+	io->enc_samples = bufs->enc_samples;
+
+	ffb_rewind(io->dec_data);
+	ffb_rewind(io->dec_samples);
+	ffb_rewind(io->enc_data);
+	ffb_rewind(io->enc_samples);
+
+	io->codec_id = codec_id;
+	return 0;
+}
+
+static int sco_duplex_init(struct sco_duplex *io) {
+
+	/* Preallocate all supported codecs, so the codec switch triggered
+	 * by the AT+BCS re-negotiation does not have to allocate anything. */
+	uint8_t codecs[8];
+	ssize_t count = hfp_codec_ids(codecs, ARRAYSIZE(codecs));
+	for (ssize_t i = 0; i < count; i++)
+		if (sco_duplex_codec_init(io, codecs[i]) == -1)
+			return -1;
+
+	if ((io->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		return -1;
+
+	return sco_duplex_codec_select(io, io->codec_id);
+}
+
+/**
+ * Hand new SCO link over to the running duplex I/O thread.
+ *
+ * This function allows to switch the SCO link - and the codec - without
+ * tearing down the I/O thread. The thread closes the previous link (if
+ * still open) and picks up the codec currently set on the transport. The
+ * link is set on the transport by the thread after the codec switch, so
+ * the new link is never serviced with the previous codec.
+ *
+ * @return If there is no duplex I/O thread for the given transport, this
+ *   function returns false and the ownership of the fd is not taken. */
+bool sco_duplex_handover(struct ba_transport *t, int fd) {
+
+	bool rv = false;
+
+	pthread_mutex_lock(&sco_duplex_mutex);
+
+	for (GSList *el = sco_duplex_list; el != NULL; el = el->next) {
+		struct sco_duplex *io = el->data;
+		if (io->t != t)
+			continue;
+
+		/* link replaced again before the thread picked it up */
+		if (io->next_fd != -1) {
+			close(io->next_fd);
+			sco_gateway_release(t, io->next_id);
+		}
+		io->next_fd = fd;
+		io->next_id = sco_gateway_link_id(t, fd);
+
+		if (eventfd_write(io->event_fd, 1) == -1)
+			warn("Couldn't notify SCO I/O thread: %s", strerror(errno));
+
+		rv = true;
+		break;
+	}
+
+	pthread_mutex_unlock(&sco_duplex_mutex);
+	return rv;
+}
+
+/**
+ * Get latency histograms of the duplex I/O thread of the given transport.
+ *
+ * The snapshot is taken without stopping the I/O thread, so it is cheap
+ * enough to be used by the D-Bus property getter on every request.
+ *
+ * @return If there is no duplex I/O thread for the given transport, this
+ *   function returns false. */
+bool sco_duplex_get_latency(const struct ba_transport *t, struct sco_latency_stats *stats) {
+
+	bool rv = false;
+
+	pthread_mutex_lock(&sco_duplex_mutex);
+
+	for (GSList *el = sco_duplex_list; el != NULL; el = el->next) {
+		struct sco_duplex *io = el->data;
+		if (io->t != t)
+			continue;
+		sco_latency_snapshot(&io->lat, stats);
+		rv = true;
+		break;
+	}
+
+	pthread_mutex_unlock(&sco_duplex_mutex);
+	return rv;
+}
+
+static GVariant *sco_duplex_dbus_get_property(GDBusConnection *conn,
+		const char *sender, const char *path, const char *interface,
+		const char *property, GError **error, void *userdata) {
+	(void)conn;
+	(void)sender;
+	(void)path;
+	(void)interface;
+	(void)property;
+
+	struct sco_latency_stats stats;
+	if (!sco_duplex_get_latency(userdata, &stats)) {
+		g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "SCO I/O not running");
+		return NULL;
+	}
+
+	return sco_latency_stats_to_variant(&stats);
+}
+
+static const GDBusPropertyInfo sco_duplex_dbus_latency = {
+	-1, "Latency", "a{s(uau)}", G_DBUS_PROPERTY_INFO_FLAGS_READABLE, NULL };
+
+static const GDBusPropertyInfo * const sco_duplex_dbus_properties[] = {
+	&sco_duplex_dbus_latency, NULL };
+
+static const GDBusInterfaceInfo sco_duplex_dbus_interface = {
+	-1, SCO_DUPLEX_DBUS_LATENCY_INTERFACE, NULL, NULL,
+	(GDBusPropertyInfo **)sco_duplex_dbus_properties, NULL };
+
+static const GDBusInterfaceVTable sco_duplex_dbus_vtable = {
+	.get_property = sco_duplex_dbus_get_property,
+};
+
+/**
+ * Export latency histograms on the D-Bus object of the decoding PCM.
+ *
+ * The property getter looks the I/O thread up by its transport, so it
+ * is safe to call it while the thread is going away. */
+static void sco_duplex_dbus_register(struct sco_duplex *io) {
+
+	if (!io->dec_pcm->ba_dbus_exported)
+		return;
+
+	GError *err = NULL;
+	if ((io->dbus_id = g_dbus_connection_register_object(config.dbus,
+					io->dec_pcm->ba_dbus_path,
+					(GDBusInterfaceInfo *)&sco_duplex_dbus_interface,
+					&sco_duplex_dbus_vtable, ba_transport_ref(io->t),
+					(GDestroyNotify)ba_transport_unref, &err)) == 0) {
+		warn("Couldn't export SCO latency: %s", err->message);
+		g_error_free(err);
+	}
+
+}
+
+/**
+ * Close SCO link which has been disconnected or replaced. */
+static void sco_duplex_link_close(struct sco_duplex *io) {
+
+	if (io->bt_fd == -1)
+		return;
+
+	debug("Closing SCO link: %d", io->bt_fd);
+
+	/* The link released by the transport is not ours to close any more,
+	 * its fd number might have been reused already. */
+	pthread_mutex_lock(&io->t->bt_fd_mtx);
+	const bool owned = io->t->bt_fd == io->bt_fd;
+	if (owned)
+		io->t->bt_fd = -1;
+	pthread_mutex_unlock(&io->t->bt_fd_mtx);
+
+	if (owned)
+		close(io->bt_fd);
+	sco_gateway_release(io->t, io->bt_id);
+	io->bt_fd = -1;
+	io->bt_id = 0;
+
+}
+
+/**
+ * Check whether the transport has released the serviced SCO link. */
+static bool sco_duplex_link_released(struct sco_duplex *io) {
+	pthread_mutex_lock(&io->t->bt_fd_mtx);
+	const bool released = io->t->bt_fd != io->bt_fd;
+	pthread_mutex_unlock(&io->t->bt_fd_mtx);
+	return released;
+}
+
+/**
+ * Switch to the SCO link handed over to the thread. */
+static int sco_duplex_link_switch(struct sco_duplex *io) {
+
+	eventfd_t value;
+	eventfd_read(io->event_fd, &value);
+
+	pthread_mutex_lock(&sco_duplex_mutex);
+	const int fd = io->next_fd;
+	const unsigned int id = io->next_id;
+	io->next_fd = -1;
+	io->next_id = 0;
+	pthread_mutex_unlock(&sco_duplex_mutex);
+
+	if (fd == -1)
+		return 0;
+
+	sco_duplex_link_close(io);
+
+	const uint32_t codec_id = ba_transport_get_codec(io->t);
+	if (codec_id != io->codec_id ||
+			/* the link was closed with data in flight */
+			ffb_len_out(io->enc_data) > 0) {
+		debug("Switching SCO codec: %s -> %s",
+				hfp_codec_id_to_string(io->codec_id), hfp_codec_id_to_string(codec_id));
+		if (sco_duplex_codec_select(io, codec_id) == -1)
+			goto fail;
+	}
+
+	if (io->jitter && io->jb.rate != io->dec_pcm->rate) {
+		sco_jitter_free(&io->jb);
+		free(io->playout);
+		io->jitter = false;
+		if (sco_duplex_jitter_init(io) == -1)
+			goto fail;
+	}
+
+	/* The I/O functions operate on the link of the transport, so it is
+	 * switched only now, when the codec context matches the link. */
+	pthread_mutex_lock(&io->t->bt_fd_mtx);
+	io->t->bt_fd = io->bt_fd = fd;
+	pthread_mutex_unlock(&io->t->bt_fd_mtx);
+	io->bt_id = id;
+
+	debug("Resuming SCO duplex I/O: %d", fd);
+	return 0;
+
+fail:
+	close(fd);
+	sco_gateway_release(io->t, id);
+	return -1;
+}
+
+/**
+ * Account the time the last packet read has waited in the SCO socket.
+ *
+ * The kernel timestamps every packet handed over by the HCI driver. The
+ * stamp of the last packet read is fetched with SIOCGSTAMP, which also
+ * enables socket timestamping on the first call. */
+static void sco_duplex_rx_stamp(struct sco_duplex *io) {
+
+	struct timeval tv;
+	if (ioctl(io->bt_fd, SIOCGSTAMP, &tv) == -1)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	sco_latency_add(&io->lat, SCO_LATENCY_RX_SOCKET,
+			(now.tv_sec - tv.tv_sec) * 1000000 + now.tv_nsec / 1000 - tv.tv_usec);
+
+}
+
+/**
+ * Handle signal sent to one of the serviced PCMs. */
+static void sco_duplex_pcm_signal(struct sco_duplex *io, struct ba_transport_pcm *pcm) {
+	switch (ba_transport_pcm_signal_recv(pcm)) {
+	case BA_TRANSPORT_PCM_SIGNAL_OPEN:
+	case BA_TRANSPORT_PCM_SIGNAL_RESUME:
+		break;
+	case BA_TRANSPORT_PCM_SIGNAL_CLOSE:
+	case BA_TRANSPORT_PCM_SIGNAL_DROP:
+		if (pcm == io->enc_pcm)
+			ffb_rewind(io->enc_samples);
+		else if (io->jitter)
+			sco_jitter_reset(&io->jb);
+		break;
+	case BA_TRANSPORT_PCM_SIGNAL_SYNC:
+		/* Samples are drained at the pace of the incoming SCO traffic,
+		 * so by the time the next packet is paired the PCM is synced. */
+		pthread_mutex_lock(&pcm->mutex);
+		pcm->synced = true;
+		pthread_mutex_unlock(&pcm->mutex);
+		pthread_cond_signal(&pcm->cond);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Read PCM samples available for encoding without blocking. */
+static ssize_t sco_duplex_pcm_read(struct sco_duplex *io) {
+
+	struct ba_transport_pcm *pcm = io->enc_pcm;
+	size_t samples = ffb_len_in(io->enc_samples);
+	ssize_t ret = 0;
+
+	pthread_mutex_lock(&pcm->mutex);
+
+	struct pollfd pfd = { pcm->fd, POLLIN, 0 };
+	if (pcm->fd == -1 || samples == 0 ||
+			poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN))
+		goto final;
+
+	if ((ret = read(pcm->fd, io->enc_samples->tail, samples * sizeof(int16_t))) <= 0) {
+		if (ret == 0 || errno != EAGAIN) {
+			debug("PCM has been closed: %d", pcm->fd);
+			ba_transport_pcm_release(pcm);
+		}
+		ret = 0;
+		goto final;
+	}
+
+	ret /= sizeof(int16_t);
+
+final:
+	pthread_mutex_unlock(&pcm->mutex);
+
+	if (ret > 0) {
+		io_pcm_scale(pcm, io->enc_samples->tail, ret);
+		ffb_seek(io->enc_samples, ret);
+		if (io->ts_pcm_read.tv_sec == 0 && io->ts_pcm_read.tv_nsec == 0 &&
+				io->lat_count % SCO_DUPLEX_LATENCY_INTERVAL == 0)
+			clock_gettime(CLOCK_MONOTONIC, &io->ts_pcm_read);
+	}
+
+	return ret;
+}
+
+/**
+ * Prepare exactly len bytes of encoded data.
+ *
+ * If the PCM client does not keep up (or there is no client at all), the
+ * missing part is filled with silence, so the outgoing stream does not
+ * drift away from the incoming one. */
+static int sco_duplex_prepare(struct sco_duplex *io, size_t len) {
+
+	sco_duplex_pcm_read(io);
+
+	for (;;) {
+
+		if (io->codec->encode(io->codec_ctx) == -1) {
+			error("SCO encoding error: %s", strerror(errno));
+			return -1;
+		}
+
+		if (ffb_blen_out(io->enc_data) >= len)
+			return 0;
+
+		size_t samples = ffb_len_in(io->enc_samples);
+		if (samples == 0 && io->enc_samples != io->enc_data) {
+			/* encoder did not consume full buffer */
+			error("SCO encoder stalled: %zu", ffb_len_out(io->enc_samples));
+			return -1;
+		}
+
+		/* Raw PCM is padded up to the requested length only, while
+		 * the encoders need the rest of the current frame to progress.
+		 * Padding more than that would delay the audio which follows. */
+		size_t pad;
+		if (io->enc_samples == io->enc_data)
+			pad = (len - ffb_blen_out(io->enc_data)) / sizeof(int16_t);
+		else {
+			const size_t frame = io->codec->encode_frame;
+			pad = frame - ffb_len_out(io->enc_samples) % frame;
+		}
+		pad = MIN(pad, samples);
+		memset(io->enc_samples->tail, 0, pad * sizeof(int16_t));
+		ffb_seek(io->enc_samples, pad);
+
+	}
+
+}
+
+void *sco_duplex_thread(struct ba_transport_pcm *t_pcm) {
+
+	struct ba_transport *t = t_pcm->t;
+	struct sco_duplex io = {
+		.t = t,
+		.dec_pcm = t_pcm,
+		.enc_pcm = t_pcm == &t->sco.pcm_spk ? &t->sco.pcm_mic : &t->sco.pcm_spk,
+		.bt_fd = t->bt_fd,
+		.bt_id = sco_gateway_link_id(t, t->bt_fd),
+		.next_fd = -1,
+		.event_fd = -1,
+		.codec_id = ba_transport_get_codec(t),
+	};
+
+	/* Cancellation should be possible only in the carefully selected place
+	 * in order to prevent memory leaks and resources not being released. */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	pthread_cleanup_push(PTHREAD_CLEANUP(ba_transport_pcm_thread_cleanup), t_pcm);
+	pthread_cleanup_push(PTHREAD_CLEANUP(sco_duplex_cleanup), &io);
+
+	if (sco_duplex_init(&io) == -1) {
+		error("Couldn't initialize SCO duplex I/O: %s", strerror(errno));
+		goto fail;
+	}
+
+	if (sco_jitter_get_latency() > 0 &&
+			sco_duplex_jitter_init(&io) == -1) {
+		error("Couldn't initialize SCO jitter buffer: %s", strerror(errno));
+		goto fail;
+	}
+
+	pthread_mutex_lock(&sco_duplex_mutex);
+	sco_duplex_list = g_slist_prepend(sco_duplex_list, &io);
+	pthread_mutex_unlock(&sco_duplex_mutex);
+
+	sco_duplex_dbus_register(&io);
+
+	debug("Starting SCO duplex I/O loop: %s", hfp_codec_id_to_string(io.codec_id));
+
+	ba_transport_pcm_state_set_running(io.dec_pcm);
+	ba_transport_pcm_state_set_running(io.enc_pcm);
+
+	for (;;) {
+
+		/* negative fd of the SCO link which is down is ignored by poll */
+		struct pollfd pfds[] = {
+			{ io.bt_fd, POLLIN, 0 },
+			{ io.dec_pcm->pipe[0], POLLIN, 0 },
+			{ io.enc_pcm->pipe[0], POLLIN, 0 },
+			{ io.event_fd, POLLIN, 0 },
+		};
+
+		int timeout = SCO_DUPLEX_IDLE_TIMEOUT;
+		if (io.jitter)
+			timeout = sco_duplex_playout(&io);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		int ret = poll(pfds, ARRAYSIZE(pfds), timeout);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			error("SCO duplex poll error: %s", strerror(errno));
+			goto fail;
+		}
+
+		if (pfds[1].revents & POLLIN)
+			sco_duplex_pcm_signal(&io, io.dec_pcm);
+		if (pfds[2].revents & POLLIN)
+			sco_duplex_pcm_signal(&io, io.enc_pcm);
+
+		/* events of the previous link are stale after the switch */
+		if (pfds[3].revents & POLLIN) {
+			if (sco_duplex_link_switch(&io) == -1) {
+				error("Couldn't switch SCO link: %s", strerror(errno));
+				goto fail;
+			}
+			continue;
+		}
+
+		/* Link released by the transport, so it is dropped without being
+		 * touched: its fd number might belong to a new link already. */
+		if (io.bt_fd != -1 && sco_duplex_link_released(&io)) {
+			debug("SCO link has been released: %d", io.bt_fd);
+			sco_duplex_link_close(&io);
+			continue;
+		}
+
+		/* Keep the thread running when the link goes down, so it can be
+		 * resumed straight away when the codec is re-negotiated. */
+		if (pfds[0].revents & (POLLERR | POLLHUP)) {
+			debug("SCO link has been closed: %d", io.bt_fd);
+			sco_duplex_link_close(&io);
+			continue;
+		}
+
+		if (!(pfds[0].revents & POLLIN))
+			continue;
+
+		ssize_t len;
+		if ((len = io_bt_read(io.dec_pcm, io.dec_data->tail, ffb_blen_in(io.dec_data))) <= 0) {
+			/* link released by the transport right after the check above */
+			if (len == 0 || errno == EBADF) {
+				sco_duplex_link_close(&io);
+				continue;
+			}
+			if (errno == EAGAIN)
+				continue;
+			error("SCO read error: %s", strerror(errno));
+			goto fail;
+		}
+
+		const bool stamp = io.lat_count++ % SCO_DUPLEX_LATENCY_INTERVAL == 0;
+		struct timespec ts_read;
+		if (stamp) {
+			clock_gettime(CLOCK_MONOTONIC, &ts_read);
+			sco_duplex_rx_stamp(&io);
+		}
+
+		ffb_seek(io.dec_data, len / io.dec_data->size);
+
+		ssize_t samples;
+		if ((samples = io.codec->decode(io.codec_ctx)) == -1) {
+			error("SCO decoding error: %s", strerror(errno));
+			ffb_rewind(io.dec_data);
+			samples = 0;
+		}
+
+		/* time the decoded samples wait in the jitter buffer */
+		long playout_us = 0;
+
+		if ((samples = ffb_len_out(io.dec_samples)) > 0 && io.jitter) {
+			if (io.ts_playout.tv_sec == 0 && io.ts_playout.tv_nsec == 0)
+				clock_gettime(CLOCK_MONOTONIC, &io.ts_playout);
+			if (stamp)
+				playout_us = ffb_len_out(&io.jb.buffer) * 1000000 / io.jb.rate;
+			sco_jitter_put(&io.jb, io.dec_samples->data, samples);
+			ffb_rewind(io.dec_samples);
+		}
+		else if (samples > 0) {
+			io_pcm_scale(io.dec_pcm, io.dec_samples->data, samples);
+			if (io_pcm_write(io.dec_pcm, io.dec_samples->data, samples) == -1)
+				error("PCM write error: %s", strerror(errno));
+			ffb_rewind(io.dec_samples);
+		}
+
+		if (stamp && samples > 0) {
+			struct timespec ts_pcm;
+			clock_gettime(CLOCK_MONOTONIC, &ts_pcm);
+			/* Buffered samples are played out ahead of the ones just
+			 * decoded, starting at the next playout deadline. */
+			if (io.jitter)
+				playout_us += MAX(0, timespec_diff_us(&io.ts_playout, &ts_pcm));
+			sco_latency_add(&io.lat, SCO_LATENCY_RX_PCM,
+					timespec_diff_us(&ts_pcm, &ts_read) + playout_us);
+		}
+
+		/* Pair every received packet with an outgoing one of the same
+		 * size. This keeps both directions in lock-step with the SCO
+		 * clock of the controller. */
+		if (sco_duplex_prepare(&io, len) == -1)
+			goto fail;
+
+		/* In the gateway mode the packet over the fair share of this
+		 * link is dropped the same way as when the socket is full. */
+		ssize_t written;
+		if (!sco_gateway_tx_grant(io.t, len))
+			debug("SCO link over UART share, dropping packet: %zd", len);
+		else if ((written = io_bt_write(io.enc_pcm, io.enc_data->data, len)) <= 0) {
+			/* Link lost on the write side is handled like the read
+			 * side, so the thread survives the codec re-negotiation. */
+			if (written == 0 || errno == ECONNRESET || errno == ENOTCONN ||
+					errno == EPIPE || errno == ETIMEDOUT || errno == EBADF) {
+				debug("SCO link has been lost: %d", io.bt_fd);
+				sco_duplex_link_close(&io);
+				ffb_rewind(io.enc_data);
+				continue;
+			}
+			if (errno != EAGAIN) {
+				error("SCO write error: %s", strerror(errno));
+				goto fail;
+			}
+		}
+		else if (io.ts_pcm_read.tv_sec != 0 || io.ts_pcm_read.tv_nsec != 0) {
+			struct timespec ts_write;
+			clock_gettime(CLOCK_MONOTONIC, &ts_write);
+			sco_latency_add_ts(&io.lat, SCO_LATENCY_TX_SOCKET, &io.ts_pcm_read, &ts_write);
+			io.ts_pcm_read = (struct timespec){ 0 };
+		}
+
+		ffb_shift(io.enc_data, len / io.enc_data->size);
+
+	}
+
+fail:
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	return NULL;
+}
@@ -0,0 +1,29 @@
+/*
+ * BlueALSA - sco-duplex.h
+ * Copyright (c) 2016-2024 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef BLUEALSA_SCODUPLEX_H_
+#define BLUEALSA_SCODUPLEX_H_
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+
+#include "ba-transport.h"
+#include "ba-transport-pcm.h"
+#include "sco-latency.h"
+
+bool sco_duplex_handover(struct ba_transport *t, int fd);
+bool sco_duplex_get_latency(const struct ba_transport *t, struct sco_latency_stats *stats);
+void *sco_duplex_thread(struct ba_transport_pcm *t_pcm);
+
+#endif
@@ -0,0 +1,521 @@
+/*
+ * BlueALSA - sco-gateway.c
+ * Copyright (c) 2016-2024 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "sco-gateway.h"
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include <glib.h>
+
+#include "hci.h"
+#include "hfp.h"
+#include "shared/defs.h"
+#include "shared/log.h"
+
+/* Share of the UART bandwidth which can be taken by SCO links, the rest
+ * is left for the ACL traffic (RFCOMM, A2DP) and HCI commands. */
+#define SCO_GATEWAY_UART_SHARE 80
+
+/* Bits on the wire per byte with the 8N1 framing. */
+#define SCO_GATEWAY_UART_BITS 10
+
+/* H5 header, CRC and SLIP delimiters plus the HCI SCO header which are
+ * sent along with every SCO packet. */
+#define SCO_GATEWAY_PKT_OVERHEAD 11
+
+/* SCO packet interval of the eSCO T2 settings. */
+#define SCO_GATEWAY_FRAME_US 7500
+
+/* Baseband slots in one SCO packet interval, and the slots reserved by
+ * CVSD link (EV3/HV3 without retransmissions) and by transparent link
+ * (EV3 with the retransmission window of the T2 settings). */
+#define SCO_GATEWAY_AIR_SLOTS 12
+#define SCO_GATEWAY_AIR_SLOTS_CVSD 4
+#define SCO_GATEWAY_AIR_SLOTS_WIDEBAND 6
+
+/* Controller SCO buffers kept in flight by every link. */
+#define SCO_GATEWAY_LINK_BUFFERS 2
+
+/* Encoder output which can be sent ahead of the fair share. */
+#define SCO_GATEWAY_BURST_US 30000
+
+/* Time given to the new link to be attached to the transport, before
+ * its fd is checked against the transport one. */
+#define SCO_GATEWAY_ATTACH_GRACE_MS 1000
+
+/**
+ * SCO link admitted by the gateway. */
+struct sco_gateway_link {
+	/* unique ID, unlike the fd number which can be reused */
+	unsigned int id;
+	int dev_id;
+	struct ba_transport *t;
+	int fd;
+	uint32_t codec_id;
+	bool wideband;
+	/* reserved resources */
+	unsigned int uart_bps;
+	unsigned int air_slots;
+	/* UART share and the token bucket of the encoder output,
+	 * where tokens are expressed in bytes times 10^6 */
+	unsigned int share_bps;
+	uint64_t tokens;
+	struct timespec ts_tokens;
+	struct timespec ts_admit;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	/* baud rate of the HCI UART, zero disables gateway mode */
+	unsigned int uart_baud;
+	GSList *links;
+	unsigned int link_id;
+} sco_gateway = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static long timespec_diff_us(const struct timespec *a, const struct timespec *b) {
+	return (a->tv_sec - b->tv_sec) * 1000000 + (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+/**
+ * Set the baud rate of the HCI UART shared by all SCO links.
+ *
+ * The gateway mode, which performs the admission control of new SCO
+ * links and schedules the encoder output of all links, is enabled by
+ * setting non-zero baud rate. */
+void sco_gateway_set_uart_baud(unsigned int baud) {
+	sco_gateway.uart_baud = baud;
+}
+
+bool sco_gateway_enabled(void) {
+	return sco_gateway.uart_baud != 0;
+}
+
+static unsigned int sco_gateway_uart_budget(void) {
+	return (uint64_t)sco_gateway.uart_baud / SCO_GATEWAY_UART_BITS *
+		SCO_GATEWAY_UART_SHARE / 100;
+}
+
+/**
+ * Calculate resources reserved by the link with the given codec. */
+static void sco_gateway_link_cost(struct sco_gateway_link *l, uint32_t codec_id,
+		size_t mtu) {
+
+	const struct hfp_codec *codec;
+	if ((codec = hfp_codec_lookup(codec_id)) == NULL)
+		codec = hfp_codec_lookup(HFP_CODEC_CVSD);
+
+	unsigned int bps;
+	if (codec->transparent)
+		/* one codec frame per SCO packet interval */
+		bps = codec->frame_size * 1000000 / SCO_GATEWAY_FRAME_US;
+	else
+		/* controller transcodes the raw PCM stream */
+		bps = codec->rate * codec->frame_size;
+
+	mtu = MAX(mtu, 1);
+	const unsigned int pps = (bps + mtu - 1) / mtu;
+
+	l->codec_id = codec->codec_id;
+	l->wideband = codec->transparent;
+	l->uart_bps = bps + pps * SCO_GATEWAY_PKT_OVERHEAD;
+	l->air_slots = codec->transparent ?
+		SCO_GATEWAY_AIR_SLOTS_WIDEBAND : SCO_GATEWAY_AIR_SLOTS_CVSD;
+
+}
+
+/**
+ * Sum up resources reserved by links of the given adapter.
+ *
+ * Links of the excluded transport are not taken into account, so the
+ * link which is about to be replaced does not count against the new one.
+ * The caller shall hold the gateway mutex. */
+static void sco_gateway_sum(int dev_id, const struct ba_transport *exclude,
+		struct sco_gateway_stats *stats) {
+
+	memset(stats, 0, sizeof(*stats));
+	stats->uart_budget_bps = sco_gateway_uart_budget();
+
+	for (GSList *el = sco_gateway.links; el != NULL; el = el->next) {
+		const struct sco_gateway_link *l = el->data;
+		if (l->dev_id != dev_id || l->t == exclude)
+			continue;
+		stats->links++;
+		if (l->wideband)
+			stats->wideband++;
+		stats->uart_bps += l->uart_bps;
+		stats->air_slots += l->air_slots;
+		stats->buffers += SCO_GATEWAY_LINK_BUFFERS;
+	}
+
+}
+
+static bool sco_gateway_fits(const struct sco_gateway_stats *stats,
+		const struct sco_gateway_link *l) {
+	if (stats->uart_bps + l->uart_bps > stats->uart_budget_bps)
+		return false;
+	if (stats->air_slots + l->air_slots > SCO_GATEWAY_AIR_SLOTS)
+		return false;
+	/* not every controller reports its SCO buffers */
+	if (stats->buffers_max != 0 &&
+			stats->buffers + SCO_GATEWAY_LINK_BUFFERS > stats->buffers_max)
+		return false;
+	return true;
+}
+
+/**
+ * Split the UART bandwidth among links of the given adapter.
+ *
+ * Every link gets what it has reserved on the admission, and the spare
+ * bandwidth is divided equally, so a link catching up after a stall can
+ * not take over the share of the others. The caller shall hold the
+ * gateway mutex. */
+static void sco_gateway_reshare(int dev_id) {
+
+	struct sco_gateway_stats stats;
+	sco_gateway_sum(dev_id, NULL, &stats);
+
+	if (stats.links == 0)
+		return;
+
+	const unsigned int spare = stats.uart_budget_bps > stats.uart_bps ?
+		(stats.uart_budget_bps - stats.uart_bps) / stats.links : 0;
+
+	for (GSList *el = sco_gateway.links; el != NULL; el = el->next) {
+		struct sco_gateway_link *l = el->data;
+		if (l->dev_id == dev_id)
+			l->share_bps = l->uart_bps + spare;
+	}
+
+}
+
+/**
+ * Remove links matching the predicate.
+ *
+ * Removed links are moved to the dead list, so the transports can be
+ * unreferenced without holding the gateway mutex. */
+static GSList *sco_gateway_remove(bool (*match)(const struct sco_gateway_link *, const void *),
+		const void *data, GSList *dead) {
+
+	GSList *el = sco_gateway.links;
+	while (el != NULL) {
+		GSList *next = el->next;
+		struct sco_gateway_link *l = el->data;
+		if (match(l, data)) {
+			sco_gateway.links = g_slist_delete_link(sco_gateway.links, el);
+			dead = g_slist_prepend(dead, l);
+		}
+		el = next;
+	}
+
+	return dead;
+}
+
+static void sco_gateway_link_free(struct sco_gateway_link *l) {
+	ba_transport_unref(l->t);
+	free(l);
+}
+
+/**
+ * Check whether the link is not used by the transport any more. Links
+ * are released by the duplex I/O thread when closed, but a link which
+ * has never been picked up by the thread (e.g. the transport failed to
+ * start) is closed by the transport, so it is checked against the
+ * transport fd. */
+static bool sco_gateway_link_is_dead(const struct sco_gateway_link *l, const void *now) {
+
+	if (timespec_diff_us(now, &l->ts_admit) < SCO_GATEWAY_ATTACH_GRACE_MS * 1000)
+		return false;
+
+	pthread_mutex_lock(&l->t->bt_fd_mtx);
+	const bool dead = l->t->bt_fd != l->fd;
+	pthread_mutex_unlock(&l->t->bt_fd_mtx);
+
+	return dead;
+}
+
+static bool sco_gateway_link_of_transport(const struct sco_gateway_link *l, const void *t) {
+	return l->t == t;
+}
+
+struct sco_gateway_link_key {
+	const struct ba_transport *t;
+	unsigned int id;
+};
+
+static bool sco_gateway_link_is_key(const struct sco_gateway_link *l, const void *key) {
+	const struct sco_gateway_link_key *k = key;
+	return l->t == k->t && l->id == k->id;
+}
+
+/**
+ * Decide whether new SCO link can be attached to the transport.
+ *
+ * The link is admitted if the aggregate load of all links of the adapter,
+ * including the new one, fits into the UART bandwidth, the baseband air
+ * time and the controller SCO buffers. Wideband link which does not fit,
+ * but would fit with CVSD, shall be re-negotiated with CVSD codec.
+ *
+ * @return If the gateway mode is disabled, this function always admits
+ *   the link. */
+enum sco_gateway_verdict sco_gateway_admit(struct ba_adapter *a,
+		struct ba_transport *t, int fd) {
+
+	if (!sco_gateway_enabled())
+		return SCO_GATEWAY_ADMIT;
+
+	const int dev_id = a->hci.dev_id;
+	const size_t mtu = hci_sco_get_mtu(fd, a);
+
+	unsigned int buffers_max = 0;
+	struct hci_dev_info di;
+	if (hci_devinfo(dev_id, &di) == 0)
+		buffers_max = di.sco_pkts;
+
+	struct sco_gateway_link *l;
+	if ((l = calloc(1, sizeof(*l))) == NULL) {
+		error("Couldn't create SCO gateway link: %s", strerror(errno));
+		return SCO_GATEWAY_REJECT;
+	}
+
+	l->dev_id = dev_id;
+	l->fd = fd;
+	clock_gettime(CLOCK_MONOTONIC, &l->ts_admit);
+	l->ts_tokens = l->ts_admit;
+	sco_gateway_link_cost(l, ba_transport_get_codec(t), mtu);
+
+	enum sco_gateway_verdict verdict = SCO_GATEWAY_ADMIT;
+	struct sco_gateway_stats stats;
+	GSList *dead = NULL;
+
+	pthread_mutex_lock(&sco_gateway.mutex);
+
+	dead = sco_gateway_remove(sco_gateway_link_is_dead, &l->ts_admit, dead);
+
+	sco_gateway_sum(dev_id, t, &stats);
+	stats.buffers_max = buffers_max;
+
+	if (!sco_gateway_fits(&stats, l)) {
+		verdict = SCO_GATEWAY_REJECT;
+#if ENABLE_HFP_CODEC_SELECTION
+		if (l->wideband) {
+			sco_gateway_link_cost(l, HFP_CODEC_CVSD, mtu);
+			if (sco_gateway_fits(&stats, l))
+				verdict = SCO_GATEWAY_FALLBACK;
+		}
+#endif
+	}
+
+	if (verdict == SCO_GATEWAY_ADMIT) {
+		/* new link replaces the previous one of the same transport */
+		dead = sco_gateway_remove(sco_gateway_link_of_transport, t, dead);
+		l->t = ba_transport_ref(t);
+		/* zero is never used, it stands for no link */
+		if ((l->id = ++sco_gateway.link_id) == 0)
+			l->id = ++sco_gateway.link_id;
+		sco_gateway.links = g_slist_prepend(sco_gateway.links, l);
+		sco_gateway_reshare(dev_id);
+		l->tokens = (uint64_t)l->share_bps * SCO_GATEWAY_BURST_US;
+	}
+
+	pthread_mutex_unlock(&sco_gateway.mutex);
+
+	g_slist_free_full(dead, (GDestroyNotify)sco_gateway_link_free);
+
+	switch (verdict) {
+	case SCO_GATEWAY_ADMIT:
+		debug("SCO link admitted [%s]: codec=%s uart=%u/%u B/s air=%u/%u",
+				t->bluez_dbus_path, hfp_codec_id_to_string(l->codec_id),
+				stats.uart_bps + l->uart_bps, stats.uart_budget_bps,
+				stats.air_slots + l->air_slots, SCO_GATEWAY_AIR_SLOTS);
+		return verdict;
+	case SCO_GATEWAY_FALLBACK:
+		info("SCO wideband capacity exceeded [%s]: links=%u wideband=%u: Falling back to CVSD",
+				t->bluez_dbus_path, stats.links, stats.wideband);
+		break;
+	case SCO_GATEWAY_REJECT:
+		warn("SCO capacity exceeded [%s]: links=%u uart=%u/%u B/s air=%u/%u buffers=%u/%u",
+				t->bluez_dbus_path, stats.links, stats.uart_bps, stats.uart_budget_bps,
+				stats.air_slots, SCO_GATEWAY_AIR_SLOTS, stats.buffers, stats.buffers_max);
+		break;
+	}
+
+	free(l);
+	return verdict;
+}
+
+/**
+ * Get the ID of the link admitted for the given transport.
+ *
+ * The fd has to be open, so its number identifies the link.
+ *
+ * @return The link ID, or zero if the link has not been admitted by the
+ *   gateway (e.g. the gateway mode is disabled). */
+unsigned int sco_gateway_link_id(const struct ba_transport *t, int fd) {
+
+	if (!sco_gateway_enabled() || fd == -1)
+		return 0;
+
+	unsigned int id = 0;
+
+	pthread_mutex_lock(&sco_gateway.mutex);
+	for (GSList *el = sco_gateway.links; el != NULL; el = el->next) {
+		const struct sco_gateway_link *l = el->data;
+		if (l->t == t && l->fd == fd) {
+			id = l->id;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sco_gateway.mutex);
+
+	return id;
+}
+
+/**
+ * Release resources reserved by the SCO link which has been closed. */
+void sco_gateway_release(const struct ba_transport *t, unsigned int id) {
+
+	if (!sco_gateway_enabled() || id == 0)
+		return;
+
+	const struct sco_gateway_link_key key = { t, id };
+	GSList *dead = NULL;
+
+	pthread_mutex_lock(&sco_gateway.mutex);
+	if ((dead = sco_gateway_remove(sco_gateway_link_is_key, &key, dead)) != NULL)
+		sco_gateway_reshare(((struct sco_gateway_link *)dead->data)->dev_id);
+	pthread_mutex_unlock(&sco_gateway.mutex);
+
+	g_slist_free_full(dead, (GDestroyNotify)sco_gateway_link_free);
+
+}
+
+#if ENABLE_HFP_CODEC_SELECTION
+static void *sco_gateway_fallback_thread(struct ba_transport *t) {
+
+	sigset_t sigset;
+	/* See the ba_transport_pcm_start() function for information
+	 * why we have to mask all signals. */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, NULL);
+
+	if (ba_transport_select_codec_sco(t, HFP_CODEC_CVSD) == -1)
+		error("Couldn't select CVSD codec [%s]: %s", t->bluez_dbus_path, strerror(errno));
+
+	ba_transport_unref(t);
+	return NULL;
+}
+#endif
+
+/**
+ * Re-negotiate the codec of the transport with CVSD.
+ *
+ * The codec selection waits for the remote device to confirm the codec,
+ * so it is done in a detached thread, not to stall the SCO dispatcher. */
+void sco_gateway_fallback(struct ba_transport *t) {
+#if ENABLE_HFP_CODEC_SELECTION
+
+	pthread_t thread;
+	int ret;
+
+	ba_transport_ref(t);
+	if ((ret = pthread_create(&thread, NULL,
+					PTHREAD_FUNC(sco_gateway_fallback_thread), t)) != 0) {
+		error("Couldn't create SCO codec fallback thread: %s", strerror(ret));
+		ba_transport_unref(t);
+		return;
+	}
+
+	pthread_setname_np(thread, "ba-sco-fallback");
+	pthread_detach(thread);
+
+#else
+	(void)t;
+#endif
+}
+
+/**
+ * Check whether the encoder output can be sent over the SCO link.
+ *
+ * Links share the UART bandwidth according to their fair share. When
+ * the link has used up its share the packet shall be dropped, as it is
+ * done when the socket is not writable.
+ *
+ * @return If the gateway mode is disabled or the transport has no link
+ *   admitted, this function always returns true. */
+bool sco_gateway_tx_grant(const struct ba_transport *t, size_t len) {
+
+	if (!sco_gateway_enabled())
+		return true;
+
+	bool rv = true;
+
+	pthread_mutex_lock(&sco_gateway.mutex);
+
+	for (GSList *el = sco_gateway.links; el != NULL; el = el->next) {
+		struct sco_gateway_link *l = el->data;
+		if (l->t != t)
+			continue;
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		const long dt = timespec_diff_us(&now, &l->ts_tokens);
+		l->ts_tokens = now;
+
+		const uint64_t burst = (uint64_t)l->share_bps * SCO_GATEWAY_BURST_US;
+		l->tokens = MIN(burst, l->tokens + (uint64_t)l->share_bps * MAX(dt, 0));
+
+		const uint64_t cost = (uint64_t)(len + SCO_GATEWAY_PKT_OVERHEAD) * 1000000;
+		if ((rv = l->tokens >= cost))
+			l->tokens -= cost;
+
+		break;
+	}
+
+	pthread_mutex_unlock(&sco_gateway.mutex);
+	return rv;
+}
+
+/**
+ * Get aggregate load of the SCO links of the given adapter. */
+void sco_gateway_get_stats(int dev_id, struct sco_gateway_stats *stats) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	GSList *dead = NULL;
+
+	pthread_mutex_lock(&sco_gateway.mutex);
+	dead = sco_gateway_remove(sco_gateway_link_is_dead, &now, dead);
+	for (GSList *el = dead; el != NULL; el = el->next)
+		sco_gateway_reshare(((struct sco_gateway_link *)el->data)->dev_id);
+	sco_gateway_sum(dev_id, NULL, stats);
+	pthread_mutex_unlock(&sco_gateway.mutex);
+
+	g_slist_free_full(dead, (GDestroyNotify)sco_gateway_link_free);
+
+	struct hci_dev_info di;
+	if (hci_devinfo(dev_id, &di) == 0)
+		stats->buffers_max = di.sco_pkts;
+
+}
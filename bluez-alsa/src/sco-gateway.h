@@ -0,0 +1,63 @@
+/*
+ * BlueALSA - sco-gateway.h
+ * Copyright (c) 2016-2024 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef BLUEALSA_SCOGATEWAY_H_
+#define BLUEALSA_SCOGATEWAY_H_
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ba-adapter.h"
+#include "ba-transport.h"
+
+/**
+ * Admission decision for a new SCO link. */
+enum sco_gateway_verdict {
+	SCO_GATEWAY_ADMIT,
+	/* link fits only with CVSD, the codec has to be re-negotiated */
+	SCO_GATEWAY_FALLBACK,
+	SCO_GATEWAY_REJECT,
+};
+
+/**
+ * Aggregate load of the SCO links of one adapter. */
+struct sco_gateway_stats {
+	unsigned int links;
+	unsigned int wideband;
+	/* HCI transport bytes per second in each direction */
+	unsigned int uart_bps;
+	unsigned int uart_budget_bps;
+	/* reserved air slots per 7.5 ms interval */
+	unsigned int air_slots;
+	/* controller SCO buffers used and available */
+	unsigned int buffers;
+	unsigned int buffers_max;
+};
+
+void sco_gateway_set_uart_baud(unsigned int baud);
+bool sco_gateway_enabled(void);
+
+enum sco_gateway_verdict sco_gateway_admit(struct ba_adapter *a,
+		struct ba_transport *t, int fd);
+unsigned int sco_gateway_link_id(const struct ba_transport *t, int fd);
+void sco_gateway_release(const struct ba_transport *t, unsigned int id);
+void sco_gateway_fallback(struct ba_transport *t);
+
+bool sco_gateway_tx_grant(const struct ba_transport *t, size_t len);
+
+void sco_gateway_get_stats(int dev_id, struct sco_gateway_stats *stats);
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * BlueALSA - sco-jitter.c
+ * Copyright (c) 2016-2024 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "sco-jitter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared/defs.h"
+
+/* Number of concealed frames after which the output fades to silence. */
+#define SCO_JITTER_PLC_FADE_FRAMES 4
+
+/* Samples dropped per played frame, as a fraction of the frame, while the
+ * delay is shrinking. With a 7.5 ms frame this is about 1 ms at a time. */
+#define SCO_JITTER_SHRINK_DIV 8
+
+/* Target playout latency in milliseconds, zero disables jitter buffer. */
+static unsigned int sco_jitter_latency = 0;
+
+void sco_jitter_set_latency(unsigned int ms) {
+	sco_jitter_latency = ms;
+}
+
+unsigned int sco_jitter_get_latency(void) {
+	return sco_jitter_latency;
+}
+
+int sco_jitter_init(struct sco_jitter *jb, unsigned int rate, size_t frame) {
+
+	memset(jb, 0, sizeof(*jb));
+
+	jb->rate = rate;
+	jb->frame = frame;
+
+	jb->delay_min = frame;
+	jb->delay_target = MAX(2 * frame, (size_t)sco_jitter_latency * rate / 1000);
+	jb->delay_max = MAX(8 * frame, 4 * jb->delay_target);
+
+	if (ffb_init_int16(&jb->buffer, jb->delay_max + 4 * frame) == -1)
+		return -1;
+	if ((jb->plc_frame = calloc(frame, sizeof(int16_t))) == NULL) {
+		ffb_free(&jb->buffer);
+		return -1;
+	}
+
+	jb->priming = true;
+	return 0;
+}
+
+void sco_jitter_free(struct sco_jitter *jb) {
+	ffb_free(&jb->buffer);
+	free(jb->plc_frame);
+	jb->plc_frame = NULL;
+}
+
+void sco_jitter_reset(struct sco_jitter *jb) {
+	ffb_rewind(&jb->buffer);
+	jb->arrival_samples = 0;
+	jb->priming = true;
+	jb->plc_run = 0;
+}
+
+/**
+ * Set codec concealment used for missing frames. */
+void sco_jitter_set_plc(struct sco_jitter *jb, sco_jitter_plc_func func, void *userdata) {
+	jb->plc = func;
+	jb->plc_data = userdata;
+}
+
+/**
+ * Update inter-arrival jitter estimate and the playout target.
+ *
+ * The jitter is estimated as in RFC 3550: a running average of the
+ * difference between the actual and the expected packet spacing. */
+static void sco_jitter_update(struct sco_jitter *jb, size_t len) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (jb->arrival_samples > 0) {
+
+		const long elapsed_us = (now.tv_sec - jb->ts_arrival.tv_sec) * 1000000 +
+			(now.tv_nsec - jb->ts_arrival.tv_nsec) / 1000;
+		const long expected_us = jb->arrival_samples * 1000000 / jb->rate;
+		const long d = labs(elapsed_us - expected_us);
+		jb->jitter_us = (long)jb->jitter_us + (d - (long)jb->jitter_us) / 16;
+
+		/* Keep the delay at twice the jitter plus one frame of margin,
+		 * but never below the configured latency. */
+		size_t target = (size_t)jb->jitter_us * 2 * jb->rate / 1000000 + jb->frame;
+		target = MAX(target, (size_t)sco_jitter_latency * jb->rate / 1000);
+		jb->delay_target = MIN(MAX(target, jb->delay_min), jb->delay_max);
+
+	}
+
+	jb->ts_arrival = now;
+	jb->arrival_samples = len;
+
+}
+
+/**
+ * Queue decoded samples.
+ *
+ * @return The number of samples dropped due to buffer overflow. */
+ssize_t sco_jitter_put(struct sco_jitter *jb, const int16_t *samples, size_t len) {
+
+	sco_jitter_update(jb, len);
+
+	size_t dropped = 0;
+	if (len > ffb_len_in(&jb->buffer)) {
+		/* drop the oldest samples to make room */
+		dropped = MIN(len - ffb_len_in(&jb->buffer), ffb_len_out(&jb->buffer));
+		ffb_shift(&jb->buffer, dropped);
+		jb->stats.dropped += dropped;
+	}
+
+	len = MIN(len, ffb_len_in(&jb->buffer));
+	memcpy(jb->buffer.tail, samples, len * sizeof(int16_t));
+	ffb_seek(&jb->buffer, len);
+
+	return dropped;
+}
+
+/**
+ * Conceal missing frame with the codec PLC, or by repeating the last one
+ * with a fade-out. */
+static void sco_jitter_conceal(struct sco_jitter *jb, int16_t *samples) {
+
+	if (jb->plc_run++ == 0)
+		jb->stats.underruns++;
+	jb->stats.concealed++;
+
+	if (jb->plc != NULL && jb->plc(jb->plc_data, samples, jb->frame) == 0)
+		return;
+
+	if (jb->plc_run > SCO_JITTER_PLC_FADE_FRAMES) {
+		memset(samples, 0, jb->frame * sizeof(int16_t));
+		return;
+	}
+
+	const int gain = SCO_JITTER_PLC_FADE_FRAMES - jb->plc_run + 1;
+	for (size_t i = 0; i < jb->frame; i++)
+		samples[i] = jb->plc_frame[i] * gain / (SCO_JITTER_PLC_FADE_FRAMES + 1);
+
+}
+
+/**
+ * Get one frame of samples shortened by the given number of samples.
+ *
+ * The frame is built from frame + drop queued samples: the head is copied
+ * as is, and the tail is crossfaded with the same span shifted by drop
+ * samples, so the splice is spread over a quarter of the frame instead of
+ * being a hard cut. */
+static void sco_jitter_get_shrink(struct sco_jitter *jb, int16_t *samples, size_t drop) {
+
+	const int16_t *in = jb->buffer.data;
+	const size_t overlap = MAX(MAX(jb->frame / 4, drop), 1);
+	const size_t head = jb->frame - overlap;
+
+	memcpy(samples, in, head * sizeof(int16_t));
+	for (size_t i = 0; i < overlap; i++)
+		samples[head + i] = (in[head + i] * (long)(overlap - i) +
+				in[head + i + drop] * (long)(i + 1)) / (long)(overlap + 1);
+
+	ffb_shift(&jb->buffer, jb->frame + drop);
+	jb->stats.dropped += drop;
+
+}
+
+/**
+ * Get one frame of samples for playout.
+ *
+ * This function always provides exactly one frame of audio. */
+void sco_jitter_get(struct sco_jitter *jb, int16_t *samples) {
+
+	size_t avail = ffb_len_out(&jb->buffer);
+
+	if (jb->priming) {
+		if (avail < jb->delay_target) {
+			if (jb->plc_run > 0)
+				sco_jitter_conceal(jb, samples);
+			else
+				memset(samples, 0, jb->frame * sizeof(int16_t));
+			return;
+		}
+		jb->priming = false;
+	}
+
+	if (avail < jb->frame) {
+		sco_jitter_conceal(jb, samples);
+		/* let the buffer refill up to the (grown) target */
+		jb->priming = true;
+		return;
+	}
+
+	/* shrink the delay gradually when the jitter has settled down */
+	if (avail > jb->delay_target + 2 * jb->frame) {
+		const size_t excess = avail - jb->frame - jb->delay_target;
+		const size_t drop = MIN(MAX(jb->frame / SCO_JITTER_SHRINK_DIV, 1), excess);
+		sco_jitter_get_shrink(jb, samples, drop);
+	}
+	else {
+		memcpy(samples, jb->buffer.data, jb->frame * sizeof(int16_t));
+		ffb_shift(&jb->buffer, jb->frame);
+	}
+
+	memcpy(jb->plc_frame, samples, jb->frame * sizeof(int16_t));
+	jb->plc_run = 0;
+	jb->stats.frames++;
+
+}
+
+/**
+ * Get the current playout delay in 1/10 of millisecond. */
+unsigned int sco_jitter_delay_dms(const struct sco_jitter *jb) {
+	return ffb_len_out(&jb->buffer) * 10000 / jb->rate;
+}
@@ -0,0 +1,91 @@
+/*
+ * BlueALSA - sco-jitter.h
+ * Copyright (c) 2016-2024 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef BLUEALSA_SCOJITTER_H_
+#define BLUEALSA_SCOJITTER_H_
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "shared/ffb.h"
+
+/**
+ * Adaptive jitter buffer for decoded SCO audio.
+ *
+ * Decoded samples are queued as they arrive from the SCO socket and are
+ * played out at the nominal sampling rate. The playout delay follows the
+ * measured inter-arrival jitter, bounded by the configured target latency
+ * and the buffer capacity. Missing audio is concealed by the PLC of the
+ * codec, or by repeating the last frame with a fade-out if the codec has
+ * none. */
+
+/**
+ * Codec packet loss concealment, synthesizes exactly one frame.
+ *
+ * @return Zero on success, -1 if the concealment is not available. */
+typedef int (*sco_jitter_plc_func)(void *userdata, int16_t *samples, size_t len);
+
+struct sco_jitter {
+
+	unsigned int rate;
+	/* samples per playout frame */
+	size_t frame;
+	ffb_t buffer;
+
+	/* playout delay bounds and current target in samples */
+	size_t delay_min;
+	size_t delay_max;
+	size_t delay_target;
+
+	/* smoothed inter-arrival jitter in microseconds */
+	unsigned int jitter_us;
+	struct timespec ts_arrival;
+	size_t arrival_samples;
+
+	/* waiting for the buffer to fill up to the target */
+	bool priming;
+
+	/* codec concealment and the last played frame for the fallback */
+	sco_jitter_plc_func plc;
+	void *plc_data;
+	int16_t *plc_frame;
+	unsigned int plc_run;
+
+	struct {
+		unsigned long frames;
+		unsigned long concealed;
+		unsigned long dropped;
+		unsigned long underruns;
+	} stats;
+
+};
+
+void sco_jitter_set_latency(unsigned int ms);
+unsigned int sco_jitter_get_latency(void);
+
+int sco_jitter_init(struct sco_jitter *jb, unsigned int rate, size_t frame);
+void sco_jitter_free(struct sco_jitter *jb);
+void sco_jitter_reset(struct sco_jitter *jb);
+void sco_jitter_set_plc(struct sco_jitter *jb, sco_jitter_plc_func func, void *userdata);
+
+ssize_t sco_jitter_put(struct sco_jitter *jb, const int16_t *samples, size_t len);
+void sco_jitter_get(struct sco_jitter *jb, int16_t *samples);
+
+unsigned int sco_jitter_delay_dms(const struct sco_jitter *jb);
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * BlueALSA - sco-latency.c
+ * Copyright (c) 2016-2024 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#include "sco-latency.h"
+
+#include "shared/defs.h"
+
+static const char *sco_latency_stage_names[SCO_LATENCY_STAGES] = {
+	[SCO_LATENCY_RX_SOCKET] = "rx-socket",
+	[SCO_LATENCY_RX_PCM] = "rx-pcm",
+	[SCO_LATENCY_TX_SOCKET] = "tx-socket",
+};
+
+void sco_latency_reset(struct sco_latency *l) {
+	for (size_t i = 0; i < SCO_LATENCY_STAGES; i++) {
+		for (size_t j = 0; j < SCO_LATENCY_BUCKETS; j++)
+			atomic_store_explicit(&l->hist[i][j], 0, memory_order_relaxed);
+		atomic_store_explicit(&l->max_us[i], 0, memory_order_relaxed);
+	}
+}
+
+void sco_latency_add(struct sco_latency *l, enum sco_latency_stage stage, long us) {
+
+	if (us < 0)
+		us = 0;
+
+	/* bucket index is the bit length of the value */
+	unsigned int i = 0;
+	for (unsigned long v = us; v != 0 && i < SCO_LATENCY_BUCKETS - 1; v >>= 1)
+		i++;
+
+	/* Single writer, so a plain load and store are enough and much
+	 * cheaper than a read-modify-write on most targets. */
+	atomic_uint *bucket = &l->hist[stage][i];
+	atomic_store_explicit(bucket,
+			atomic_load_explicit(bucket, memory_order_relaxed) + 1,
+			memory_order_relaxed);
+
+	if ((unsigned long)us > atomic_load_explicit(&l->max_us[stage], memory_order_relaxed))
+		atomic_store_explicit(&l->max_us[stage], us, memory_order_relaxed);
+
+}
+
+void sco_latency_add_ts(struct sco_latency *l, enum sco_latency_stage stage,
+		const struct timespec *start, const struct timespec *end) {
+	sco_latency_add(l, stage, (end->tv_sec - start->tv_sec) * 1000000 +
+			(end->tv_nsec - start->tv_nsec) / 1000);
+}
+
+void sco_latency_snapshot(const struct sco_latency *l, struct sco_latency_stats *stats) {
+	for (size_t i = 0; i < SCO_LATENCY_STAGES; i++) {
+		for (size_t j = 0; j < SCO_LATENCY_BUCKETS; j++)
+			stats->hist[i][j] = atomic_load_explicit(&l->hist[i][j], memory_order_relaxed);
+		stats->max_us[i] = atomic_load_explicit(&l->max_us[i], memory_order_relaxed);
+	}
+}
+
+/**
+ * Get the upper bound of the bucket holding the given percentile.
+ *
+ * @return Latency in microseconds, or 0 if there are no samples. */
+unsigned int sco_latency_percentile(const struct sco_latency_stats *stats,
+		enum sco_latency_stage stage, unsigned int pct) {
+
+	unsigned long total = 0;
+	for (size_t i = 0; i < SCO_LATENCY_BUCKETS; i++)
+		total += stats->hist[stage][i];
+	if (total == 0)
+		return 0;
+
+	const unsigned long rank = (total * MIN(pct, 100) + 99) / 100;
+	unsigned long count = 0;
+	for (size_t i = 0; i < SCO_LATENCY_BUCKETS - 1; i++)
+		if ((count += stats->hist[stage][i]) >= rank)
+			return i == 0 ? 0 : MIN(1U << i, stats->max_us[stage]);
+
+	return stats->max_us[stage];
+}
+
+const char *sco_latency_stage_to_string(enum sco_latency_stage stage) {
+	if (stage < SCO_LATENCY_STAGES)
+		return sco_latency_stage_names[stage];
+	return "unknown";
+}
+
+/**
+ * Build D-Bus representation of the histograms.
+ *
+ * @return Floating reference to a GVariant of the a{s(uau)} type, which
+ *   maps the stage name to its maximum latency and histogram buckets. */
+GVariant *sco_latency_stats_to_variant(const struct sco_latency_stats *stats) {
+
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{s(uau)}"));
+
+	for (size_t i = 0; i < SCO_LATENCY_STAGES; i++) {
+		GVariant *hist = g_variant_new_fixed_array(G_VARIANT_TYPE_UINT32,
+				stats->hist[i], SCO_LATENCY_BUCKETS, sizeof(stats->hist[i][0]));
+		g_variant_builder_add(&builder, "{s(u@au)}",
+				sco_latency_stage_names[i], stats->max_us[i], hist);
+	}
+
+	return g_variant_builder_end(&builder);
+}
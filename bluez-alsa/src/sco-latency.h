@@ -0,0 +1,70 @@
+/*
+ * BlueALSA - sco-latency.h
+ * Copyright (c) 2016-2024 Arkadiusz Bokowy
+ *
+ * This file is a part of bluez-alsa.
+ *
+ * This project is licensed under the terms of the MIT license.
+ *
+ */
+
+#pragma once
+#ifndef BLUEALSA_SCOLATENCY_H_
+#define BLUEALSA_SCOLATENCY_H_
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <glib.h>
+
+/* Bucket n counts samples of [2^(n-1), 2^n) microseconds, the last
+ * bucket counts everything above. */
+#define SCO_LATENCY_BUCKETS 16
+
+enum sco_latency_stage {
+	/* SCO packet received by the HCI core until read from the socket */
+	SCO_LATENCY_RX_SOCKET,
+	/* SCO packet read until decoded audio written to the PCM, including
+	 * the expected wait in the playout jitter buffer */
+	SCO_LATENCY_RX_PCM,
+	/* PCM read until the encoded SCO packet written to the socket */
+	SCO_LATENCY_TX_SOCKET,
+	SCO_LATENCY_STAGES,
+};
+
+/**
+ * Per-stage log2 latency histograms.
+ *
+ * There is a single writer per histogram (the SCO I/O thread), so samples
+ * are added with relaxed atomic operations only. Readers, e.g. the D-Bus
+ * thread, take a snapshot without any locking. */
+struct sco_latency {
+	atomic_uint hist[SCO_LATENCY_STAGES][SCO_LATENCY_BUCKETS];
+	atomic_uint max_us[SCO_LATENCY_STAGES];
+};
+
+/**
+ * Snapshot of the histograms, suitable for reporting. */
+struct sco_latency_stats {
+	unsigned int hist[SCO_LATENCY_STAGES][SCO_LATENCY_BUCKETS];
+	unsigned int max_us[SCO_LATENCY_STAGES];
+};
+
+void sco_latency_reset(struct sco_latency *l);
+void sco_latency_add(struct sco_latency *l, enum sco_latency_stage stage, long us);
+void sco_latency_add_ts(struct sco_latency *l, enum sco_latency_stage stage,
+		const struct timespec *start, const struct timespec *end);
+
+void sco_latency_snapshot(const struct sco_latency *l, struct sco_latency_stats *stats);
+unsigned int sco_latency_percentile(const struct sco_latency_stats *stats,
+		enum sco_latency_stage stage, unsigned int pct);
+
+const char *sco_latency_stage_to_string(enum sco_latency_stage stage);
+GVariant *sco_latency_stats_to_variant(const struct sco_latency_stats *stats);
+
+#endif
@@ -15,11 +15,15 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -30,6 +34,7 @@
 
 #include <glib.h>
 
+#include "ba-adapter.h"
 #include "ba-config.h"
 #include "ba-device.h"
 #include "ba-transport.h"
@@ -37,9 +42,10 @@
 #include "bluealsa-dbus.h"
 #include "hci.h"
 #include "hfp.h"
-#include "sco-cvsd.h"
-#include "sco-lc3-swb.h"
-#include "sco-msbc.h"
+#include "sco-codec.h"
+#include "sco-duplex.h"
+#include "sco-gateway.h"
+#include "sco-jitter.h"
 #include "shared/bluetooth.h"
 #include "shared/defs.h"
 #include "shared/log.h"
@@ -51,6 +57,252 @@ struct sco_data {
 	struct pollfd pfd;
 };
 
+static enum sco_dispatcher_mode sco_dispatcher_mode = SCO_DISPATCHER_THREAD;
+
+void sco_set_dispatcher_mode(enum sco_dispatcher_mode mode) {
+	sco_dispatcher_mode = mode;
+}
+
+static enum sco_io_mode sco_io_mode = SCO_IO_THREADS;
+
+void sco_set_io_mode(enum sco_io_mode mode) {
+	sco_io_mode = mode;
+}
+
+/**
+ * Check whether SCO audio is serviced by the duplex I/O thread.
+ *
+ * The encoder output is scheduled by the gateway in the duplex thread,
+ * so the gateway mode always runs with the duplex I/O. */
+static bool sco_io_duplex(void) {
+	return sco_io_mode == SCO_IO_DUPLEX || sco_gateway_enabled();
+}
+
+/**
+ * Apply SCO options given in the environment.
+ *
+ * These tunables have no command line option, so they can be set for the
+ * daemon in its start script, e.g. BLUEALSA_SCO_DISPATCHER=epoll. */
+static void sco_env_load(void) {
+
+	const char *env;
+
+	if ((env = getenv("BLUEALSA_SCO_DISPATCHER")) != NULL) {
+		if (strcmp(env, "thread") == 0)
+			sco_dispatcher_mode = SCO_DISPATCHER_THREAD;
+		else if (strcmp(env, "epoll") == 0)
+			sco_dispatcher_mode = SCO_DISPATCHER_EPOLL;
+		else
+			warn("Invalid SCO dispatcher mode: %s", env);
+	}
+
+	if ((env = getenv("BLUEALSA_SCO_IO")) != NULL) {
+		if (strcmp(env, "threads") == 0)
+			sco_io_mode = SCO_IO_THREADS;
+		else if (strcmp(env, "duplex") == 0)
+			sco_io_mode = SCO_IO_DUPLEX;
+		else
+			warn("Invalid SCO I/O mode: %s", env);
+	}
+
+	/* target latency of the duplex I/O jitter buffer in milliseconds */
+	if ((env = getenv("BLUEALSA_SCO_JITTER_LATENCY")) != NULL) {
+		char *end;
+		unsigned long ms = strtoul(env, &end, 10);
+		if (*env == '\0' || *end != '\0' || ms > 1000)
+			warn("Invalid SCO jitter buffer latency: %s", env);
+		else
+			sco_jitter_set_latency(ms);
+	}
+
+	/* baud rate of the HCI UART, which enables the SCO gateway mode */
+	if ((env = getenv("BLUEALSA_SCO_UART_BAUD")) != NULL) {
+		char *end;
+		unsigned long baud = strtoul(env, &end, 10);
+		if (*env == '\0' || *end != '\0' || baud > UINT32_MAX)
+			warn("Invalid SCO UART baud rate: %s", env);
+		else
+			sco_gateway_set_uart_baud(baud);
+	}
+
+}
+
+static pthread_once_t sco_env_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Open SCO listening socket for the given HCI device. */
+static int sco_listen(int dev_id) {
+
+	int fd;
+	if ((fd = hci_sco_open(dev_id)) == -1) {
+		error("Couldn't open SCO socket: %s", strerror(errno));
+		return -1;
+	}
+
+#if ENABLE_HFP_CODEC_SELECTION
+	uint32_t defer = 1;
+	if (setsockopt(fd, SOL_BLUETOOTH, BT_DEFER_SETUP, &defer, sizeof(defer)) == -1) {
+		error("Couldn't set deferred connection setup: %s", strerror(errno));
+		goto fail;
+	}
+#endif
+
+	if (listen(fd, 10) == -1) {
+		error("Couldn't listen on SCO socket: %s", strerror(errno));
+		goto fail;
+	}
+
+	return fd;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+/**
+ * Lookup transport for incoming SCO link.
+ *
+ * @return On success this function returns referenced transport. */
+static struct ba_transport *sco_lookup_transport(struct ba_adapter *a,
+		const bdaddr_t *addr) {
+
+	struct ba_device *d;
+	struct ba_transport *t;
+	char addrstr[18];
+
+	ba2str(addr, addrstr);
+	if ((d = ba_device_lookup(a, addr)) == NULL) {
+		error("Couldn't lookup device: %s", addrstr);
+		return NULL;
+	}
+
+	if ((t = ba_transport_lookup(d, d->bluez_dbus_path)) == NULL)
+		error("Couldn't lookup transport: %s", d->bluez_dbus_path);
+
+	ba_device_unref(d);
+	return t;
+}
+
+/**
+ * Authorize deferred SCO connection.
+ *
+ * The voice setting has to be selected before the connection is accepted,
+ * according to the codec negotiated on the RFCOMM link. */
+static int sco_authorize(int fd, struct ba_transport *t) {
+#if ENABLE_HFP_CODEC_SELECTION
+	const struct hfp_codec *codec = hfp_codec_lookup(ba_transport_get_codec(t));
+	struct bt_voice voice = { .setting = BT_VOICE_TRANSPARENT };
+	if (codec != NULL && codec->transparent &&
+			setsockopt(fd, SOL_BLUETOOTH, BT_VOICE, &voice, sizeof(voice)) == -1) {
+		error("Couldn't setup transparent voice: %s", strerror(errno));
+		return -1;
+	}
+	if (read(fd, &voice, 1) == -1) {
+		error("Couldn't authorize SCO connection: %s", strerror(errno));
+		return -1;
+	}
+#else
+	(void)fd;
+	(void)t;
+#endif
+	return 0;
+}
+
+/**
+ * Size of the codec data unit carried by SCO packets. */
+static size_t sco_codec_frame_size(uint32_t codec_id) {
+	const struct hfp_codec *codec;
+	if ((codec = hfp_codec_lookup(codec_id)) == NULL)
+		codec = hfp_codec_lookup(HFP_CODEC_CVSD);
+	return codec->frame_size;
+}
+
+/**
+ * Tune SCO link for the codec used by the transport.
+ *
+ * The I/O batch is set to the largest whole number of codec frames which
+ * fits into the SCO MTU, so every syscall carries complete frames. Socket
+ * buffers are left at the kernel defaults: the receive queue is charged
+ * with the skb truesize, which for small SCO packets is many times the
+ * payload, so buffers sized by the payload would drop packets during the
+ * bursts of the UART transport. */
+static void sco_link_tune(struct ba_adapter *a, struct ba_transport *t, int fd) {
+
+	const uint32_t codec_id = ba_transport_get_codec(t);
+	const size_t frame = sco_codec_frame_size(codec_id);
+	size_t mtu = hci_sco_get_mtu(fd, a);
+
+	struct hci_dev_info di;
+	if (hci_devinfo(a->hci.dev_id, &di) == 0 && di.sco_mtu > 0) {
+		debug("Controller SCO buffers: %u x %u", di.sco_pkts, di.sco_mtu);
+		mtu = MIN(mtu, di.sco_mtu);
+	}
+
+	size_t batch = mtu / frame * frame;
+	if (batch == 0) {
+		warn("SCO MTU smaller than codec frame: %zu < %zu", mtu, frame);
+		batch = mtu;
+	}
+
+	t->mtu_read = t->mtu_write = batch;
+
+	info("SCO link tuned [%s]: codec=%s mtu=%zu frame=%zu batch=%zu",
+			t->bluez_dbus_path, hfp_codec_id_to_string(codec_id),
+			mtu, frame, batch);
+
+}
+
+/**
+ * Hand connected SCO link over to the transport.
+ *
+ * The ownership of the fd is transferred to the transport. */
+static void sco_transport_attach(struct ba_adapter *a, struct ba_transport *t, int fd) {
+
+	/* In the gateway mode all links of the adapter share the UART, so
+	 * link which does not fit is dropped instead of degrading others. */
+	switch (sco_gateway_admit(a, t, fd)) {
+	case SCO_GATEWAY_ADMIT:
+		break;
+	case SCO_GATEWAY_FALLBACK:
+		sco_gateway_fallback(t);
+		/* fall-through */
+	case SCO_GATEWAY_REJECT:
+		close(fd);
+		return;
+	}
+
+	bool tuned = false;
+
+	/* Warm restart: the duplex I/O thread survives the SCO link drop, so
+	 * after the codec re-negotiation only the link is handed over to it,
+	 * without stopping and starting the transport. */
+	if (sco_io_duplex()) {
+		pthread_mutex_lock(&t->bt_fd_mtx);
+		sco_link_tune(a, t, fd);
+		pthread_mutex_unlock(&t->bt_fd_mtx);
+		tuned = true;
+		if (sco_duplex_handover(t, fd)) {
+			debug("SCO link handed over to running I/O thread: %d", fd);
+			return;
+		}
+	}
+
+	ba_transport_stop(t);
+
+	pthread_mutex_lock(&t->bt_fd_mtx);
+
+	t->bt_fd = fd;
+	if (!tuned)
+		sco_link_tune(a, t, fd);
+
+	pthread_mutex_unlock(&t->bt_fd_mtx);
+
+	ba_transport_pcm_state_set_idle(&t->sco.pcm_spk);
+	ba_transport_pcm_state_set_idle(&t->sco.pcm_mic);
+	ba_transport_start(t);
+
+}
+
 static void sco_dispatcher_cleanup(struct sco_data *data) {
 	debug("SCO dispatcher cleanup: %s", data->a->hci.name);
 	if (data->pfd.fd != -1)
@@ -70,23 +322,8 @@ static void *sco_dispatcher_thread(struct ba_adapter *a) {
 	sigfillset(&sigset);
 	pthread_sigmask(SIG_SETMASK, &sigset, NULL);
 
-	if ((data.pfd.fd = hci_sco_open(data.a->hci.dev_id)) == -1) {
-		error("Couldn't open SCO socket: %s", strerror(errno));
-		goto fail;
-	}
-
-#if ENABLE_HFP_CODEC_SELECTION
-	uint32_t defer = 1;
-	if (setsockopt(data.pfd.fd, SOL_BLUETOOTH, BT_DEFER_SETUP, &defer, sizeof(defer)) == -1) {
-		error("Couldn't set deferred connection setup: %s", strerror(errno));
+	if ((data.pfd.fd = sco_listen(data.a->hci.dev_id)) == -1)
 		goto fail;
-	}
-#endif
-
-	if (listen(data.pfd.fd, 10) == -1) {
-		error("Couldn't listen on SCO socket: %s", strerror(errno));
-		goto fail;
-	}
 
 	debug("Starting SCO dispatcher loop: %s", a->hci.name);
 	for (;;) {
@@ -104,7 +341,6 @@ static void *sco_dispatcher_thread(struct ba_adapter *a) {
 
 		struct sockaddr_sco addr;
 		socklen_t addrlen = sizeof(addr);
-		struct ba_device *d = NULL;
 		struct ba_transport *t = NULL;
 		char addrstr[18];
 		int fd = -1;
@@ -117,47 +353,16 @@ static void *sco_dispatcher_thread(struct ba_adapter *a) {
 		ba2str(&addr.sco_bdaddr, addrstr);
 		debug("New incoming SCO link: %s: %d", addrstr, fd);
 
-		if ((d = ba_device_lookup(data.a, &addr.sco_bdaddr)) == NULL) {
-			error("Couldn't lookup device: %s", addrstr);
+		if ((t = sco_lookup_transport(data.a, &addr.sco_bdaddr)) == NULL)
 			goto cleanup;
-		}
 
-		if ((t = ba_transport_lookup(d, d->bluez_dbus_path)) == NULL) {
-			error("Couldn't lookup transport: %s", d->bluez_dbus_path);
+		if (sco_authorize(fd, t) == -1)
 			goto cleanup;
-		}
 
-#if ENABLE_HFP_CODEC_SELECTION
-		const uint32_t codec_id = ba_transport_get_codec(t);
-		struct bt_voice voice = { .setting = BT_VOICE_TRANSPARENT };
-		if ((codec_id == HFP_CODEC_MSBC || codec_id == HFP_CODEC_LC3_SWB) &&
-				setsockopt(fd, SOL_BLUETOOTH, BT_VOICE, &voice, sizeof(voice)) == -1) {
-			error("Couldn't setup transparent voice: %s", strerror(errno));
-			goto cleanup;
-		}
-		if (read(fd, &voice, 1) == -1) {
-			error("Couldn't authorize SCO connection: %s", strerror(errno));
-			goto cleanup;
-		}
-#endif
-
-		ba_transport_stop(t);
-
-		pthread_mutex_lock(&t->bt_fd_mtx);
-
-		t->bt_fd = fd;
-		t->mtu_read = t->mtu_write = hci_sco_get_mtu(fd, a);
+		sco_transport_attach(data.a, t, fd);
 		fd = -1;
 
-		pthread_mutex_unlock(&t->bt_fd_mtx);
-
-		ba_transport_pcm_state_set_idle(&t->sco.pcm_spk);
-		ba_transport_pcm_state_set_idle(&t->sco.pcm_mic);
-		ba_transport_start(t);
-
 cleanup:
-		if (d != NULL)
-			ba_device_unref(d);
 		if (t != NULL)
 			ba_transport_unref(t);
 		if (fd != -1)
@@ -170,8 +375,438 @@ fail:
 	return NULL;
 }
 
+/**
+ * Event source of the shared SCO dispatcher. */
+struct sco_epoll_source {
+	enum {
+		/* listening socket of an adapter */
+		SCO_EPOLL_LISTENER,
+		/* incoming link waiting for connection */
+		SCO_EPOLL_LINK,
+		/* HCI stack events, for adapter removal */
+		SCO_EPOLL_HCI,
+	} type;
+	int fd;
+	int dev_id;
+	bdaddr_t addr;
+};
+
+/**
+ * Connected SCO link waiting to be attached to its transport. */
+struct sco_epoll_attach {
+	struct ba_adapter *a;
+	struct ba_transport *t;
+	int fd;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_t thread;
+	bool running;
+	int epfd;
+	/* listening sources, one per adapter */
+	GSList *listeners;
+	struct sco_epoll_source *hci;
+	/* attaching stops the transport, which blocks, so it is done by
+	 * a worker instead of the dispatcher shared by all adapters */
+	pthread_t attach_thread;
+	GAsyncQueue *attach_queue;
+} sco_epoll = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.epfd = -1,
+};
+
+static void sco_epoll_source_free(struct sco_epoll_source *src) {
+	close(src->fd);
+	free(src);
+}
+
+static int sco_epoll_listener_cmp(const void *src, const void *dev_id) {
+	return ((const struct sco_epoll_source *)src)->dev_id - *(const int *)dev_id;
+}
+
+static void sco_epoll_listener_remove(struct sco_epoll_source *src) {
+	debug("Removing SCO listener: hci%d", src->dev_id);
+	pthread_mutex_lock(&sco_epoll.mutex);
+	sco_epoll.listeners = g_slist_remove(sco_epoll.listeners, src);
+	pthread_mutex_unlock(&sco_epoll.mutex);
+	epoll_ctl(sco_epoll.epfd, EPOLL_CTL_DEL, src->fd, NULL);
+	sco_epoll_source_free(src);
+}
+
+/**
+ * Open HCI socket which receives the stack internal events. */
+static int sco_epoll_hci_open(void) {
+
+	struct sockaddr_hci addr = { .hci_family = AF_BLUETOOTH, .hci_dev = HCI_DEV_NONE };
+	struct hci_filter filter;
+	int fd;
+
+	if ((fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, BTPROTO_HCI)) == -1)
+		return -1;
+
+	hci_filter_clear(&filter);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+	hci_filter_set_event(EVT_STACK_INTERNAL, &filter);
+
+	if (setsockopt(fd, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) == -1 ||
+			bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Remove the listener of an adapter which was unregistered. */
+static void sco_epoll_hci_event(struct sco_epoll_source *src) {
+
+	uint8_t buffer[HCI_MAX_EVENT_SIZE + 1];
+	const size_t size = 1 + HCI_EVENT_HDR_SIZE + sizeof(evt_stack_internal) +
+		sizeof(evt_si_device);
+	ssize_t len;
+
+	while ((len = read(src->fd, buffer, sizeof(buffer))) > 0) {
+
+		const hci_event_hdr *hdr = (void *)&buffer[1];
+		const evt_stack_internal *si = (void *)&buffer[1 + HCI_EVENT_HDR_SIZE];
+		const evt_si_device *sd = (void *)si->data;
+
+		if ((size_t)len < size || buffer[0] != HCI_EVENT_PKT ||
+				hdr->evt != EVT_STACK_INTERNAL ||
+				btohs(si->type) != EVT_SI_DEVICE ||
+				btohs(sd->event) != HCI_DEV_UNREG)
+			continue;
+
+		int dev_id = btohs(sd->dev_id);
+		GSList *el;
+
+		pthread_mutex_lock(&sco_epoll.mutex);
+		el = g_slist_find_custom(sco_epoll.listeners, &dev_id, sco_epoll_listener_cmp);
+		pthread_mutex_unlock(&sco_epoll.mutex);
+
+		if (el != NULL)
+			sco_epoll_listener_remove(el->data);
+
+	}
+
+	if (len == -1 && errno != EAGAIN && errno != EINTR)
+		error("Couldn't read HCI event: %s", strerror(errno));
+
+}
+
+static void *sco_epoll_attach_thread(void *userdata) {
+	(void)userdata;
+
+	sigset_t sigset;
+	/* See the ba_transport_pcm_start() function for information
+	 * why we have to mask all signals. */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, NULL);
+
+	for (;;) {
+		struct sco_epoll_attach *link = g_async_queue_pop(sco_epoll.attach_queue);
+		sco_transport_attach(link->a, link->t, link->fd);
+		ba_transport_unref(link->t);
+		ba_adapter_unref(link->a);
+		free(link);
+	}
+
+	return NULL;
+}
+
+/**
+ * Dispatch incoming SCO link once it is connected. */
+static void sco_epoll_dispatch(struct sco_epoll_source *src) {
+
+	struct sco_epoll_attach *link;
+	struct ba_adapter *a;
+	struct ba_transport *t = NULL;
+
+	if ((a = ba_adapter_lookup(src->dev_id)) == NULL) {
+		error("Couldn't lookup adapter: hci%d", src->dev_id);
+		goto final;
+	}
+
+	if ((t = sco_lookup_transport(a, &src->addr)) == NULL)
+		goto final;
+
+	if ((link = malloc(sizeof(*link))) == NULL) {
+		error("Couldn't create SCO link: %s", strerror(errno));
+		goto final;
+	}
+
+	link->a = a;
+	link->t = t;
+	link->fd = src->fd;
+	g_async_queue_push(sco_epoll.attach_queue, link);
+	a = NULL;
+	t = NULL;
+	src->fd = -1;
+
+final:
+	if (t != NULL)
+		ba_transport_unref(t);
+	if (a != NULL)
+		ba_adapter_unref(a);
+	if (src->fd != -1)
+		close(src->fd);
+	free(src);
+}
+
+/**
+ * Accept incoming SCO link on the listening socket.
+ *
+ * With deferred setup the link is authorized right away and dispatched to
+ * the transport when the socket becomes writable, i.e. when the controller
+ * reports the connection as completed. */
+static void sco_epoll_accept(struct sco_epoll_source *listener) {
+
+	struct sco_epoll_source *src = NULL;
+	struct sockaddr_sco addr;
+	socklen_t addrlen = sizeof(addr);
+	struct ba_adapter *a = NULL;
+	struct ba_transport *t = NULL;
+	char addrstr[18];
+	int fd;
+
+	if ((fd = accept(listener->fd, (struct sockaddr *)&addr, &addrlen)) == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			error("Couldn't accept incoming SCO link: %s", strerror(errno));
+		return;
+	}
+
+	ba2str(&addr.sco_bdaddr, addrstr);
+	debug("New incoming SCO link: %s: %d", addrstr, fd);
+
+	if ((src = malloc(sizeof(*src))) == NULL) {
+		error("Couldn't create SCO link source: %s", strerror(errno));
+		goto fail;
+	}
+
+	src->type = SCO_EPOLL_LINK;
+	src->fd = fd;
+	src->dev_id = listener->dev_id;
+	bacpy(&src->addr, &addr.sco_bdaddr);
+
+#if ENABLE_HFP_CODEC_SELECTION
+
+	if ((a = ba_adapter_lookup(src->dev_id)) == NULL) {
+		error("Couldn't lookup adapter: hci%d", src->dev_id);
+		goto fail;
+	}
+
+	if ((t = sco_lookup_transport(a, &addr.sco_bdaddr)) == NULL)
+		goto fail;
+
+	if (sco_authorize(fd, t) == -1)
+		goto fail;
+
+	struct epoll_event event = { .events = EPOLLOUT, .data.ptr = src };
+	if (epoll_ctl(sco_epoll.epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		error("Couldn't watch SCO link: %s", strerror(errno));
+		goto fail;
+	}
+
+	ba_transport_unref(t);
+	ba_adapter_unref(a);
+	return;
+
+#else
+	(void)a;
+	(void)t;
+	sco_epoll_dispatch(src);
+	return;
+#endif
+
+fail:
+	if (t != NULL)
+		ba_transport_unref(t);
+	if (a != NULL)
+		ba_adapter_unref(a);
+	free(src);
+	close(fd);
+}
+
+static void *sco_epoll_thread(void *userdata) {
+	(void)userdata;
+
+	sigset_t sigset;
+	/* See the ba_transport_pcm_start() function for information
+	 * why we have to mask all signals. */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, NULL);
+
+	debug("Starting SCO epoll dispatcher loop");
+	for (;;) {
+
+		struct epoll_event events[8];
+		int count;
+
+		if ((count = epoll_wait(sco_epoll.epfd, events, ARRAYSIZE(events), -1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			error("SCO dispatcher epoll error: %s", strerror(errno));
+			break;
+		}
+
+		for (int i = 0; i < count; i++) {
+			struct sco_epoll_source *src = events[i].data.ptr;
+			const bool failed = events[i].events & (EPOLLERR | EPOLLHUP);
+			switch (src->type) {
+			case SCO_EPOLL_LISTENER:
+				if (failed)
+					sco_epoll_listener_remove(src);
+				else
+					sco_epoll_accept(src);
+				break;
+			case SCO_EPOLL_LINK:
+				epoll_ctl(sco_epoll.epfd, EPOLL_CTL_DEL, src->fd, NULL);
+				if (failed) {
+					debug("Incoming SCO link closed before setup: %d", src->fd);
+					sco_epoll_source_free(src);
+				}
+				else
+					sco_epoll_dispatch(src);
+				break;
+			case SCO_EPOLL_HCI:
+				sco_epoll_hci_event(src);
+				/* Removed listener might be among the remaining events,
+				 * these are level-triggered so they will be back. */
+				i = count;
+				break;
+			}
+		}
+
+	}
+
+	return NULL;
+}
+
+/**
+ * Start the shared dispatcher threads and watch adapter removal. */
+static int sco_epoll_start(void) {
+
+	int ret;
+
+	if (sco_epoll.epfd == -1 &&
+			(sco_epoll.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		error("Couldn't create SCO epoll: %s", strerror(errno));
+		return -1;
+	}
+
+	/* Without stack events the listener of a removed adapter stays
+	 * until its socket reports an error, which is not fatal. */
+	if (sco_epoll.hci == NULL) {
+		struct sco_epoll_source *src;
+		if ((src = malloc(sizeof(*src))) != NULL &&
+				(src->fd = sco_epoll_hci_open()) != -1) {
+			src->type = SCO_EPOLL_HCI;
+			src->dev_id = HCI_DEV_NONE;
+			bacpy(&src->addr, BDADDR_ANY);
+			struct epoll_event event = { .events = EPOLLIN, .data.ptr = src };
+			if (epoll_ctl(sco_epoll.epfd, EPOLL_CTL_ADD, src->fd, &event) == 0) {
+				sco_epoll.hci = src;
+				src = NULL;
+			}
+		}
+		if (src != NULL) {
+			warn("Couldn't watch HCI stack events: %s", strerror(errno));
+			if (src->fd != -1)
+				close(src->fd);
+			free(src);
+		}
+	}
+
+	if (sco_epoll.attach_queue == NULL) {
+		GAsyncQueue *queue = g_async_queue_new();
+		sco_epoll.attach_queue = queue;
+		if ((ret = pthread_create(&sco_epoll.attach_thread, NULL,
+						sco_epoll_attach_thread, NULL)) != 0) {
+			error("Couldn't create SCO attach thread: %s", strerror(ret));
+			sco_epoll.attach_queue = NULL;
+			g_async_queue_unref(queue);
+			return -1;
+		}
+		pthread_setname_np(sco_epoll.attach_thread, "ba-sco-attach");
+	}
+
+	if ((ret = pthread_create(&sco_epoll.thread, NULL, sco_epoll_thread, NULL)) != 0) {
+		error("Couldn't create SCO dispatcher: %s", strerror(ret));
+		return -1;
+	}
+	pthread_setname_np(sco_epoll.thread, "ba-sco-epoll");
+
+	sco_epoll.running = true;
+	return 0;
+}
+
+/**
+ * Add adapter listening socket to the shared SCO dispatcher. */
+static int sco_setup_epoll_dispatcher(struct ba_adapter *a) {
+
+	struct sco_epoll_source *src = NULL;
+	int dev_id = a->hci.dev_id;
+	int ret = -1;
+	int fd = -1;
+
+	pthread_mutex_lock(&sco_epoll.mutex);
+
+	/* skip setup if adapter is already served */
+	if (g_slist_find_custom(sco_epoll.listeners, &dev_id, sco_epoll_listener_cmp) != NULL) {
+		ret = 0;
+		goto final;
+	}
+
+	if (!sco_epoll.running && sco_epoll_start() == -1)
+		goto final;
+
+	if ((fd = sco_listen(dev_id)) == -1)
+		goto final;
+
+	/* Accepted sockets do not inherit O_NONBLOCK, so the
+	 * transport will get a regular blocking socket. */
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+		error("Couldn't set non-blocking SCO socket: %s", strerror(errno));
+		goto final;
+	}
+
+	if ((src = malloc(sizeof(*src))) == NULL) {
+		error("Couldn't create SCO listener: %s", strerror(errno));
+		goto final;
+	}
+
+	src->type = SCO_EPOLL_LISTENER;
+	src->fd = fd;
+	src->dev_id = dev_id;
+	bacpy(&src->addr, BDADDR_ANY);
+
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = src };
+	if (epoll_ctl(sco_epoll.epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		error("Couldn't watch SCO socket: %s", strerror(errno));
+		goto final;
+	}
+
+	sco_epoll.listeners = g_slist_prepend(sco_epoll.listeners, src);
+	src = NULL;
+	fd = -1;
+
+	debug("Added SCO listener [%s]: %s", "ba-sco-epoll", a->hci.name);
+	ret = 0;
+
+final:
+	pthread_mutex_unlock(&sco_epoll.mutex);
+	free(src);
+	if (fd != -1)
+		close(fd);
+	return ret;
+}
+
 int sco_setup_connection_dispatcher(struct ba_adapter *a) {
 
+	pthread_once(&sco_env_once, sco_env_load);
+
 	/* skip setup if dispatcher thread is already running */
 	if (!pthread_equal(a->sco_dispatcher, config.main_thread))
 		return 0;
@@ -204,6 +839,9 @@ int sco_setup_connection_dispatcher(struct ba_adapter *a) {
 
 	}
 
+	if (sco_dispatcher_mode == SCO_DISPATCHER_EPOLL)
+		return sco_setup_epoll_dispatcher(a);
+
 	int ret;
 
 	/* Please note, that during the SCO dispatcher thread creation the adapter
@@ -224,40 +862,18 @@ int sco_setup_connection_dispatcher(struct ba_adapter *a) {
 }
 
 void *sco_enc_thread(struct ba_transport_pcm *pcm) {
-	switch (ba_transport_get_codec(pcm->t)) {
-	case HFP_CODEC_CVSD:
-	default:
-		return sco_cvsd_enc_thread(pcm);
-#if ENABLE_MSBC
-	case HFP_CODEC_MSBC:
-		return sco_msbc_enc_thread(pcm);
-#endif
-#if ENABLE_LC3_SWB
-	case HFP_CODEC_LC3_SWB:
-		return sco_lc3_swb_enc_thread(pcm);
-#endif
-	}
+	return sco_codec_lookup(ba_transport_get_codec(pcm->t))->io->enc_thread(pcm);
 }
 
 __attribute__ ((weak))
 void *sco_dec_thread(struct ba_transport_pcm *pcm) {
-	switch (ba_transport_get_codec(pcm->t)) {
-	case HFP_CODEC_CVSD:
-	default:
-		return sco_cvsd_dec_thread(pcm);
-#if ENABLE_MSBC
-	case HFP_CODEC_MSBC:
-		return sco_msbc_dec_thread(pcm);
-#endif
-#if ENABLE_LC3_SWB
-	case HFP_CODEC_LC3_SWB:
-		return sco_lc3_swb_dec_thread(pcm);
-#endif
-	}
+	return sco_codec_lookup(ba_transport_get_codec(pcm->t))->io->dec_thread(pcm);
 }
 
 int sco_transport_init(struct ba_transport *t) {
 
+	pthread_once(&sco_env_once, sco_env_load);
+
 	t->sco.pcm_spk.format = BA_TRANSPORT_PCM_FORMAT_S16_2LE;
 	t->sco.pcm_spk.channels = 1;
 	t->sco.pcm_spk.channel_map[0] = BA_TRANSPORT_PCM_CHANNEL_MONO;
@@ -266,43 +882,43 @@ int sco_transport_init(struct ba_transport *t) {
 	t->sco.pcm_mic.channels = 1;
 	t->sco.pcm_mic.channel_map[0] = BA_TRANSPORT_PCM_CHANNEL_MONO;
 
-	uint32_t codec_id;
-	switch (codec_id = ba_transport_get_codec(t)) {
-	case HFP_CODEC_UNDEFINED:
-		t->sco.pcm_spk.rate = 0;
-		t->sco.pcm_mic.rate = 0;
-		break;
-	case HFP_CODEC_CVSD:
-		t->sco.pcm_spk.rate = 8000;
-		t->sco.pcm_mic.rate = 8000;
-		break;
-#if ENABLE_MSBC
-	case HFP_CODEC_MSBC:
-		t->sco.pcm_spk.rate = 16000;
-		t->sco.pcm_mic.rate = 16000;
-		break;
-#endif
-#if ENABLE_LC3_SWB
-	case HFP_CODEC_LC3_SWB:
-		t->sco.pcm_spk.rate = 32000;
-		t->sco.pcm_mic.rate = 32000;
-		break;
-#endif
-	default:
-		debug("Unsupported SCO codec: %#x", codec_id);
-		g_assert_not_reached();
+	const uint32_t codec_id = ba_transport_get_codec(t);
+	unsigned int rate = 0;
+
+	if (codec_id != HFP_CODEC_UNDEFINED) {
+		const struct hfp_codec *codec = hfp_codec_lookup(codec_id);
+		if (codec == NULL || codec->io == NULL) {
+			debug("Unsupported SCO codec: %#x", codec_id);
+			g_assert_not_reached();
+			return -1;
+		}
+		rate = codec->rate;
 	}
 
+	t->sco.pcm_spk.rate = rate;
+	t->sco.pcm_mic.rate = rate;
+
+	/* Initial playout delay of the jitter buffer, which is updated by the
+	 * duplex I/O thread as the buffer adapts to the link conditions. */
+	const unsigned int jitter_dms = sco_io_duplex() ?
+		sco_jitter_get_latency() * 10 : 0;
+	if (t->profile & BA_TRANSPORT_PROFILE_MASK_AG)
+		t->sco.pcm_mic.processing_delay_dms = jitter_dms;
+	if (t->profile & BA_TRANSPORT_PROFILE_MASK_HF)
+		t->sco.pcm_spk.processing_delay_dms = jitter_dms;
+
 	if (t->sco.pcm_spk.ba_dbus_exported)
 		bluealsa_dbus_pcm_update(&t->sco.pcm_spk,
 				BA_DBUS_PCM_UPDATE_RATE |
 				BA_DBUS_PCM_UPDATE_CODEC |
+				BA_DBUS_PCM_UPDATE_DELAY |
 				BA_DBUS_PCM_UPDATE_CLIENT_DELAY);
 
 	if (t->sco.pcm_mic.ba_dbus_exported)
 		bluealsa_dbus_pcm_update(&t->sco.pcm_mic,
 				BA_DBUS_PCM_UPDATE_RATE |
 				BA_DBUS_PCM_UPDATE_CODEC |
+				BA_DBUS_PCM_UPDATE_DELAY |
 				BA_DBUS_PCM_UPDATE_CLIENT_DELAY);
 
 	return 0;
@@ -312,6 +928,15 @@ int sco_transport_start(struct ba_transport *t) {
 
 	int rv = 0;
 
+	/* In the duplex mode a single thread is attached to the PCM which
+	 * receives decoded audio, and it services the other PCM as well. */
+	if (sco_io_duplex()) {
+		if (t->profile & BA_TRANSPORT_PROFILE_MASK_AG)
+			return ba_transport_pcm_start(&t->sco.pcm_mic, sco_duplex_thread, "ba-sco-io");
+		if (t->profile & BA_TRANSPORT_PROFILE_MASK_HF)
+			return ba_transport_pcm_start(&t->sco.pcm_spk, sco_duplex_thread, "ba-sco-io");
+	}
+
 	if (t->profile & BA_TRANSPORT_PROFILE_MASK_AG) {
 		rv |= ba_transport_pcm_start(&t->sco.pcm_spk, sco_enc_thread, "ba-sco-enc");
 		rv |= ba_transport_pcm_start(&t->sco.pcm_mic, sco_dec_thread, "ba-sco-dec");
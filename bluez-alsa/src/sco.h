@@ -19,6 +19,28 @@
 #include "ba-adapter.h"
 #include "ba-transport.h"
 
+/**
+ * SCO connection dispatcher modes. */
+enum sco_dispatcher_mode {
+	/* dedicated thread for every adapter */
+	SCO_DISPATCHER_THREAD,
+	/* single epoll thread shared by all adapters */
+	SCO_DISPATCHER_EPOLL,
+};
+
+void sco_set_dispatcher_mode(enum sco_dispatcher_mode mode);
+
+/**
+ * SCO audio I/O modes. */
+enum sco_io_mode {
+	/* separate encoder and decoder threads */
+	SCO_IO_THREADS,
+	/* single thread clocked by the incoming SCO traffic */
+	SCO_IO_DUPLEX,
+};
+
+void sco_set_io_mode(enum sco_io_mode mode);
+
 int sco_setup_connection_dispatcher(struct ba_adapter *a);
 int sco_transport_init(struct ba_transport *t);
 int sco_transport_start(struct ba_transport *t);
@@ -26,12 +26,40 @@
 
 #define BLUEZ_PROFILE_MGMT_INTERFACE   BLUEZ_SERVICE ".ProfileManager1"
 
+/*
+ * Connections which can be paged at once. A BR/EDR controller pages one
+ * device at a time, further requests would only wait in BlueZ, holding
+ * up devices which are in range behind ones which are not.
+ */
+#define BT_CONNECT_SLOTS	1
+
 struct finish_callback {
 	bt_finish_cb cb;
 	gpointer user_data;
 	char *member;
 };
 
+struct connect_request {
+	DBusConnection *conn;
+	char *device;
+	char *uuid;
+	unsigned int used;
+	GSList *callbacks;
+};
+
+/* RegisterProfile() calls not replied yet */
+static unsigned int pending_registrations;
+
+/* Connect requests waiting for a slot, most recently used device first */
+static GList *connect_queue;
+static GSList *connect_active;
+
+/* Device path to the sequence number of its last connection */
+static GHashTable *device_used;
+static unsigned int device_used_seq;
+
+static void connect_queue_run(void);
+
 static void profile_register_cb(DBusPendingCall *call, gpointer user_data)
 {
 	DBusMessage *reply;
@@ -52,6 +80,10 @@ static void profile_register_cb(DBusPendingCall *call, gpointer user_data)
 
 done:
 	dbus_message_unref(reply);
+
+	/* Connecting before BlueZ knows the profile would fail */
+	pending_registrations--;
+	connect_queue_run();
 }
 
 static void unregister_profile_cb(DBusPendingCall *call, gpointer user_data)
@@ -118,6 +150,8 @@ int bt_register_profile(DBusConnection *conn, const char *uuid,
 
 	dbus_message_unref(msg);
 
+	pending_registrations++;
+
 	return 0;
 }
 
@@ -184,7 +218,7 @@ static void finish_callback_free(void *data)
 	g_free(callback);
 }
 
-static void device_send_message(DBusConnection *conn, const char *device,
+static int device_send_message(DBusConnection *conn, const char *device,
 				const char *member, const char *uuid,
 				bt_finish_cb cb, gpointer user_data)
 {
@@ -204,7 +238,7 @@ static void device_send_message(DBusConnection *conn, const char *device,
 	if (!dbus_connection_send_with_reply(conn, msg, &c, -1)) {
 		ofono_error("Sending %s failed", member);
 		dbus_message_unref(msg);
-		return;
+		return -EIO;
 	}
 
 	callback = g_new0(struct finish_callback, 1);
@@ -217,15 +251,231 @@ static void device_send_message(DBusConnection *conn, const char *device,
 	dbus_pending_call_unref(c);
 
 	dbus_message_unref(msg);
+
+	return 0;
+}
+
+void bt_device_used(const char *device)
+{
+	if (device_used == NULL)
+		device_used = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
+
+	g_hash_table_replace(device_used, g_strdup(device),
+					GUINT_TO_POINTER(++device_used_seq));
+}
+
+static unsigned int device_last_used(const char *device)
+{
+	if (device_used == NULL)
+		return 0;
+
+	return GPOINTER_TO_UINT(g_hash_table_lookup(device_used, device));
+}
+
+static void connect_request_free(struct connect_request *req)
+{
+	g_slist_free_full(req->callbacks, g_free);
+	dbus_connection_unref(req->conn);
+	g_free(req->device);
+	g_free(req->uuid);
+	g_free(req);
+}
+
+static void connect_request_finish(struct connect_request *req,
+							gboolean success)
+{
+	GSList *l;
+
+	for (l = req->callbacks; l; l = l->next) {
+		struct finish_callback *callback = l->data;
+
+		callback->cb(success, callback->user_data);
+	}
+
+	connect_request_free(req);
+}
+
+static void connect_profile_cb(gboolean success, gpointer user_data)
+{
+	struct connect_request *req = user_data;
+
+	connect_active = g_slist_remove(connect_active, req);
+
+	if (success)
+		bt_device_used(req->device);
+
+	connect_request_finish(req, success);
+	connect_queue_run();
+}
+
+static void connect_queue_run(void)
+{
+	while (pending_registrations == 0 && connect_queue != NULL &&
+			g_slist_length(connect_active) < BT_CONNECT_SLOTS) {
+		struct connect_request *req = connect_queue->data;
+
+		connect_queue = g_list_delete_link(connect_queue,
+							connect_queue);
+
+		if (device_send_message(req->conn, req->device,
+					"ConnectProfile", req->uuid,
+					connect_profile_cb, req) < 0) {
+			connect_request_finish(req, FALSE);
+			continue;
+		}
+
+		connect_active = g_slist_prepend(connect_active, req);
+	}
+}
+
+static gint connect_request_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct connect_request *ra = a;
+	const struct connect_request *rb = b;
+
+	return ra->used < rb->used ? 1 : ra->used > rb->used ? -1 : 0;
 }
 
+static void connect_queue_insert(struct connect_request *req)
+{
+	GList *l;
+
+	/*
+	 * Goes after the requests for devices used alike, unlike
+	 * g_list_insert_sorted(), so these are sent in the order made
+	 */
+	for (l = connect_queue; l; l = l->next)
+		if (connect_request_cmp(req, l->data) < 0)
+			break;
+
+	connect_queue = g_list_insert_before(connect_queue, l, req);
+}
+
+static struct connect_request *connect_request_find(const char *device,
+							const char *uuid)
+{
+	GSList *sl;
+	GList *l;
+
+	for (l = connect_queue; l; l = l->next) {
+		struct connect_request *req = l->data;
+
+		if (g_str_equal(req->device, device) &&
+				g_str_equal(req->uuid, uuid))
+			return req;
+	}
+
+	for (sl = connect_active; sl; sl = sl->next) {
+		struct connect_request *req = sl->data;
+
+		if (g_str_equal(req->device, device) &&
+				g_str_equal(req->uuid, uuid))
+			return req;
+	}
+
+	return NULL;
+}
+
+/*
+ * Requests are queued and sent as paging slots free up, most recently
+ * used device first. A request for a device and profile which is queued
+ * or in progress already shares its outcome.
+ */
 void bt_connect_profile(DBusConnection *conn,
 				const char *device, const char *uuid,
 				bt_finish_cb cb, gpointer user_data)
 {
-	device_send_message(conn, device, "ConnectProfile", uuid,
-							cb, user_data);
+	struct connect_request *req;
+	struct finish_callback *callback = NULL;
+
+	if (cb) {
+		callback = g_new0(struct finish_callback, 1);
+		callback->cb = cb;
+		callback->user_data = user_data;
+	}
+
+	req = connect_request_find(device, uuid);
+	if (req) {
+		DBG("Bluetooth: joining ConnectProfile for %s on %s",
+							uuid, device);
+		goto done;
+	}
+
+	req = g_new0(struct connect_request, 1);
+	req->conn = dbus_connection_ref(conn);
+	req->device = g_strdup(device);
+	req->uuid = g_strdup(uuid);
+	req->used = device_last_used(device);
+
+	connect_queue_insert(req);
+
+done:
+	if (callback)
+		req->callbacks = g_slist_append(req->callbacks, callback);
+
+	connect_queue_run();
+}
+
+static gboolean connect_request_cancel(struct connect_request *req,
+							gpointer user_data)
+{
+	GSList *l = req->callbacks;
+	gboolean found = FALSE;
+
+	while (l) {
+		GSList *next = l->next;
+		struct finish_callback *callback = l->data;
+
+		if (callback->user_data == user_data) {
+			req->callbacks = g_slist_delete_link(req->callbacks, l);
+			g_free(callback);
+			found = TRUE;
+		}
+
+		l = next;
+	}
+
+	return found;
+}
+
+/*
+ * Drop the callbacks of connect requests made for user_data. A request
+ * already sent is left to complete.
+ */
+void bt_cancel_connect(gpointer user_data)
+{
+	GSList *sl;
+	GList *l = connect_queue;
+
+	while (l) {
+		GList *next = l->next;
+		struct connect_request *req = l->data;
+
+		if (connect_request_cancel(req, user_data) &&
+				req->callbacks == NULL) {
+			connect_queue = g_list_delete_link(connect_queue, l);
+			connect_request_free(req);
+		}
+
+		l = next;
+	}
+
+	for (sl = connect_active; sl; sl = sl->next)
+		connect_request_cancel(sl->data, user_data);
+}
+
+static void bluez5_exit(void)
+{
+	g_list_free_full(connect_queue,
+			(GDestroyNotify) connect_request_free);
+	connect_queue = NULL;
+
+	if (device_used) {
+		g_hash_table_destroy(device_used);
+		device_used = NULL;
+	}
 }
 
 OFONO_PLUGIN_DEFINE(bluez5, "BlueZ 5 Utils Plugin", VERSION,
-			OFONO_PLUGIN_PRIORITY_DEFAULT, NULL, NULL)
+			OFONO_PLUGIN_PRIORITY_DEFAULT, NULL, bluez5_exit)
@@ -27,3 +27,6 @@ typedef void (*bt_finish_cb)(gboolean success, gpointer user_data);
 void bt_connect_profile(DBusConnection *conn,
 				const char *device, const char *uuid,
 				bt_finish_cb cb, gpointer user_data);
+void bt_cancel_connect(gpointer user_data);
+
+void bt_device_used(const char *device);
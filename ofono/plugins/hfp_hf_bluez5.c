@@ -52,16 +52,76 @@
 
 #define HFP16_HF_DRIVER		"hfp16-hf-driver"
 
+#define CALLSETUP_INCOMING	1
+
+/* Time given to the AG to start the codec connection for the ring */
+#define PREWARM_DELAY_MS	300
+
 struct hfp {
 	struct hfp_slc_info info;
 	DBusMessage *msg;
 	struct ofono_handsfree_card *card;
 	unsigned int bcc_id;
+	char remote[18];
+	gboolean codec_confirmed;
+	gboolean in_band_ring;
+	guint prewarm_source;
 };
 
 static const char *none_prefix[] = { NULL };
 static GDBusClient *bluez = NULL;
 
+/*
+ * Codec last confirmed by each AG, by remote address. It survives the
+ * SLC, so a reconnecting AG gets its codec offered first.
+ */
+static GHashTable *codec_cache = NULL;
+
+/*
+ * Devices of AGs connected, by path, and those of them to reconnect once
+ * BlueZ is back and has announced the device again
+ */
+static GHashTable *connected_ags = NULL;
+static GHashTable *reconnect_ags = NULL;
+
+static gboolean codec_negotiation(struct hfp_slc_info *info)
+{
+	return info->hf_features & HFP_HF_FEATURE_CODEC_NEGOTIATION &&
+			info->ag_features & HFP_AG_FEATURE_CODEC_NEGOTIATION;
+}
+
+static void send_bac(struct hfp *hfp)
+{
+	struct hfp_slc_info *info = &hfp->info;
+	unsigned int codec;
+	char str[32];
+
+	if (!ofono_handsfree_audio_has_wideband()) {
+		sprintf(str, "AT+BAC=%d", HFP_CODEC_CVSD);
+		goto done;
+	}
+
+	codec = GPOINTER_TO_UINT(g_hash_table_lookup(codec_cache,
+							hfp->remote));
+
+	if (codec == HFP_CODEC_MSBC)
+		sprintf(str, "AT+BAC=%d,%d", HFP_CODEC_MSBC, HFP_CODEC_CVSD);
+	else
+		sprintf(str, "AT+BAC=%d,%d", HFP_CODEC_CVSD, HFP_CODEC_MSBC);
+
+done:
+	g_at_chat_send(info->chat, str, none_prefix, NULL, NULL, NULL);
+}
+
+static void prewarm_cancel(struct hfp *hfp)
+{
+	if (hfp->prewarm_source == 0)
+		return;
+
+	g_source_remove(hfp->prewarm_source);
+	hfp->prewarm_source = 0;
+}
+
 static void hfp_debug(const char *str, void *user_data)
 {
 	const char *prefix = user_data;
@@ -84,7 +144,21 @@ static void slc_established(gpointer userdata)
 
 	ofono_info("Service level connection established");
 
+	hfp->in_band_ring = (hfp->info.ag_features &
+				HFP_AG_FEATURE_IN_BAND_RING_TONE) != 0;
+
 	ofono_handsfree_card_register(hfp->card);
+
+	/*
+	 * The SLC setup offered the codecs in the default order, put mSBC
+	 * first if this AG settled on it last time
+	 */
+	hfp->codec_confirmed = FALSE;
+	if (codec_negotiation(&hfp->info) &&
+			ofono_handsfree_audio_has_wideband() &&
+			GPOINTER_TO_UINT(g_hash_table_lookup(codec_cache,
+					hfp->remote)) == HFP_CODEC_MSBC)
+		send_bac(hfp);
 }
 
 static void slc_failed(gpointer userdata)
@@ -239,6 +313,10 @@ static void hfp_remove(struct ofono_modem *modem)
 
 	DBG("modem: %p", modem);
 
+	bt_cancel_connect(modem);
+
+	prewarm_cancel(hfp);
+
 	if (hfp->msg)
 		dbus_message_unref(hfp->msg);
 
@@ -288,6 +366,9 @@ static int hfp_disable(struct ofono_modem *modem)
 
 	DBG("%p", modem);
 
+	g_hash_table_remove(connected_ags,
+				ofono_modem_get_string(modem, "DevicePath"));
+
 	/*
 	 * Instead of triggering two round trips to BlueZ (DisconnectProfile,
 	 * RequestDisconnection) simply kill the connection on the RFCOMM fd
@@ -338,6 +419,48 @@ static struct ofono_modem_driver hfp_driver = {
 
 OFONO_MODEM_DRIVER_BUILTIN(hfp, &hfp_driver)
 
+static void bcc_cb(gboolean ok, GAtResult *result, gpointer user_data)
+{
+	struct cb_data *cbd = user_data;
+	ofono_handsfree_card_connect_cb_t cb = cbd->cb;
+	struct ofono_handsfree_card *card = cbd->user;
+	struct hfp *hfp = ofono_handsfree_card_get_data(card);
+	struct ofono_error error;
+
+	hfp->bcc_id = 0;
+
+	/* no connect request attached to the pre-warm request */
+	if (cb == NULL)
+		return;
+
+	decode_at_error(&error, g_at_result_final_response(result));
+
+	cb(&error, cbd->data);
+}
+
+static gboolean prewarm_timeout(gpointer user_data)
+{
+	struct hfp *hfp = user_data;
+	struct hfp_slc_info *info = &hfp->info;
+	struct cb_data *cbd;
+
+	hfp->prewarm_source = 0;
+
+	if (hfp->codec_confirmed || hfp->bcc_id != 0 || !hfp->in_band_ring)
+		return FALSE;
+
+	DBG("Incoming call, pre-warming the codec connection");
+
+	/* A connect request issued meanwhile completes with this one */
+	cbd = cb_data_new(NULL, NULL);
+	cbd->user = hfp->card;
+
+	hfp->bcc_id = g_at_chat_send(info->chat, "AT+BCC", none_prefix,
+						bcc_cb, cbd, g_free);
+
+	return FALSE;
+}
+
 static void bcs_notify(GAtResult *result, gpointer user_data)
 {
 	struct hfp *hfp = user_data;
@@ -354,24 +477,87 @@ static void bcs_notify(GAtResult *result, gpointer user_data)
 	if (!g_at_result_iter_next_number(&iter, &value))
 		return;
 
+	/* The AG has started the codec connection itself */
+	prewarm_cancel(hfp);
+
 	if (ofono_handsfree_card_set_codec(hfp->card, value) == FALSE) {
 		/* Unsupported codec, re-send our codecs */
-		if (ofono_handsfree_audio_has_wideband())
-			sprintf(str, "AT+BAC=%d,%d", HFP_CODEC_CVSD,
-							HFP_CODEC_MSBC);
-		else
-			sprintf(str, "AT+BAC=%d", HFP_CODEC_CVSD);
-
-		goto done;
+		send_bac(hfp);
+		return;
 	}
 
+	g_hash_table_insert(codec_cache, g_strdup(hfp->remote),
+						GUINT_TO_POINTER(value));
+	hfp->codec_confirmed = TRUE;
+
 	/* Confirm the codec */
 	sprintf(str, "AT+BCS=%d", value);
-
-done:
 	g_at_chat_send(info->chat, str, none_prefix, NULL, NULL, NULL);
 }
 
+static void ciev_notify(GAtResult *result, gpointer user_data)
+{
+	struct hfp *hfp = user_data;
+	struct hfp_slc_info *info = &hfp->info;
+	GAtResultIter iter;
+	int index, value;
+
+	g_at_result_iter_init(&iter, result);
+
+	if (!g_at_result_iter_next(&iter, "+CIEV:"))
+		return;
+
+	if (!g_at_result_iter_next_number(&iter, &index))
+		return;
+
+	if (index != info->cind_pos[HFP_INDICATOR_CALLSETUP])
+		return;
+
+	if (!g_at_result_iter_next_number(&iter, &value))
+		return;
+
+	if (value != CALLSETUP_INCOMING) {
+		prewarm_cancel(hfp);
+		return;
+	}
+
+	if (hfp->codec_confirmed || hfp->bcc_id != 0 ||
+			hfp->prewarm_source != 0)
+		return;
+
+	/*
+	 * An AG with in-band ringing brings the audio up for the ring
+	 * anyway. Unless it starts the codec connection on its own shortly,
+	 * ask for it, so the codec is settled and SCO is up by the time the
+	 * call is answered.
+	 */
+	if (!codec_negotiation(info) || !hfp->in_band_ring)
+		return;
+
+	hfp->prewarm_source = g_timeout_add(PREWARM_DELAY_MS,
+						prewarm_timeout, hfp);
+}
+
+static void bsir_notify(GAtResult *result, gpointer user_data)
+{
+	struct hfp *hfp = user_data;
+	GAtResultIter iter;
+	int value;
+
+	g_at_result_iter_init(&iter, result);
+
+	if (!g_at_result_iter_next(&iter, "+BSIR:"))
+		return;
+
+	if (!g_at_result_iter_next_number(&iter, &value))
+		return;
+
+	hfp->in_band_ring = value != 0;
+
+	if (!hfp->in_band_ring)
+		prewarm_cancel(hfp);
+}
+
 static int hfp16_card_probe(struct ofono_handsfree_card *card,
 					unsigned int vendor, void *data)
 {
@@ -380,27 +566,19 @@ static int hfp16_card_probe(struct ofono_handsfree_card *card,
 
 	g_at_chat_register(info->chat, "+BCS:", bcs_notify, FALSE,
 								hfp, NULL);
+	g_at_chat_register(info->chat, "+CIEV:", ciev_notify, FALSE,
+								hfp, NULL);
+	g_at_chat_register(info->chat, "+BSIR:", bsir_notify, FALSE,
+								hfp, NULL);
 
 	return 0;
 }
 
 static void hfp16_card_remove(struct ofono_handsfree_card *card)
 {
-}
-
-static void bcc_cb(gboolean ok, GAtResult *result, gpointer user_data)
-{
-	struct cb_data *cbd = user_data;
-	ofono_handsfree_card_connect_cb_t cb = cbd->cb;
-	struct ofono_handsfree_card *card = cbd->user;
 	struct hfp *hfp = ofono_handsfree_card_get_data(card);
-	struct ofono_error error;
 
-	hfp->bcc_id = 0;
-
-	decode_at_error(&error, g_at_result_final_response(result));
-
-	cb(&error, cbd->data);
+	prewarm_cancel(hfp);
 }
 
 static void hfp16_card_connect(struct ofono_handsfree_card *card,
@@ -410,10 +588,20 @@ static void hfp16_card_connect(struct ofono_handsfree_card *card,
 	struct hfp *hfp = ofono_handsfree_card_get_data(card);
 	struct hfp_slc_info *info = &hfp->info;
 
-	if (info->hf_features & HFP_HF_FEATURE_CODEC_NEGOTIATION &&
-			info->ag_features & HFP_AG_FEATURE_CODEC_NEGOTIATION) {
-		struct cb_data *cbd = cb_data_new(cb, data);
+	if (codec_negotiation(info)) {
+		struct cb_data *cbd;
+
+		/* Attach to the codec connection pre-warmed for the ring */
+		if (hfp->bcc_id != 0) {
+			cbd = g_at_chat_get_userdata(info->chat, hfp->bcc_id);
+			if (cbd != NULL && cbd->cb == NULL) {
+				cbd->cb = cb;
+				cbd->data = data;
+				return;
+			}
+		}
 
+		cbd = cb_data_new(cb, data);
 		cbd->user = card;
 		hfp->bcc_id = g_at_chat_send(info->chat, "AT+BCC",
 						none_prefix, bcc_cb,
@@ -451,7 +639,8 @@ static void hfp16_sco_connected_hint(struct ofono_handsfree_card *card)
 		return;
 
 	cb = cbd->cb;
-	CALLBACK_WITH_SUCCESS(cb, cbd->data);
+	if (cb != NULL)
+		CALLBACK_WITH_SUCCESS(cb, cbd->data);
 
 	/* cbd will be freed once cancel is processed */
 	g_at_chat_cancel(info->chat, hfp->bcc_id);
@@ -580,6 +769,13 @@ static void *device_changed(GDBusProxy *proxy, const char *path)
 
 	modem = modem_register(path, proxy);
 
+	/* The AG was connected before BlueZ went away, bring it back */
+	if (modem && g_hash_table_remove(reconnect_ags, path)) {
+		DBG("Reconnecting %s", path);
+		bt_connect_profile(ofono_dbus_get_connection(), path,
+					HFP_AG_UUID, connect_cb, modem);
+	}
+
 	return modem;
 }
 
@@ -675,6 +871,11 @@ static DBusMessage *profile_new_connection(DBusConnection *conn,
 
 	hfp = ofono_modem_get_data(modem);
 	hfp->msg = dbus_message_ref(msg);
+	l_strlcpy(hfp->remote, remote, sizeof(hfp->remote));
+
+	/* Reconnections after a BlueZ restart go to this device first */
+	bt_device_used(device);
+	g_hash_table_add(connected_ags, g_strdup(device));
 
 	driver = NULL;
 
@@ -727,6 +928,9 @@ static DBusMessage *profile_disconnection(DBusConnection *conn,
 	if (modem == NULL)
 		goto error;
 
+	/* Disconnected on purpose, no reconnection after a BlueZ restart */
+	g_hash_table_remove(connected_ags, device);
+
 	ofono_modem_set_powered(modem, FALSE);
 
 	hfp = ofono_modem_get_data(modem);
@@ -760,6 +964,8 @@ static const GDBusMethodTable profile_methods[] = {
 
 static void connect_handler(DBusConnection *conn, void *user_data)
 {
+	GHashTableIter iter;
+	gpointer key;
 	uint16_t features = HFP_SDP_HF_FEATURE_ECNR |
 				HFP_SDP_HF_FEATURE_3WAY |
 				HFP_SDP_HF_FEATURE_CLIP |
@@ -776,6 +982,16 @@ static void connect_handler(DBusConnection *conn, void *user_data)
 
 	bt_register_profile(conn, HFP_HS_UUID, HFP_VERSION_1_8, "hfp_hf",
 					HFP_EXT_PROFILE_PATH, NULL, features);
+
+	/*
+	 * BlueZ is back after a restart. The links of the AGs connected
+	 * before are gone, so reconnect them as their devices show up,
+	 * once the profile above is registered.
+	 */
+	g_hash_table_remove_all(reconnect_ags);
+	g_hash_table_iter_init(&iter, connected_ags);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		g_hash_table_add(reconnect_ags, g_strdup(key));
 }
 
 static void proxy_added(GDBusProxy *proxy, void *user_data)
@@ -841,6 +1057,13 @@ static int hfp_init(void)
 		return -ENOMEM;
 	}
 
+	codec_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, NULL);
+	connected_ags = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, NULL);
+	reconnect_ags = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, NULL);
+
 	g_dbus_client_set_connect_watch(bluez, connect_handler, NULL);
 	g_dbus_client_set_proxy_handlers(bluez, proxy_added, NULL,
 						property_changed, NULL);
@@ -862,6 +1085,10 @@ static void hfp_exit(void)
 
 	g_dbus_client_unref(bluez);
 
+	g_hash_table_destroy(codec_cache);
+	g_hash_table_destroy(connected_ags);
+	g_hash_table_destroy(reconnect_ags);
+
 	ofono_handsfree_audio_unref();
 }
 
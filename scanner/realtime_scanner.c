@@ -1,17 +1,31 @@
 /*
  * Real-time Device Scanner for RV1106
  * Monitors serial and Bluetooth devices in real-time
+ *
+ * The controller runs periodic inquiry in RSSI/EIR mode and an LE scan at
+ * the same time, results are read as events from one raw HCI socket.
+ * Remote names missing from the EIR data are requested asynchronously,
+ * with at most NAME_INFLIGHT requests outstanding.
+ *
+ * Serial ports are probed when inotify reports them in /dev. Output is a
+ * table redrawn on change, only the changed rows (-o diff) or one JSON
+ * object per change (-o json). Known names are kept in a cache file.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <termios.h>
 #include <dirent.h>
+#include <limits.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
@@ -19,7 +33,30 @@
 #include <time.h>
 
 #define MAX_DEVICES 256
+#define MAX_BT_DEVICES 1024
+#define BT_HASH_SIZE 2048       // power of two
 #define SCAN_INTERVAL 5  // seconds
+#define DISPLAY_INTERVAL 1  // seconds
+
+// Periodic inquiry, in units of 1.28 s: inquire 5.12 s every 6.4-7.68 s
+#define INQUIRY_LENGTH 4
+#define INQUIRY_MIN_PERIOD 5
+#define INQUIRY_MAX_PERIOD 6
+
+// LE scan 30 ms every 60 ms, restarted to get fresh RSSI past the
+// controller's duplicate filter
+#define LE_SCAN_INTERVAL 0x0060
+#define LE_SCAN_WINDOW 0x0030
+#define LE_SCAN_REFRESH 10  // seconds
+
+#define NAME_INFLIGHT 1     // paging for names competes with inquiry
+#define NAME_TIMEOUT 10     // seconds
+#define NAME_RETRIES 2
+
+#define RSSI_DELTA 5        // dB, smaller moves are not reported
+#define CACHE_INTERVAL 60   // seconds between cache writes
+#define CACHE_PATH "/var/cache/realtime_scanner/bt_devices"
+#define CACHE_MAX_AGE (7 * 24 * 3600)   // seconds, older entries are dropped
 
 static volatile int keep_running = 1;
 
@@ -27,20 +64,60 @@ typedef struct {
     char path[64];
     int baud_rate;
     int is_active;
+    int seen;
 } serial_device_t;
 
+enum {
+    NAME_NONE,      // not requested yet
+    NAME_PENDING,   // request outstanding
+    NAME_DONE,      // known, from EIR, advertising data or a request
+    NAME_FAILED,    // gave up after NAME_RETRIES
+};
+
 typedef struct {
     bdaddr_t addr;
     char name[248];
     int8_t rssi;
     uint32_t class;
     time_t last_seen;
+    uint8_t le;             // seen in LE advertising
+    uint8_t le_addr_type;
+    uint8_t name_state;
+    uint8_t name_tries;
+    time_t name_sent;
+    // paging parameters from the last inquiry result
+    uint8_t pscan_rep_mode;
+    uint16_t clock_offset;
+    uint8_t seen;           // in this run, cached entries start unseen
+    uint8_t dirty;          // to be shown
+    uint8_t reported;       // shown at least once
+    int8_t shown_rssi;
+    int next;               // hash chain, -1 terminates
 } bt_device_t;
 
+enum {
+    OUTPUT_TABLE,
+    OUTPUT_DIFF,
+    OUTPUT_JSON,
+};
+
 static serial_device_t serial_devices[MAX_DEVICES];
-static bt_device_t bt_devices[MAX_DEVICES];
+static bt_device_t bt_devices[MAX_BT_DEVICES];
+static int bt_hash[BT_HASH_SIZE];
 static int serial_count = 0;
 static int bt_count = 0;
+static int names_inflight = 0;
+static int name_last = -1;      // device of the newest name request
+
+static int hci_sock = -1;
+static int le_scanning = 0;
+
+static int output_mode = OUTPUT_TABLE;
+static int display_dirty = 1;
+static const char *cache_path = CACHE_PATH;
+static int cache_dirty = 0;
+
+static void report_serial(const serial_device_t *dev, char op);
 
 void signal_handler(int sig) {
     keep_running = 0;
@@ -50,16 +127,16 @@ void signal_handler(int sig) {
 int get_baud_rate(const char *device) {
     int fd = open(device, O_RDONLY | O_NOCTTY | O_NONBLOCK);
     if (fd < 0) return -1;
-    
+
     struct termios tty;
     if (tcgetattr(fd, &tty) != 0) {
         close(fd);
         return -1;
     }
-    
+
     speed_t speed = cfgetispeed(&tty);
     close(fd);
-    
+
     switch(speed) {
         case B9600: return 9600;
         case B19200: return 19200;
@@ -73,113 +150,661 @@ int get_baud_rate(const char *device) {
     }
 }
 
-// Scan serial devices
+static int is_serial_name(const char *name) {
+    return strncmp(name, "ttyS", 4) == 0 ||
+           strncmp(name, "ttyUSB", 6) == 0 ||
+           strncmp(name, "ttyACM", 6) == 0;
+}
+
+static serial_device_t *serial_find(const char *path) {
+    for (int i = 0; i < serial_count; i++) {
+        if (strcmp(serial_devices[i].path, path) == 0)
+            return &serial_devices[i];
+    }
+    return NULL;
+}
+
+// Probe one node, reporting it when it is new or its state changed
+static void serial_probe(const char *name) {
+    serial_device_t *dev;
+    char path[64];
+    int baud, is_new = 0;
+
+    snprintf(path, sizeof(path), "/dev/%s", name);
+    dev = serial_find(path);
+    if (!dev) {
+        if (serial_count >= MAX_DEVICES)
+            return;
+        dev = &serial_devices[serial_count++];
+        memset(dev, 0, sizeof(*dev));
+        snprintf(dev->path, sizeof(dev->path), "%s", path);
+        is_new = 1;
+    }
+
+    baud = get_baud_rate(dev->path);
+    dev->seen = 1;
+    if (!is_new && baud == dev->baud_rate)
+        return;
+
+    dev->baud_rate = baud;
+    dev->is_active = (baud > 0);
+    report_serial(dev, is_new ? '+' : '~');
+}
+
+static void serial_remove(const char *name) {
+    serial_device_t *dev;
+    char path[64];
+
+    snprintf(path, sizeof(path), "/dev/%s", name);
+    dev = serial_find(path);
+    if (!dev)
+        return;
+
+    report_serial(dev, '-');
+    *dev = serial_devices[--serial_count];
+}
+
+// Scan serial devices, used once at start and when inotify is missing
 void scan_serial_devices() {
     DIR *dir;
     struct dirent *ent;
-    
-    serial_count = 0;
-    
+
+    for (int i = 0; i < serial_count; i++)
+        serial_devices[i].seen = 0;
+
     if ((dir = opendir("/dev")) != NULL) {
-        while ((ent = readdir(dir)) != NULL && serial_count < MAX_DEVICES) {
-            if (strncmp(ent->d_name, "ttyS", 4) == 0 ||
-                strncmp(ent->d_name, "ttyUSB", 6) == 0 ||
-                strncmp(ent->d_name, "ttyACM", 6) == 0) {
-                
-                snprintf(serial_devices[serial_count].path, 64, "/dev/%s", ent->d_name);
-                serial_devices[serial_count].baud_rate = get_baud_rate(serial_devices[serial_count].path);
-                serial_devices[serial_count].is_active = (serial_devices[serial_count].baud_rate > 0);
-                serial_count++;
-            }
+        while ((ent = readdir(dir)) != NULL) {
+            if (is_serial_name(ent->d_name))
+                serial_probe(ent->d_name);
         }
         closedir(dir);
     }
+
+    for (int i = serial_count - 1; i >= 0; i--) {
+        if (!serial_devices[i].seen)
+            serial_remove(serial_devices[i].path + 5);
+    }
+}
+
+// Watch /dev so ttys are only probed when they appear or change
+static int serial_watch_start(void) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    // udev creates the node, then fixes its mode: IN_ATTRIB re-probes
+    if (inotify_add_watch(fd, "/dev", IN_CREATE | IN_DELETE | IN_ATTRIB |
+                          IN_MOVED_TO | IN_MOVED_FROM) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void serial_watch_handle(int fd) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (!ev->len || !is_serial_name(ev->name))
+                continue;
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                serial_remove(ev->name);
+            else
+                serial_probe(ev->name);
+        }
+    }
+}
+
+static unsigned int bt_hash_addr(const bdaddr_t *bdaddr) {
+    // FNV-1a over the six address bytes
+    unsigned int h = 2166136261u;
+
+    for (int i = 0; i < 6; i++) {
+        h ^= bdaddr->b[i];
+        h *= 16777619u;
+    }
+    return h & (BT_HASH_SIZE - 1);
+}
+
+// Take a device out of its hash chain
+static void bt_unlink(int idx) {
+    int *link = &bt_hash[bt_hash_addr(&bt_devices[idx].addr)];
+
+    while (*link != idx)
+        link = &bt_devices[*link].next;
+    *link = bt_devices[idx].next;
 }
 
-// Bluetooth inquiry callback
-static void bt_inquiry_result(int dev_id, bdaddr_t *bdaddr, uint32_t class, int8_t rssi) {
+// With rotating LE random addresses the table fills up over time, make
+// room by reusing the device seen longest ago
+static int bt_evict(void) {
+    int oldest = -1;
+
+    for (int i = 0; i < bt_count; i++) {
+        const bt_device_t *dev = &bt_devices[i];
+
+        if (dev->name_state == NAME_PENDING)
+            continue;
+        if (oldest < 0 || dev->last_seen < bt_devices[oldest].last_seen)
+            oldest = i;
+    }
+
+    if (oldest >= 0)
+        bt_unlink(oldest);
+    return oldest;
+}
+
+// Find a device, adding it when create is set
+static bt_device_t *bt_lookup(const bdaddr_t *bdaddr, int create) {
+    unsigned int h = bt_hash_addr(bdaddr);
+    bt_device_t *dev;
+    int idx;
+
+    for (int i = bt_hash[h]; i >= 0; i = bt_devices[i].next) {
+        if (bacmp(&bt_devices[i].addr, bdaddr) == 0)
+            return &bt_devices[i];
+    }
+
+    if (!create)
+        return NULL;
+
+    if (bt_count < MAX_BT_DEVICES)
+        idx = bt_count++;
+    else if ((idx = bt_evict()) < 0)
+        return NULL;
+
+    dev = &bt_devices[idx];
+    memset(dev, 0, sizeof(*dev));
+    bacpy(&dev->addr, bdaddr);
+    dev->next = bt_hash[h];
+    bt_hash[h] = idx;
+    return dev;
+}
+
+static const char *bt_type(const bt_device_t *dev) {
+    return dev->le ? (dev->class ? "DUAL" : "LE") : "BR";
+}
+
+static void json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+// Serial changes are rare, report them as they happen
+static void report_serial(const serial_device_t *dev, char op) {
+    if (output_mode == OUTPUT_TABLE) {
+        display_dirty = 1;
+        return;
+    }
+
+    if (output_mode == OUTPUT_JSON) {
+        printf("{\"kind\":\"serial\",\"event\":\"%s\",\"path\":",
+               op == '+' ? "add" : op == '-' ? "remove" : "update");
+        json_string(dev->path);
+        if (op != '-')
+            printf(",\"baud\":%d,\"active\":%s", dev->baud_rate,
+                   dev->is_active ? "true" : "false");
+        printf("}\n");
+    } else if (op == '-') {
+        printf("serial - %s\n", dev->path);
+    } else {
+        printf("serial %c %-20s %d %s\n", op, dev->path, dev->baud_rate,
+               dev->is_active ? "Active" : "Inactive");
+    }
+    fflush(stdout);
+}
+
+// Flag a device for the next display when a shown field moved
+static void bt_touch(bt_device_t *dev) {
+    int delta = dev->rssi - dev->shown_rssi;
+
+    dev->last_seen = time(NULL);
+    if (!dev->seen || delta >= RSSI_DELTA || delta <= -RSSI_DELTA) {
+        dev->dirty = 1;
+        display_dirty = 1;
+    }
+    if (!dev->seen)
+        cache_dirty = 1;
+    dev->seen = 1;
+}
+
+static void bt_name_changed(bt_device_t *dev) {
+    dev->dirty = 1;
+    display_dirty = 1;
+    cache_dirty = 1;
+}
+
+// Emit the Bluetooth rows that changed since the last flush
+static void report_bt(void) {
     char addr[18];
-    char name[248] = {0};
-    
-    ba2str(bdaddr, addr);
-    
-    // Check if device already in list
+
+    for (int i = 0; i < bt_count; i++) {
+        bt_device_t *dev = &bt_devices[i];
+
+        if (!dev->dirty)
+            continue;
+        dev->dirty = 0;
+        dev->shown_rssi = dev->rssi;
+
+        ba2str(&dev->addr, addr);
+        if (output_mode == OUTPUT_JSON) {
+            printf("{\"kind\":\"bt\",\"event\":\"%s\",\"addr\":\"%s\",\"type\":\"%s\",\"name\":",
+                   dev->reported ? "update" : "add", addr, bt_type(dev));
+            json_string(dev->name);
+            printf(",\"rssi\":%d,\"class\":%u,\"last_seen\":%ld}\n",
+                   dev->rssi, dev->class, (long)dev->last_seen);
+        } else {
+            printf("bt %c %-18s %-4s %-30s %d\n", dev->reported ? '~' : '+',
+                   addr, bt_type(dev), dev->name[0] ? dev->name : "Unknown",
+                   dev->rssi);
+        }
+        dev->reported = 1;
+    }
+    fflush(stdout);
+}
+
+// Names survive restarts so they are not paged for again
+static void bt_cache_load(void) {
+    char line[512], addr[18];
+    bt_device_t *dev;
+    bdaddr_t bdaddr;
+    unsigned int le, addr_type, class;
+    long last_seen;
+    time_t now = time(NULL);
+    int off;
+    FILE *fp;
+
+    if (!cache_path || !(fp = fopen(cache_path, "r")))
+        return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%17s %u %u %x %ld %n", addr, &le, &addr_type,
+                   &class, &last_seen, &off) != 5 || str2ba(addr, &bdaddr) < 0)
+            continue;
+        if (now - last_seen > CACHE_MAX_AGE) {
+            cache_dirty = 1;
+            continue;
+        }
+        if (!(dev = bt_lookup(&bdaddr, 1)))
+            break;
+
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(dev->name, sizeof(dev->name), "%s", line + off);
+        dev->le = le;
+        dev->le_addr_type = addr_type;
+        dev->class = class;
+        dev->last_seen = last_seen;
+        if (dev->name[0])
+            dev->name_state = NAME_DONE;
+    }
+    fclose(fp);
+}
+
+static void bt_cache_save(void) {
+    char tmp[PATH_MAX], addr[18];
+    time_t now = time(NULL);
+    FILE *fp;
+
+    if (!cache_path || !cache_dirty)
+        return;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache_path);
+    if (!(fp = fopen(tmp, "w")))
+        return;
+
+    for (int i = 0; i < bt_count; i++) {
+        const bt_device_t *dev = &bt_devices[i];
+
+        if (now - dev->last_seen > CACHE_MAX_AGE)
+            continue;
+        ba2str(&dev->addr, addr);
+        fprintf(fp, "%s %u %u %06x %ld %s\n", addr, dev->le, dev->le_addr_type,
+                dev->class, (long)dev->last_seen,
+                dev->name_state == NAME_DONE ? dev->name : "");
+    }
+
+    if (fclose(fp) == 0 && rename(tmp, cache_path) == 0)
+        cache_dirty = 0;
+    else
+        unlink(tmp);
+}
+
+// Pick the local name out of EIR or advertising data
+static int parse_name(const uint8_t *data, size_t len, char *name, size_t size) {
+    size_t off = 0;
+
+    while (off < len) {
+        uint8_t field_len = data[off];
+
+        if (field_len == 0 || off + 1 + field_len > len)
+            break;
+
+        // 0x09 complete, 0x08 shortened local name
+        if (data[off + 1] == 0x09 || data[off + 1] == 0x08) {
+            size_t n = field_len - 1;
+
+            if (n >= size)
+                n = size - 1;
+            memcpy(name, data + off + 2, n);
+            name[n] = '\0';
+            return 0;
+        }
+        off += field_len + 1;
+    }
+    return -1;
+}
+
+// Bluetooth inquiry result, from any of the three result events
+static void bt_inquiry_result(const bdaddr_t *bdaddr, const uint8_t *dev_class,
+                              int8_t rssi, uint8_t pscan_rep_mode,
+                              uint16_t clock_offset,
+                              const uint8_t *eir, size_t eir_len) {
+    bt_device_t *dev = bt_lookup(bdaddr, 1);
+
+    if (!dev)
+        return;
+
+    dev->class = dev_class[2] << 16 | dev_class[1] << 8 | dev_class[0];
+    dev->rssi = rssi;
+    bt_touch(dev);
+    dev->pscan_rep_mode = pscan_rep_mode;
+    dev->clock_offset = clock_offset;
+
+    if (dev->name_state != NAME_DONE && eir &&
+        parse_name(eir, eir_len, dev->name, sizeof(dev->name)) == 0) {
+        if (dev->name_state == NAME_PENDING)
+            names_inflight--;
+        dev->name_state = NAME_DONE;
+        bt_name_changed(dev);
+    }
+}
+
+static void bt_le_report(const le_advertising_info *info) {
+    bt_device_t *dev = bt_lookup(&info->bdaddr, 1);
+
+    if (!dev)
+        return;
+
+    dev->le = 1;
+    dev->le_addr_type = info->bdaddr_type;
+    dev->rssi = (int8_t)info->data[info->length];
+    bt_touch(dev);
+
+    // LE devices have no remote name request, only advertised names
+    if (dev->name_state != NAME_DONE &&
+        parse_name(info->data, info->length, dev->name, sizeof(dev->name)) == 0) {
+        if (dev->name_state == NAME_PENDING)
+            names_inflight--;
+        dev->name_state = NAME_DONE;
+        bt_name_changed(dev);
+    }
+}
+
+// Start remote name requests for new devices, up to NAME_INFLIGHT
+static void bt_request_names(void) {
+    time_t now = time(NULL);
+    remote_name_req_cp cp;
+
     for (int i = 0; i < bt_count; i++) {
-        if (bacmp(&bt_devices[i].addr, bdaddr) == 0) {
-            bt_devices[i].rssi = rssi;
-            bt_devices[i].last_seen = time(NULL);
+        bt_device_t *dev = &bt_devices[i];
+
+        // a lost completion must not block the queue
+        if (dev->name_state == NAME_PENDING && now - dev->name_sent > NAME_TIMEOUT) {
+            names_inflight--;
+            dev->name_state = dev->name_tries < NAME_RETRIES ? NAME_NONE : NAME_FAILED;
+        }
+    }
+
+    for (int i = 0; i < bt_count && names_inflight < NAME_INFLIGHT; i++) {
+        bt_device_t *dev = &bt_devices[i];
+
+        // LE-only devices cannot be paged
+        if (dev->name_state != NAME_NONE || (dev->le && !dev->class))
+            continue;
+
+        memset(&cp, 0, sizeof(cp));
+        bacpy(&cp.bdaddr, &dev->addr);
+        cp.pscan_rep_mode = dev->pscan_rep_mode;
+        cp.clock_offset = htobs(dev->clock_offset | 0x8000);
+        if (hci_send_cmd(hci_sock, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ,
+                         REMOTE_NAME_REQ_CP_SIZE, &cp) < 0)
             return;
+
+        dev->name_state = NAME_PENDING;
+        dev->name_tries++;
+        dev->name_sent = now;
+        names_inflight++;
+        name_last = i;
+    }
+}
+
+static void bt_name_complete(const evt_remote_name_req_complete *ev) {
+    bt_device_t *dev = bt_lookup(&ev->bdaddr, 0);
+
+    if (!dev || dev->name_state != NAME_PENDING)
+        return;
+
+    names_inflight--;
+    if (ev->status) {
+        dev->name_state = dev->name_tries < NAME_RETRIES ? NAME_NONE : NAME_FAILED;
+        return;
+    }
+
+    memcpy(dev->name, ev->name, sizeof(dev->name) - 1);
+    dev->name[sizeof(dev->name) - 1] = '\0';
+    dev->name_state = NAME_DONE;
+    bt_name_changed(dev);
+}
+
+// A rejected name request never completes, free its slot. Commands are
+// handled in order, so the status is for the newest request.
+static void bt_cmd_status(const evt_cmd_status *ev) {
+    bt_device_t *dev;
+
+    if (btohs(ev->opcode) != cmd_opcode_pack(OGF_LINK_CTL, OCF_REMOTE_NAME_REQ) ||
+        ev->status == 0 || name_last < 0)
+        return;
+
+    dev = &bt_devices[name_last];
+    name_last = -1;
+    if (dev->name_state != NAME_PENDING)
+        return;
+
+    names_inflight--;
+    dev->name_state = dev->name_tries < NAME_RETRIES ? NAME_NONE : NAME_FAILED;
+}
+
+static void bt_handle_event(const uint8_t *buf, int len) {
+    const hci_event_hdr *hdr = (const void *)(buf + 1);
+    const uint8_t *ptr = buf + 1 + HCI_EVENT_HDR_SIZE;
+    int num;
+
+    if (len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT)
+        return;
+    len -= 1 + HCI_EVENT_HDR_SIZE;
+    if (len > hdr->plen)
+        len = hdr->plen;
+
+    switch (hdr->evt) {
+    case EVT_INQUIRY_RESULT:
+        num = len ? *ptr++ : 0;
+        for (int i = 0; i < num && 1 + (i + 1) * INQUIRY_INFO_SIZE <= len; i++) {
+            const inquiry_info *info = (const void *)(ptr + i * INQUIRY_INFO_SIZE);
+
+            bt_inquiry_result(&info->bdaddr, info->dev_class, 0,
+                              info->pscan_rep_mode, btohs(info->clock_offset),
+                              NULL, 0);
+        }
+        break;
+
+    case EVT_INQUIRY_RESULT_WITH_RSSI:
+        num = len ? *ptr++ : 0;
+        for (int i = 0; i < num && 1 + (i + 1) * INQUIRY_INFO_WITH_RSSI_SIZE <= len; i++) {
+            const inquiry_info_with_rssi *info =
+                (const void *)(ptr + i * INQUIRY_INFO_WITH_RSSI_SIZE);
+
+            bt_inquiry_result(&info->bdaddr, info->dev_class, info->rssi,
+                              info->pscan_rep_mode, btohs(info->clock_offset),
+                              NULL, 0);
+        }
+        break;
+
+    case EVT_EXTENDED_INQUIRY_RESULT:
+        if (len >= 1 + EXTENDED_INQUIRY_INFO_SIZE) {
+            const extended_inquiry_info *info = (const void *)(ptr + 1);
+
+            bt_inquiry_result(&info->bdaddr, info->dev_class, info->rssi,
+                              info->pscan_rep_mode, btohs(info->clock_offset),
+                              info->data, sizeof(info->data));
+        }
+        break;
+
+    case EVT_REMOTE_NAME_REQ_COMPLETE:
+        if (len >= EVT_REMOTE_NAME_REQ_COMPLETE_SIZE)
+            bt_name_complete((const void *)ptr);
+        break;
+
+    case EVT_CMD_STATUS:
+        if (len >= EVT_CMD_STATUS_SIZE)
+            bt_cmd_status((const void *)ptr);
+        break;
+
+    case EVT_LE_META_EVENT: {
+        const evt_le_meta_event *meta = (const void *)ptr;
+        const uint8_t *end = ptr + len;
+        const uint8_t *p;
+
+        if (len < 2 || meta->subevent != EVT_LE_ADVERTISING_REPORT)
+            break;
+
+        // reports are packed back to back, each followed by its RSSI
+        num = meta->data[0];
+        p = meta->data + 1;
+        for (int i = 0; i < num && p + LE_ADVERTISING_INFO_SIZE <= end; i++) {
+            const le_advertising_info *info = (const void *)p;
+
+            if (p + LE_ADVERTISING_INFO_SIZE + info->length + 1 > end)
+                break;
+            bt_le_report(info);
+            p += LE_ADVERTISING_INFO_SIZE + info->length + 1;
         }
+        break;
+    }
     }
-    
-    // Add new device
-    if (bt_count < MAX_DEVICES) {
-        bacpy(&bt_devices[bt_count].addr, bdaddr);
-        bt_devices[bt_count].class = class;
-        bt_devices[bt_count].rssi = rssi;
-        bt_devices[bt_count].last_seen = time(NULL);
-        
-        // Try to get device name
-        hci_read_remote_name(dev_id, bdaddr, sizeof(name), name, 0);
-        strncpy(bt_devices[bt_count].name, name, sizeof(bt_devices[bt_count].name) - 1);
-        
-        bt_count++;
-    }
-}
-
-// Scan Bluetooth devices
-void scan_bluetooth_devices() {
-    inquiry_info *ii = NULL;
-    int max_rsp = 255;
-    int num_rsp;
-    int dev_id, sock, flags;
-    char addr[19] = {0};
-    char name[248] = {0};
-    
+}
+
+static void bt_le_scan(uint8_t enable) {
+    le_set_scan_enable_cp cp;
+
+    memset(&cp, 0, sizeof(cp));
+    cp.enable = enable;
+    cp.filter_dup = 0x01;
+    hci_send_cmd(hci_sock, OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE,
+                 LE_SET_SCAN_ENABLE_CP_SIZE, &cp);
+}
+
+// Open the adapter and start inquiry and LE scanning in the controller
+static int bt_start(void) {
+    periodic_inquiry_cp pi;
+    struct hci_filter flt;
+    int dev_id;
+
     dev_id = hci_get_route(NULL);
     if (dev_id < 0) {
         printf("No Bluetooth adapter found\n");
-        return;
+        return -1;
     }
-    
-    sock = hci_open_dev(dev_id);
-    if (sock < 0) {
+
+    hci_sock = hci_open_dev(dev_id);
+    if (hci_sock < 0) {
         printf("Failed to open HCI socket\n");
-        return;
+        return -1;
     }
-    
-    flags = IREQ_CACHE_FLUSH;
-    ii = (inquiry_info*)malloc(max_rsp * sizeof(inquiry_info));
-    
-    // Classic Bluetooth scan
-    num_rsp = hci_inquiry(dev_id, 8, max_rsp, NULL, &ii, flags);
-    if (num_rsp > 0) {
-        for (int i = 0; i < num_rsp; i++) {
-            bt_inquiry_result(sock, &(ii+i)->bdaddr, 
-                            (ii+i)->dev_class[2] << 16 | (ii+i)->dev_class[1] << 8 | (ii+i)->dev_class[0],
-                            0);
-        }
+
+    // RSSI and EIR in the results, older controllers stop at RSSI
+    if (hci_write_inquiry_mode(hci_sock, 0x02, 1000) < 0 &&
+        hci_write_inquiry_mode(hci_sock, 0x01, 1000) < 0)
+        printf("Inquiry results without RSSI\n");
+
+    if (hci_le_set_scan_parameters(hci_sock, 0x01, htobs(LE_SCAN_INTERVAL),
+                                   htobs(LE_SCAN_WINDOW), 0x00, 0x00, 1000) < 0 ||
+        hci_le_set_scan_enable(hci_sock, 0x01, 0x01, 1000) < 0)
+        printf("LE scan unavailable: %s\n", strerror(errno));
+    else
+        le_scanning = 1;
+
+    // the blocking setup requests above install their own filter
+    hci_filter_clear(&flt);
+    hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+    hci_filter_set_event(EVT_INQUIRY_RESULT, &flt);
+    hci_filter_set_event(EVT_INQUIRY_RESULT_WITH_RSSI, &flt);
+    hci_filter_set_event(EVT_EXTENDED_INQUIRY_RESULT, &flt);
+    hci_filter_set_event(EVT_REMOTE_NAME_REQ_COMPLETE, &flt);
+    hci_filter_set_event(EVT_CMD_STATUS, &flt);
+    hci_filter_set_event(EVT_LE_META_EVENT, &flt);
+    if (setsockopt(hci_sock, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
+        printf("Failed to set HCI filter: %s\n", strerror(errno));
+        return -1;
     }
-    
-    free(ii);
-    
-    // TODO: Add BLE scanning using HCI commands
-    
-    close(sock);
+
+    memset(&pi, 0, sizeof(pi));
+    pi.max_period = htobs(INQUIRY_MAX_PERIOD);
+    pi.min_period = htobs(INQUIRY_MIN_PERIOD);
+    pi.lap[0] = 0x33;   // GIAC
+    pi.lap[1] = 0x8b;
+    pi.lap[2] = 0x9e;
+    pi.length = INQUIRY_LENGTH;
+    pi.num_rsp = 0;     // unlimited
+    if (hci_send_cmd(hci_sock, OGF_LINK_CTL, OCF_PERIODIC_INQUIRY,
+                     PERIODIC_INQUIRY_CP_SIZE, &pi) < 0) {
+        printf("Failed to start periodic inquiry: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void bt_stop(void) {
+    if (hci_sock < 0)
+        return;
+
+    hci_send_cmd(hci_sock, OGF_LINK_CTL, OCF_EXIT_PERIODIC_INQUIRY, 0, NULL);
+    if (le_scanning)
+        bt_le_scan(0x00);
+    close(hci_sock);
+    hci_sock = -1;
 }
 
 // Display results
 void display_results() {
-    system("clear");
-    
+    int seen = 0;
+
+    // home and clear with an escape sequence instead of forking clear
+    printf("\033[H\033[2J");
+
     printf("=== RV1106 Real-time Device Scanner ===\n");
     printf("Press Ctrl+C to exit\n\n");
-    
+
     // Display serial devices
     printf("[Serial Devices] Found: %d\n", serial_count);
     printf("%-20s %-15s %s\n", "Device", "Baud Rate", "Status");
     printf("%-20s %-15s %s\n", "------", "---------", "------");
-    
+
     for (int i = 0; i < serial_count; i++) {
         printf("%-20s ", serial_devices[i].path);
         if (serial_devices[i].baud_rate > 0) {
@@ -190,40 +815,171 @@ void display_results() {
             printf("Inactive\n");
         }
     }
-    
+
+    for (int i = 0; i < bt_count; i++)
+        seen += bt_devices[i].seen;
+
     // Display Bluetooth devices
-    printf("\n[Bluetooth Devices] Found: %d\n", bt_count);
-    printf("%-18s %-30s %-8s %s\n", "Address", "Name", "RSSI", "Last Seen");
-    printf("%-18s %-30s %-8s %s\n", "-------", "----", "----", "---------");
-    
+    printf("\n[Bluetooth Devices] Found: %d\n", seen);
+    printf("%-18s %-4s %-30s %-8s %s\n", "Address", "Type", "Name", "RSSI", "Last Seen");
+    printf("%-18s %-4s %-30s %-8s %s\n", "-------", "----", "----", "----", "---------");
+
     time_t now = time(NULL);
     char addr[18];
-    
+
     for (int i = 0; i < bt_count; i++) {
-        ba2str(&bt_devices[i].addr, addr);
+        bt_device_t *dev = &bt_devices[i];
+
+        if (!dev->seen)
+            continue;
+        dev->dirty = 0;
+        dev->shown_rssi = dev->rssi;
+        ba2str(&dev->addr, addr);
         printf("%-18s ", addr);
-        printf("%-30s ", bt_devices[i].name[0] ? bt_devices[i].name : "Unknown");
-        printf("%-8d ", bt_devices[i].rssi);
-        printf("%lds ago\n", now - bt_devices[i].last_seen);
+        printf("%-4s ", bt_type(dev));
+        printf("%-30s ", dev->name[0] ? dev->name : "Unknown");
+        printf("%-8d ", dev->rssi);
+        printf("%lds ago\n", now - dev->last_seen);
     }
-    
+
     printf("\nLast update: %s", ctime(&now));
+    fflush(stdout);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-o table|diff|json] [-c cache|-C]\n", prog);
+    printf("  -o  table redraws on change, diff and json print changed rows only\n");
+    printf("  -c  device name cache (default %s)\n", CACHE_PATH);
+    printf("  -C  do not use a cache\n");
 }
 
 int main(int argc, char *argv[]) {
+    unsigned char buf[HCI_MAX_EVENT_SIZE + 1];
+    time_t now, next_serial = 0, next_display = 0, next_le = 0, next_names = 0;
+    time_t next_cache;
+    struct pollfd pfd[2];
+    int len, opt, watch_fd, nfds;
+
+    while ((opt = getopt(argc, argv, "o:c:Ch")) != -1) {
+        switch (opt) {
+        case 'o':
+            if (strcmp(optarg, "table") == 0)
+                output_mode = OUTPUT_TABLE;
+            else if (strcmp(optarg, "diff") == 0)
+                output_mode = OUTPUT_DIFF;
+            else if (strcmp(optarg, "json") == 0)
+                output_mode = OUTPUT_JSON;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            cache_path = optarg;
+            break;
+        case 'C':
+            cache_path = NULL;
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
-    
-    printf("Starting device scanner...\n");
-    
+
+    // machine consumers only get the records on stdout
+    if (output_mode == OUTPUT_TABLE)
+        printf("Starting device scanner...\n");
+
+    for (int i = 0; i < BT_HASH_SIZE; i++)
+        bt_hash[i] = -1;
+    if (cache_path && strcmp(cache_path, CACHE_PATH) == 0)
+        mkdir("/var/cache/realtime_scanner", 0755);
+    bt_cache_load();
+
+    watch_fd = serial_watch_start();
+    if (watch_fd < 0)
+        fprintf(stderr, "inotify unavailable, rescanning serial ports every %ds\n",
+                SCAN_INTERVAL);
+    scan_serial_devices();
+    next_serial = watch_fd < 0 ? time(NULL) + SCAN_INTERVAL : 0;
+
+    if (bt_start() < 0)
+        fprintf(stderr, "Bluetooth scanning disabled\n");
+    next_le = time(NULL) + LE_SCAN_REFRESH;
+    next_cache = time(NULL) + CACHE_INTERVAL;
+
     while (keep_running) {
-        scan_serial_devices();
-        scan_bluetooth_devices();
-        display_results();
-        
-        sleep(SCAN_INTERVAL);
-    }
-    
-    printf("\nScanner stopped.\n");
+        now = time(NULL);
+
+        if (watch_fd < 0 && now >= next_serial) {
+            scan_serial_devices();
+            next_serial = now + SCAN_INTERVAL;
+        }
+
+        if (hci_sock >= 0) {
+            // walks the whole table, keep it off the per-event path
+            if (now >= next_names) {
+                bt_request_names();
+                next_names = now + 1;
+            }
+            if (le_scanning && now >= next_le) {
+                bt_le_scan(0x00);
+                bt_le_scan(0x01);
+                next_le = now + LE_SCAN_REFRESH;
+            }
+        }
+
+        if (now >= next_display) {
+            if (output_mode != OUTPUT_TABLE)
+                report_bt();
+            else if (display_dirty)
+                display_results();
+            display_dirty = 0;
+            next_display = now + DISPLAY_INTERVAL;
+        }
+
+        if (now >= next_cache) {
+            bt_cache_save();
+            next_cache = now + CACHE_INTERVAL;
+        }
+
+        // results arrive as events, the timeout only paces the display
+        nfds = 0;
+        if (hci_sock >= 0) {
+            pfd[nfds].fd = hci_sock;
+            pfd[nfds++].events = POLLIN;
+        }
+        if (watch_fd >= 0) {
+            pfd[nfds].fd = watch_fd;
+            pfd[nfds++].events = POLLIN;
+        }
+        if (poll(pfd, nfds, (next_display - now) * 1000) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            if (!(pfd[i].revents & POLLIN))
+                continue;
+            if (pfd[i].fd == watch_fd) {
+                serial_watch_handle(watch_fd);
+                continue;
+            }
+            len = read(hci_sock, buf, sizeof(buf));
+            if (len > 0)
+                bt_handle_event(buf, len);
+        }
+    }
+
+    bt_stop();
+    bt_cache_save();
+    if (watch_fd >= 0)
+        close(watch_fd);
+    if (output_mode == OUTPUT_TABLE)
+        printf("\nScanner stopped.\n");
     return 0;
-}
\ No newline at end of file
+}
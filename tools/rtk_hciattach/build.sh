@@ -28,7 +28,7 @@ fi
 
 # Build
 echo "Compiling..."
-$CC -Wall -O2 -static -o rtk_hciattach hciattach.c hciattach_rtk.c
+$CC -Wall -O2 -static -o rtk_hciattach hciattach.c hciattach_rtk.c -lpthread
 
 if [ -f rtk_hciattach ]; then
     echo "✓ Build successful!"
@@ -0,0 +1,217 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  Module Name:
+ *     h5_bench.c
+ *
+ *  Description:
+ *     Compare the bulk H5 codec in h5_codec.h against the per byte
+ *     reference it replaced, and report the throughput of both.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "h5_codec.h"
+
+#define BENCH_BYTES	(64 * 1024 * 1024)
+
+/* Keeps the timed loops from being optimised away */
+static volatile uint16_t bench_sink;
+
+static const uint16_t ref_crc_table[] = {
+	0x0000, 0x1081, 0x2102, 0x3183,
+	0x4204, 0x5285, 0x6306, 0x7387,
+	0x8408, 0x9489, 0xa50a, 0xb58b,
+	0xc60c, 0xd68d, 0xe70e, 0xf78f
+};
+
+static uint16_t ref_crc_update(uint16_t reg, uint8_t d)
+{
+	reg = (reg >> 4) ^ ref_crc_table[(reg ^ d) & 0x000f];
+	reg = (reg >> 4) ^ ref_crc_table[(reg ^ (d >> 4)) & 0x000f];
+	return reg;
+}
+
+static size_t ref_slip(uint8_t *dst, const uint8_t *src, size_t len,
+		       uint16_t *crc)
+{
+	size_t i, n = 0;
+	uint8_t c;
+
+	for (i = 0; i < len; i++) {
+		c = src[i];
+		*crc = ref_crc_update(*crc, c);
+		switch (c) {
+		case 0xc0:
+			dst[n++] = 0xdb;
+			dst[n++] = 0xdc;
+			break;
+		case 0xdb:
+			dst[n++] = 0xdb;
+			dst[n++] = 0xdd;
+			break;
+		case 0x11:
+			dst[n++] = 0xdb;
+			dst[n++] = 0xde;
+			break;
+		case 0x13:
+			dst[n++] = 0xdb;
+			dst[n++] = 0xdf;
+			break;
+		default:
+			dst[n++] = c;
+			break;
+		}
+	}
+	return n;
+}
+
+static size_t ref_unslip(uint8_t *dst, const uint8_t *src, size_t len,
+			 uint16_t *crc)
+{
+	size_t i, n = 0;
+	int c;
+
+	for (i = 0; i < len; i++) {
+		c = src[i];
+		if (c == 0xdb)
+			c = h5_unslip_esc(src[++i]);
+		dst[n] = c;
+		*crc = ref_crc_update(*crc, dst[n++]);
+	}
+	return n;
+}
+
+static size_t new_slip(uint8_t *dst, const uint8_t *src, size_t len,
+		       uint16_t *crc)
+{
+	*crc = h5_crc_buf(*crc, src, len);
+	return h5_slip_encode(dst, src, len);
+}
+
+static size_t new_unslip(uint8_t *dst, const uint8_t *src, size_t len,
+			 uint16_t *crc)
+{
+	size_t i = 0, n = 0, run;
+
+	while (i < len) {
+		run = h5_unslip_span(src + i, len - i);
+		memcpy(dst + n, src + i, run);
+		*crc = h5_crc_buf(*crc, dst + n, run);
+		i += run;
+		n += run;
+		if (i < len) {
+			dst[n] = h5_unslip_esc(src[i + 1]);
+			*crc = h5_crc_byte(*crc, dst[n++]);
+			i += 2;
+		}
+	}
+	return n;
+}
+
+typedef size_t (*codec_fn) (uint8_t *, const uint8_t *, size_t, uint16_t *);
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(codec_fn fn, uint8_t *dst, const uint8_t *src,
+		    size_t len)
+{
+	size_t i, loops = BENCH_BYTES / len;
+	uint16_t crc = 0xffff;
+	double t;
+
+	t = now();
+	for (i = 0; i < loops; i++)
+		fn(dst, src, len, &crc);
+	t = now() - t;
+	bench_sink ^= crc;
+
+	return (double)loops * len / t / 1e6;
+}
+
+static int run(const char *name, size_t len, int esc_pct)
+{
+	uint8_t *src, *enc_ref, *enc_new, *dec_ref, *dec_new;
+	uint16_t crc_ref = 0xffff, crc_new = 0xffff;
+	static const uint8_t specials[] = { 0xc0, 0xdb, 0x11, 0x13 };
+	size_t i, n_ref, n_new;
+	int ret = 0;
+
+	src = malloc(len);
+	enc_ref = malloc(len * 2);
+	enc_new = malloc(len * 2);
+	dec_ref = malloc(len);
+	dec_new = malloc(len);
+
+	for (i = 0; i < len; i++) {
+		src[i] = rand();
+		if (rand() % 100 < esc_pct)
+			src[i] = specials[rand() % 4];
+		else if (h5_slip_needs_esc(src[i]))
+			src[i] ^= 0x01;
+	}
+
+	n_ref = ref_slip(enc_ref, src, len, &crc_ref);
+	n_new = new_slip(enc_new, src, len, &crc_new);
+	if (n_ref != n_new || memcmp(enc_ref, enc_new, n_ref) ||
+	    crc_ref != crc_new) {
+		printf("%s: encode mismatch\n", name);
+		ret = 1;
+	}
+
+	crc_ref = crc_new = 0xffff;
+	if (ref_unslip(dec_ref, enc_ref, n_ref, &crc_ref) != len ||
+	    new_unslip(dec_new, enc_ref, n_ref, &crc_new) != len ||
+	    memcmp(dec_ref, src, len) || memcmp(dec_new, src, len) ||
+	    crc_ref != crc_new) {
+		printf("%s: decode mismatch\n", name);
+		ret = 1;
+	}
+
+	printf("%-20s encode %8.1f -> %8.1f MB/s  decode %8.1f -> %8.1f MB/s\n",
+	       name,
+	       bench(ref_slip, enc_ref, src, len),
+	       bench(new_slip, enc_new, src, len),
+	       bench(ref_unslip, dec_ref, enc_ref, n_ref),
+	       bench(new_unslip, dec_new, enc_ref, n_ref));
+
+	free(src);
+	free(enc_ref);
+	free(enc_new);
+	free(dec_ref);
+	free(dec_new);
+
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	srand(1);
+	ret |= run("patch 252B clean", 252, 0);
+	ret |= run("patch 252B 1% esc", 252, 1);
+	ret |= run("patch 252B 10% esc", 252, 10);
+	ret |= run("sco 60B 1% esc", 60, 1);
+	ret |= run("acl 1021B 1% esc", 1021, 1);
+
+	return ret;
+}
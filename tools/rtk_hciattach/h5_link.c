@@ -0,0 +1,506 @@
+/*
+ *
+ *  Realtek H5 (3-wire UART) link engine
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  Module Name:
+ *     h5_link.c
+ *
+ *  Description:
+ *     Sliding window, link establishment and framing of the 3-wire UART
+ *     transport, see "Three-wire UART Transport Layer" in the Core Spec.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include "h5_codec.h"
+#include "h5_link.h"
+
+#define H5_HDR_SEQ(h)		((h)[0] & 0x07)
+#define H5_HDR_ACK(h)		(((h)[0] >> 3) & 0x07)
+#define H5_HDR_CRC(h)		((h)[0] & 0x40)
+#define H5_HDR_RELIABLE(h)	((h)[0] & 0x80)
+#define H5_HDR_TYPE(h)		((h)[1] & 0x0f)
+#define H5_HDR_LEN(h)		(((h)[1] >> 4) | ((h)[2] << 4))
+
+/* Link control messages answered from h5_link_poll() */
+#define H5_REQ_SYNC_RSP		(1 << 0)
+#define H5_REQ_CONF_RSP		(1 << 1)
+#define H5_REQ_WOKEN		(1 << 2)
+
+static const uint8_t h5_sync[] = { 0x01, 0x7e };
+static const uint8_t h5_sync_rsp[] = { 0x02, 0x7d };
+static const uint8_t h5_conf[] = { 0x03, 0xfc };
+static const uint8_t h5_conf_rsp[] = { 0x04, 0x7b };
+static const uint8_t h5_wakeup[] = { 0x05, 0xfa };
+static const uint8_t h5_woken[] = { 0x06, 0xf9 };
+
+static void h5_list_push(struct h5_pkt_list *l, struct h5_pkt *p)
+{
+	p->next = NULL;
+	if (l->tail)
+		l->tail->next = p;
+	else
+		l->head = p;
+	l->tail = p;
+	l->num++;
+}
+
+static struct h5_pkt *h5_list_pop(struct h5_pkt_list *l)
+{
+	struct h5_pkt *p = l->head;
+
+	if (!p)
+		return NULL;
+
+	l->head = p->next;
+	if (!l->head)
+		l->tail = NULL;
+	l->num--;
+
+	return p;
+}
+
+static void h5_list_splice(struct h5_pkt_list *to, struct h5_pkt_list *from)
+{
+	struct h5_pkt *p;
+
+	while ((p = h5_list_pop(from)))
+		h5_list_push(to, p);
+}
+
+static uint16_t h5_bitrev16(uint16_t x)
+{
+	x = ((x >> 1) & 0x5555) | ((x & 0x5555) << 1);
+	x = ((x >> 2) & 0x3333) | ((x & 0x3333) << 2);
+	x = ((x >> 4) & 0x0f0f) | ((x & 0x0f0f) << 4);
+	return (x >> 8) | (x << 8);
+}
+
+static void h5_link_set_state(struct h5_link *h5, enum h5_link_state state)
+{
+	h5->state = state;
+	h5->ctl_deadline = 0;
+	if (h5->ops && h5->ops->state)
+		h5->ops->state(h5->user, state);
+}
+
+void h5_link_init(struct h5_link *h5, const struct h5_link_ops *ops,
+		  void *user, uint8_t cfg)
+{
+	unsigned int i;
+
+	memset(h5, 0, sizeof(*h5));
+	h5->ops = ops;
+	h5->user = user;
+	h5->cfg = cfg;
+	h5->tx_win = 1;
+	h5->sync_ms = H5_LINK_SYNC_MS;
+	h5->retx_ms = H5_LINK_RETX_MS;
+	/* ignore whatever precedes the first delimiter */
+	h5->rx_drop = 1;
+
+	for (i = 0; i < H5_LINK_POOL_SIZE; i++)
+		h5_list_push(&h5->free, &h5->pool[i]);
+}
+
+void h5_link_reset(struct h5_link *h5)
+{
+	h5_list_splice(&h5->free, &h5->unacked);
+	h5_list_splice(&h5->free, &h5->rel_q);
+	h5_list_splice(&h5->free, &h5->unrel_q);
+
+	h5->tx_seq = 0;
+	h5->tx_ack = 0;
+	h5->ack_req = 0;
+	h5->ctl_req = 0;
+	h5->tx_win = 1;
+	h5->use_crc = 0;
+	h5->rx_resync = 0;
+	h5->state = H5_LINK_UNINIT;
+	h5->ctl_deadline = 0;
+}
+
+void h5_link_resume(struct h5_link *h5, uint8_t tx_seq, uint8_t tx_ack,
+		    uint8_t tx_win, int use_crc)
+{
+	h5->tx_seq = tx_seq & 0x07;
+	h5->tx_ack = tx_ack & 0x07;
+	h5->tx_win = tx_win ? tx_win : 1;
+	h5->use_crc = !!use_crc;
+	h5->ctl_req = 0;
+	h5->rx_resync = 0;
+	h5->state = H5_LINK_ACTIVE;
+}
+
+void h5_link_rx_reset_seq(struct h5_link *h5)
+{
+	h5->rx_resync = 1;
+}
+
+int h5_link_send(struct h5_link *h5, uint8_t type, const uint8_t *data,
+		 size_t len)
+{
+	struct h5_pkt *p;
+
+	if (len > H5_LINK_MTU)
+		return -EMSGSIZE;
+
+	p = h5_list_pop(&h5->free);
+	if (!p)
+		return -ENOBUFS;
+
+	p->type = type;
+	p->len = len;
+	memcpy(p->data, data, len);
+
+	switch (type) {
+	case 0x01:	/* command */
+	case 0x02:	/* ACL */
+	case 0x04:	/* event */
+		h5_list_push(&h5->rel_q, p);
+		break;
+	default:
+		h5_list_push(&h5->unrel_q, p);
+		break;
+	}
+
+	return 0;
+}
+
+/* Take the window size and CRC use from the peer's config field */
+static void h5_link_negotiate(struct h5_link *h5, const uint8_t *data,
+			      size_t len)
+{
+	uint8_t peer = len > 2 ? data[2] : 0;
+
+	h5->tx_win = peer & 0x07;
+	if (h5->tx_win > (h5->cfg & 0x07))
+		h5->tx_win = h5->cfg & 0x07;
+	if (!h5->tx_win)
+		h5->tx_win = 1;
+	h5->use_crc = (h5->cfg & 0x10) && (peer & 0x10);
+}
+
+static int h5_ctl_is(const uint8_t *data, size_t len, const uint8_t *msg)
+{
+	return len >= 2 && data[0] == msg[0] && data[1] == msg[1];
+}
+
+static void h5_link_rx_ctl(struct h5_link *h5, const uint8_t *data,
+			   size_t len)
+{
+	if (h5_ctl_is(data, len, h5_sync)) {
+		/* the peer restarted, so do we */
+		if (h5->state == H5_LINK_ACTIVE) {
+			h5->stats.resets++;
+			h5_link_reset(h5);
+			h5_link_set_state(h5, H5_LINK_UNINIT);
+		}
+		h5->ctl_req |= H5_REQ_SYNC_RSP;
+	} else if (h5_ctl_is(data, len, h5_sync_rsp)) {
+		if (h5->state == H5_LINK_UNINIT)
+			h5_link_set_state(h5, H5_LINK_INIT);
+	} else if (h5_ctl_is(data, len, h5_conf)) {
+		if (h5->state == H5_LINK_UNINIT)
+			return;
+		if (h5->state == H5_LINK_INIT)
+			h5_link_negotiate(h5, data, len);
+		h5->ctl_req |= H5_REQ_CONF_RSP;
+	} else if (h5_ctl_is(data, len, h5_conf_rsp)) {
+		if (h5->state != H5_LINK_INIT)
+			return;
+		h5_link_negotiate(h5, data, len);
+		h5_link_set_state(h5, H5_LINK_ACTIVE);
+	} else if (h5_ctl_is(data, len, h5_wakeup)) {
+		h5->ctl_req |= H5_REQ_WOKEN;
+	}
+}
+
+static void h5_link_rx_ack(struct h5_link *h5, uint8_t ack, uint64_t now_ms)
+{
+	unsigned int n;
+
+	if (!h5->unacked.num)
+		return;
+
+	/* ack is the next seq the peer wants, anything outside the window
+	 * is stale
+	 */
+	n = (ack - h5->unacked.head->seq) & 0x07;
+	if (!n || n > h5->unacked.num)
+		return;
+
+	while (n--)
+		h5_list_push(&h5->free, h5_list_pop(&h5->unacked));
+	h5->retx_deadline = now_ms + h5->retx_ms;
+}
+
+static void h5_link_rx_frame(struct h5_link *h5, uint64_t now_ms)
+{
+	const uint8_t *h = h5->rx_buf;
+	size_t len;
+	uint16_t crc;
+
+	/* back to back delimiters */
+	if (!h5->rx_len)
+		return;
+
+	if (h5->rx_len < 4 || ((h[0] + h[1] + h[2] + h[3]) & 0xff) != 0xff) {
+		h5->stats.hdr_err++;
+		return;
+	}
+
+	len = H5_HDR_LEN(h);
+	if (h5->rx_len != 4 + len + (H5_HDR_CRC(h) ? 2 : 0)) {
+		h5->stats.hdr_err++;
+		return;
+	}
+
+	if (H5_HDR_CRC(h)) {
+		crc = h5_bitrev16(h5_crc_buf(0xffff, h, 4 + len));
+		if (crc != (h[4 + len] << 8 | h[4 + len + 1])) {
+			h5->stats.crc_err++;
+			return;
+		}
+	}
+
+	if (H5_HDR_TYPE(h) == H5_LINK_CTL_PKT) {
+		h5_link_rx_ctl(h5, h + 4, len);
+		return;
+	}
+
+	if (h5->state != H5_LINK_ACTIVE)
+		return;
+
+	h5_link_rx_ack(h5, H5_HDR_ACK(h), now_ms);
+
+	if (H5_HDR_RELIABLE(h)) {
+		/* always ack, a duplicate means our ack got lost */
+		h5->ack_req = 1;
+		if (H5_HDR_SEQ(h) != h5->tx_ack) {
+			h5->stats.ooo++;
+			if (!h5->rx_resync)
+				return;
+			h5->tx_ack = H5_HDR_SEQ(h);
+			h5->rx_resync = 0;
+		}
+		h5->tx_ack = (h5->tx_ack + 1) & 0x07;
+	} else if (H5_HDR_TYPE(h) == H5_LINK_ACK_PKT) {
+		return;
+	}
+
+	h5->stats.rx_pkts++;
+	if (h5->ops && h5->ops->recv)
+		h5->ops->recv(h5->user, H5_HDR_TYPE(h), h + 4, len);
+}
+
+void h5_link_feed(struct h5_link *h5, const uint8_t *buf, size_t len,
+		  uint64_t now_ms)
+{
+	const uint8_t *end = buf + len;
+	const uint8_t *p;
+	size_t n;
+	int c;
+
+	while (buf < end) {
+		if (*buf == H5_SLIP_DELIM) {
+			if (!h5->rx_drop && !h5->rx_esc)
+				h5_link_rx_frame(h5, now_ms);
+			h5->rx_len = 0;
+			h5->rx_esc = 0;
+			h5->rx_drop = 0;
+			buf++;
+			continue;
+		}
+
+		if (h5->rx_drop) {
+			p = memchr(buf, H5_SLIP_DELIM, end - buf);
+			buf = p ? p : end;
+			continue;
+		}
+
+		if (h5->rx_esc || *buf == H5_SLIP_ESC) {
+			if (!h5->rx_esc) {
+				h5->rx_esc = 1;
+				buf++;
+				continue;
+			}
+			h5->rx_esc = 0;
+			c = h5_unslip_esc(*buf++);
+			if (c < 0 || h5->rx_len == sizeof(h5->rx_buf)) {
+				h5->stats.hdr_err++;
+				h5->rx_drop = 1;
+				continue;
+			}
+			h5->rx_buf[h5->rx_len++] = c;
+			continue;
+		}
+
+		n = h5_unslip_span(buf, end - buf);
+		if (n > sizeof(h5->rx_buf) - h5->rx_len) {
+			h5->stats.hdr_err++;
+			h5->rx_drop = 1;
+			continue;
+		}
+		memcpy(h5->rx_buf + h5->rx_len, buf, n);
+		h5->rx_len += n;
+		buf += n;
+	}
+}
+
+/* Frame one packet with the current ack, the caller checks the room */
+static size_t h5_link_frame(struct h5_link *h5, uint8_t *out, uint8_t type,
+			    int rel, uint8_t seq, const uint8_t *data,
+			    size_t len)
+{
+	uint8_t *d = out;
+	uint8_t hdr[4];
+	uint8_t crc[2];
+	uint16_t c;
+
+	hdr[0] = h5->tx_ack << 3;
+	if (rel)
+		hdr[0] |= 0x80 | seq;
+	if (h5->use_crc)
+		hdr[0] |= 0x40;
+	hdr[1] = (len << 4) | type;
+	hdr[2] = len >> 4;
+	hdr[3] = ~(hdr[0] + hdr[1] + hdr[2]);
+
+	*d++ = H5_SLIP_DELIM;
+	d += h5_slip_encode(d, hdr, 4);
+	d += h5_slip_encode(d, data, len);
+	if (h5->use_crc) {
+		c = h5_crc_buf(0xffff, hdr, 4);
+		c = h5_bitrev16(h5_crc_buf(c, data, len));
+		crc[0] = c >> 8;
+		crc[1] = c & 0xff;
+		d += h5_slip_encode(d, crc, 2);
+	}
+	*d++ = H5_SLIP_DELIM;
+
+	h5->ack_req = 0;
+	return d - out;
+}
+
+static size_t h5_link_poll_ctl(struct h5_link *h5, uint8_t *out, size_t size,
+			       uint64_t now_ms)
+{
+	uint8_t msg[3];
+	size_t n = 0;
+
+	if (size < 3 * H5_LINK_FRAME_MAX(3))
+		return 0;
+
+	if (h5->ctl_req & H5_REQ_SYNC_RSP)
+		n += h5_link_frame(h5, out + n, H5_LINK_CTL_PKT, 0, 0,
+				   h5_sync_rsp, 2);
+	if (h5->ctl_req & H5_REQ_CONF_RSP) {
+		memcpy(msg, h5_conf_rsp, 2);
+		msg[2] = h5->cfg;
+		n += h5_link_frame(h5, out + n, H5_LINK_CTL_PKT, 0, 0, msg, 3);
+	}
+	if (h5->ctl_req & H5_REQ_WOKEN)
+		n += h5_link_frame(h5, out + n, H5_LINK_CTL_PKT, 0, 0,
+				   h5_woken, 2);
+	h5->ctl_req = 0;
+
+	if (h5->state == H5_LINK_ACTIVE || now_ms < h5->ctl_deadline)
+		return n;
+
+	if (h5->state == H5_LINK_UNINIT) {
+		n += h5_link_frame(h5, out + n, H5_LINK_CTL_PKT, 0, 0,
+				   h5_sync, 2);
+	} else {
+		memcpy(msg, h5_conf, 2);
+		msg[2] = h5->cfg;
+		n += h5_link_frame(h5, out + n, H5_LINK_CTL_PKT, 0, 0, msg, 3);
+	}
+	h5->ctl_deadline = now_ms + h5->sync_ms;
+
+	return n;
+}
+
+size_t h5_link_poll(struct h5_link *h5, uint8_t *out, size_t size,
+		    uint64_t now_ms)
+{
+	struct h5_pkt *p;
+	size_t n;
+
+	n = h5_link_poll_ctl(h5, out, size, now_ms);
+	if (h5->state != H5_LINK_ACTIVE)
+		return n;
+
+	if (h5->unacked.num && now_ms >= h5->retx_deadline) {
+		for (p = h5->unacked.head; p; p = p->next) {
+			if (size - n < H5_LINK_FRAME_MAX(p->len))
+				break;
+			n += h5_link_frame(h5, out + n, p->type, 1, p->seq,
+					   p->data, p->len);
+			h5->stats.retx++;
+		}
+		h5->retx_deadline = now_ms + h5->retx_ms;
+	}
+
+	while ((p = h5->rel_q.head) && h5->unacked.num < h5->tx_win &&
+	       size - n >= H5_LINK_FRAME_MAX(p->len)) {
+		h5_list_pop(&h5->rel_q);
+		p->seq = h5->tx_seq;
+		h5->tx_seq = (h5->tx_seq + 1) & 0x07;
+		if (!h5->unacked.num)
+			h5->retx_deadline = now_ms + h5->retx_ms;
+		h5_list_push(&h5->unacked, p);
+		n += h5_link_frame(h5, out + n, p->type, 1, p->seq, p->data,
+				   p->len);
+		h5->stats.tx_pkts++;
+	}
+
+	while ((p = h5->unrel_q.head) &&
+	       size - n >= H5_LINK_FRAME_MAX(p->len)) {
+		h5_list_pop(&h5->unrel_q);
+		n += h5_link_frame(h5, out + n, p->type, 0, 0, p->data,
+				   p->len);
+		h5_list_push(&h5->free, p);
+		h5->stats.tx_pkts++;
+	}
+
+	if (h5->ack_req && size - n >= H5_LINK_FRAME_MAX(0))
+		n += h5_link_frame(h5, out + n, H5_LINK_ACK_PKT, 0, 0, NULL, 0);
+
+	return n;
+}
+
+int h5_link_timeout(const struct h5_link *h5, uint64_t now_ms)
+{
+	uint64_t next;
+
+	if (h5->ctl_req)
+		return 0;
+
+	if (h5->state != H5_LINK_ACTIVE) {
+		next = h5->ctl_deadline;
+	} else {
+		if (h5->ack_req || h5->unrel_q.num ||
+		    (h5->rel_q.num && h5->unacked.num < h5->tx_win))
+			return 0;
+		if (!h5->unacked.num)
+			return -1;
+		next = h5->retx_deadline;
+	}
+
+	if (next <= now_ms)
+		return 0;
+	return next - now_ms > INT_MAX ? INT_MAX : (int)(next - now_ms);
+}
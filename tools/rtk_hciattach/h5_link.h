@@ -0,0 +1,196 @@
+/*
+ *
+ *  Realtek H5 (3-wire UART) link engine
+ *
+ *  Reentrant sliding window link layer. All state lives in struct h5_link,
+ *  packets come from a pool inside it, and no I/O is done by the engine:
+ *  received bytes are fed in with h5_link_feed() and bytes to transmit are
+ *  collected with h5_link_poll(). The link establishment is symmetric, so
+ *  the same engine can play the controller side in tests.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef __H5_LINK_H
+#define __H5_LINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Largest HCI packet carried: ACL header plus a 1024 byte payload */
+#define H5_LINK_MTU		(4 + 1024)
+#define H5_LINK_POOL_SIZE	16
+#define H5_LINK_WIN_MAX		7
+
+/* Worst case on the wire: everything escaped, plus the two delimiters */
+#define H5_LINK_FRAME_MAX(len)	(2 + 2 * (4 + (size_t)(len) + 2))
+#define H5_LINK_TX_BUF		H5_LINK_FRAME_MAX(H5_LINK_MTU)
+
+#define H5_LINK_SYNC_MS		250
+#define H5_LINK_RETX_MS		250
+
+/* H5 packet types besides the HCI ones */
+#define H5_LINK_ACK_PKT		0x00
+#define H5_LINK_VDRSPEC_PKT	0x0e
+#define H5_LINK_CTL_PKT		0x0f
+
+enum h5_link_state {
+	H5_LINK_UNINIT,
+	H5_LINK_INIT,
+	H5_LINK_ACTIVE,
+};
+
+struct h5_pkt {
+	struct h5_pkt *next;
+	uint16_t len;
+	uint8_t type;
+	uint8_t seq;
+	uint8_t data[H5_LINK_MTU];
+};
+
+struct h5_pkt_list {
+	struct h5_pkt *head;
+	struct h5_pkt *tail;
+	unsigned int num;
+};
+
+struct h5_link_ops {
+	/* An HCI packet arrived, in order for reliable packets */
+	void (*recv)(void *user, uint8_t type, const uint8_t *data,
+		     size_t len);
+	/* The link became active, or went back to uninitialized because
+	 * the peer restarted it. Optional.
+	 */
+	void (*state)(void *user, enum h5_link_state state);
+};
+
+struct h5_link {
+	const struct h5_link_ops *ops;
+	void *user;
+	enum h5_link_state state;
+
+	/* Config field offered in CONFIG: window size and CRC bit */
+	uint8_t cfg;
+	uint8_t tx_win;
+	uint8_t use_crc;
+
+	unsigned int sync_ms;
+	unsigned int retx_ms;
+
+	/* Take the seq of the next out of order reliable packet as the
+	 * expected one, set by h5_link_rx_reset_seq() for a single packet
+	 */
+	uint8_t rx_resync;
+
+	/* tx */
+	uint8_t tx_seq;		/* seq of the next reliable packet */
+	uint8_t tx_ack;		/* next seq expected from the peer */
+	uint8_t ack_req;
+	uint8_t ctl_req;	/* link control messages to send */
+	uint64_t ctl_deadline;
+	uint64_t retx_deadline;
+	struct h5_pkt_list unacked;
+	struct h5_pkt_list rel_q;
+	struct h5_pkt_list unrel_q;
+
+	/* rx, a frame is collected until the closing delimiter */
+	uint8_t rx_esc;
+	uint8_t rx_drop;
+	size_t rx_len;
+	uint8_t rx_buf[4 + H5_LINK_MTU + 2];
+
+	struct h5_pkt_list free;
+	struct h5_pkt pool[H5_LINK_POOL_SIZE];
+
+	struct {
+		unsigned long tx_pkts;
+		unsigned long rx_pkts;
+		unsigned long retx;
+		unsigned long hdr_err;
+		unsigned long crc_err;
+		unsigned long ooo;
+		unsigned long resets;
+	} stats;
+};
+
+/**
+* Initialize a link, it starts uninitialized and sends SYNC on the first
+* poll.
+*
+* @param h5 link context
+* @param ops receive callbacks
+* @param user passed to the callbacks
+* @param cfg config field: window size in bits 0-2, CRC in bit 4
+*/
+void h5_link_init(struct h5_link *h5, const struct h5_link_ops *ops,
+		  void *user, uint8_t cfg);
+
+/* Drop all queued packets and restart link establishment */
+void h5_link_reset(struct h5_link *h5);
+
+/**
+* Continue a link that was established by other code, e.g. the H5 stack
+* of hciattach_rtk.c, from the given sequence state.
+*
+* @param tx_seq seq of the next reliable packet to send
+* @param tx_ack next seq expected from the peer
+* @param tx_win negotiated sliding window
+* @param use_crc frames carry the CRC
+*/
+void h5_link_resume(struct h5_link *h5, uint8_t tx_seq, uint8_t tx_ack,
+		    uint8_t tx_win, int use_crc);
+
+/**
+* Accept the seq of the next out of order reliable packet from the peer
+* instead of dropping it, once, and continue in order from there. For
+* peers that restart their numbering without link establishment, e.g.
+* Realtek controllers once the last patch command is in. Packets still
+* in the old order are taken as usual in the meantime.
+*/
+void h5_link_rx_reset_seq(struct h5_link *h5);
+
+/**
+* Queue an HCI packet. Commands, ACL and event packets are reliable, SCO
+* and vendor packets are not.
+*
+* @return #0 on success, -EMSGSIZE or -ENOBUFS
+*/
+int h5_link_send(struct h5_link *h5, uint8_t type, const uint8_t *data,
+		 size_t len);
+
+/* Consume received bytes, callbacks are run from here */
+void h5_link_feed(struct h5_link *h5, const uint8_t *buf, size_t len,
+		  uint64_t now_ms);
+
+/**
+* Collect the bytes to transmit: link control, retransmissions, new
+* packets within the window and a pure ack when nothing else carried it.
+*
+* @param out at least H5_LINK_TX_BUF bytes to be sure to make progress
+* @return number of bytes written to out
+*/
+size_t h5_link_poll(struct h5_link *h5, uint8_t *out, size_t size,
+		    uint64_t now_ms);
+
+/**
+* @return ms until h5_link_poll() has work to do, #0 if it has now, -1
+* if only received data can create work
+*/
+int h5_link_timeout(const struct h5_link *h5, uint64_t now_ms);
+
+/* Reliable packets queued or waiting for an ack */
+static inline unsigned int h5_link_pending(const struct h5_link *h5)
+{
+	return h5->unacked.num + h5->rel_q.num;
+}
+
+#endif /* __H5_LINK_H */
@@ -0,0 +1,288 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  Module Name:
+ *     h5_link_bench.c
+ *
+ *  Description:
+ *     Run two h5_link engines back to back, one as host and one as
+ *     controller, and compare the reliable packet throughput with the
+ *     skb based path of hciattach_rtk.c: a malloc per packet on each side,
+ *     frames encoded once with the ack they were created with, and a pure
+ *     ack for every received packet.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "h5_codec.h"
+#include "h5_link.h"
+
+#define BENCH_BYTES	(32 * 1024 * 1024)
+#define BENCH_CFG	(0x10 | H5_LINK_WIN_MAX)
+
+struct peer {
+	struct h5_link h5;
+	uint32_t rx_next;
+	unsigned long rx_bytes;
+	int errors;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(uint8_t *buf, size_t len, uint32_t n)
+{
+	size_t i;
+
+	memcpy(buf, &n, 4);
+	for (i = 4; i < len; i++)
+		buf[i] = n + i;
+}
+
+static int check(const uint8_t *buf, size_t len, uint32_t n)
+{
+	uint32_t got;
+	size_t i;
+
+	memcpy(&got, buf, 4);
+	if (got != n)
+		return -1;
+	for (i = 4; i < len; i++)
+		if (buf[i] != (uint8_t)(n + i))
+			return -1;
+	return 0;
+}
+
+static void peer_recv(void *user, uint8_t type, const uint8_t *data,
+		      size_t len)
+{
+	struct peer *p = user;
+
+	if (type != 0x02 || check(data, len, p->rx_next))
+		p->errors++;
+	p->rx_next++;
+	p->rx_bytes += len;
+}
+
+static const struct h5_link_ops peer_ops = {
+	.recv = peer_recv,
+};
+
+/* Move what one side has to send over to the other, dropping the whole
+ * chunk now and then when loss is set.
+ */
+static size_t pump(struct peer *from, struct peer *to, uint64_t ms,
+		   int loss_pct)
+{
+	static uint8_t wire[8 * H5_LINK_TX_BUF];
+	size_t n;
+
+	n = h5_link_poll(&from->h5, wire, sizeof(wire), ms);
+	if (n && !(loss_pct && rand() % 100 < loss_pct))
+		h5_link_feed(&to->h5, wire, n, ms);
+
+	return n;
+}
+
+static int run_link(const char *name, size_t len, int loss_pct,
+		    double *mbps)
+{
+	static struct peer host, ctrl;
+	uint8_t pkt[H5_LINK_MTU];
+	unsigned long total = BENCH_BYTES / len;
+	unsigned long sent = 0;
+	uint64_t ms = 0;
+	double t;
+	size_t n;
+
+	memset(&host, 0, sizeof(host));
+	memset(&ctrl, 0, sizeof(ctrl));
+	h5_link_init(&host.h5, &peer_ops, &host, BENCH_CFG);
+	h5_link_init(&ctrl.h5, &peer_ops, &ctrl, BENCH_CFG);
+
+	while (host.h5.state != H5_LINK_ACTIVE ||
+	       ctrl.h5.state != H5_LINK_ACTIVE) {
+		pump(&host, &ctrl, ms, 0);
+		pump(&ctrl, &host, ms, 0);
+		ms += H5_LINK_SYNC_MS;
+	}
+
+	t = now();
+	while (ctrl.rx_next < total) {
+		while (sent < total) {
+			fill(pkt, len, sent);
+			if (h5_link_send(&host.h5, 0x02, pkt, len))
+				break;
+			sent++;
+		}
+
+		n = pump(&host, &ctrl, ms, loss_pct);
+		n += pump(&ctrl, &host, ms, loss_pct);
+		/* nothing in flight made it, let the retransmit timer run */
+		if (!n)
+			ms += H5_LINK_RETX_MS;
+	}
+	t = now() - t;
+
+	*mbps = ctrl.rx_bytes / t / 1e6;
+	if (ctrl.errors) {
+		printf("%s: %d bad packets\n", name, ctrl.errors);
+		return 1;
+	}
+	if (loss_pct)
+		printf("%-22s retx %lu crc %lu hdr %lu ooo %lu\n", name,
+		       host.h5.stats.retx, ctrl.h5.stats.crc_err,
+		       ctrl.h5.stats.hdr_err, ctrl.h5.stats.ooo);
+
+	return 0;
+}
+
+/* ---- skb based reference ---- */
+
+struct ref_skb {
+	uint8_t *data;
+	size_t len;
+};
+
+static struct ref_skb *ref_frame(uint8_t seq, uint8_t ack, int rel,
+				 uint8_t type, const uint8_t *data,
+				 size_t len)
+{
+	struct ref_skb *skb;
+	uint8_t hdr[4], crc[2];
+	uint16_t c;
+
+	skb = malloc(sizeof(*skb));
+	skb->data = malloc((len + 6) * 2 + 2);
+	skb->len = 0;
+
+	hdr[0] = ack << 3 | 0x40;
+	if (rel)
+		hdr[0] |= 0x80 | seq;
+	hdr[1] = (len << 4) | type;
+	hdr[2] = len >> 4;
+	hdr[3] = ~(hdr[0] + hdr[1] + hdr[2]);
+
+	skb->data[skb->len++] = H5_SLIP_DELIM;
+	skb->len += h5_slip_encode(skb->data + skb->len, hdr, 4);
+	skb->len += h5_slip_encode(skb->data + skb->len, data, len);
+	c = h5_crc_buf(h5_crc_buf(0xffff, hdr, 4), data, len);
+	crc[0] = c >> 8;
+	crc[1] = c;
+	skb->len += h5_slip_encode(skb->data + skb->len, crc, 2);
+	skb->data[skb->len++] = H5_SLIP_DELIM;
+
+	return skb;
+}
+
+static void ref_free(struct ref_skb *skb)
+{
+	free(skb->data);
+	free(skb);
+}
+
+/* Decode one frame into a freshly allocated rx skb */
+static struct ref_skb *ref_unframe(const uint8_t *src, size_t len)
+{
+	struct ref_skb *skb;
+	size_t i = 1, run;
+
+	skb = malloc(sizeof(*skb));
+	skb->data = malloc(4 + H5_LINK_MTU + 2);
+	skb->len = 0;
+
+	while (i < len - 1) {
+		run = h5_unslip_span(src + i, len - 1 - i);
+		memcpy(skb->data + skb->len, src + i, run);
+		skb->len += run;
+		i += run;
+		if (i < len - 1) {
+			skb->data[skb->len++] = h5_unslip_esc(src[i + 1]);
+			i += 2;
+		}
+	}
+
+	return skb;
+}
+
+static int run_ref(const char *name, size_t len, double *mbps)
+{
+	unsigned long total = BENCH_BYTES / len;
+	struct ref_skb *tx, *rx, *ack;
+	uint8_t pkt[H5_LINK_MTU];
+	unsigned long n;
+	uint16_t crc;
+	int errors = 0;
+	double t;
+
+	t = now();
+	for (n = 0; n < total; n++) {
+		fill(pkt, len, n);
+		tx = ref_frame(n & 7, 0, 1, 0x02, pkt, len);
+
+		rx = ref_unframe(tx->data, tx->len);
+		crc = h5_crc_buf(0xffff, rx->data, rx->len - 2);
+		if (crc != (rx->data[rx->len - 2] << 8 | rx->data[rx->len - 1]) ||
+		    check(rx->data + 4, len, n))
+			errors++;
+		ack = ref_frame(0, (n + 1) & 7, 0, 0x00, NULL, 0);
+
+		ref_free(ack);
+		ref_free(rx);
+		ref_free(tx);
+	}
+	t = now() - t;
+
+	*mbps = (double)total * len / t / 1e6;
+	if (errors) {
+		printf("%s: %d bad packets\n", name, errors);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int run(const char *name, size_t len)
+{
+	double ref, link, lossy;
+	int ret = 0;
+
+	ret |= run_ref(name, len, &ref);
+	ret |= run_link(name, len, 0, &link);
+	ret |= run_link(name, len, 2, &lossy);
+
+	printf("%-22s skb %8.1f  link %8.1f  link 2%% loss %8.1f MB/s\n",
+	       name, ref, link, lossy);
+
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	srand(1);
+	ret |= run("cmd 16B", 16);
+	ret |= run("sco-sized 60B", 60);
+	ret |= run("patch 252B", 252);
+	ret |= run("acl 1021B", 1021);
+
+	return ret;
+}
@@ -0,0 +1,624 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  Module Name:
+ *     h5_replay.c
+ *
+ *  Description:
+ *     Replay UART byte streams through the H5/H4 receive state machines:
+ *     h5_recv() of rtk_hciattach and the unmodified hci_rtk_h5 and hci_h4
+ *     kernel drivers built against kshim. Reports MB/s, cycles per byte
+ *     and allocations per packet. Streams are either captured ones given
+ *     on the command line or one of the built-in scenarios: a patch
+ *     download, a long mSBC call and a noisy link with bad CRCs, out of
+ *     order and truncated frames.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "h5_codec.h"
+#include "rtk_replay.h"
+#include "kshim/kshim.h"
+
+#define REPLAY_BYTES		(16 * 1024 * 1024)
+#define REPLAY_CHUNK		64
+#define REPLAY_MAX_FRAME	(2 + 2 * (4 + 1028 + 2))
+
+/* Drivers as registered with kshim by their init functions */
+int h5_init(void);
+int h4_init(void);
+
+enum stream_fmt {
+	FMT_H5,
+	FMT_H4,
+};
+
+struct stream {
+	const char *name;
+	enum stream_fmt fmt;
+	uint8_t *buf;
+	size_t len, size;
+	/* HCI packets a correct parser passes up */
+	unsigned long pkts;
+	uint8_t seq;		/* next reliable seq */
+};
+
+struct result {
+	double secs;
+	double cycles;		/* < 0 when no counter is available */
+	unsigned long bytes;
+	unsigned long pkts;
+	unsigned long allocs;
+	unsigned long errors;
+};
+
+static size_t chunk = REPLAY_CHUNK;
+static int verbose;
+static int ack_fd = -1;
+
+/* ---- stream generation ---- */
+
+static uint16_t rev16(uint16_t x)
+{
+	uint16_t r = 0;
+	int i;
+
+	for (i = 0; i < 16; i++, x >>= 1)
+		r = (r << 1) | (x & 1);
+	return r;
+}
+
+static void stream_put(struct stream *s, const void *p, size_t len)
+{
+	if (s->len + len > s->size) {
+		s->size = (s->size + len) * 2;
+		s->buf = realloc(s->buf, s->size);
+		if (!s->buf) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(s->buf + s->len, p, len);
+	s->len += len;
+}
+
+/**
+* Append an H5 frame, CRC included as rtk_hciattach configures the link.
+*
+* @param corrupt flip a payload bit after the CRC was computed
+*/
+static void h5_put(struct stream *s, uint8_t type, int rel, uint8_t seq,
+		   const uint8_t *data, size_t len, int corrupt)
+{
+	uint8_t frame[REPLAY_MAX_FRAME], hdr[4], crc[2];
+	uint8_t payload[1028];
+	uint16_t c = 0xffff;
+	size_t n = 0;
+
+	hdr[0] = 0x40 | (rel ? 0x80 | (seq & 0x07) : 0);
+	hdr[1] = ((len << 4) & 0xf0) | type;
+	hdr[2] = len >> 4;
+	hdr[3] = ~(hdr[0] + hdr[1] + hdr[2]);
+
+	c = h5_crc_buf(c, hdr, 4);
+	c = h5_crc_buf(c, data, len);
+	c = rev16(c);
+	crc[0] = c >> 8;
+	crc[1] = c;
+
+	memcpy(payload, data, len);
+	if (corrupt && len)
+		payload[len / 2] ^= 0x04;
+
+	frame[n++] = 0xc0;
+	n += h5_slip_encode(frame + n, hdr, 4);
+	n += h5_slip_encode(frame + n, payload, len);
+	n += h5_slip_encode(frame + n, crc, 2);
+	frame[n++] = 0xc0;
+
+	stream_put(s, frame, n);
+}
+
+static void h4_put(struct stream *s, uint8_t type, const uint8_t *data,
+		   size_t len)
+{
+	stream_put(s, &type, 1);
+	stream_put(s, data, len);
+}
+
+/* One HCI packet, arrives intact */
+static void pkt_put(struct stream *s, uint8_t type, const uint8_t *data,
+		    size_t len)
+{
+	int rel = type != HCI_SCODATA_PKT;
+
+	if (s->fmt == FMT_H5) {
+		h5_put(s, type, rel, s->seq, data, len, 0);
+		if (rel)
+			s->seq = (s->seq + 1) & 0x07;
+	} else {
+		h4_put(s, type, data, len);
+	}
+	s->pkts++;
+}
+
+/* Pad with ACL until a replayed loop lands on the same seq again */
+static void stream_close(struct stream *s)
+{
+	static const uint8_t acl[] = { 0x01, 0x20, 0x04, 0x00, 0, 0, 0, 0 };
+
+	while (s->fmt == FMT_H5 && s->seq)
+		pkt_put(s, HCI_ACLDATA_PKT, acl, sizeof(acl));
+}
+
+static void rand_fill(uint8_t *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		p[i] = rand();
+}
+
+/* Command complete for each 252 byte download command of a 40 KB patch */
+static void gen_patch(struct stream *s)
+{
+	uint8_t evt[] = { 0x0e, 0x05, 0x01, 0x20, 0xfc, 0x00, 0x00 };
+	int i;
+
+	for (i = 0; i < 40 * 1024 / 252; i++) {
+		evt[6] = i & 0x7f;
+		pkt_put(s, HCI_EVENT_PKT, evt, sizeof(evt));
+	}
+}
+
+/* mSBC frames every 7.5 ms for a minute, some ACL on the side for AT
+ * commands and the completed packets events */
+static void gen_msbc(struct stream *s)
+{
+	static const uint8_t h2[4] = { 0x08, 0x38, 0xc8, 0xf8 };
+	uint8_t sco[3 + 60], acl[4 + 24];
+	uint8_t ncp[] = { 0x13, 0x05, 0x01, 0x06, 0x00, 0x01, 0x00 };
+	int i;
+
+	sco[0] = 0x06;
+	sco[1] = 0x00;
+	sco[2] = 60;
+	acl[0] = 0x01;
+	acl[1] = 0x20;
+	acl[2] = sizeof(acl) - 4;
+	acl[3] = 0x00;
+
+	for (i = 0; i < 8000; i++) {
+		/* H2 header, then the mSBC frame with its sync word */
+		sco[3] = 0x01;
+		sco[4] = h2[i & 3];
+		sco[5] = 0xad;
+		sco[6] = 0x00;
+		sco[7] = 0x00;
+		rand_fill(sco + 8, sizeof(sco) - 8);
+		pkt_put(s, HCI_SCODATA_PKT, sco, sizeof(sco));
+
+		if (i % 50 == 0) {
+			rand_fill(acl + 4, sizeof(acl) - 4);
+			pkt_put(s, HCI_ACLDATA_PKT, acl, sizeof(acl));
+		}
+		if (i % 100 == 0)
+			pkt_put(s, HCI_EVENT_PKT, ncp, sizeof(ncp));
+	}
+}
+
+/**
+* Noisy link: like the call, but with frames the receiver has to drop
+* before the good copy arrives, the way the controller retransmits them:
+* bad CRC, a seq from the future, frames cut short and line noise.
+*/
+static void gen_noisy(struct stream *s)
+{
+	uint8_t sco[3 + 60], acl[4 + 64], junk[8];
+	int i, r;
+
+	sco[0] = 0x06;
+	sco[1] = 0x00;
+	sco[2] = 60;
+	acl[0] = 0x01;
+	acl[1] = 0x20;
+	acl[2] = sizeof(acl) - 4;
+	acl[3] = 0x00;
+
+	for (i = 0; i < 8000; i++) {
+		int acl_turn = i % 4 == 0;
+		uint8_t *p = acl_turn ? acl : sco;
+		size_t len = acl_turn ? sizeof(acl) : sizeof(sco);
+		uint8_t type = acl_turn ? HCI_ACLDATA_PKT : HCI_SCODATA_PKT;
+
+		rand_fill(p + (acl_turn ? 4 : 3), len - (acl_turn ? 4 : 3));
+
+		r = rand() % 100;
+		if (s->fmt == FMT_H5) {
+			if (r < 2) {
+				h5_put(s, type, acl_turn, s->seq, p, len, 1);
+			} else if (r < 3 && acl_turn) {
+				h5_put(s, type, 1, s->seq + 1, p, len, 0);
+			} else if (r < 4) {
+				uint8_t cut[REPLAY_MAX_FRAME];
+				struct stream t = { .fmt = FMT_H5 };
+
+				h5_put(&t, type, acl_turn, s->seq, p, len, 0);
+				memcpy(cut, t.buf, t.len / 2);
+				stream_put(s, cut, t.len / 2);
+				free(t.buf);
+			}
+		}
+
+		/* Bytes between frames that are not a packet type. H4 can
+		 * not resync after anything worse, H5 drops them until the
+		 * next delimiter. */
+		if (r >= 90) {
+			size_t n = 1 + rand() % sizeof(junk);
+
+			memset(junk, s->fmt == FMT_H5 ? 0x55 : 0xff, n);
+			stream_put(s, junk, n);
+		}
+
+		pkt_put(s, type, p, len);
+	}
+}
+
+static int load_file(struct stream *s, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	s->size = s->len = st.st_size;
+	s->buf = malloc(st.st_size ? st.st_size : 1);
+	if (!s->buf || read(fd, s->buf, st.st_size) != st.st_size) {
+		fprintf(stderr, "%s: short read\n", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	/* Unknown for a capture, only reported */
+	s->pkts = 0;
+	return 0;
+}
+
+/* ---- cycle counter ---- */
+
+static int cycles_fd = -1;
+
+static void cycles_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	cycles_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Core cycles if perf allows, else the TSC on x86, else -1 */
+static double cycles_now(void)
+{
+	uint64_t v;
+
+	if (cycles_fd >= 0 && read(cycles_fd, &v, sizeof(v)) == sizeof(v))
+		return v;
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return -1;
+#endif
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ---- parsers ---- */
+
+struct parser {
+	const char *name;
+	enum stream_fmt fmt;
+	void (*open)(void);
+	void (*feed)(const uint8_t *buf, size_t len);
+	void (*close)(void);
+	unsigned long (*pkts)(void);
+	unsigned long (*allocs)(void);
+	unsigned long (*errors)(void);
+};
+
+static void rtk_open(void)
+{
+	rtk_replay_reset(ack_fd);
+}
+
+static void rtk_close(void)
+{
+}
+
+static unsigned long rtk_allocs(void)
+{
+	return rtk_replay_allocs;
+}
+
+static unsigned long rtk_errors(void)
+{
+	return 0;
+}
+
+static struct tty_struct k_tty = { .name = "ttyREPLAY" };
+static struct hci_dev k_hdev = { .name = "hci0" };
+static struct hci_uart k_hu = { .tty = &k_tty, .hdev = &k_hdev };
+
+static void k_open(unsigned int id)
+{
+	k_hu.proto = kshim_get_proto(id);
+	if (!k_hu.proto || k_hu.proto->open(&k_hu)) {
+		fprintf(stderr, "Can't open kernel proto %u\n", id);
+		exit(1);
+	}
+	memset(&kshim_stats, 0, sizeof(kshim_stats));
+}
+
+static void k_h5_open(void)
+{
+	k_open(HCI_UART_3WIRE);
+}
+
+static void k_h4_open(void)
+{
+	k_open(HCI_UART_H4);
+}
+
+static void k_feed(const uint8_t *buf, size_t len)
+{
+	k_hu.proto->recv(&k_hu, (void *)buf, len);
+	k_hu.hdev->stat.byte_rx += len;
+}
+
+static void k_close(void)
+{
+	k_hu.proto->close(&k_hu);
+}
+
+static unsigned long k_pkts(void)
+{
+	return kshim_stats.rx_pkts[HCI_COMMAND_PKT] +
+	       kshim_stats.rx_pkts[HCI_ACLDATA_PKT] +
+	       kshim_stats.rx_pkts[HCI_SCODATA_PKT] +
+	       kshim_stats.rx_pkts[HCI_EVENT_PKT];
+}
+
+static unsigned long k_allocs(void)
+{
+	return kshim_allocs;
+}
+
+static unsigned long k_errors(void)
+{
+	return kshim_errors;
+}
+
+static const struct parser parsers[] = {
+	{ "rtk_hciattach h5", FMT_H5, rtk_open, rtk_replay_feed, rtk_close,
+	  rtk_replay_pkts, rtk_allocs, rtk_errors },
+	{ "kernel hci_rtk_h5", FMT_H5, k_h5_open, k_feed, k_close,
+	  k_pkts, k_allocs, k_errors },
+	{ "kernel hci_h4", FMT_H4, k_h4_open, k_feed, k_close,
+	  k_pkts, k_allocs, k_errors },
+};
+
+/* Feed the stream in tty sized chunks, looped up to REPLAY_BYTES */
+static void replay(const struct parser *p, const struct stream *s,
+		   struct result *r)
+{
+	unsigned long loops, i, allocs, errors;
+	size_t off, n, step = chunk ? chunk : s->len;
+	double t, c;
+
+	loops = s->len ? (REPLAY_BYTES + s->len - 1) / s->len : 0;
+
+	p->open();
+	allocs = p->allocs();
+	errors = p->errors();
+
+	c = cycles_now();
+	t = now();
+	for (i = 0; i < loops; i++) {
+		for (off = 0; off < s->len; off += n) {
+			n = s->len - off < step ? s->len - off : step;
+			p->feed(s->buf + off, n);
+		}
+	}
+	r->secs = now() - t;
+	r->cycles = c < 0 ? -1 : cycles_now() - c;
+
+	r->bytes = loops * s->len;
+	r->pkts = p->pkts();
+	r->allocs = p->allocs() - allocs;
+	r->errors = p->errors() - errors;
+	p->close();
+
+	/* Packets a correct parser delivers for the whole replay */
+	if (s->pkts)
+		r->pkts = r->pkts == loops * s->pkts ? r->pkts : ~0UL;
+}
+
+static int run(const struct stream *s)
+{
+	struct result r;
+	unsigned int i;
+	int ret = 0;
+
+	printf("%s: %zu bytes, %lu packets\n", s->name, s->len, s->pkts);
+
+	for (i = 0; i < sizeof(parsers) / sizeof(parsers[0]); i++) {
+		const struct parser *p = &parsers[i];
+		char cpb[16];
+
+		if (p->fmt != s->fmt)
+			continue;
+
+		replay(p, s, &r);
+		if (r.pkts == ~0UL) {
+			printf("  %-18s packet count mismatch\n", p->name);
+			ret = 1;
+			continue;
+		}
+
+		if (r.cycles < 0)
+			snprintf(cpb, sizeof(cpb), "-");
+		else
+			snprintf(cpb, sizeof(cpb), "%.2f", r.cycles / r.bytes);
+
+		printf("  %-18s %8.1f MB/s %8s cycles/B %6.3f allocs/pkt"
+		       " %8lu pkts %6lu errors\n",
+		       p->name, r.bytes / r.secs / 1e6, cpb,
+		       r.pkts ? (double)r.allocs / r.pkts : 0.0,
+		       r.pkts, r.errors);
+	}
+
+	return ret;
+}
+
+static void usage(void)
+{
+	printf("Usage: h5_replay [-c chunk] [-d] [-v] [-5 file.h5]... [-4 file.h4]...\n"
+	       "  -c  bytes handed to the parser at once, 0 for all (%d)\n"
+	       "  -d  keep the DBG_ON logging of rtk_hciattach\n"
+	       "  -v  show driver and parser messages\n"
+	       "  -5  replay a captured H5 byte stream\n"
+	       "  -4  replay a captured H4 byte stream\n"
+	       "Without files the built-in scenarios are replayed.\n",
+	       REPLAY_CHUNK);
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*const gens[])(struct stream *) = {
+		gen_patch, gen_msbc, gen_noisy,
+	};
+	static const char *const names[] = { "patch", "msbc", "noisy" };
+	struct stream s;
+	char name[32];
+	int opt, debug = 0, files = 0, ret = 0;
+	unsigned int i, f;
+
+	while ((opt = getopt(argc, argv, "c:dv4:5:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case '4':
+		case '5':
+			files++;
+			break;
+		default:
+			usage();
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	ack_fd = open("/dev/null", O_WRONLY);
+	kshim_verbose = verbose;
+	/* Parse errors of rtk_hciattach go to stderr */
+	if (!verbose && !debug)
+		freopen("/dev/null", "w", stderr);
+
+	if (rtk_replay_init(ack_fd, debug) || h5_init() || h4_init()) {
+		printf("Can't set up the parsers\n");
+		return 1;
+	}
+	cycles_open();
+
+	printf("chunk %zu bytes, %d MB replayed per run, cycles from %s\n",
+	       chunk, REPLAY_BYTES >> 20,
+	       cycles_fd >= 0 ? "perf" :
+#if defined(__x86_64__) || defined(__i386__)
+	       "the TSC"
+#else
+	       "nowhere"
+#endif
+	       );
+
+	if (files) {
+		optind = 1;
+		while ((opt = getopt(argc, argv, "c:dv4:5:h")) != -1) {
+			if (opt != '4' && opt != '5')
+				continue;
+			memset(&s, 0, sizeof(s));
+			s.name = optarg;
+			s.fmt = opt == '5' ? FMT_H5 : FMT_H4;
+			if (load_file(&s, optarg)) {
+				ret = 1;
+				continue;
+			}
+			ret |= run(&s);
+			free(s.buf);
+		}
+		return ret;
+	}
+
+	for (i = 0; i < sizeof(gens) / sizeof(gens[0]); i++) {
+		for (f = FMT_H5; f <= FMT_H4; f++) {
+			srand(1);
+			memset(&s, 0, sizeof(s));
+			snprintf(name, sizeof(name), "%s.%s", names[i],
+				 f == FMT_H5 ? "h5" : "h4");
+			s.name = name;
+			s.fmt = f;
+			gens[i](&s);
+			stream_close(&s);
+			ret |= run(&s);
+			free(s.buf);
+		}
+	}
+
+	return ret;
+}
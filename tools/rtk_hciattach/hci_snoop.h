@@ -0,0 +1,185 @@
+/*
+ *
+ *  HCI snoop capture ring
+ *
+ *  Fixed size ring of timestamped HCI packets, preallocated once. Adding a
+ *  packet is a copy of at most HCI_SNOOP_SNAPLEN bytes, without allocation
+ *  or formatting, so it can stay enabled in production. The ring is written
+ *  out in btsnoop format (H4 datalink) with open/write only, which also
+ *  makes hci_snoop_dump() usable from a signal handler. The same header is
+ *  used by rtk_hciattach and hfp_monitor, which includes it from here.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef __HCI_SNOOP_H
+#define __HCI_SNOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+/* Enough for headers, SCO/mSBC sync words and most commands and events */
+#define HCI_SNOOP_SNAPLEN	68
+
+#define HCI_SNOOP_TX		0	/* host to controller */
+#define HCI_SNOOP_RX		1	/* controller to host */
+
+/* btsnoop: datalink 1002 is H4, timestamps count us from 0000-01-01 */
+#define HCI_SNOOP_DATALINK_H4	1002
+#define HCI_SNOOP_EPOCH_DELTA	0x00dcddb30f2f8000ULL
+
+struct hci_snoop_rec {
+	uint64_t ts_us;		/* since the unix epoch */
+	uint16_t len;		/* original packet length, without type */
+	uint8_t dir;
+	uint8_t type;		/* H4 packet type */
+	uint8_t data[HCI_SNOOP_SNAPLEN];
+};
+
+struct hci_snoop {
+	struct hci_snoop_rec *ring;
+	unsigned int size;	/* power of two */
+	unsigned long head;	/* packets added so far */
+};
+
+/**
+* Allocate the ring, rounded up to a power of two records.
+*
+* @return #0 on success, -1 if out of memory
+*/
+static inline int hci_snoop_init(struct hci_snoop *s, unsigned int records)
+{
+	unsigned int size = 1;
+
+	while (size < records)
+		size <<= 1;
+
+	s->ring = calloc(size, sizeof(*s->ring));
+	if (!s->ring)
+		return -1;
+	s->size = size;
+	s->head = 0;
+	return 0;
+}
+
+static inline void hci_snoop_free(struct hci_snoop *s)
+{
+	free(s->ring);
+	s->ring = NULL;
+	s->size = 0;
+}
+
+/* Add a packet with the given timestamp, tv NULL takes the current time */
+static inline void hci_snoop_add_tv(struct hci_snoop *s, uint8_t dir,
+				    uint8_t type, const void *data, size_t len,
+				    const struct timeval *tv)
+{
+	struct hci_snoop_rec *rec;
+	struct timeval now;
+
+	if (!s->ring)
+		return;
+
+	if (!tv) {
+		gettimeofday(&now, NULL);
+		tv = &now;
+	}
+
+	rec = &s->ring[s->head & (s->size - 1)];
+	rec->ts_us = (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+	rec->len = len;
+	rec->dir = dir;
+	rec->type = type;
+	memcpy(rec->data, data,
+	       len < HCI_SNOOP_SNAPLEN ? len : HCI_SNOOP_SNAPLEN);
+	s->head++;
+}
+
+static inline void hci_snoop_add(struct hci_snoop *s, uint8_t dir,
+				 uint8_t type, const void *data, size_t len)
+{
+	hci_snoop_add_tv(s, dir, type, data, len, NULL);
+}
+
+static inline void hci_snoop_put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/**
+* Write the ring to path in btsnoop format, oldest packet first.
+*
+* @return number of packets written, -1 on error
+*/
+static inline int hci_snoop_dump(const struct hci_snoop *s, const char *path)
+{
+	static const uint8_t hdr[16] = {
+		'b', 't', 's', 'n', 'o', 'o', 'p', 0,
+		0, 0, 0, 1,
+		0, 0, HCI_SNOOP_DATALINK_H4 >> 8, HCI_SNOOP_DATALINK_H4 & 0xff,
+	};
+	uint8_t buf[24 + 1 + HCI_SNOOP_SNAPLEN];
+	const struct hci_snoop_rec *rec;
+	unsigned long i, head = s->head;
+	unsigned int incl;
+	uint64_t ts;
+	int fd, n = 0;
+
+	if (!s->ring)
+		return -1;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr))
+		goto fail;
+
+	for (i = head > s->size ? head - s->size : 0; i < head; i++) {
+		rec = &s->ring[i & (s->size - 1)];
+		incl = rec->len < HCI_SNOOP_SNAPLEN ? rec->len :
+		       HCI_SNOOP_SNAPLEN;
+		ts = rec->ts_us + HCI_SNOOP_EPOCH_DELTA;
+
+		hci_snoop_put_be32(buf, rec->len + 1);
+		hci_snoop_put_be32(buf + 4, incl + 1);
+		/* bit 0 received, bit 1 command or event */
+		hci_snoop_put_be32(buf + 8, rec->dir |
+				   (rec->type == 0x01 || rec->type == 0x04) << 1);
+		hci_snoop_put_be32(buf + 12, 0);
+		hci_snoop_put_be32(buf + 16, ts >> 32);
+		hci_snoop_put_be32(buf + 20, ts);
+		buf[24] = rec->type;
+		memcpy(buf + 25, rec->data, incl);
+
+		if (write(fd, buf, 25 + incl) != (ssize_t)(25 + incl))
+			goto fail;
+		n++;
+	}
+
+	close(fd);
+	return n;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+#endif /* __HCI_SNOOP_H */
@@ -1235,7 +1235,7 @@ static void usage(void)
 {
 	printf("hciattach - HCI UART driver initialization utility\n");
 	printf("Usage:\n");
-	printf("\thciattach [-n] [-p] [-b] [-r] [-t timeout] [-s initial_speed] <tty> <type | id> [speed] [flow|noflow] [bdaddr]\n");
+	printf("\thciattach [-n] [-p] [-b] [-r] [-f] [-P patch] [-m] [-t timeout] [-s initial_speed] <tty> <type | id> [speed] [flow|noflow] [bdaddr]\n");
 	printf("\thciattach -l\n");
 }
 
@@ -1256,7 +1256,7 @@ int main(int argc, char *argv[])
 	printpid = 0;
 	raw = 0;
 
-	while ((opt=getopt(argc, argv, "bnpt:s:lr")) != EOF) {
+	while ((opt=getopt(argc, argv, "bnpt:s:lrfP:m")) != EOF) {
 		switch(opt) {
 		case 'b':
 			send_break = 1;
@@ -1289,6 +1289,21 @@ int main(int argc, char *argv[])
 			raw = 1;
 			break;
 
+		case 'f':
+			/* skip the download if the patch is still running */
+			rtk_set_fast_reattach(1);
+			break;
+
+		case 'P':
+			/* blob from rtk_fwprep instead of the fw/config files */
+			rtk_set_prepared_fw(optarg);
+			break;
+
+		case 'm':
+			/* map the firmware and free the setup once attached */
+			rtk_set_low_memory(1);
+			break;
+
 		default:
 			usage();
 			exit(1);
@@ -54,4 +54,7 @@ int bgb2xx_init(int dd, bdaddr_t *bdaddr);
 //add realtek init and post process for realtek Bluetooth chip
 int rtk_init(int fd, int proto, int speed, struct termios *ti);
 int rtk_post(int fd, int proto, struct termios *ti);
+void rtk_set_fast_reattach(int enable);
+void rtk_set_prepared_fw(const char *path);
+void rtk_set_low_memory(int enable);
 //Realtek_add_end
@@ -46,7 +46,10 @@
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <string.h>
@@ -54,8 +57,17 @@
 #include <byteswap.h>
 #include <netinet/in.h>
 #include <ctype.h>
+#include <limits.h>
+#include <strings.h>
+#include <sys/resource.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "hciattach.h"
+#include "h5_codec.h"
+#include "hci_snoop.h"
+#include "h5_link.h"
 
 #define RTK_VERSION "3.1"
 
@@ -63,6 +75,9 @@
 
 #define USE_CUSTOMER_ADDRESS
 
+/* Keep up to the negotiated H5 window of patch commands in flight */
+#define H5_PIPELINE_DOWNLOAD
+
 #define BAUDRATE_4BYTES
 #define FIRMWARE_DIRECTORY  "/lib/firmware/rtlbt/"
 #define BT_CONFIG_DIRECTORY "/lib/firmware/rtlbt/"
@@ -76,6 +91,58 @@ static uint8_t customer_bdaddr = 0;
 #define CONFIG_XTAL	(1 << 1)
 #define CONFIG_BTMAC	(1 << 2)
 
+/* Keep the merged fw & config blob for the next attach */
+#define RTK_PATCH_CACHE
+#ifdef RTK_PATCH_CACHE
+#define RTK_PATCH_CACHE_DIR	"/var/cache/rtlbt/"
+#define RTK_PATCH_CACHE_MAGIC	0x52504331	/* "RPC1" */
+#endif
+
+/* Download a blob from rtk_fwprep instead of the fw and config files */
+#define RTK_PREPARED_FW
+#ifdef RTK_PREPARED_FW
+#include "rtk_fw_blob.h"
+#endif
+
+/* Map the firmware, pool the H5 frames and let go of it all after attach */
+#define RTK_LOW_MEMORY
+#ifdef RTK_LOW_MEMORY
+#define RTK_SKB_POOL_TX		12	/* patch window, last command and acks */
+#define RTK_SKB_POOL_RX		2
+#define RTK_SKB_TX_LEN		544	/* largest command, slipped */
+#define RTK_SKB_RX_LEN		0x1005
+#define RTK_PATCH_SEGS		3	/* patch, fw version and config */
+#endif
+
+/* Pick the fastest verified uart rate instead of the config one */
+#define RTK_AUTO_BAUD
+#ifdef RTK_AUTO_BAUD
+#define RTK_AUTO_BAUD_DIR	"/var/cache/rtlbt/"
+#define RTK_AUTO_BAUD_FILE	RTK_AUTO_BAUD_DIR "baudrate"
+#define RTK_AUTO_BAUD_ROUNDS	4
+#define RTK_ECHO_LEN		248	/* HCI local name length */
+#endif
+
+/* Skip the download when the controller still runs the last patch */
+#define RTK_FAST_REATTACH
+#ifdef RTK_FAST_REATTACH
+#define RTK_REATTACH_DIR	"/var/cache/rtlbt/"
+#define RTK_REATTACH_FILE	RTK_REATTACH_DIR "attach"
+#define RTK_REATTACH_TIMEOUT_MS	100
+#endif
+
+/* Keep the HCI packets of the attach for a btsnoop post-mortem */
+#define RTK_SNOOP
+#ifdef RTK_SNOOP
+#define RTK_SNOOP_RECORDS	1024
+#define RTK_SNOOP_FILE		"/var/log/rtk_hciattach.btsnoop"
+static struct hci_snoop rtk_snoop;
+#define RTK_SNOOP_ADD(dir, type, data, len) \
+	hci_snoop_add(&rtk_snoop, dir, type, data, len)
+#else
+#define RTK_SNOOP_ADD(dir, type, data, len) do { } while (0)
+#endif
+
 #define EXTRA_CONFIG_OPTION
 #ifdef EXTRA_CONFIG_OPTION
 #define EXTRA_CONFIG_FILE	"/opt/rtk_btconfig.txt"
@@ -131,6 +198,14 @@ RT_U8 DBG_ON = 1;
 #define READ_DATA_SIZE              16
 #define H5_MAX_RETRY_COUNT          40
 
+/* Sliding window size we advertise in the 3-wire config message, the
+ * controller's answer is also used by the kernel driver after attach */
+#define H5_CFG_WINSIZE              7
+#define H5_CFG_FIELD                (0x10 | H5_CFG_WINSIZE)	/* CRC | win */
+#define H5_DL_WINSIZE               4	/* patch packets in flight */
+#define H5_DL_RTO_MS                1000
+#define H5_TXWIN_PARAM              "/sys/module/hci_uart/parameters/txwinsize"
+
 #define RTK_VENDOR_CONFIG_MAGIC     0x8723ab55
 const RT_U8 RTK_EPATCH_SIGNATURE[8] =
     { 0x52, 0x65, 0x61, 0x6C, 0x74, 0x65, 0x63, 0x68 };
@@ -141,6 +216,8 @@ const RT_U8 Extension_Section_SIGNATURE[4] = { 0x51, 0x04, 0xFD, 0x77 };
 #define HCI_VENDOR_READ_RTK_ROM_VERISION    0xfc6d
 #define HCI_CMD_READ_LOCAL_VERISION         0x1001
 #define HCI_VENDOR_READ_CHIP_TYPE           0xfc61
+#define HCI_CMD_WRITE_LOCAL_NAME            0x0c13
+#define HCI_CMD_READ_LOCAL_NAME             0x0c14
 
 #define ROM_LMP_NONE            0x0000
 #define ROM_LMP_8723a           0x1200
@@ -184,7 +261,9 @@ const RT_U8 Extension_Section_SIGNATURE[4] = { 0x51, 0x04, 0xFD, 0x77 };
 #define HCI_SCODATA_PKT         0x03
 #define HCI_EVENT_PKT           0x04
 #define H5_VDRSPEC_PKT          0x0E
+#ifndef H5_LINK_CTL_PKT		/* also defined by h5_link.h */
 #define H5_LINK_CTL_PKT         0x0F
+#endif
 
 #define H5_HDR_SEQ(hdr)         ((hdr)[0] & 0x07)
 #define H5_HDR_ACK(hdr)         (((hdr)[0] >> 3) & 0x07)
@@ -243,6 +322,14 @@ struct rtk_bt_vendor_config {
 	struct rtk_bt_vendor_config_entry entry[0];
 } __attribute__ ((packed));
 
+#ifdef RTK_LOW_MEMORY
+/* Piece of the fw & config image, which is not copied in one buffer */
+struct rtk_patch_seg {
+	const uint8_t *data;
+	int len;
+};
+#endif
+
 struct rtk_epatch_entry {
 	RT_U16 chipID;
 	RT_U16 patch_length;
@@ -423,6 +510,7 @@ typedef struct btrtl_info {
 	RT_U8 use_crc;
 	RT_U8 is_txack_req;	/* txack required */
 	RT_U8 msgq_txseq;	/* next pkt seq */
+	RT_U8 tx_win;	/* sliding window negotiated in config */
 	RT_U16 message_crc;
 	RT_U32 rx_count;	/* expected pkts to recv */
 
@@ -458,9 +546,26 @@ typedef struct btrtl_info {
 	uint8_t *fw_buf;	/* fw patch file buf */
 	uint8_t *config_buf;	/* config patch file buf */
 	uint8_t *total_buf;	/* fw & config extracted buf */
+	uint8_t *total_map;	/* mapping total_buf points into, if any */
+	size_t total_map_len;
+	int total_cmds;	/* total_buf holds ready H4 commands */
+#ifdef RTK_LOW_MEMORY
+	/* total_buf is NULL, the image is pieced together from these */
+	struct rtk_patch_seg total_seg[RTK_PATCH_SEGS];
+	int total_nseg;
+	uint8_t *seg_fw_map;	/* owned by the segments */
+	size_t seg_fw_len;
+	uint8_t *seg_config;
+#endif
 	RTK_ROM_VERSION_CMD_STATE rom_version_cmd_state;
 	RTK_ROM_VERSION_CMD_STATE hci_version_cmd_state;
 	RTK_ROM_VERSION_CMD_STATE chip_type_cmd_state;
+	RTK_ROM_VERSION_CMD_STATE baud_cmd_state;
+#ifdef RTK_AUTO_BAUD
+	RTK_ROM_VERSION_CMD_STATE echo_cmd_state;
+	uint8_t echo_status;
+	uint8_t echo_name[RTK_ECHO_LEN];
+#endif
 
 	struct patch_info *patch_ent;
 
@@ -705,16 +810,73 @@ static __inline RT_U16 bit_rev16(RT_U16 x)
 	return (bit_rev8(x & 0xff) << 8) | bit_rev8(x >> 8);
 }
 
-static const RT_U16 crc_table[] = {
-	0x0000, 0x1081, 0x2102, 0x3183,
-	0x4204, 0x5285, 0x6306, 0x7387,
-	0x8408, 0x9489, 0xa50a, 0xb58b,
-	0xc60c, 0xd68d, 0xe70e, 0xf78f
-};
-
 // Initialise the crc calculator
 #define H5_CRC_INIT(x) x = 0xffff
 
+#ifdef RTK_LOW_MEMORY
+static int rtk_low_memory;
+
+void rtk_set_low_memory(int enable)
+{
+	rtk_low_memory = enable;
+}
+
+/* Untouched slots cost no memory, rtk_release_memory() drops the rest */
+static RT_U8 rtk_skb_tx_pool[RTK_SKB_POOL_TX][8 + RTK_SKB_TX_LEN]
+	__attribute__ ((aligned(4096)));
+static RT_U8 rtk_skb_rx_pool[RTK_SKB_POOL_RX][8 + RTK_SKB_RX_LEN]
+	__attribute__ ((aligned(4096)));
+static uint32_t rtk_skb_tx_used;
+static uint32_t rtk_skb_rx_used;
+
+static struct sk_buff *rtk_skb_pool_get(unsigned int len)
+{
+	int i;
+
+	if (len <= RTK_SKB_TX_LEN) {
+		i = ffs(~rtk_skb_tx_used) - 1;
+		if (i >= 0 && i < RTK_SKB_POOL_TX) {
+			rtk_skb_tx_used |= 1U << i;
+			return (struct sk_buff *)rtk_skb_tx_pool[i];
+		}
+	}
+
+	if (len <= RTK_SKB_RX_LEN) {
+		i = ffs(~rtk_skb_rx_used) - 1;
+		if (i >= 0 && i < RTK_SKB_POOL_RX) {
+			rtk_skb_rx_used |= 1U << i;
+			return (struct sk_buff *)rtk_skb_rx_pool[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+* Give a pooled skb back.
+*
+* @return #1 if skb came from the pool, #0 if it was malloced
+*/
+static int rtk_skb_pool_put(struct sk_buff *skb)
+{
+	RT_U8 *p = (RT_U8 *)skb;
+
+	if (p >= rtk_skb_tx_pool[0] && p < rtk_skb_tx_pool[RTK_SKB_POOL_TX]) {
+		rtk_skb_tx_used &= ~(1U << ((p - rtk_skb_tx_pool[0]) /
+					    sizeof(rtk_skb_tx_pool[0])));
+		return 1;
+	}
+
+	if (p >= rtk_skb_rx_pool[0] && p < rtk_skb_rx_pool[RTK_SKB_POOL_RX]) {
+		rtk_skb_rx_used &= ~(1U << ((p - rtk_skb_rx_pool[0]) /
+					    sizeof(rtk_skb_rx_pool[0])));
+		return 1;
+	}
+
+	return 0;
+}
+#endif
+
 /**
 * Malloc the socket buffer
 *
@@ -724,14 +886,22 @@ static const RT_U16 crc_table[] = {
 static __inline struct sk_buff *skb_alloc(unsigned int len)
 {
 	struct sk_buff *skb = NULL;
-	if ((skb = malloc(len + 8))) {
+
+#ifdef RTK_LOW_MEMORY
+	/* The pool running dry falls back to the heap */
+	if (rtk_low_memory)
+		skb = rtk_skb_pool_get(len);
+	if (!skb)
+#endif
+		skb = malloc(len + 8);
+	if (skb) {
 		skb->max_len = len;
 		skb->data_len = 0;
+		memset(skb->data, 0, len);
 	} else {
 		RS_ERR("Allocate skb fails!!!");
 		skb = NULL;
 	}
-	memset(skb->data, 0, len);
 	return skb;
 }
 
@@ -742,6 +912,10 @@ static __inline struct sk_buff *skb_alloc(unsigned int len)
 */
 static __inline void skb_free(struct sk_buff *skb)
 {
+#ifdef RTK_LOW_MEMORY
+	if (rtk_skb_pool_put(skb))
+		return;
+#endif
 	free(skb);
 	return;
 }
@@ -814,12 +988,7 @@ static RT_U8 *skb_pull(struct sk_buff *skb, RT_U32 len)
 */
 static void h5_crc_update(RT_U16 * crc, RT_U8 d)
 {
-	RT_U16 reg = *crc;
-
-	reg = (reg >> 4) ^ crc_table[(reg ^ d) & 0x000f];
-	reg = (reg >> 4) ^ crc_table[(reg ^ (d >> 4)) & 0x000f];
-
-	*crc = reg;
+	*crc = h5_crc_byte(*crc, d);
 }
 
 struct __una_u16 {
@@ -874,47 +1043,6 @@ static void h5_slip_msgdelim(struct sk_buff *skb)
 	memcpy(skb_put(skb, 1), &pkt_delim, 1);
 }
 
-/**
-* Slip ecode one byte in h5 proto, as follows:
-* 0xc0 -> 0xdb, 0xdc
-* 0xdb -> 0xdb, 0xdd
-* 0x11 -> 0xdb, 0xde
-* 0x13 -> 0xdb, 0xdf
-* others will not change
-*
-* @param skb socket buffer
-* @c pure data in the one byte
-*/
-static void h5_slip_one_byte(struct sk_buff *skb, RT_U8 c)
-{
-	const RT_S8 esc_c0[2] = { 0xdb, 0xdc };
-	const RT_S8 esc_db[2] = { 0xdb, 0xdd };
-	const RT_S8 esc_11[2] = { 0xdb, 0xde };
-	const RT_S8 esc_13[2] = { 0xdb, 0xdf };
-
-	switch (c) {
-	case 0xc0:
-		memcpy(skb_put(skb, 2), &esc_c0, 2);
-		break;
-
-	case 0xdb:
-		memcpy(skb_put(skb, 2), &esc_db, 2);
-		break;
-
-	case 0x11:
-		memcpy(skb_put(skb, 2), &esc_11, 2);
-		break;
-
-	case 0x13:
-		memcpy(skb_put(skb, 2), &esc_13, 2);
-		break;
-
-	default:
-		memcpy(skb_put(skb, 1), &c, 1);
-		break;
-	}
-}
-
 /**
 * Decode one byte in h5 proto, as follows:
 * 0xdb, 0xdc -> 0xc0
@@ -1014,14 +1142,16 @@ static struct sk_buff *h5_prepare_pkt(rtk_hw_cfg_t * h5, RT_U8 * data,
 {
 	struct sk_buff *nskb;
 	RT_U8 hdr[4];
+	RT_U8 crc[2];
 	RT_U16 H5_CRC_INIT(h5_txmsg_crc);
-	int rel, i;
+	int rel;
 
 	switch (pkt_type) {
 	case HCI_ACLDATA_PKT:
 	case HCI_COMMAND_PKT:
 	case HCI_EVENT_PKT:
 		rel = 1;	// reliable
+		RTK_SNOOP_ADD(HCI_SNOOP_TX, pkt_type, data, len);
 		break;
 
 	case H5_ACK_PKT:
@@ -1069,27 +1199,19 @@ static struct sk_buff *h5_prepare_pkt(rtk_hw_cfg_t * h5, RT_U8 * data,
 	// set checksum
 	hdr[3] = ~(hdr[0] + hdr[1] + hdr[2]);
 
-	// Put h5 header */
-	for (i = 0; i < 4; i++) {
-		h5_slip_one_byte(nskb, hdr[i]);
-
-		if (h5->use_crc)
-			h5_crc_update(&h5_txmsg_crc, hdr[i]);
-	}
-
-	// Put payload */
-	for (i = 0; i < len; i++) {
-		h5_slip_one_byte(nskb, data[i]);
-
-		if (h5->use_crc)
-			h5_crc_update(&h5_txmsg_crc, data[i]);
-	}
+	// Put h5 header and payload, clean runs are copied in one go */
+	nskb->data_len += h5_slip_encode(nskb->data + nskb->data_len, hdr, 4);
+	nskb->data_len += h5_slip_encode(nskb->data + nskb->data_len, data, len);
 
 	// Put CRC */
 	if (h5->use_crc) {
+		h5_txmsg_crc = h5_crc_buf(h5_txmsg_crc, hdr, 4);
+		h5_txmsg_crc = h5_crc_buf(h5_txmsg_crc, data, len);
 		h5_txmsg_crc = bit_rev16(h5_txmsg_crc);
-		h5_slip_one_byte(nskb, (RT_U8) ((h5_txmsg_crc >> 8) & 0x00ff));
-		h5_slip_one_byte(nskb, (RT_U8) (h5_txmsg_crc & 0x00ff));
+		crc[0] = (RT_U8) ((h5_txmsg_crc >> 8) & 0x00ff);
+		crc[1] = (RT_U8) (h5_txmsg_crc & 0x00ff);
+		nskb->data_len += h5_slip_encode(nskb->data + nskb->data_len,
+						 crc, 2);
 	}
 	// Add SLIP end byte: 0xc0
 	h5_slip_msgdelim(nskb);
@@ -1180,6 +1302,7 @@ static void hci_event_cmd_complete(struct sk_buff *skb)
 	case HCI_VENDOR_CHANGE_BDRATE:
 		status = skb->data[0];
 		RS_DBG("Change BD Rate with status:%x", status);
+		rtk_hw_cfg.baud_cmd_state = event_received;
 		skb_free(rtk_hw_cfg.host_last_cmd);
 		rtk_hw_cfg.host_last_cmd = NULL;
 		rtk_hw_cfg.link_estab_state = H5_PATCH;
@@ -1241,6 +1364,23 @@ static void hci_event_cmd_complete(struct sk_buff *skb)
 		skb_free(rtk_hw_cfg.host_last_cmd);
 		rtk_hw_cfg.host_last_cmd = NULL;
 		break;
+#ifdef RTK_AUTO_BAUD
+	case HCI_CMD_WRITE_LOCAL_NAME:
+	case HCI_CMD_READ_LOCAL_NAME:
+		rtk_hw_cfg.echo_cmd_state = event_received;
+		status = skb->data[0];
+		rtk_hw_cfg.echo_status = status;
+		if (opcode == HCI_CMD_READ_LOCAL_NAME && !status) {
+			if (skb->data_len > RTK_ECHO_LEN)
+				memcpy(rtk_hw_cfg.echo_name, &skb->data[1],
+				       RTK_ECHO_LEN);
+			else
+				memset(rtk_hw_cfg.echo_name, 0, RTK_ECHO_LEN);
+		}
+		skb_free(rtk_hw_cfg.host_last_cmd);
+		rtk_hw_cfg.host_last_cmd = NULL;
+		return;
+#endif
 	default:
 		return;
 	}
@@ -1286,6 +1426,14 @@ static void hci_recv_frame(struct sk_buff *skb)
 			RS_DBG("Get CONFG pkt-active mode\n");
 		} else if (!memcmp(skb->data, h5confresp, 0x2)) {
 			RS_DBG("Get CONFG resp pkt-active mode\n");
+			/* No config field means a window of one packet */
+			rtk_hw_cfg.tx_win = 1;
+			if (skb->data_len > 2 && (skb->data[2] & 0x07)) {
+				rtk_hw_cfg.tx_win = skb->data[2] & 0x07;
+				if (rtk_hw_cfg.tx_win > H5_CFG_WINSIZE)
+					rtk_hw_cfg.tx_win = H5_CFG_WINSIZE;
+			}
+			RS_DBG("H5 sliding window %u", rtk_hw_cfg.tx_win);
 			rtk_hw_cfg.link_estab_state = H5_INIT;
 		} else {
 			RS_DBG("H5_CONFIG receive event\n");
@@ -1370,6 +1518,10 @@ static void h5_complete_rx_pkt(rtk_hw_cfg_t * h5)
 
 	h5_remove_acked_pkt(h5);
 
+	if (pass_up && H5_HDR_PKT_TYPE(h5_hdr) != H5_LINK_CTL_PKT)
+		RTK_SNOOP_ADD(HCI_SNOOP_RX, H5_HDR_PKT_TYPE(h5_hdr),
+			      h5_hdr + H5_HDR_SIZE, H5_HDR_LEN(h5_hdr));
+
 	if (pass_up) {
 		skb_pull(h5->rx_skb, H5_HDR_SIZE);
 		hci_recv_frame(h5->rx_skb);
@@ -1392,11 +1544,31 @@ static void h5_complete_rx_pkt(rtk_hw_cfg_t * h5)
 static int h5_recv(rtk_hw_cfg_t * h5, void *data, int count)
 {
 	unsigned char *ptr;
+	size_t n;
 	//RS_DBG("count %d rx_state %d rx_count %ld", count, h5->rx_state, h5->rx_count);
 	ptr = (unsigned char *)data;
 
 	while (count) {
 		if (h5->rx_count) {
+			/* Copy the run of bytes that need no unescaping at once */
+			if (H5_ESCSTATE_NOESC == h5->rx_esc_state) {
+				n = (RT_U32) count < h5->rx_count ?
+				    (RT_U32) count : h5->rx_count;
+				n = h5_unslip_span(ptr, n);
+				if (n) {
+					memcpy(skb_put(h5->rx_skb, n), ptr, n);
+					if ((h5->rx_skb->data[0] & 0x40) != 0
+					    && h5->rx_state != H5_W4_CRC)
+						h5->message_crc =
+						    h5_crc_buf(h5->message_crc,
+							       ptr, n);
+					h5->rx_count -= n;
+					ptr += n;
+					count -= n;
+					continue;
+				}
+			}
+
 			if (*ptr == 0xc0) {
 				RS_ERR("short h5 packet");
 				skb_free(h5->rx_skb);
@@ -1433,15 +1605,16 @@ static int h5_recv(rtk_hw_cfg_t * h5, void *data, int count)
 				     h5->rxseq_txack);
 				h5->is_txack_req = 1;
 
-				skb_free(h5->rx_skb);
-				h5->rx_state = H5_W4_PKT_DELIMITER;
-				h5->rx_count = 0;
-
 				/* depend on weather remote will reset ack numb or not!!!!!!special */
 				if (rtk_hw_cfg.tx_index == rtk_hw_cfg.total_num) {
 					rtk_hw_cfg.rxseq_txack =
 					    h5->rx_skb->data[0] & 0x07;
 				}
+
+				skb_free(h5->rx_skb);
+				h5->rx_skb = NULL;
+				h5->rx_state = H5_W4_PKT_DELIMITER;
+				h5->rx_count = 0;
 				continue;
 			}
 			h5->rx_state = H5_W4_DATA;
@@ -1595,7 +1768,7 @@ static void h5_tsync_sig_alarm(int sig)
 */
 static void h5_tconf_sig_alarm(int sig)
 {
-	unsigned char h5conf[3] = { 0x03, 0xFC, 0x14 };
+	unsigned char h5conf[3] = { 0x03, 0xFC, H5_CFG_FIELD };
 	static int retries = 0;
 	struct itimerval value;
 
@@ -1624,39 +1797,6 @@ static void h5_tconf_sig_alarm(int sig)
 	exit(1);
 }
 
-/**
-* Retry to init when timeout in h5 proto, max retry times is 10.
-*
-* @warning Each time to retry, the time for timeout will be set as 1s.
-*
-* @param sig signaction for timeout
-*
-*/
-static void h5_tinit_sig_alarm(int sig)
-{
-	static int retries = 0;
-	if (retries < rtk_hw_cfg.h5_max_retries) {
-		retries++;
-		if (rtk_hw_cfg.host_last_cmd) {
-			int len =
-			    write(rtk_hw_cfg.serial_fd,
-				  rtk_hw_cfg.host_last_cmd->data,
-				  rtk_hw_cfg.host_last_cmd->data_len);
-			RS_DBG("3-wire change baudrate re send:%d, len:%d",
-			       retries, len);
-			alarm(1);
-			return;
-		} else {
-			RS_DBG
-			    ("3-wire init timeout without last command stored\n");
-		}
-	}
-
-	tcflush(rtk_hw_cfg.serial_fd, TCIOFLUSH);
-	RS_ERR("H5 init process timed out");
-	exit(1);
-}
-
 /**
 * Retry to download patch when timeout in h5 proto, max retry times is 10.
 *
@@ -1682,9 +1822,56 @@ static void h5_tpatch_sig_alarm(int sig)
 		return;
 	}
 	RS_ERR("H5 patch timed out\n");
+#ifdef RTK_SNOOP
+	hci_snoop_dump(&rtk_snoop, RTK_SNOOP_FILE);
+#endif
 	exit(1);
 }
 
+#ifdef RTK_LOW_MEMORY
+static const RT_U8 *rtk_patch_seg_data(int off, int len, RT_U8 *tmp)
+{
+	const struct rtk_patch_seg *seg = rtk_hw_cfg.total_seg;
+	int nseg = rtk_hw_cfg.total_nseg;
+	int i, n, done;
+
+	for (i = 0; i < nseg && off >= seg[i].len; i++)
+		off -= seg[i].len;
+	if (i < nseg && off + len <= seg[i].len)
+		return seg[i].data + off;
+
+	for (done = 0; i < nseg && done < len; i++, off = 0) {
+		n = seg[i].len - off;
+		if (n > len - done)
+			n = len - done;
+		memcpy(tmp + done, seg[i].data + off, n);
+		done += n;
+	}
+
+	return tmp;
+}
+#endif
+
+/**
+* Get len bytes at off of the fw & config image. In low memory mode the
+* image is a list of segments and a chunk crossing two is gathered in tmp.
+*
+* @param buf merged image, unused with segments
+* @param tmp room for len bytes
+* @return pointer to the chunk
+*/
+static const RT_U8 *rtk_patch_data(const RT_U8 *buf, int off, int len,
+				   RT_U8 *tmp)
+{
+#ifdef RTK_LOW_MEMORY
+	if (rtk_hw_cfg.total_nseg)
+		return rtk_patch_seg_data(off, len, tmp);
+#endif
+	(void)len;
+	(void)tmp;
+	return buf + off;
+}
+
 /**
 * Download patch using hci. For h5 proto, not recv reply for 2s will timeout.
 * Call h5_tpatch_sig_alarm for retry.
@@ -1696,8 +1883,8 @@ static void h5_tpatch_sig_alarm(int sig)
 * @return #0 on success
 *
 */
-static int hci_download_patch(int dd, int index, uint8_t * data, int len,
-			      struct termios *ti)
+static int hci_download_patch(int dd, int index, const uint8_t * data,
+			      int len, struct termios *ti)
 {
 	unsigned char hcipatch[256] = { 0x20, 0xfc, 00 };
 	unsigned char bytes[READ_DATA_SIZE];
@@ -1749,6 +1936,208 @@ static int hci_download_patch(int dd, int index, uint8_t * data, int len,
 	return 0;
 }
 
+#ifdef H5_PIPELINE_DOWNLOAD
+/* Patch download on h5_link, picks up the link set up by the H5 stack */
+struct rtk_dl_link {
+	struct h5_link h5;
+	int events;		/* command complete events seen */
+	int done;		/* event of the end packet seen */
+};
+
+static uint64_t rtk_now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void rtk_dl_recv(void *user, uint8_t type, const uint8_t *data,
+			size_t len)
+{
+	struct rtk_dl_link *dl = user;
+
+	RTK_SNOOP_ADD(HCI_SNOOP_RX, type, data, len);
+
+	if (type != HCI_EVENT_PKT || len < 7 || data[0] != 0x0e) {
+		RS_DBG("Ignore packet 0x%02x during patch download", type);
+		return;
+	}
+
+	rtk_hw_cfg.rx_index = data[6];
+	dl->events++;
+
+	/* Download fw/config done */
+	if (rtk_hw_cfg.rx_index & 0x80) {
+		rtk_hw_cfg.rx_index &= ~0x80;
+		dl->done = 1;
+	}
+}
+
+static const struct h5_link_ops rtk_dl_ops = {
+	.recv = rtk_dl_recv,
+};
+
+/**
+* Download patch with several vendor 0xfc20 commands kept in flight on
+* h5_link. The index sequence is the same as in the stop-and-wait
+* download; the number of outstanding commands is bounded by the
+* negotiated sliding window and lost frames are resent by the link.
+*
+* @param fd uart file descriptor
+* @param buf fw & config content
+* @param end_index index of the last data packet
+* @param last_len payload length of the last data packet
+* @param total_index index of the end packet
+* @return #0 on success
+*/
+static int hci_download_patch_pipelined(int fd, RT_U8 * buf, int end_index,
+					int last_len, int total_index)
+{
+	unsigned char hcipatch[256] = { 0x20, 0xfc, 00 };
+	unsigned char chunk[PATCH_DATA_FIELD_MAX_SIZE];
+	unsigned char bytes[256];
+	unsigned char out[H5_LINK_TX_BUF];
+	struct rtk_dl_link dl;
+	struct pollfd pfd;
+	uint64_t now, progress;
+	int win;
+	int next = 0;
+	int timeout;
+	int events;
+	int ret = 0;
+	int len;
+	int j;
+	size_t n;
+
+	win = rtk_hw_cfg.tx_win;
+	if (win > H5_DL_WINSIZE)
+		win = H5_DL_WINSIZE;
+
+	dl.events = 0;
+	dl.done = 0;
+	h5_link_init(&dl.h5, &rtk_dl_ops, &dl, H5_CFG_FIELD);
+	h5_link_resume(&dl.h5, rtk_hw_cfg.msgq_txseq, rtk_hw_cfg.rxseq_txack,
+		       win, rtk_hw_cfg.use_crc);
+	dl.h5.ack_req = rtk_hw_cfg.is_txack_req;
+
+	/* Timeouts are handled with poll below */
+	alarm(0);
+
+	RS_INFO("Pipelined patch download, window %d", win);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	progress = rtk_now_ms();
+
+	while (!dl.done) {
+		/* Commands count as in flight until their complete event is
+		 * in, the controller has no room for more than that
+		 */
+		while (next <= total_index && next - dl.events < win) {
+			/* Index will roll over when it reaches 0x80. */
+			if (next > 0x7f)
+				j = (next & 0x7f) + 1;
+			else
+				j = next;
+
+			if (next == total_index)
+				j |= 0x80;
+
+			if (next < end_index)
+				len = PATCH_DATA_FIELD_MAX_SIZE;
+			else if (next == end_index)
+				len = last_len;
+			else
+				len = 0;
+
+			hcipatch[2] = len + 1;
+			hcipatch[3] = j;
+			if (len)
+				memcpy(hcipatch + 4,
+				       rtk_patch_data(buf,
+					next * PATCH_DATA_FIELD_MAX_SIZE, len,
+					chunk),
+				       len);
+
+			if (h5_link_send(&dl.h5, HCI_COMMAND_PKT, hcipatch,
+					 len + 4) < 0) {
+				RS_ERR("Queue patch %u failed", j);
+				ret = -1;
+				goto done;
+			}
+			RTK_SNOOP_ADD(HCI_SNOOP_TX, HCI_COMMAND_PKT, hcipatch,
+				      len + 4);
+			rtk_hw_cfg.tx_index = j & 0x7f;
+
+			if (j & 0x80) {
+				RS_DBG("Send FW last command");
+				/* The controller restarts its numbering
+				 * once the last patch command is in.
+				 */
+				h5_link_rx_reset_seq(&dl.h5);
+			}
+			next++;
+		}
+
+		now = rtk_now_ms();
+		n = h5_link_poll(&dl.h5, out, sizeof(out), now);
+		if (n && write(fd, out, n) < 0) {
+			RS_ERR("Write patch failed, %s", strerror(errno));
+			ret = -1;
+			goto done;
+		}
+
+		timeout = h5_link_timeout(&dl.h5, now);
+		if (timeout < 0 || timeout > H5_DL_RTO_MS)
+			timeout = H5_DL_RTO_MS;
+
+		pfd.revents = 0;
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			RS_ERR("Poll fail, %s", strerror(errno));
+			goto done;
+		}
+
+		now = rtk_now_ms();
+		if (ret > 0) {
+			if ((ret = read_check_rtk(fd, bytes, sizeof(bytes))) == -1) {
+				RS_ERR("read fail\n");
+				goto done;
+			}
+			events = dl.events;
+			h5_link_feed(&dl.h5, bytes, ret, now);
+			if (dl.events != events)
+				progress = now;
+		}
+
+		if (now - progress > (uint64_t) H5_DL_RTO_MS *
+		    (rtk_hw_cfg.h5_max_retries + 1)) {
+			RS_ERR("H5 patch timed out, %lu retransmissions",
+			       dl.h5.stats.retx);
+			ret = -1;
+			goto done;
+		}
+	}
+
+	ret = 0;
+	rtk_hw_cfg.link_estab_state = H5_ACTIVE;
+	RS_INFO("Patch download done, %lu packets, %lu retransmissions",
+		dl.h5.stats.tx_pkts, dl.h5.stats.retx);
+
+done:
+	/* The H5 stack carries on from here, the caller acks the last event */
+	rtk_hw_cfg.msgq_txseq = dl.h5.tx_seq;
+	rtk_hw_cfg.rxseq_txack = dl.h5.tx_ack;
+	rtk_hw_cfg.is_txack_req = dl.h5.ack_req;
+	rtk_hw_cfg.rxack = (dl.h5.tx_seq - dl.h5.unacked.num) & 0x07;
+
+	return ret;
+}
+#endif
+
 #define READ_TRY_MAX	6
 int os_read(int fd, uint8_t * buff, int len)
 {
@@ -1849,6 +2238,7 @@ start_read:
 #ifdef DUMP_HCI_EVT
 	hci_dump_evt(evt_buff, ret + 3);
 #endif
+	RTK_SNOOP_ADD(HCI_SNOOP_RX, evt_buff[0], evt_buff + 1, ret + 2);
 
 	/* This event to wake up host. */
 	if (evt_buff[1] == vendor_evt) {
@@ -1867,25 +2257,17 @@ start_read:
 }
 
 /**
-* Download h4 patch
+* Write one complete 0xfc20 command and wait for its command complete.
 *
 * @param dd uart file descriptor
-* @param index current index
-* @param data point to the config file
-* @param len current buf length
-* @return ret_index
-*
+* @param buf H4 command, type byte included
+* @param total_len length of buf
+* @return index from the controller, -1 on failure
 */
-static int hci_download_patch_h4(int dd, int index, uint8_t * data, int len)
+static int hci_send_patch_h4(int dd, const uint8_t *buf, size_t total_len)
 {
 	unsigned char bytes[257] = { 0 };
-	unsigned char buf[257] = { 0x01, 0x20, 0xfc, 00 };
-	uint16_t readbytes = 0;
-	int cur_index = index;
 	int ret_Index = -1;
-	uint16_t res = 0;
-	int i = 0;
-	size_t total_len;
 	uint16_t w_len;
 	uint8_t rstatus;
 	int ret;
@@ -1893,17 +2275,9 @@ static int hci_download_patch_h4(int dd, int index, uint8_t * data, int len)
 		0x20, 0xfc,
 	};
 
-	RS_DBG("dd:%d, index:%d, len:%d", dd, index, len);
-	if (NULL != data) {
-		memcpy(&buf[5], data, len);
-	}
-
-	buf[3] = len + 1;
-	buf[4] = cur_index;
-	total_len = len + 5;
-
 	w_len = write(dd, buf, total_len);
 	RS_DBG("h4 write success with len: %d\n", w_len);
+	RTK_SNOOP_ADD(HCI_SNOOP_TX, buf[0], buf + 1, total_len - 1);
 
 	ret = read_hci_evt(dd, bytes, 0x0e);
 	if (ret < 0) {
@@ -1933,6 +2307,32 @@ static int hci_download_patch_h4(int dd, int index, uint8_t * data, int len)
 	return ret_Index;
 }
 
+/**
+* Download h4 patch
+*
+* @param dd uart file descriptor
+* @param index current index
+* @param data point to the config file
+* @param len current buf length
+* @return ret_index
+*
+*/
+static int hci_download_patch_h4(int dd, int index, const uint8_t * data,
+				 int len)
+{
+	unsigned char buf[257] = { 0x01, 0x20, 0xfc, 00 };
+
+	RS_DBG("dd:%d, index:%d, len:%d", dd, index, len);
+	if (NULL != data) {
+		memcpy(&buf[5], data, len);
+	}
+
+	buf[3] = len + 1;
+	buf[4] = index;
+
+	return hci_send_patch_h4(dd, buf, len + 5);
+}
+
 /**
 * Realtek change speed with h4 proto. Using vendor specified command packet to achieve this.
 *
@@ -1942,6 +2342,9 @@ static int hci_download_patch_h4(int dd, int index, uint8_t * data, int len)
 * @param baudrate the speed want to change
 * @return #0 on success
 */
+static int rtk_h4_cmd(int fd, uint8_t *cmd, int len, uint8_t *result,
+		      const char *name);
+
 static int rtk_vendor_change_speed_h4(int fd, RT_U32 baudrate)
 {
 	int res;
@@ -1967,18 +2370,12 @@ static int rtk_vendor_change_speed_h4(int fd, RT_U32 baudrate)
 	RS_DBG("baudrate in change speed command: 0x%x 0x%x 0x%x 0x%x \n",
 	       cmd[4], cmd[5], cmd[6], cmd[7]);
 
-	if (write(fd, cmd, 8) != 8) {
+	res = rtk_h4_cmd(fd, cmd, 8, bytes, "change speed");
+	if (res < 0) {
 		RS_ERR
 		    ("H4 change uart speed error when writing vendor command");
 		return -1;
 	}
-	RS_DBG("H4 Change uart Baudrate after write ");
-
-	res = read_hci_evt(fd, bytes, 0x0e);
-	if (res < 0) {
-		RS_ERR("%s: Failed to read hci evt.\n", __func__);
-		return -1;
-	}
 
 	if ((0x04 == bytes[0]) && (0x17 == bytes[4]) && (0xfc == bytes[5])) {
 		RS_DBG("H4 change uart speed success, receving status:%x",
@@ -2274,36 +2671,23 @@ int bachk(const char *str)
  * 	}
  * }
  */
-#endif
 
+#define BDADDR_STRING_LEN	17
 /**
-* Get realtek Bluetooth config file. The bt addr arg is stored in /data/btmac.txt, if there is not this file,
-* change to /data/misc/bluetoothd/bt_mac/btmac.txt. If both of them are not found, using
-* random bt addr.
+* Read the customer bt addr from BT_ADDR_FILE.
 *
-* @param config_buf point to the content of realtek Bluetooth config file
-* @param config_baud_rate the baudrate set in the config file
-* @return file_len the length of config file
+* @param bt_addr where bt addr is stored, little endian as in the config
+* @return #0 on success, -1 if there is no valid address
 */
-int rtk_get_bt_config(struct btrtl_info *btrtl, uint8_t **config_buf,
-		RT_U32 *config_baud_rate)
+static int rtk_get_customer_bdaddr(uint8_t bt_addr[6])
 {
-	char bt_config_file_name[PATH_MAX] = { 0 };
-	RT_U8 *bt_addr_temp = NULL;
-	uint8_t bt_addr[6] = { 0x00, 0xe0, 0x4c, 0x88, 0x88, 0x88 };
 	struct stat st;
-	size_t filelen;
-	size_t tlength;
-	int fd;
-	int ret = 0;
-	int i = 0;
-
-#ifdef USE_CUSTOMER_ADDRESS
-#define BDADDR_STRING_LEN	17
 	size_t size;
-	size_t result;
+	ssize_t result;
 	uint8_t tbuf[BDADDR_STRING_LEN + 1];
 	char *str;
+	int fd;
+	int i;
 
 	if (stat(BT_ADDR_FILE, &st) < 0) {
 		RS_INFO("Couldnt access customer BT MAC file %s",
@@ -2313,7 +2697,7 @@ int rtk_get_bt_config(struct btrtl_info *btrtl, uint8_t **config_buf,
 		 * 	rtk_get_ram_addr(&bt_addr[i]);
 		 * rtk_write_btmac2file(bt_addr);
 		 */
-		goto GET_CONFIG;
+		return -1;
 	}
 
 	size = st.st_size;
@@ -2325,41 +2709,68 @@ int rtk_get_bt_config(struct btrtl_info *btrtl, uint8_t **config_buf,
 	if (fd == -1) {
 		RS_ERR("Couldnt open BT MAC file %s, %s", BT_ADDR_FILE,
 		       strerror(errno));
-	} else {
-		memset(tbuf, 0, sizeof(tbuf));
-		result = read(fd, tbuf, size);
-		close(fd);
-		if (result == -1) {
-			RS_ERR("Couldnt read BT MAC file %s, err %s",
-			       BT_ADDR_FILE, strerror(errno));
-			goto GET_CONFIG;
-		}
+		return -1;
+	}
 
-		if (bachk(tbuf) < 0) {
-			goto GET_CONFIG;
-		}
+	memset(tbuf, 0, sizeof(tbuf));
+	result = read(fd, tbuf, size);
+	close(fd);
+	if (result == -1) {
+		RS_ERR("Couldnt read BT MAC file %s, err %s",
+		       BT_ADDR_FILE, strerror(errno));
+		return -1;
+	}
 
-		str = tbuf;
-		for (i = 5; i >= 0; i--) {
-			bt_addr[i] = (uint8_t)strtoul(str, NULL, 16);
-			str += 3;
-		}
+	if (bachk((char *)tbuf) < 0)
+		return -1;
 
-		/*reserve LAP addr from 0x9e8b00 to 0x9e8b3f, change to 0x008b** */
-		if (0x9e == bt_addr[3] && 0x8b == bt_addr[4]
-		    && (bt_addr[5] <= 0x3f)) {
-			bt_addr[3] = 0x00;
-		}
+	str = (char *)tbuf;
+	for (i = 5; i >= 0; i--) {
+		bt_addr[i] = (uint8_t)strtoul(str, NULL, 16);
+		str += 3;
+	}
 
-		RS_DBG("BT MAC is %02x:%02x:%02x:%02x:%02x:%02x",
-		       bt_addr[5], bt_addr[4],
-		       bt_addr[3], bt_addr[2],
-		       bt_addr[1], bt_addr[0]);
-		customer_bdaddr = 1;
+	/*reserve LAP addr from 0x9e8b00 to 0x9e8b3f, change to 0x008b** */
+	if (0x9e == bt_addr[3] && 0x8b == bt_addr[4]
+	    && (bt_addr[5] <= 0x3f)) {
+		bt_addr[3] = 0x00;
 	}
+
+	RS_DBG("BT MAC is %02x:%02x:%02x:%02x:%02x:%02x",
+	       bt_addr[5], bt_addr[4],
+	       bt_addr[3], bt_addr[2],
+	       bt_addr[1], bt_addr[0]);
+	return 0;
+}
+#endif
+
+/**
+* Get realtek Bluetooth config file. The bt addr arg is stored in /data/btmac.txt, if there is not this file,
+* change to /data/misc/bluetoothd/bt_mac/btmac.txt. If both of them are not found, using
+* random bt addr.
+*
+* @param config_buf point to the content of realtek Bluetooth config file
+* @param config_baud_rate the baudrate set in the config file
+* @return file_len the length of config file
+*/
+int rtk_get_bt_config(struct btrtl_info *btrtl, uint8_t **config_buf,
+		RT_U32 *config_baud_rate)
+{
+	char bt_config_file_name[PATH_MAX] = { 0 };
+	RT_U8 *bt_addr_temp = NULL;
+	uint8_t bt_addr[6] = { 0x00, 0xe0, 0x4c, 0x88, 0x88, 0x88 };
+	struct stat st;
+	size_t filelen;
+	size_t tlength;
+	int fd;
+	int ret = 0;
+	int i = 0;
+
+#ifdef USE_CUSTOMER_ADDRESS
+	if (rtk_get_customer_bdaddr(bt_addr) == 0)
+		customer_bdaddr = 1;
 #endif
 
-GET_CONFIG:
 	//ret = sprintf(bt_config_file_name, BT_CONFIG_DIRECTORY "rtlbt_config");
 	ret = sprintf(bt_config_file_name, "%s", BT_CONFIG_DIRECTORY);
 	strcat(bt_config_file_name, btrtl->patch_ent->config_file);
@@ -2426,16 +2837,13 @@ GET_CONFIG:
 * @param baudrate the speed want to change
 *
 */
+static int h5_send_cmd(int fd, uint8_t *cmd, int len);
+static int h5_wait_cmd_complete(int fd, RTK_ROM_VERSION_CMD_STATE *state,
+				int timeout_ms, const char *name);
+
 int rtk_vendor_change_speed_h5(int fd, RT_U32 baudrate)
 {
-	struct sk_buff *cmd_change_bdrate = NULL;
 	unsigned char cmd[7] = { 0 };
-	int retlen;
-	unsigned char bytes[READ_DATA_SIZE];
-	struct sigaction sa;
-
-	sa.sa_handler = h5_tinit_sig_alarm;
-	sigaction(SIGALRM, &sa, NULL);
 
 	cmd[0] = 0x17;	//ocf
 	cmd[1] = 0xfc;	//ogf, vendor specified
@@ -2455,28 +2863,14 @@ int rtk_vendor_change_speed_h5(int fd, RT_U32 baudrate)
 	RS_DBG("baudrate in change speed command: 0x%x 0x%x 0x%x 0x%x \n",
 	       cmd[3], cmd[4], cmd[5], cmd[6]);
 
-	cmd_change_bdrate =
-	    h5_prepare_pkt(&rtk_hw_cfg, cmd, 7, HCI_COMMAND_PKT);
-	if (!cmd_change_bdrate) {
+	rtk_hw_cfg.baud_cmd_state = cmd_has_sent;
+	if (h5_send_cmd(fd, cmd, 7) < 0) {
 		RS_ERR("Prepare command packet for change speed fail");
 		return -1;
 	}
 
-	rtk_hw_cfg.host_last_cmd = cmd_change_bdrate;
-	alarm(1);
-	write(fd, cmd_change_bdrate->data, cmd_change_bdrate->data_len);
-
-	while (rtk_hw_cfg.link_estab_state == H5_INIT) {
-		if ((retlen = read_check_rtk(fd, &bytes, READ_DATA_SIZE)) == -1) {
-			perror("read fail");
-			return -1;
-		}
-		//add pure ack check
-		h5_recv(&rtk_hw_cfg, &bytes, retlen);
-	}
-
-	alarm(0);
-	return 0;
+	return h5_wait_cmd_complete(fd, &rtk_hw_cfg.baud_cmd_state, 1000,
+				    "change speed");
 }
 
 /**
@@ -2587,7 +2981,9 @@ static int rtk_download_fw_config(int fd, RT_U8 * buf, size_t filesize,
 	uint8_t iAdditionPkt = 0;
 	uint8_t iTotalIndex = 0;
 	uint8_t iCmdSentNum = 0;
-	unsigned char *bufpatch;
+	unsigned char chunk[PATCH_DATA_FIELD_MAX_SIZE];
+	const unsigned char *data;
+	int off = 0;
 	uint8_t i, j;
 
 	iEndIndex = (uint8_t) ((filesize - 1) / PATCH_DATA_FIELD_MAX_SIZE);
@@ -2614,7 +3010,16 @@ static int rtk_download_fw_config(int fd, RT_U8 * buf, size_t filesize,
 	if (iLastPacketLen == 0)
 		iLastPacketLen = PATCH_DATA_FIELD_MAX_SIZE;
 
-	bufpatch = buf;
+#ifdef H5_PIPELINE_DOWNLOAD
+	if (proto == HCI_UART_3WIRE && rtk_hw_cfg.tx_win > 1) {
+		if (hci_download_patch_pipelined(fd, buf, iEndIndex,
+						 iLastPacketLen,
+						 iTotalIndex) < 0)
+			return -1;
+		rtk_send_pure_ack_down(fd);
+		return 0;
+	}
+#endif
 
 	for (i = 0; i <= iTotalIndex; i++) {
 		/* Index will roll over when it reaches 0x80. */
@@ -2636,23 +3041,22 @@ static int rtk_download_fw_config(int fd, RT_U8 * buf, size_t filesize,
 		} else if (i < iTotalIndex) {
 			/* Send additional packets */
 			iCurIndex = j;
-			bufpatch = NULL;
 			iCurLen = 0;
 			RS_DBG("Send additional packet %u", iCurIndex);
 		} else {
 			/* Send end packet */
 			iCurIndex = j | 0x80;
-			bufpatch = NULL;
 			iCurLen = 0;
 			RS_DBG("Send end packet %u", iCurIndex);
 		}
+		data = iCurLen ? rtk_patch_data(buf, off, iCurLen, chunk) : NULL;
 
 		if (iCurIndex & 0x80)
 			RS_DBG("Send FW last command");
 
 		if (proto == HCI_UART_H4) {
 			iCurIndex = hci_download_patch_h4(fd, iCurIndex,
-							  bufpatch, iCurLen);
+							  data, iCurLen);
 			if ((iCurIndex != j) && (i != rtk_hw_cfg.total_num)) {
 				RS_DBG(
 				  "index mismatch j %d, iCurIndex:%d, fail\n",
@@ -2660,13 +3064,13 @@ static int rtk_download_fw_config(int fd, RT_U8 * buf, size_t filesize,
 				return -1;
 			}
 		} else if (proto == HCI_UART_3WIRE) {
-			if (hci_download_patch(fd, iCurIndex, bufpatch, iCurLen,
+			if (hci_download_patch(fd, iCurIndex, data, iCurLen,
 					       ti) < 0)
 				return -1;
 		}
 
 		if (iCurIndex < iEndIndex) {
-			bufpatch += PATCH_DATA_FIELD_MAX_SIZE;
+			off += PATCH_DATA_FIELD_MAX_SIZE;
 		}
 	}
 
@@ -2678,6 +3082,19 @@ static int rtk_download_fw_config(int fd, RT_U8 * buf, size_t filesize,
 	return 0;
 }
 
+/* Release what rtk_get_bt_firmware() returned */
+static void rtk_free_bt_firmware(RT_U8 *fw_buf, int fw_len)
+{
+#ifdef RTK_LOW_MEMORY
+	if (rtk_low_memory) {
+		munmap(fw_buf, fw_len);
+		return;
+	}
+#endif
+	(void)fw_len;
+	free(fw_buf);
+}
+
 /**
 * Get realtek Bluetooth firmaware file. The content will be saved in *fw_buf which is malloc here.
 * The length malloc here will be lager than length of firmware file if there is a config file.
@@ -2714,6 +3131,21 @@ int rtk_get_bt_firmware(struct btrtl_info *btrtl, RT_U8 **fw_buf)
 		return -1;
 	}
 
+#ifdef RTK_LOW_MEMORY
+	/* Sent from the page cache, only the patch of this chip is read */
+	if (rtk_low_memory) {
+		*fw_buf = mmap(NULL, fwsize, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (*fw_buf == MAP_FAILED) {
+			RS_ERR("Can't map firmware, %s", strerror(errno));
+			*fw_buf = NULL;
+			return -1;
+		}
+		RS_DBG("Map FW OK");
+		return fwsize;
+	}
+#endif
+
 	if (!(*fw_buf = malloc(fwsize))) {
 		RS_ERR("Can't alloc memory for fw&config, errno:%d", errno);
 		close(fd);
@@ -2841,305 +3273,241 @@ static inline void uart_speed_to_rtk_speed(int uart_speed, RT_U32 * rtk_speed)
 	return;
 }
 
-static void rtk_get_chip_type_timeout(int sig)
+/**
+* Milliseconds left until the deadline, never negative.
+*/
+static int rtk_ms_left(const struct timespec *deadline)
 {
-	static int retries = 0;
-	int len = 0;
-	struct btrtl_info *btrtl = &rtk_hw_cfg;
+	struct timespec now;
+	long ms;
 
-	RS_INFO("RTK get HCI_VENDOR_READ_RTK_CHIP_TYPE_Command\n");
-	if (retries < btrtl->h5_max_retries) {
-		RS_DBG("rtk get chip type timerout, retry:%d\n", retries);
-		if (btrtl->host_last_cmd) {
-			len = write(btrtl->serial_fd,
-				    btrtl->host_last_cmd->data,
-				    btrtl->host_last_cmd->data_len);
-		}
-		retries++;
-		alarm(3);
-		return;
-	}
-	tcflush(btrtl->serial_fd, TCIOFLUSH);
-	RS_ERR("rtk get chip type cmd complete event timed out\n");
-	exit(1);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+	     (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	return ms > 0 ? ms : 0;
 }
 
-void rtk_get_chip_type(int dd)
+static void rtk_deadline(struct timespec *deadline, int ms)
 {
-	unsigned char bytes[READ_DATA_SIZE];
-	int retlen;
-	struct sigaction sa;
-	/* 0xB000A094 */
-	unsigned char cmd_buff[] = {0x61, 0xfc,
-		0x05, 0x00, 0x94, 0xa0, 0x00, 0xb0};
-	struct sk_buff *nskb;
-	struct btrtl_info *btrtl = &rtk_hw_cfg;
-
-	nskb = h5_prepare_pkt(btrtl, cmd_buff, sizeof(cmd_buff),
-			HCI_COMMAND_PKT);
-	if (btrtl->host_last_cmd){
-		skb_free(btrtl->host_last_cmd);
-		btrtl->host_last_cmd = NULL;
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += ms / 1000;
+	deadline->tv_nsec += (ms % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
 	}
+}
 
-	btrtl->host_last_cmd = nskb;
-
-	write(dd, nskb->data, nskb->data_len);
-	RS_INFO("RTK send HCI_VENDOR_READ_CHIP_TYPE_Command\n");
+/**
+* Wait for the H5 command tracked by state to complete. The last command
+* is resent every time its deadline passes without a reply.
+*
+* @param fd uart file descriptor
+* @param state command state updated by hci_event_cmd_complete
+* @param timeout_ms deadline of a single attempt
+* @param name command name for the log
+* @return #0 on success, -1 on timeout or read error
+*/
+static int h5_wait_cmd_complete(int fd, RTK_ROM_VERSION_CMD_STATE *state,
+				int timeout_ms, const char *name)
+{
+	unsigned char bytes[READ_DATA_SIZE];
+	struct timespec deadline;
+	struct pollfd pfd;
+	int retries = 0;
+	int ret;
 
-	alarm(0);
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_flags = SA_NOCLDSTOP;
-	sa.sa_handler = rtk_get_chip_type_timeout;
-	sigaction(SIGALRM, &sa, NULL);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	rtk_deadline(&deadline, timeout_ms);
 
-	alarm(3);
-	while (btrtl->chip_type_cmd_state != event_received) {
-		if ((retlen = read_check_rtk(dd, &bytes, READ_DATA_SIZE)) == -1) {
-			perror("rtk get chip type: read fail");
-			return;
+	while (*state != event_received) {
+		ret = poll(&pfd, 1, rtk_ms_left(&deadline));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			RS_ERR("%s: poll fail, %s", name, strerror(errno));
+			return -1;
 		}
-		h5_recv(btrtl, &bytes, retlen);
-	}
-	alarm(0);
-	return;
-}
 
-static void rtk_get_eversion_timeout(int sig)
-{
-	static int retries = 0;
-	int len = 0;
+		if (ret == 0) {
+			if (retries++ >= rtk_hw_cfg.h5_max_retries) {
+				tcflush(fd, TCIOFLUSH);
+				RS_ERR("%s cmd complete event timed out", name);
+				return -1;
+			}
+			RS_DBG("%s timeout, retry %d", name, retries);
+			if (rtk_hw_cfg.host_last_cmd &&
+			    write(fd, rtk_hw_cfg.host_last_cmd->data,
+				  rtk_hw_cfg.host_last_cmd->data_len) < 0)
+				RS_ERR("%s: resend fail, %s", name,
+				       strerror(errno));
+			rtk_deadline(&deadline, timeout_ms);
+			continue;
+		}
 
-	RS_DBG("RTK get HCI_VENDOR_READ_RTK_ROM_VERISION_Command\n");
-	if (retries < rtk_hw_cfg.h5_max_retries) {
-		RS_DBG("rtk get eversion timerout, retry:%d\n", retries);
-		if (rtk_hw_cfg.host_last_cmd) {
-			len = write(rtk_hw_cfg.serial_fd,
-				    rtk_hw_cfg.host_last_cmd->data,
-				    rtk_hw_cfg.host_last_cmd->data_len);
+		if ((ret = read_check_rtk(fd, &bytes, READ_DATA_SIZE)) == -1) {
+			RS_ERR("%s: read fail, %s", name, strerror(errno));
+			return -1;
 		}
-		retries++;
-		alarm(3);
-		return;
+		h5_recv(&rtk_hw_cfg, &bytes, ret);
 	}
-	tcflush(rtk_hw_cfg.serial_fd, TCIOFLUSH);
-	RS_ERR("rtk get eversion cmd complete event timed out\n");
-	exit(1);
+
+	return 0;
 }
 
 /**
-* Send vendor cmd to get eversion: 0xfc6d
-* If Rom code does not support this cmd, use default.
+* Queue an H5 command and make it the one resent on timeout.
 */
-void rtk_get_eversion(int dd)
+static int h5_send_cmd(int fd, uint8_t *cmd, int len)
 {
-	unsigned char bytes[READ_DATA_SIZE];
-	int retlen;
-	struct sigaction sa;
-	unsigned char read_rom_patch_cmd[3] = { 0x6d, 0xfc, 00 };
-	struct sk_buff *nskb =
-	    h5_prepare_pkt(&rtk_hw_cfg, read_rom_patch_cmd, 3, HCI_COMMAND_PKT);
+	struct sk_buff *nskb;
 
+	nskb = h5_prepare_pkt(&rtk_hw_cfg, cmd, len, HCI_COMMAND_PKT);
+	if (!nskb)
+		return -1;
 	if (rtk_hw_cfg.host_last_cmd) {
 		skb_free(rtk_hw_cfg.host_last_cmd);
 		rtk_hw_cfg.host_last_cmd = NULL;
 	}
 
 	rtk_hw_cfg.host_last_cmd = nskb;
+	if (write(fd, nskb->data, nskb->data_len) < 0)
+		RS_ERR("H5 command write fail, %s", strerror(errno));
 
-	write(dd, nskb->data, nskb->data_len);
-	rtk_hw_cfg.rom_version_cmd_state = cmd_has_sent;
-	RS_DBG("RTK send HCI_VENDOR_READ_RTK_ROM_VERISION_Command\n");
+	return 0;
+}
 
-	alarm(0);
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_flags = SA_NOCLDSTOP;
-	sa.sa_handler = rtk_get_eversion_timeout;
-	sigaction(SIGALRM, &sa, NULL);
+int rtk_get_chip_type(int dd)
+{
+	/* 0xB000A094 */
+	unsigned char cmd_buff[] = {0x61, 0xfc,
+		0x05, 0x00, 0x94, 0xa0, 0x00, 0xb0};
 
-	alarm(3);
-	while (rtk_hw_cfg.rom_version_cmd_state != event_received) {
-		if ((retlen = read_check_rtk(dd, &bytes, READ_DATA_SIZE)) == -1) {
-			perror("rtk get eversion: read fail");
-			return;
-		}
-		h5_recv(&rtk_hw_cfg, &bytes, retlen);
-	}
-	alarm(0);
-	return;
+	h5_send_cmd(dd, cmd_buff, sizeof(cmd_buff));
+	RS_INFO("RTK send HCI_VENDOR_READ_CHIP_TYPE_Command\n");
+
+	return h5_wait_cmd_complete(dd, &rtk_hw_cfg.chip_type_cmd_state,
+				    3000, "rtk get chip type");
 }
 
-static void rtk_get_lmp_version_timeout(int sig)
+/**
+* Send vendor cmd to get eversion: 0xfc6d
+* If Rom code does not support this cmd, use default.
+*/
+int rtk_get_eversion(int dd)
 {
-	static int retries = 0;
-	RS_DBG("RTK get HCI_VENDOR_READ_RTK_LMP_VERISION_Command\n");
-	if (retries < rtk_hw_cfg.h5_max_retries) {
-		RS_DBG("rtk get lmp version timeout, retry: %d\n", retries);
-		if (rtk_hw_cfg.host_last_cmd) {
-			int len = write(rtk_hw_cfg.serial_fd,
-					rtk_hw_cfg.host_last_cmd->data,
-					rtk_hw_cfg.host_last_cmd->data_len);
-		}
-		retries++;
-		alarm(3);
-		return;
-	}
-	tcflush(rtk_hw_cfg.serial_fd, TCIOFLUSH);
-	RS_ERR("rtk get lmp version cmd complete event timed out\n");
-	exit(1);
+	unsigned char read_rom_patch_cmd[3] = { 0x6d, 0xfc, 00 };
+
+	h5_send_cmd(dd, read_rom_patch_cmd, 3);
+	rtk_hw_cfg.rom_version_cmd_state = cmd_has_sent;
+	RS_DBG("RTK send HCI_VENDOR_READ_RTK_ROM_VERISION_Command\n");
+
+	return h5_wait_cmd_complete(dd, &rtk_hw_cfg.rom_version_cmd_state,
+				    3000, "rtk get eversion");
 }
 
-void rtk_get_lmp_version(int dd)
+int rtk_get_lmp_version(int dd)
 {
-	unsigned char bytes[READ_DATA_SIZE];
-	int retlen;
-	struct sigaction sa;
 	unsigned char read_rom_patch_cmd[3] = { 0x01, 0x10, 00 };
-	struct sk_buff *nskb = h5_prepare_pkt(&rtk_hw_cfg, read_rom_patch_cmd, 3, HCI_COMMAND_PKT);	//data:len+head:4
-
-	if (rtk_hw_cfg.host_last_cmd) {
-		skb_free(rtk_hw_cfg.host_last_cmd);
-		rtk_hw_cfg.host_last_cmd = NULL;
-	}
-
-	rtk_hw_cfg.host_last_cmd = nskb;
 
-	write(dd, nskb->data, nskb->data_len);
+	h5_send_cmd(dd, read_rom_patch_cmd, 3);
 	rtk_hw_cfg.hci_version_cmd_state = cmd_has_sent;
-	RS_DBG("RTK send HCI_VENDOR_READ_RTK_ROM_VERISION_Command\n");
-
-	alarm(0);
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_flags = SA_NOCLDSTOP;
-	sa.sa_handler = rtk_get_lmp_version_timeout;
-	sigaction(SIGALRM, &sa, NULL);
+	RS_DBG("RTK send HCI_VENDOR_READ_RTK_LMP_VERISION_Command\n");
 
-	alarm(3);
-	while (rtk_hw_cfg.hci_version_cmd_state != event_received) {
-		if ((retlen = read_check_rtk(dd, &bytes, READ_DATA_SIZE)) == -1) {
-			perror("read fail");
-			return;
-		}
-		h5_recv(&rtk_hw_cfg, &bytes, retlen);
-	}
-	alarm(0);
-	return;
+	return h5_wait_cmd_complete(dd, &rtk_hw_cfg.hci_version_cmd_state,
+				    3000, "rtk get lmp version");
 }
 
 static int rtk_max_retries = 5;
+static int rtk_cmd_timeout_ms = 1000;
 
-static void rtk_local_ver_sig_alarm(int sig)
+/**
+* Send an H4 command and read its command complete event, resending the
+* command every rtk_cmd_timeout_ms until rtk_max_retries is reached.
+*
+* @return length of the event on success, -1 on timeout
+*/
+static int rtk_h4_cmd(int fd, uint8_t *cmd, int len, uint8_t *result,
+		      const char *name)
 {
-	uint8_t cmd[4] = { 0x01, 0x01, 0x10, 0x00 };
-	static int retries;
+	struct timespec deadline;
+	struct pollfd pfd;
+	int retries;
+	int ret;
 
-	if (retries < rtk_max_retries) {
-		retries++;
-		if (write(rtk_hw_cfg.serial_fd, cmd, sizeof(cmd)) < 0)
-			return;
-		alarm(1);
-		return;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	for (retries = 0; retries < rtk_max_retries; retries++) {
+		if (write(fd, cmd, len) < 0) {
+			RS_ERR("%s: write fail, %s", name, strerror(errno));
+			return -1;
+		}
+		RTK_SNOOP_ADD(HCI_SNOOP_TX, cmd[0], cmd + 1, len - 1);
+
+		rtk_deadline(&deadline, rtk_cmd_timeout_ms);
+		while ((ret = poll(&pfd, 1, rtk_ms_left(&deadline))) != 0) {
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				RS_ERR("%s: poll fail, %s", name,
+				       strerror(errno));
+				return -1;
+			}
+			ret = read_hci_evt(fd, result, 0x0e);
+			if (ret >= 0)
+				return ret;
+			RS_ERR("%s: Read HCI event error.", name);
+		}
 	}
 
-	tcflush(rtk_hw_cfg.serial_fd, TCIOFLUSH);
-	RS_ERR("init timed out, read local ver fails");
-	exit(1);
+	tcflush(fd, TCIOFLUSH);
+	RS_ERR("init timed out, %s fails", name);
+	return -1;
 }
 
-static void rtk_hci_local_ver(int fd)
+static int rtk_hci_local_ver(int fd)
 {
-	struct sigaction sa;
+	uint8_t cmd[4] = { 0x01, 0x01, 0x10, 0x00 };
 	uint8_t result[258];
 	int ret;
 
-	alarm(0);
-
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_flags = SA_NOCLDSTOP;
-	sa.sa_handler = rtk_local_ver_sig_alarm;
-	sigaction(SIGALRM, &sa, NULL);
+	ret = rtk_h4_cmd(fd, cmd, sizeof(cmd), result, "read local ver");
+	if (ret < 0)
+		return -1;
 
-	rtk_local_ver_sig_alarm(0);
-
-	while (1) {
-		ret = read_hci_evt(fd, result, 0x0e);
-		/* break down is not needed if read fails, because the program
-		 * will exit when alarm timeout
-		 */
-		if (ret < 0)
-			RS_ERR("%s: Read HCI event error.", __func__);
-		else
-			break;
-	}
-
-	/* Cancel pending alarm */
-	alarm(0);
-
-	if (ret != 15) {
-		RS_ERR("%s: incorrect complete event, len %u", __func__, ret);
-		exit(1);
-	}
+	if (ret != 15) {
+		RS_ERR("%s: incorrect complete event, len %u", __func__, ret);
+		return -1;
+	}
 
 	if (result[6]) {
 		RS_ERR("%s: status is %u", __func__, result[6]);
-		exit(1);
+		return -1;
 	}
 
 	rtk_hw_cfg.hci_ver = result[7];
 	rtk_hw_cfg.hci_rev = (uint32_t)result[9] << 8 | result[8];
 	rtk_hw_cfg.lmp_subver = (uint32_t)result[14] << 8 | result[13];
-}
-
-static void rtk_rom_ver_sig_alarm(int sig)
-{
-	uint8_t cmd[4] = { 0x01, 0x6d, 0xfc, 0x00 };
-	static int retries;
-
-	if (retries < rtk_max_retries) {
-		retries++;
-		if (write(rtk_hw_cfg.serial_fd, cmd, sizeof(cmd)) < 0)
-			return;
-		alarm(1);
-		return;
-	}
 
-	tcflush(rtk_hw_cfg.serial_fd, TCIOFLUSH);
-	RS_ERR("init timed out, read rom ver fails");
-	exit(1);
+	return 0;
 }
 
-static void rtk_hci_rom_ver(int fd)
+static int rtk_hci_rom_ver(int fd)
 {
-	struct sigaction sa;
+	uint8_t cmd[4] = { 0x01, 0x6d, 0xfc, 0x00 };
 	uint8_t result[256];
 	int ret;
 
-	alarm(0);
-
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_flags = SA_NOCLDSTOP;
-	sa.sa_handler = rtk_rom_ver_sig_alarm;
-	sigaction(SIGALRM, &sa, NULL);
-
-	rtk_rom_ver_sig_alarm(0);
-
-	while (1) {
-		ret = read_hci_evt(fd, result, 0x0e);
-		/* break down is not needed if read fails, because the program
-		 * will exit when alarm timeout
-		 */
-		if (ret < 0)
-			RS_ERR("%s: Read HCI event error.", __func__);
-		else
-			break;
-	}
-
-	/* Cancel pending alarm */
-	alarm(0);
+	ret = rtk_h4_cmd(fd, cmd, sizeof(cmd), result, "read rom ver");
+	if (ret < 0)
+		return -1;
 
 	if (ret != 8) {
 		RS_ERR("%s: incorrect complete event, len %u", __func__, ret);
-		exit(1);
+		return -1;
 	}
 
 	if (result[6]) {
@@ -3147,6 +3515,8 @@ static void rtk_hci_rom_ver(int fd)
 		rtk_hw_cfg.eversion = 0;
 	} else
 		rtk_hw_cfg.eversion = result[7];
+
+	return 0;
 }
 
 uint8_t rtk_get_fw_project_id(uint8_t * p_buf)
@@ -3183,6 +3553,7 @@ struct rtk_epatch_entry *rtk_get_patch_entry(void)
 	struct rtk_epatch_entry *entry;
 	uint8_t *p;
 	uint16_t chip_id;
+	uint16_t num;
 	uint32_t tmp;
 
 	patch = (struct rtk_epatch *)rtk_hw_cfg.fw_buf;
@@ -3192,12 +3563,13 @@ struct rtk_epatch_entry *rtk_get_patch_entry(void)
 		return NULL;
 	}
 
-	patch->number_of_patch = le16_to_cpu(patch->number_of_patch);
+	/* fw_buf may be a read-only mapping */
+	num = le16_to_cpu(patch->number_of_patch);
 
 	RS_DBG("fw_ver 0x%08x, patch_num %d",
-	       le32_to_cpu(patch->fw_version), patch->number_of_patch);
+	       le32_to_cpu(patch->fw_version), num);
 
-	for (i = 0; i < patch->number_of_patch; i++) {
+	for (i = 0; i < num; i++) {
 		RS_DBG("chip id 0x%04x",
 			get_unaligned_le16(rtk_hw_cfg.fw_buf + 14 + 2 * i));
 		if (get_unaligned_le16(rtk_hw_cfg.fw_buf + 14 + 2 * i) ==
@@ -3205,11 +3577,11 @@ struct rtk_epatch_entry *rtk_get_patch_entry(void)
 			entry->chipID = rtk_hw_cfg.eversion + 1;
 			entry->patch_length =
 			    get_unaligned_le16(rtk_hw_cfg.fw_buf + 14 +
-					       2 * patch->number_of_patch +
+					       2 * num +
 					       2 * i);
 			entry->start_offset =
 			    get_unaligned_le32(rtk_hw_cfg.fw_buf + 14 +
-					       4 * patch->number_of_patch +
+					       4 * num +
 					       4 * i);
 			RS_DBG("patch length is 0x%x", entry->patch_length);
 			RS_DBG("start offset is 0x%x", entry->start_offset);
@@ -3232,7 +3604,7 @@ struct rtk_epatch_entry *rtk_get_patch_entry(void)
 
 	}
 
-	if (i == patch->number_of_patch) {
+	if (i == num) {
 		RS_ERR("failed to get entry");
 		free(entry);
 		entry = NULL;
@@ -3241,6 +3613,33 @@ struct rtk_epatch_entry *rtk_get_patch_entry(void)
 	return entry;
 }
 
+#ifdef RTK_LOW_MEMORY
+/**
+* Take the image as pieces of the firmware mapping and config instead of
+* merging them into total_buf. The segments own both buffers from here.
+*/
+static void rtk_patch_seg_add(struct btrtl_info *rtl, const uint8_t *data,
+			      int len)
+{
+	if (len <= 0)
+		return;
+	rtl->total_seg[rtl->total_nseg].data = data;
+	rtl->total_seg[rtl->total_nseg].len = len;
+	rtl->total_nseg++;
+	rtl->total_len += len;
+}
+
+static void rtk_patch_seg_own(struct btrtl_info *rtl)
+{
+	rtl->seg_fw_map = rtl->fw_buf;
+	rtl->seg_fw_len = rtl->fw_len;
+	rtl->seg_config = rtl->config_len > 0 ? rtl->config_buf : NULL;
+	rtl->fw_len = 0;
+	rtl->config_len = 0;
+	rtl->dl_fw_flag = 1;
+}
+#endif
+
 void rtk_get_final_patch(int fd, int proto)
 {
 	struct btrtl_info *rtl = &rtk_hw_cfg;
@@ -3256,6 +3655,16 @@ void rtk_get_final_patch(int fd, int proto)
 			rtl->dl_fw_flag = 0;
 			goto free_buf;
 		} else {
+#ifdef RTK_LOW_MEMORY
+			if (rtk_low_memory) {
+				rtl->total_len = 0;
+				rtk_patch_seg_add(rtl, rtl->fw_buf, rtl->fw_len);
+				rtk_patch_seg_add(rtl, rtl->config_buf,
+						  rtl->config_len);
+				rtk_patch_seg_own(rtl);
+				goto free_buf;
+			}
+#endif
 			rtl->total_len = rtl->config_len + rtl->fw_len;
 			if (!(rtl->total_buf = malloc(rtl->total_len))) {
 				RS_ERR("Can't alloc mem for fw/config, errno:%d",
@@ -3345,6 +3754,19 @@ void rtk_get_final_patch(int fd, int proto)
 		goto free_buf;
 	}
 
+#ifdef RTK_LOW_MEMORY
+	/* The last 4 bytes of the patch are replaced with the fw version */
+	if (rtk_low_memory && entry->patch_length >= 4) {
+		rtl->total_len = 0;
+		rtk_patch_seg_add(rtl, rtl->fw_buf + entry->start_offset,
+				  entry->patch_length - 4);
+		rtk_patch_seg_add(rtl, (uint8_t *)&patch->fw_version, 4);
+		rtk_patch_seg_add(rtl, rtl->config_buf, rtl->config_len);
+		rtk_patch_seg_own(rtl);
+		goto free_buf;
+	}
+#endif
+
 	if (!(rtl->total_buf = malloc(rtl->total_len))) {
 		RS_ERR("Can't alloc memory for multi fw&config, errno:%d",
 		       errno);
@@ -3370,7 +3792,7 @@ void rtk_get_final_patch(int fd, int proto)
 
 free_buf:
 	if (rtl->fw_len > 0) {
-		free(rtl->fw_buf);
+		rtk_free_bt_firmware(rtl->fw_buf, rtl->fw_len);
 		rtl->fw_len = 0;
 	}
 
@@ -3383,185 +3805,1472 @@ free_buf:
 		free(entry);
 }
 
+#ifdef RTK_PATCH_CACHE
+/*
+ * Everything the merged blob depends on. The bdaddr and the extra config
+ * are patched into the config while parsing, so their files are part of
+ * the config hash.
+ */
+struct rtk_patch_cache_key {
+	uint32_t magic;
+	uint16_t lmp_subver;
+	uint8_t eversion;
+	uint8_t chip_type;
+	uint8_t proto;
+	uint8_t pad[3];
+	uint32_t cfg_hash;
+	char bdaddr[20];
+	int64_t fw_mtime;
+	int64_t fw_size;
+	int64_t cfg_mtime;
+	int64_t cfg_size;
+};
+
+struct rtk_patch_cache_hdr {
+	struct rtk_patch_cache_key key;
+	/* results of rtk_parse_config_file() */
+	uint32_t baudrate;
+	uint8_t hw_flow_control;
+	uint8_t parity_en;
+	uint8_t parity_even;
+	uint8_t pad;
+	uint32_t total_len;
+	uint16_t crc;
+	uint16_t pad2;
+};
+
+static struct rtk_patch_cache_key patch_cache_key;
+
+static uint32_t rtk_hash_file(uint32_t hash, const char *path)
+{
+	uint8_t buf[256];
+	ssize_t n, i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return hash;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		/* FNV-1a */
+		for (i = 0; i < n; i++)
+			hash = (hash ^ buf[i]) * 16777619u;
+	}
+	close(fd);
+
+	return hash;
+}
+
+static void rtk_patch_cache_path(char *path, size_t size)
+{
+	snprintf(path, size, "%s%s.%04x.%u.bin", RTK_PATCH_CACHE_DIR,
+		 rtk_hw_cfg.patch_ent->patch_file, rtk_hw_cfg.lmp_subver,
+		 rtk_hw_cfg.eversion);
+}
+
 /**
-* Config realtek Bluetooth. The configuration parameter is get from config file and fw.
-* Config file is rtk8723_bt_config. which is set in rtk_get_bt_config.
-* fw file is "rlt8723a_chip_b_cut_bt40_fw", which is set in get_firmware_name.
+* Build the key of the prepared patch for the attached controller.
 *
-* @warning maybe only one of config file and fw file exists. The bt_addr arg is stored in "/data/btmac.txt"
-* or "/data/misc/bluetoothd/bt_mac/btmac.txt",
-*
-* @param fd uart file descriptor
-* @param proto realtek Bluetooth protocol, shall be either HCI_UART_H4 or HCI_UART_3WIRE
-* @param speed init_speed in uart struct
-* @param ti termios struct
-* @returns #0 on success
+* @return #0 on success, -1 if the firmware or config file is missing
 */
-static int rtk_config(int fd, int proto, int speed, struct termios *ti)
+static int rtk_patch_cache_key_init(void)
 {
-	int final_speed = 0;
-	int ret = 0;
-	struct btrtl_info *btrtl = &rtk_hw_cfg;
-
-	btrtl->proto = proto;
+	struct rtk_patch_cache_key *key = &patch_cache_key;
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
 
-	/* Get Local Version Information and RTK ROM version */
-	if (proto == HCI_UART_3WIRE) {
-		RS_INFO("H5 IC");
-		rtk_get_lmp_version(fd);
-		rtk_get_eversion(fd);
-	} else {
-		RS_INFO("H4 IC");
-		ti->c_cflag &= ~PARENB;
-		ti->c_cflag |= CRTSCTS;
-		if (tcsetattr(fd, TCSANOW, ti) < 0) {
-			RS_ERR("H4 Can't enable RTSCTS");
-			return -1;
-		}
-		usleep(20 * 1000);
-		rtk_hci_local_ver(fd);
-		rtk_hci_rom_ver(fd);
-		if (rtk_hw_cfg.lmp_subver == ROM_LMP_8761btc) {
-			rtk_hw_cfg.chip_type = CHIP_8761BTC;
-			rtk_hw_cfg.hw_flow_control = 1;
-			/* TODO: Change to different uart baud */
-			uart_speed_to_rtk_speed(1500000, &rtk_hw_cfg.baudrate);
-			goto change_baud;
-		} else if (rtk_hw_cfg.lmp_subver == ROM_LMP_8761a) {
-			if (rtk_hw_cfg.hci_rev == 0x000b) {
-				rtk_hw_cfg.chip_type = CHIP_8761B;
-				rtk_hw_cfg.hw_flow_control = 1;
-				/* TODO: Change to different uart baud */
-				uart_speed_to_rtk_speed(1500000, &rtk_hw_cfg.baudrate);
-				goto change_baud;
-			} else if (rtk_hw_cfg.hci_rev == 0x000a) {
-				if (rtk_hw_cfg.eversion == 3)
-					rtk_hw_cfg.chip_type = CHIP_8761ATF;
-				else if (rtk_hw_cfg.eversion == 2)
-					rtk_hw_cfg.chip_type = CHIP_8761AT;
-				else
-					rtk_hw_cfg.chip_type = CHIP_UNKNOWN;
-			}
-		} else if (rtk_hw_cfg.lmp_subver == ROM_LMP_8723b) {
-			if (rtk_hw_cfg.hci_ver == 0x08 &&
-			    rtk_hw_cfg.hci_rev == 0x000d) {
-				rtk_hw_cfg.chip_type = CHIP_8723DS;
-			} else if (rtk_hw_cfg.hci_ver == 0x06 &&
-				 rtk_hw_cfg.hci_rev == 0x000b) {
-				rtk_hw_cfg.chip_type = CHIP_8723BS;
-			} else {
-				RS_ERR("H4: unknown chip");
-				return -1;
-			}
-		}
+	memset(key, 0, sizeof(*key));
+	key->magic = RTK_PATCH_CACHE_MAGIC;
+	key->lmp_subver = rtk_hw_cfg.lmp_subver;
+	key->eversion = rtk_hw_cfg.eversion;
+	key->chip_type = rtk_hw_cfg.chip_type;
+	key->proto = rtk_hw_cfg.proto;
 
-	}
+	snprintf(path, sizeof(path), "%s%s", FIRMWARE_DIRECTORY,
+		 rtk_hw_cfg.patch_ent->patch_file);
+	if (stat(path, &st) < 0)
+		return -1;
+	key->fw_mtime = st.st_mtime;
+	key->fw_size = st.st_size;
 
-	RS_INFO("LMP Subversion 0x%04x", btrtl->lmp_subver);
-	RS_INFO("EVersion %d", btrtl->eversion);
+	snprintf(path, sizeof(path), "%s%s", BT_CONFIG_DIRECTORY,
+		 rtk_hw_cfg.patch_ent->config_file);
+	if (stat(path, &st) < 0)
+		return -1;
+	key->cfg_mtime = st.st_mtime;
+	key->cfg_size = st.st_size;
 
-	switch (rtk_hw_cfg.lmp_subver) {
-	case ROM_LMP_8723a:
-		break;
-	case ROM_LMP_8723b:
-#ifdef RTL_8703A_SUPPORT
-		/* Set chip type for matching fw/config entry */
-		rtl->chip_type = CHIP_8703AS;
+	key->cfg_hash = rtk_hash_file(2166136261u, path);
+#ifdef EXTRA_CONFIG_OPTION
+	key->cfg_hash = rtk_hash_file(key->cfg_hash, EXTRA_CONFIG_FILE);
 #endif
-		break;
-	case ROM_LMP_8821a:
-		break;
-	case ROM_LMP_8761a:
-		break;
-	case ROM_LMP_8703b:
-		rtk_get_chip_type(fd);
-		break;
+#ifdef USE_CUSTOMER_ADDRESS
+	fd = open(BT_ADDR_FILE, O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, key->bdaddr, 17) < 0)
+			memset(key->bdaddr, 0, sizeof(key->bdaddr));
+		close(fd);
 	}
+#endif
 
-	btrtl->patch_ent = get_patch_entry(btrtl);
-	if (btrtl->patch_ent) {
-		RS_INFO("IC: %s\n", btrtl->patch_ent->ic_name);
-		RS_INFO("Firmware/config: %s, %s\n",
-			btrtl->patch_ent->patch_file,
-			btrtl->patch_ent->config_file);
-	} else {
-		RS_ERR("Can not find firmware/config entry\n");
-		return -1;
-	}
+	return 0;
+}
 
-	rtk_hw_cfg.config_len =
-	    rtk_get_bt_config(btrtl, &btrtl->config_buf, &btrtl->baudrate);
-	if (rtk_hw_cfg.config_len < 0) {
-		RS_ERR("Get Config file error, just use efuse settings");
-		rtk_hw_cfg.config_len = 0;
-	}
+/**
+* Map the prepared patch from the cache. On a hit total_buf points into
+* the mapping and the config parsing and fw/config merge are skipped.
+*
+* @return #0 on hit, -1 on miss
+*/
+static int rtk_patch_cache_load(void)
+{
+	struct rtk_patch_cache_hdr *hdr;
+	char path[PATH_MAX];
+	struct stat st;
+	uint8_t *map;
+	int fd;
 
-	rtk_hw_cfg.fw_len = rtk_get_bt_firmware(btrtl, &btrtl->fw_buf);
-	if (rtk_hw_cfg.fw_len < 0) {
-		RS_ERR("Get BT firmware error");
-		rtk_hw_cfg.fw_len = 0;
+	if (rtk_patch_cache_key_init() < 0)
 		return -1;
-	} else {
-		rtk_get_final_patch(fd, proto);
-	}
 
-	if (rtk_hw_cfg.total_len > RTK_PATCH_LENGTH_MAX) {
-		RS_ERR("total length of fw&config larger than allowed");
+	rtk_patch_cache_path(path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
 		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		goto invalid;
 	}
 
-	RS_INFO("Total len %d for fw/config", rtk_hw_cfg.total_len);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
 
-	if (rtk_hw_cfg.chip_type == CHIP_8723DS &&
-	    rtk_hw_cfg.proto == HCI_UART_H4) {
-		if (rtk_hw_cfg.parity_en) {
-			/* set parity */
-			ti->c_cflag |= PARENB;
-			if (rtk_hw_cfg.parity_even)
-				ti->c_cflag &= ~(PARODD);
-			else
-				ti->c_cflag |= PARODD;
-			if (tcsetattr(fd, TCSANOW, ti) < 0) {
-				RS_ERR("8723DSH4 Can't set parity");
-				return -1;
-			}
-		}
+	hdr = (struct rtk_patch_cache_hdr *)map;
+	if (memcmp(&hdr->key, &patch_cache_key, sizeof(hdr->key)) ||
+	    hdr->total_len != st.st_size - sizeof(*hdr) ||
+	    hdr->total_len > RTK_PATCH_LENGTH_MAX ||
+	    h5_crc_buf(0xffff, map + sizeof(*hdr), hdr->total_len) != hdr->crc) {
+		munmap(map, st.st_size);
+		goto invalid;
 	}
 
-change_baud:
-	/* change baudrate if needed
-	 * rtk_hw_cfg.baudrate is a __u32/__u16 vendor-specific variable
-	 * parsed from config file
-	 * */
-	if (rtk_hw_cfg.baudrate == 0) {
-		uart_speed_to_rtk_speed(speed, &rtk_hw_cfg.baudrate);
-		RS_DBG("No cfg file, set baudrate, : %u, 0x%08x",
-		       (unsigned int)speed, (unsigned int)rtk_hw_cfg.baudrate);
-		goto SET_FLOW_CONTRL;
-	} else
-		rtk_speed_to_uart_speed(rtk_hw_cfg.baudrate,
-					(RT_U32 *) & (rtk_hw_cfg.final_speed));
+	rtk_hw_cfg.baudrate = hdr->baudrate;
+	rtk_hw_cfg.hw_flow_control = hdr->hw_flow_control;
+	rtk_hw_cfg.parity_en = hdr->parity_en;
+	rtk_hw_cfg.parity_even = hdr->parity_even;
+	rtk_hw_cfg.total_len = hdr->total_len;
+	rtk_hw_cfg.total_buf = map + sizeof(*hdr);
+	rtk_hw_cfg.total_map = map;
+	rtk_hw_cfg.total_map_len = st.st_size;
+	rtk_hw_cfg.dl_fw_flag = 1;
 
-	if (proto == HCI_UART_3WIRE)
-		rtk_vendor_change_speed_h5(fd, rtk_hw_cfg.baudrate);
-	else
-		rtk_vendor_change_speed_h4(fd, rtk_hw_cfg.baudrate);
+	RS_INFO("Prepared patch %s, len %u", path, hdr->total_len);
+	return 0;
 
-	usleep(50000);
-	final_speed = rtk_hw_cfg.final_speed ? rtk_hw_cfg.final_speed : speed;
-	RS_DBG("final_speed %d\n", final_speed);
-	if (set_speed(fd, ti, final_speed) < 0) {
-		RS_ERR("Can't set baud rate:%x, %x, %x", final_speed,
-		       rtk_hw_cfg.final_speed, speed);
-		return -1;
-	}
+invalid:
+	RS_INFO("Prepared patch %s is stale", path);
+	unlink(path);
+	return -1;
+}
 
-SET_FLOW_CONTRL:
-	if (rtk_hw_cfg.hw_flow_control) {
-		RS_DBG("hw flow control enable");
-		ti->c_cflag |= CRTSCTS;
+/* Write the merged fw & config, which may still be in segments */
+static int rtk_patch_cache_write(int fd)
+{
+#ifdef RTK_LOW_MEMORY
+	int i;
 
-		if (tcsetattr(fd, TCSANOW, ti) < 0) {
+	for (i = 0; i < rtk_hw_cfg.total_nseg; i++)
+		if (write(fd, rtk_hw_cfg.total_seg[i].data,
+			  rtk_hw_cfg.total_seg[i].len) !=
+		    rtk_hw_cfg.total_seg[i].len)
+			return -1;
+	if (rtk_hw_cfg.total_nseg)
+		return 0;
+#endif
+	if (write(fd, rtk_hw_cfg.total_buf, rtk_hw_cfg.total_len) !=
+	    rtk_hw_cfg.total_len)
+		return -1;
+
+	return 0;
+}
+
+/**
+* Store the merged fw & config blob together with the config parsing
+* results. The file is written aside and renamed, so an interrupted
+* attach never leaves a torn cache behind.
+*/
+static void rtk_patch_cache_store(void)
+{
+	struct rtk_patch_cache_hdr hdr;
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 8];
+	int fd;
+#ifdef RTK_LOW_MEMORY
+	int i;
+#endif
+
+	if (!rtk_hw_cfg.dl_fw_flag || rtk_hw_cfg.total_len <= 0 ||
+	    patch_cache_key.magic != RTK_PATCH_CACHE_MAGIC)
+		return;
+
+	if (mkdir(RTK_PATCH_CACHE_DIR, 0755) < 0 && errno != EEXIST) {
+		RS_DBG("Can't create %s, %s", RTK_PATCH_CACHE_DIR,
+		       strerror(errno));
+		return;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.key = patch_cache_key;
+	hdr.baudrate = rtk_hw_cfg.baudrate;
+	hdr.hw_flow_control = rtk_hw_cfg.hw_flow_control;
+	hdr.parity_en = rtk_hw_cfg.parity_en;
+	hdr.parity_even = rtk_hw_cfg.parity_even;
+	hdr.total_len = rtk_hw_cfg.total_len;
+#ifdef RTK_LOW_MEMORY
+	if (rtk_hw_cfg.total_nseg) {
+		hdr.crc = 0xffff;
+		for (i = 0; i < rtk_hw_cfg.total_nseg; i++)
+			hdr.crc = h5_crc_buf(hdr.crc,
+					     rtk_hw_cfg.total_seg[i].data,
+					     rtk_hw_cfg.total_seg[i].len);
+	} else
+#endif
+	hdr.crc = h5_crc_buf(0xffff, rtk_hw_cfg.total_buf,
+			     rtk_hw_cfg.total_len);
+
+	rtk_patch_cache_path(path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		RS_DBG("Can't create %s, %s", tmp, strerror(errno));
+		return;
+	}
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    rtk_patch_cache_write(fd) < 0 || fsync(fd) < 0) {
+		RS_ERR("Can't write %s, %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+
+	if (rename(tmp, path) < 0) {
+		RS_ERR("Can't rename %s, %s", tmp, strerror(errno));
+		unlink(tmp);
+		return;
+	}
+
+	RS_INFO("Stored prepared patch %s", path);
+}
+#endif
+
+#ifdef RTK_PREPARED_FW
+static const char *rtk_prepared_fw;
+
+void rtk_set_prepared_fw(const char *path)
+{
+	rtk_prepared_fw = path;
+}
+
+/**
+* Map the blob rtk_fwprep built for this controller in place of loading
+* and merging the fw and config files. The mapping is private, so the
+* customer bdaddr can be patched in without touching the file. The extra
+* config options are baked in on the build host.
+*
+* @param path prepared blob
+* @return #0 on success, -1 if it is missing or made for another controller
+*/
+static int rtk_prepared_fw_load(const char *path)
+{
+	const struct rtk_fw_blob_hdr *hdr;
+	struct patch_info *ent = rtk_hw_cfg.patch_ent;
+	struct stat st;
+	uint8_t *map;
+	int fd;
+#ifdef USE_CUSTOMER_ADDRESS
+	uint8_t bt_addr[6];
+	int i;
+#endif
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		RS_ERR("Can't open prepared patch %s, %s", path,
+		       strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		RS_ERR("Can't stat %s, %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		RS_ERR("Can't map %s, %s", path, strerror(errno));
+		return -1;
+	}
+
+	hdr = rtk_fw_blob_check(map, st.st_size);
+	if (!hdr) {
+		RS_ERR("%s is not a valid prepared patch", path);
+		goto fail;
+	}
+
+	if (hdr->proto != rtk_hw_cfg.proto ||
+	    hdr->lmp_subver != rtk_hw_cfg.lmp_subver ||
+	    hdr->eversion != rtk_hw_cfg.eversion ||
+	    hdr->chip_type != ent->chip_type) {
+		RS_ERR("%s is for lmp subver %04x, eversion %u, chip type %02x",
+		       path, hdr->lmp_subver, hdr->eversion, hdr->chip_type);
+		goto fail;
+	}
+
+	if ((hdr->flags & RTK_FW_BLOB_H4_CMDS) && hdr->proto != HCI_UART_H4) {
+		RS_ERR("%s holds H4 commands", path);
+		goto fail;
+	}
+
+#ifdef USE_CUSTOMER_ADDRESS
+	if (hdr->bdaddr_off && rtk_get_customer_bdaddr(bt_addr) == 0) {
+		for (i = 0; i < 6; i++)
+			map[sizeof(*hdr) +
+			    rtk_fw_blob_data_off(hdr, hdr->bdaddr_off + i)] =
+				bt_addr[i];
+		RS_INFO("BT MAC %02x:%02x:%02x:%02x:%02x:%02x", bt_addr[5],
+			bt_addr[4], bt_addr[3], bt_addr[2], bt_addr[1],
+			bt_addr[0]);
+	}
+#endif
+
+	rtk_hw_cfg.baudrate = hdr->baudrate;
+	rtk_hw_cfg.hw_flow_control = hdr->hw_flow_control;
+	rtk_hw_cfg.parity_en = hdr->parity_en;
+	rtk_hw_cfg.parity_even = hdr->parity_even;
+	rtk_hw_cfg.total_len = hdr->data_len;
+	rtk_hw_cfg.total_buf = map + sizeof(*hdr);
+	rtk_hw_cfg.total_map = map;
+	rtk_hw_cfg.total_map_len = st.st_size;
+	if (hdr->flags & RTK_FW_BLOB_H4_CMDS)
+		rtk_hw_cfg.total_cmds = hdr->n_cmds;
+	rtk_hw_cfg.dl_fw_flag = 1;
+
+	RS_INFO("Prepared patch %s, svn %u, len %u%s", path, hdr->svn_ver,
+		hdr->data_len, rtk_hw_cfg.total_cmds ? ", H4 commands" : "");
+	return 0;
+
+fail:
+	munmap(map, st.st_size);
+	return -1;
+}
+
+/**
+* Stream the ready 0xfc20 commands of a prepared patch, each written
+* straight from the mapping.
+*
+* @param fd uart file descriptor
+* @param cmds H4 commands back to back, the last one flagged with 0x80
+* @param n number of commands
+* @return #0 on success
+*/
+static int rtk_download_fw_cmds_h4(int fd, const uint8_t *cmds, int n)
+{
+	int i, len, index;
+
+	for (i = 0; i < n; i++) {
+		len = 4 + cmds[3];
+		index = hci_send_patch_h4(fd, cmds, len);
+		if (index < 0 || (i < n - 1 && index != cmds[4])) {
+			RS_ERR("Patch command %d, index %u, got %d", i,
+			       cmds[4], index);
+			return -1;
+		}
+		cmds += len;
+	}
+
+	return 0;
+}
+#endif
+
+static void rtk_free_total_buf(void)
+{
+#ifdef RTK_LOW_MEMORY
+	if (rtk_hw_cfg.total_nseg) {
+		rtk_free_bt_firmware(rtk_hw_cfg.seg_fw_map,
+				     rtk_hw_cfg.seg_fw_len);
+		free(rtk_hw_cfg.seg_config);
+		rtk_hw_cfg.seg_fw_map = NULL;
+		rtk_hw_cfg.seg_config = NULL;
+		rtk_hw_cfg.total_nseg = 0;
+	}
+#endif
+	if (!rtk_hw_cfg.total_buf)
+		return;
+
+	if (rtk_hw_cfg.total_map)
+		munmap(rtk_hw_cfg.total_map, rtk_hw_cfg.total_map_len);
+	else
+		free(rtk_hw_cfg.total_buf);
+	rtk_hw_cfg.total_buf = NULL;
+	rtk_hw_cfg.total_map = NULL;
+	rtk_hw_cfg.total_map_len = 0;
+	rtk_hw_cfg.total_cmds = 0;
+}
+
+#define RTK_PHASE_MAX	8
+
+/* Startup phases, reported once the controller is set up */
+static struct {
+	const char *name;
+	long us;
+} rtk_phases[RTK_PHASE_MAX];
+static int rtk_phase_num;
+static struct timespec rtk_phase_ts;
+static struct timespec rtk_start_ts;
+
+static long rtk_elapsed_us(struct timespec *since)
+{
+	struct timespec now;
+	long us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - since->tv_sec) * 1000000 +
+	     (now.tv_nsec - since->tv_nsec) / 1000;
+	*since = now;
+
+	return us;
+}
+
+static void rtk_phase_reset(void)
+{
+	rtk_phase_num = 0;
+	clock_gettime(CLOCK_MONOTONIC, &rtk_start_ts);
+	rtk_phase_ts = rtk_start_ts;
+}
+
+static void rtk_phase_mark(const char *name)
+{
+	long us = rtk_elapsed_us(&rtk_phase_ts);
+
+	if (rtk_phase_num < RTK_PHASE_MAX) {
+		rtk_phases[rtk_phase_num].name = name;
+		rtk_phases[rtk_phase_num].us = us;
+		rtk_phase_num++;
+	}
+}
+
+/*
+ * Firmware and config files are read and parsed on a worker thread while
+ * the remaining version queries are in flight.
+ */
+static struct {
+	pthread_t thread;
+	int started;
+	struct patch_info *ent;
+	uint8_t *config_buf;
+	int config_len;
+	RT_U32 baudrate;
+	uint8_t *fw_buf;
+	int fw_len;
+	long us;
+} rtk_prefetch;
+
+static void rtk_phase_report(void)
+{
+	struct timespec ts = rtk_start_ts;
+	int i;
+
+	RS_INFO("Startup timing:");
+	for (i = 0; i < rtk_phase_num; i++)
+		RS_INFO("  %-12s %6ld.%03ld ms", rtk_phases[i].name,
+			rtk_phases[i].us / 1000, rtk_phases[i].us % 1000);
+	if (rtk_prefetch.us)
+		RS_INFO("  %-12s %6ld.%03ld ms (worker)", "files",
+			rtk_prefetch.us / 1000, rtk_prefetch.us % 1000);
+	RS_INFO("  %-12s %6ld ms", "total", rtk_elapsed_us(&ts) / 1000);
+}
+
+static void *rtk_prefetch_thread(void *arg)
+{
+	struct btrtl_info *btrtl = &rtk_hw_cfg;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rtk_prefetch.config_len = rtk_get_bt_config(btrtl,
+						    &rtk_prefetch.config_buf,
+						    &rtk_prefetch.baudrate);
+	rtk_prefetch.fw_len = rtk_get_bt_firmware(btrtl, &rtk_prefetch.fw_buf);
+	rtk_prefetch.us = rtk_elapsed_us(&ts);
+
+	return NULL;
+}
+
+/**
+* Start reading the firmware and config files once the probed versions
+* identify the patch entry. Chips that need further queries to pick
+* their entry fall back to the synchronous load.
+*/
+static void rtk_prefetch_start(void)
+{
+	struct patch_info *ent = get_patch_entry(&rtk_hw_cfg);
+
+	memset(&rtk_prefetch, 0, sizeof(rtk_prefetch));
+	if (!ent || !ent->lmp_subver)
+		return;
+#ifdef RTK_PREPARED_FW
+	/* The files may not even be in the image */
+	if (rtk_prepared_fw)
+		return;
+#endif
+
+	rtk_hw_cfg.patch_ent = ent;
+	rtk_prefetch.ent = ent;
+	if (pthread_create(&rtk_prefetch.thread, NULL, rtk_prefetch_thread,
+			   NULL)) {
+		RS_DBG("Can't start prefetch, %s", strerror(errno));
+		return;
+	}
+	rtk_prefetch.started = 1;
+}
+
+static void rtk_prefetch_free(void)
+{
+	if (rtk_prefetch.config_len > 0)
+		free(rtk_prefetch.config_buf);
+	if (rtk_prefetch.fw_len > 0)
+		rtk_free_bt_firmware(rtk_prefetch.fw_buf, rtk_prefetch.fw_len);
+	rtk_prefetch.config_len = 0;
+	rtk_prefetch.fw_len = 0;
+}
+
+/* Drop whatever the worker loaded when the download path bails out */
+static void rtk_prefetch_discard(void)
+{
+	if (rtk_prefetch.started) {
+		pthread_join(rtk_prefetch.thread, NULL);
+		rtk_prefetch.started = 0;
+	}
+	rtk_prefetch_free();
+}
+
+/**
+* Wait for the worker to finish.
+*
+* @param ent patch entry picked after all version queries
+* @return #1 if the prefetched files belong to ent, #0 otherwise
+*/
+static int rtk_prefetch_join(struct patch_info *ent)
+{
+	if (!rtk_prefetch.started)
+		return 0;
+
+	pthread_join(rtk_prefetch.thread, NULL);
+	rtk_prefetch.started = 0;
+
+	if (rtk_prefetch.ent == ent)
+		return 1;
+
+	RS_INFO("Prefetched %s does not match, reloading",
+		rtk_prefetch.ent->patch_file);
+	rtk_prefetch_free();
+	return 0;
+}
+
+#if defined(RTK_AUTO_BAUD) || defined(RTK_FAST_REATTACH)
+/**
+* Replace a small state file under dir with one line of text, so that a
+* reader never sees it half written.
+*/
+static void rtk_state_write(const char *dir, const char *path,
+			    const char *line)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		RS_DBG("Can't create %s, %s", dir, strerror(errno));
+		return;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		RS_DBG("Can't create %s, %s", tmp, strerror(errno));
+		return;
+	}
+
+	fputs(line, fp);
+	if (fflush(fp) || fsync(fileno(fp)) < 0) {
+		RS_ERR("Can't write %s, %s", tmp, strerror(errno));
+		fclose(fp);
+		unlink(tmp);
+		return;
+	}
+	fclose(fp);
+
+	if (rename(tmp, path) < 0) {
+		RS_ERR("Can't rename %s, %s", tmp, strerror(errno));
+		unlink(tmp);
+	}
+}
+#endif
+
+#ifdef RTK_AUTO_BAUD
+/* Candidate rates, fastest first */
+static const int rtk_auto_bauds[] = { 3000000, 2000000, 1500000, 921600 };
+static int rtk_echo_supported = 1;
+
+/**
+* Look up the vendor code of a uart speed. The code parsed from the config
+* file wins when it maps to the same speed.
+*
+* @return #1 if the speed is in baudrates, #0 otherwise
+*/
+static int rtk_auto_baud_code(int speed, RT_U32 *code)
+{
+	RT_U32 cfg_speed = 0;
+	unsigned int i;
+
+	if (rtk_hw_cfg.baudrate) {
+		rtk_speed_to_uart_speed(rtk_hw_cfg.baudrate, &cfg_speed);
+		if ((int)cfg_speed == speed) {
+			*code = rtk_hw_cfg.baudrate;
+			return 1;
+		}
+	}
+
+	for (i = 0; i < sizeof(baudrates) / sizeof(baudrate_ex); i++) {
+		if (baudrates[i].uart_speed == speed) {
+			*code = baudrates[i].rtk_speed;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+* Read the rate persisted by a previous attach of the same controller.
+*
+* The record is "ok" for a rate that passed, "try" for a rate being probed
+* and "none" once every probe failed in an orderly way. A "try" record
+* found here means the probe never came back. The rate of a "none" record
+* is the limit that was in force, 0 when there was none.
+*
+* @param speed where the rate is stored
+* @param state where the state is stored
+* @return #0 on success, -1 if there is no usable record
+*/
+static int rtk_auto_baud_load(int *speed, char state[8])
+{
+	unsigned int subver;
+	FILE *fp;
+	int n;
+
+	fp = fopen(RTK_AUTO_BAUD_FILE, "r");
+	if (!fp)
+		return -1;
+
+	n = fscanf(fp, "%x %d %7s", &subver, speed, state);
+	fclose(fp);
+
+	if (n != 3 || subver != rtk_hw_cfg.lmp_subver)
+		return -1;
+
+	return 0;
+}
+
+static void rtk_auto_baud_save(int speed, const char *state)
+{
+	char line[32];
+
+	snprintf(line, sizeof(line), "%04x %d %s\n", rtk_hw_cfg.lmp_subver,
+		 speed, state);
+	rtk_state_write(RTK_AUTO_BAUD_DIR, RTK_AUTO_BAUD_FILE, line);
+}
+
+/**
+* Ask the controller to switch to speed and follow with the host uart.
+*/
+static int rtk_auto_baud_switch(int fd, int proto, struct termios *ti,
+				RT_U32 code, int speed)
+{
+	int ret;
+
+	if (proto == HCI_UART_3WIRE) {
+		rtk_hw_cfg.link_estab_state = H5_INIT;
+		ret = rtk_vendor_change_speed_h5(fd, code);
+		/* keep routing command complete events */
+		rtk_hw_cfg.link_estab_state = H5_INIT;
+	} else {
+		ret = rtk_vendor_change_speed_h4(fd, code);
+	}
+	if (ret < 0)
+		return -1;
+
+	usleep(50000);
+	if (set_speed(fd, ti, speed) < 0) {
+		RS_ERR("Auto baud: can't set host speed %d", speed);
+		return -1;
+	}
+	tcflush(fd, TCIFLUSH);
+
+	return 0;
+}
+
+static int rtk_auto_baud_version(int fd, int proto)
+{
+	RT_U16 subver = rtk_hw_cfg.lmp_subver;
+	int ret;
+
+	if (proto == HCI_UART_3WIRE)
+		ret = rtk_get_lmp_version(fd);
+	else
+		ret = rtk_hci_local_ver(fd);
+
+	if (ret < 0 || rtk_hw_cfg.lmp_subver != subver) {
+		rtk_hw_cfg.lmp_subver = subver;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+* Write or read the local name of the controller.
+*
+* @return #0 on success, #1 if the controller does not support the
+* command, -1 on timeout
+*/
+static int rtk_auto_baud_name(int fd, int proto, uint8_t *name, int set)
+{
+	uint16_t opcode = set ? HCI_CMD_WRITE_LOCAL_NAME :
+				  HCI_CMD_READ_LOCAL_NAME;
+	const char *what = set ? "write local name" : "read local name";
+	uint8_t cmd[4 + RTK_ECHO_LEN];
+	uint8_t result[258];
+	int len = set ? RTK_ECHO_LEN : 0;
+	int ret;
+
+	cmd[0] = HCI_COMMAND_PKT;
+	cmd[1] = opcode & 0xff;
+	cmd[2] = opcode >> 8;
+	cmd[3] = len;
+	if (set)
+		memcpy(cmd + 4, name, RTK_ECHO_LEN);
+
+	if (proto == HCI_UART_3WIRE) {
+		rtk_hw_cfg.echo_cmd_state = cmd_has_sent;
+		h5_send_cmd(fd, cmd + 1, 3 + len);
+		if (h5_wait_cmd_complete(fd, &rtk_hw_cfg.echo_cmd_state, 500,
+					 what) < 0)
+			return -1;
+		if (rtk_hw_cfg.echo_status)
+			return 1;
+		if (!set)
+			memcpy(name, rtk_hw_cfg.echo_name, RTK_ECHO_LEN);
+		return 0;
+	}
+
+	ret = rtk_h4_cmd(fd, cmd, 4 + len, result, what);
+	if (set ? ret < 7 : ret != 7 + RTK_ECHO_LEN)
+		return -1;
+	if (result[6])
+		return 1;
+	if (!set)
+		memcpy(name, result + 7, RTK_ECHO_LEN);
+	return 0;
+}
+
+/**
+* Write a pattern as the local name and read it back. rtk_auto_baud()
+* puts the original name back once probing is over.
+*
+* @return #0 if the name came back intact, #1 if the controller does not
+* support the commands, -1 on mismatch or timeout
+*/
+static int rtk_auto_baud_echo(int fd, int proto, int round)
+{
+	uint8_t name[RTK_ECHO_LEN];
+	uint8_t echo[RTK_ECHO_LEN];
+	int ret;
+	int i;
+
+	/* avoid NUL, the controller may cut the name there */
+	for (i = 0; i < RTK_ECHO_LEN; i++)
+		name[i] = 0x20 + (i * 7 + round * 29) % 0x5f;
+
+	ret = rtk_auto_baud_name(fd, proto, name, 1);
+	if (!ret)
+		ret = rtk_auto_baud_name(fd, proto, echo, 0);
+	if (ret)
+		return ret;
+
+	return memcmp(echo, name, RTK_ECHO_LEN) ? -1 : 0;
+}
+
+/**
+* Check the link at the current rate. Retransmission is turned off so
+* that a single lost or corrupted packet fails the rate.
+*
+* @return #0 if the link is stable
+*/
+static int rtk_auto_baud_verify(int fd, int proto, int speed)
+{
+	int h5_retries = rtk_hw_cfg.h5_max_retries;
+	int h4_retries = rtk_max_retries;
+	struct timespec ts;
+	long bytes = 0;
+	long us;
+	int ret = 0;
+	int i;
+
+	rtk_hw_cfg.h5_max_retries = 0;
+	rtk_max_retries = 1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	for (i = 0; i < RTK_AUTO_BAUD_ROUNDS && !ret; i++) {
+		ret = rtk_auto_baud_version(fd, proto);
+		if (ret < 0 || !rtk_echo_supported)
+			continue;
+
+		ret = rtk_auto_baud_echo(fd, proto, i);
+		if (ret > 0) {
+			RS_INFO("Auto baud: no local name support, "
+				"version check only");
+			rtk_echo_supported = 0;
+			ret = 0;
+		} else if (ret == 0) {
+			/* name out and back, plus headers */
+			bytes += 2 * (RTK_ECHO_LEN + 7);
+		}
+	}
+
+	us = rtk_elapsed_us(&ts);
+	rtk_hw_cfg.h5_max_retries = h5_retries;
+	rtk_max_retries = h4_retries;
+
+	if (ret)
+		return -1;
+
+	if (bytes && us)
+		RS_INFO("Auto baud: %d stable, echo %ld B/s", speed,
+			bytes * 1000000 / us);
+	else
+		RS_INFO("Auto baud: %d stable", speed);
+
+	return 0;
+}
+
+/**
+* Try one rate. On failure the controller is brought back to init_speed.
+*
+* @param limit rates at or above it are not probed on the next attach,
+* kept in the record if this rate fails
+* @return #0 if the rate is kept, #1 if it was rejected, -1 if the
+* controller can no longer be reached
+*/
+static int rtk_auto_baud_try(int fd, int proto, struct termios *ti,
+			     int init_speed, int speed, int limit)
+{
+	RT_U32 code;
+
+	if (!rtk_auto_baud_code(speed, &code))
+		return 1;
+
+	/* a hang while probing makes the next attach skip this rate */
+	rtk_auto_baud_save(speed, "try");
+
+	if (rtk_auto_baud_switch(fd, proto, ti, code, speed) == 0 &&
+	    rtk_auto_baud_verify(fd, proto, speed) == 0) {
+		rtk_hw_cfg.baudrate = code;
+		rtk_hw_cfg.final_speed = speed;
+		rtk_auto_baud_save(speed, "ok");
+		return 0;
+	}
+
+	RS_INFO("Auto baud: %d unstable, back to %d", speed, init_speed);
+	uart_speed_to_rtk_speed(init_speed, &code);
+	if (rtk_auto_baud_switch(fd, proto, ti, code, init_speed) < 0 ||
+	    rtk_auto_baud_version(fd, proto) < 0) {
+		RS_ERR("Auto baud: controller lost at %d", init_speed);
+		return -1;
+	}
+
+	/* an orderly failure is not a hang, probe it again next time */
+	rtk_auto_baud_save(limit == INT_MAX ? 0 : limit, "none");
+	return 1;
+}
+
+/**
+* Step down from the fastest candidate until a rate passes verification.
+* A rate that worked on the previous attach is tried first; rates above
+* it, or at and above one that hung while being probed, are skipped.
+* Rates rejected cleanly are probed again on the next attach. Remove
+* RTK_AUTO_BAUD_FILE to probe from the top again.
+*
+* The echo test overwrites the local name, the original one is read at
+* init_speed first and written back at the rate that is kept.
+*
+* @param init_speed speed the controller came up with
+* @return #0 if a rate was set, #1 if none was better than the config,
+* -1 if the controller can no longer be reached
+*/
+static int rtk_auto_baud(int fd, int proto, struct termios *ti,
+			 int init_speed)
+{
+	uint8_t name[RTK_ECHO_LEN];
+	int have_name;
+	int limit = INT_MAX;
+	char state[8];
+	int saved = 0;
+	unsigned int i;
+	int ret;
+
+	if (rtk_hw_cfg.hw_flow_control)
+		ti->c_cflag |= CRTSCTS;
+
+	have_name = rtk_auto_baud_name(fd, proto, name, 0) == 0;
+	if (!have_name)
+		RS_INFO("Auto baud: can't read local name, version check only");
+	rtk_echo_supported = have_name;
+
+	if (rtk_auto_baud_load(&saved, state) == 0) {
+		if (!strcmp(state, "ok")) {
+			limit = saved;
+			ret = rtk_auto_baud_try(fd, proto, ti, init_speed,
+						saved, limit);
+			if (ret <= 0)
+				goto out;
+		} else if (!strcmp(state, "try")) {
+			RS_INFO("Auto baud: %d hung last time, skipped", saved);
+			limit = saved;
+		} else if (saved > 0) {
+			limit = saved;
+		}
+	}
+
+	for (i = 0; i < sizeof(rtk_auto_bauds) / sizeof(rtk_auto_bauds[0]); i++) {
+		if (rtk_auto_bauds[i] >= limit)
+			continue;
+		ret = rtk_auto_baud_try(fd, proto, ti, init_speed,
+					rtk_auto_bauds[i], limit);
+		if (ret <= 0)
+			goto out;
+	}
+
+	RS_INFO("Auto baud: no stable rate, using config");
+	ret = 1;
+out:
+	if (ret >= 0 && have_name &&
+	    rtk_auto_baud_name(fd, proto, name, 1) != 0)
+		RS_ERR("Auto baud: can't restore local name");
+	if (proto == HCI_UART_3WIRE)
+		rtk_hw_cfg.link_estab_state = H5_PATCH;
+	return ret;
+}
+#endif
+
+/**
+* Hand the sliding window negotiated during link establishment to the
+* kernel H5 driver, which picks it up when the line discipline attaches.
+* Kernels without the parameter keep their built-in window.
+*/
+static void rtk_export_h5_window(void)
+{
+	FILE *fp;
+
+	if (!rtk_hw_cfg.tx_win)
+		return;
+
+	fp = fopen(H5_TXWIN_PARAM, "w");
+	if (!fp) {
+		RS_DBG("Can't open %s, kernel keeps its window",
+		       H5_TXWIN_PARAM);
+		return;
+	}
+
+	fprintf(fp, "%u\n", rtk_hw_cfg.tx_win);
+	fclose(fp);
+	RS_INFO("Kernel H5 sliding window %u", rtk_hw_cfg.tx_win);
+}
+
+#ifdef RTK_FAST_REATTACH
+static int rtk_fast_reattach;
+
+void rtk_set_fast_reattach(int enable)
+{
+	rtk_fast_reattach = enable;
+}
+
+/* What the last attach left the controller with */
+struct rtk_reattach_state {
+	int proto;
+	unsigned int rom_subver;
+	unsigned int fw_subver;	/* reported once patched, 0 if not seen yet */
+	int speed;
+	int hw_flow_control;
+	int parity_en;
+	int parity_even;
+};
+
+static int rtk_reattach_load(struct rtk_reattach_state *st)
+{
+	FILE *fp;
+	int n;
+
+	fp = fopen(RTK_REATTACH_FILE, "r");
+	if (!fp)
+		return -1;
+
+	n = fscanf(fp, "%d %x %x %d %d %d %d", &st->proto, &st->rom_subver,
+		   &st->fw_subver, &st->speed, &st->hw_flow_control,
+		   &st->parity_en, &st->parity_even);
+	fclose(fp);
+
+	return n == 7 ? 0 : -1;
+}
+
+static void rtk_reattach_save(const struct rtk_reattach_state *st)
+{
+	char line[128];
+
+	snprintf(line, sizeof(line), "%d %04x %04x %d %d %d %d\n", st->proto,
+		 st->rom_subver, st->fw_subver, st->speed,
+		 st->hw_flow_control, st->parity_en, st->parity_even);
+	rtk_state_write(RTK_REATTACH_DIR, RTK_REATTACH_FILE, line);
+}
+
+/* Record the state of a full attach, called once the patch is running */
+static void rtk_reattach_record(int speed)
+{
+	struct rtk_reattach_state st;
+
+	st.proto = rtk_hw_cfg.proto;
+	st.rom_subver = rtk_hw_cfg.lmp_subver;
+	st.fw_subver = 0;
+	st.speed = rtk_hw_cfg.final_speed ? rtk_hw_cfg.final_speed : speed;
+	st.hw_flow_control = rtk_hw_cfg.hw_flow_control;
+	st.parity_en = rtk_hw_cfg.parity_en;
+	st.parity_even = rtk_hw_cfg.parity_even;
+	rtk_reattach_save(&st);
+}
+
+/**
+* Poll-based H5 sync and config. Unlike rtk_init_h5() a silent peer is
+* reported instead of ending the process, and the sequence numbers start
+* over so that the kernel driver can take the link from seq 0.
+*/
+static int rtk_reattach_h5_link(int fd, int timeout_ms)
+{
+	unsigned char sync[2] = { 0x01, 0x7e };
+	unsigned char conf[3] = { 0x03, 0xfc, H5_CFG_FIELD };
+	unsigned char bytes[READ_DATA_SIZE];
+	struct timespec deadline, resend;
+	struct sk_buff *nskb;
+	struct pollfd pfd;
+	int ret;
+
+	rtk_hw_cfg.msgq_txseq = 0;
+	rtk_hw_cfg.rxseq_txack = 0;
+	rtk_hw_cfg.is_txack_req = 0;
+	rtk_hw_cfg.link_estab_state = H5_SYNC;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	rtk_deadline(&deadline, timeout_ms);
+	memset(&resend, 0, sizeof(resend));
+
+	while (rtk_hw_cfg.link_estab_state == H5_SYNC ||
+	       rtk_hw_cfg.link_estab_state == H5_CONFIG) {
+		if (!rtk_ms_left(&deadline))
+			return -1;
+
+		if (!rtk_ms_left(&resend)) {
+			if (rtk_hw_cfg.link_estab_state == H5_SYNC)
+				nskb = h5_prepare_pkt(&rtk_hw_cfg, sync, 2,
+						      H5_LINK_CTL_PKT);
+			else
+				nskb = h5_prepare_pkt(&rtk_hw_cfg, conf, 3,
+						      H5_LINK_CTL_PKT);
+			if (!nskb)
+				return -1;
+			if (write(fd, nskb->data, nskb->data_len) < 0)
+				RS_ERR("H5 link write fail, %s",
+				       strerror(errno));
+			skb_free(nskb);
+			rtk_deadline(&resend, 20);
+		}
+
+		ret = poll(&pfd, 1, rtk_ms_left(&resend));
+		if (ret < 0 && errno != EINTR)
+			return -1;
+		if (ret <= 0)
+			continue;
+
+		if ((ret = read_check_rtk(fd, &bytes, READ_DATA_SIZE)) == -1)
+			return -1;
+		h5_recv(&rtk_hw_cfg, &bytes, ret);
+	}
+
+	rtk_send_pure_ack_down(fd);
+	return 0;
+}
+
+static int rtk_reattach_probe(int fd, int proto)
+{
+	unsigned char cmd[3] = { 0x01, 0x10, 0x00 };
+	int retries;
+	int ret;
+
+	if (proto != HCI_UART_3WIRE) {
+		retries = rtk_max_retries;
+		rtk_max_retries = 2;
+		rtk_cmd_timeout_ms = RTK_REATTACH_TIMEOUT_MS;
+		ret = rtk_hci_local_ver(fd);
+		rtk_cmd_timeout_ms = 1000;
+		rtk_max_retries = retries;
+		return ret;
+	}
+
+	rtk_hw_cfg.h5_max_retries = 2;
+	if (rtk_reattach_h5_link(fd, 2 * RTK_REATTACH_TIMEOUT_MS) < 0)
+		return -1;
+
+	rtk_hw_cfg.hci_version_cmd_state = cmd_has_sent;
+	h5_send_cmd(fd, cmd, sizeof(cmd));
+	if (h5_wait_cmd_complete(fd, &rtk_hw_cfg.hci_version_cmd_state,
+				 RTK_REATTACH_TIMEOUT_MS, "reattach version") < 0)
+		return -1;
+
+	/* leave the link with no reliable packet used, as after a download */
+	return rtk_reattach_h5_link(fd, 2 * RTK_REATTACH_TIMEOUT_MS);
+}
+
+/**
+* Bring up a controller that still runs the patch of a previous attach.
+* The controller is addressed at the recorded rate and has to report an
+* LMP subversion other than its ROM one. H4 needs a single command, H5
+* also runs sync/config to restart the sequence numbers.
+*
+* @param fd uart file descriptor
+* @param proto realtek Bluetooth protocol
+* @param ti termios struct, restored when the controller is not patched
+* @return #0 if there is nothing left to download, -1 for a full attach
+*/
+static int rtk_reattach(int fd, int proto, struct termios *ti)
+{
+	struct rtk_reattach_state st;
+	struct termios saved = *ti;
+
+	if (rtk_reattach_load(&st) < 0 || st.proto != proto) {
+		RS_INFO("Fast reattach: no previous attach recorded");
+		return -1;
+	}
+
+	rtk_hw_cfg.proto = proto;
+	if (st.hw_flow_control)
+		ti->c_cflag |= CRTSCTS;
+	else
+		ti->c_cflag &= ~CRTSCTS;
+	if (proto == HCI_UART_3WIRE || st.parity_en) {
+		ti->c_cflag |= PARENB;
+		if (proto == HCI_UART_3WIRE || st.parity_even)
+			ti->c_cflag &= ~PARODD;
+		else
+			ti->c_cflag |= PARODD;
+	} else {
+		ti->c_cflag &= ~PARENB;
+	}
+
+	if (set_speed(fd, ti, st.speed) < 0)
+		goto fail;
+	tcflush(fd, TCIOFLUSH);
+
+	if (rtk_reattach_probe(fd, proto) < 0) {
+		RS_INFO("Fast reattach: no reply at %d", st.speed);
+		goto fail;
+	}
+
+	if (rtk_hw_cfg.lmp_subver == st.rom_subver ||
+	    (st.fw_subver && rtk_hw_cfg.lmp_subver != st.fw_subver)) {
+		RS_INFO("Fast reattach: lmp subver 0x%04x, not patched",
+			rtk_hw_cfg.lmp_subver);
+		goto fail;
+	}
+
+	rtk_hw_cfg.final_speed = st.speed;
+	rtk_hw_cfg.hw_flow_control = st.hw_flow_control;
+	rtk_hw_cfg.parity_en = st.parity_en;
+	rtk_hw_cfg.parity_even = st.parity_even;
+	if (!st.fw_subver) {
+		st.fw_subver = rtk_hw_cfg.lmp_subver;
+		rtk_reattach_save(&st);
+	}
+
+	if (proto == HCI_UART_3WIRE)
+		rtk_export_h5_window();
+	RS_INFO("Fast reattach: patch 0x%04x running at %d, skip download",
+		rtk_hw_cfg.lmp_subver, st.speed);
+	return 0;
+
+fail:
+	*ti = saved;
+	if (tcsetattr(fd, TCSANOW, ti) < 0)
+		RS_ERR("Can't restore port settings");
+	tcflush(fd, TCIOFLUSH);
+	return -1;
+}
+#endif
+
+/**
+* Config realtek Bluetooth. The configuration parameter is get from config file and fw.
+* Config file is rtk8723_bt_config. which is set in rtk_get_bt_config.
+* fw file is "rlt8723a_chip_b_cut_bt40_fw", which is set in get_firmware_name.
+*
+* @warning maybe only one of config file and fw file exists. The bt_addr arg is stored in "/data/btmac.txt"
+* or "/data/misc/bluetoothd/bt_mac/btmac.txt",
+*
+* @param fd uart file descriptor
+* @param proto realtek Bluetooth protocol, shall be either HCI_UART_H4 or HCI_UART_3WIRE
+* @param speed init_speed in uart struct
+* @param ti termios struct
+* @returns #0 on success
+*/
+static int rtk_config(int fd, int proto, int speed, struct termios *ti)
+{
+	int final_speed = 0;
+	int ret = 0;
+	int cfg_loaded;
+	int prefetched;
+	struct patch_info *ent;
+	struct btrtl_info *btrtl = &rtk_hw_cfg;
+
+	btrtl->proto = proto;
+
+	/* Get Local Version Information and RTK ROM version */
+	if (proto == HCI_UART_3WIRE) {
+		RS_INFO("H5 IC");
+		if (rtk_get_lmp_version(fd) < 0)
+			return -1;
+		rtk_prefetch_start();
+		if (rtk_get_eversion(fd) < 0)
+			goto fail;
+	} else {
+		RS_INFO("H4 IC");
+		ti->c_cflag &= ~PARENB;
+		ti->c_cflag |= CRTSCTS;
+		if (tcsetattr(fd, TCSANOW, ti) < 0) {
+			RS_ERR("H4 Can't enable RTSCTS");
+			return -1;
+		}
+		usleep(20 * 1000);
+		if (rtk_hci_local_ver(fd) < 0)
+			return -1;
+		rtk_prefetch_start();
+		if (rtk_hci_rom_ver(fd) < 0)
+			goto fail;
+		if (rtk_hw_cfg.lmp_subver == ROM_LMP_8761btc) {
+			rtk_hw_cfg.chip_type = CHIP_8761BTC;
+			rtk_prefetch_discard();
+			rtk_hw_cfg.hw_flow_control = 1;
+			/* TODO: Change to different uart baud */
+			uart_speed_to_rtk_speed(1500000, &rtk_hw_cfg.baudrate);
+			goto change_baud;
+		} else if (rtk_hw_cfg.lmp_subver == ROM_LMP_8761a) {
+			if (rtk_hw_cfg.hci_rev == 0x000b) {
+				rtk_hw_cfg.chip_type = CHIP_8761B;
+				rtk_prefetch_discard();
+				rtk_hw_cfg.hw_flow_control = 1;
+				/* TODO: Change to different uart baud */
+				uart_speed_to_rtk_speed(1500000, &rtk_hw_cfg.baudrate);
+				goto change_baud;
+			} else if (rtk_hw_cfg.hci_rev == 0x000a) {
+				if (rtk_hw_cfg.eversion == 3)
+					rtk_hw_cfg.chip_type = CHIP_8761ATF;
+				else if (rtk_hw_cfg.eversion == 2)
+					rtk_hw_cfg.chip_type = CHIP_8761AT;
+				else
+					rtk_hw_cfg.chip_type = CHIP_UNKNOWN;
+			}
+		} else if (rtk_hw_cfg.lmp_subver == ROM_LMP_8723b) {
+			if (rtk_hw_cfg.hci_ver == 0x08 &&
+			    rtk_hw_cfg.hci_rev == 0x000d) {
+				rtk_hw_cfg.chip_type = CHIP_8723DS;
+			} else if (rtk_hw_cfg.hci_ver == 0x06 &&
+				 rtk_hw_cfg.hci_rev == 0x000b) {
+				rtk_hw_cfg.chip_type = CHIP_8723BS;
+			} else {
+				RS_ERR("H4: unknown chip");
+				goto fail;
+			}
+		}
+
+	}
+
+	RS_INFO("LMP Subversion 0x%04x", btrtl->lmp_subver);
+	RS_INFO("EVersion %d", btrtl->eversion);
+
+	switch (rtk_hw_cfg.lmp_subver) {
+	case ROM_LMP_8723a:
+		break;
+	case ROM_LMP_8723b:
+#ifdef RTL_8703A_SUPPORT
+		/* Set chip type for matching fw/config entry */
+		rtl->chip_type = CHIP_8703AS;
+#endif
+		break;
+	case ROM_LMP_8821a:
+		break;
+	case ROM_LMP_8761a:
+		break;
+	case ROM_LMP_8703b:
+		if (rtk_get_chip_type(fd) < 0)
+			goto fail;
+		break;
+	}
+	rtk_phase_mark("probe");
+
+	ent = get_patch_entry(btrtl);
+	prefetched = rtk_prefetch_join(ent);
+	btrtl->patch_ent = ent;
+	rtk_phase_mark("wait files");
+	if (btrtl->patch_ent) {
+		RS_INFO("IC: %s\n", btrtl->patch_ent->ic_name);
+		RS_INFO("Firmware/config: %s, %s\n",
+			btrtl->patch_ent->patch_file,
+			btrtl->patch_ent->config_file);
+	} else {
+		RS_ERR("Can not find firmware/config entry\n");
+		return -1;
+	}
+
+#ifdef RTK_PREPARED_FW
+	if (rtk_prepared_fw && rtk_prepared_fw_load(rtk_prepared_fw) == 0)
+		goto prepared;
+#endif
+
+#ifdef RTK_PATCH_CACHE
+	if (rtk_patch_cache_load() == 0) {
+		rtk_prefetch_free();
+		goto prepared;
+	}
+#endif
+
+	if (prefetched) {
+		rtk_hw_cfg.config_len = rtk_prefetch.config_len;
+		btrtl->config_buf = rtk_prefetch.config_buf;
+		btrtl->baudrate = rtk_prefetch.baudrate;
+		rtk_hw_cfg.fw_len = rtk_prefetch.fw_len;
+		btrtl->fw_buf = rtk_prefetch.fw_buf;
+		rtk_prefetch.config_len = 0;
+		rtk_prefetch.fw_len = 0;
+	} else {
+		rtk_hw_cfg.config_len =
+		    rtk_get_bt_config(btrtl, &btrtl->config_buf,
+				      &btrtl->baudrate);
+		rtk_hw_cfg.fw_len = rtk_get_bt_firmware(btrtl, &btrtl->fw_buf);
+	}
+
+	if (rtk_hw_cfg.config_len < 0) {
+		RS_ERR("Get Config file error, just use efuse settings");
+		rtk_hw_cfg.config_len = 0;
+	}
+	cfg_loaded = rtk_hw_cfg.config_len > 0;
+
+	if (rtk_hw_cfg.fw_len < 0) {
+		RS_ERR("Get BT firmware error");
+		rtk_hw_cfg.fw_len = 0;
+		return -1;
+	} else {
+		rtk_get_final_patch(fd, proto);
+	}
+
+#ifdef RTK_PATCH_CACHE
+	/* A config that failed to load must not end up in the cache */
+	if (cfg_loaded)
+		rtk_patch_cache_store();
+#endif
+#if defined(RTK_PATCH_CACHE) || defined(RTK_PREPARED_FW)
+prepared:
+#endif
+
+	if (rtk_hw_cfg.total_len > RTK_PATCH_LENGTH_MAX) {
+		RS_ERR("total length of fw&config larger than allowed");
+		return -1;
+	}
+
+	RS_INFO("Total len %d for fw/config", rtk_hw_cfg.total_len);
+
+	if (rtk_hw_cfg.chip_type == CHIP_8723DS &&
+	    rtk_hw_cfg.proto == HCI_UART_H4) {
+		if (rtk_hw_cfg.parity_en) {
+			/* set parity */
+			ti->c_cflag |= PARENB;
+			if (rtk_hw_cfg.parity_even)
+				ti->c_cflag &= ~(PARODD);
+			else
+				ti->c_cflag |= PARODD;
+			if (tcsetattr(fd, TCSANOW, ti) < 0) {
+				RS_ERR("8723DSH4 Can't set parity");
+				return -1;
+			}
+		}
+	}
+
+change_baud:
+	/* change baudrate if needed
+	 * rtk_hw_cfg.baudrate is a __u32/__u16 vendor-specific variable
+	 * parsed from config file
+	 * */
+#ifdef RTK_AUTO_BAUD
+	ret = rtk_auto_baud(fd, proto, ti, speed);
+	if (ret < 0)
+		goto fail;
+	if (ret == 0) {
+		rtk_phase_mark("baudrate");
+		goto SET_FLOW_CONTRL;
+	}
+	ret = 0;
+#endif
+	if (rtk_hw_cfg.baudrate == 0) {
+		uart_speed_to_rtk_speed(speed, &rtk_hw_cfg.baudrate);
+		RS_DBG("No cfg file, set baudrate, : %u, 0x%08x",
+		       (unsigned int)speed, (unsigned int)rtk_hw_cfg.baudrate);
+		goto SET_FLOW_CONTRL;
+	} else
+		rtk_speed_to_uart_speed(rtk_hw_cfg.baudrate,
+					(RT_U32 *) & (rtk_hw_cfg.final_speed));
+
+	if (proto == HCI_UART_3WIRE)
+		ret = rtk_vendor_change_speed_h5(fd, rtk_hw_cfg.baudrate);
+	else
+		ret = rtk_vendor_change_speed_h4(fd, rtk_hw_cfg.baudrate);
+	if (ret < 0)
+		goto fail;
+
+	usleep(50000);
+	final_speed = rtk_hw_cfg.final_speed ? rtk_hw_cfg.final_speed : speed;
+	RS_DBG("final_speed %d\n", final_speed);
+	if (set_speed(fd, ti, final_speed) < 0) {
+		RS_ERR("Can't set baud rate:%x, %x, %x", final_speed,
+		       rtk_hw_cfg.final_speed, speed);
+		return -1;
+	}
+	rtk_phase_mark("baudrate");
+
+SET_FLOW_CONTRL:
+	if (rtk_hw_cfg.hw_flow_control) {
+		RS_DBG("hw flow control enable");
+		ti->c_cflag |= CRTSCTS;
+
+		if (tcsetattr(fd, TCSANOW, ti) < 0) {
 			RS_ERR("Can't set port settings");
 			return -1;
 		}
@@ -3582,20 +5291,58 @@ SET_FLOW_CONTRL:
 		rtk_hw_cfg.link_estab_state = H5_PATCH;
 		rtk_hw_cfg.rx_index = -1;
 
+#ifdef RTK_PREPARED_FW
+		if (rtk_hw_cfg.total_cmds)
+			ret = rtk_download_fw_cmds_h4(fd, rtk_hw_cfg.total_buf,
+						      rtk_hw_cfg.total_cmds);
+		else
+#endif
 		ret =
 		    rtk_download_fw_config(fd, rtk_hw_cfg.total_buf,
 					   rtk_hw_cfg.total_len,
 					   rtk_hw_cfg.baudrate, proto, ti);
-		free(rtk_hw_cfg.total_buf);
+		rtk_free_total_buf();
 
 		if (ret < 0)
 			return ret;
+		rtk_phase_mark("download");
 	}
 
 done:
+	/* 8761B skips the patch, the worker may still be running */
+	rtk_prefetch_discard();
+	if (proto == HCI_UART_3WIRE)
+		rtk_export_h5_window();
+#ifdef RTK_FAST_REATTACH
+	rtk_reattach_record(speed);
+#endif
+
+	rtk_phase_report();
 	RS_DBG("Init Process finished");
 	return 0;
+
+fail:
+	rtk_prefetch_discard();
+	return -1;
+}
+
+#ifdef RTK_SNOOP
+static void rtk_snoop_dump(const char *why)
+{
+	int n = hci_snoop_dump(&rtk_snoop, RTK_SNOOP_FILE);
+
+	if (n < 0)
+		RS_ERR("Can't write %s, %s", RTK_SNOOP_FILE, strerror(errno));
+	else
+		RS_INFO("%s: %d packets saved to %s", why, n, RTK_SNOOP_FILE);
+}
+
+/* Only open and write are used by the dump, safe in a handler */
+static void rtk_snoop_sig(int sig)
+{
+	hci_snoop_dump(&rtk_snoop, RTK_SNOOP_FILE);
 }
+#endif
 
 /**
 * Init uart by realtek Bluetooth.
@@ -3610,19 +5357,120 @@ int rtk_init(int fd, int proto, int speed, struct termios *ti)
 {
 	struct sigaction sa;
 	int retlen;
+	int ret;
 	RS_DBG("Realtek hciattach version %s \n", RTK_VERSION);
 
+#ifdef RTK_SNOOP
+	/* SIGUSR1 saves the capture, also once the ldisc has the port */
+	if (!rtk_snoop.ring &&
+	    hci_snoop_init(&rtk_snoop, RTK_SNOOP_RECORDS) == 0) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = rtk_snoop_sig;
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+#endif
+
 	memset(&rtk_hw_cfg, 0, sizeof(rtk_hw_cfg));
 	rtk_hw_cfg.serial_fd = fd;
 	rtk_hw_cfg.dl_fw_flag = 1;
+	rtk_phase_reset();
+
+#ifdef RTK_FAST_REATTACH
+	if (rtk_fast_reattach) {
+		if (rtk_reattach(fd, proto, ti) == 0) {
+			rtk_phase_mark("reattach");
+			rtk_phase_report();
+			return 0;
+		}
+		memset(&rtk_hw_cfg, 0, sizeof(rtk_hw_cfg));
+		rtk_hw_cfg.serial_fd = fd;
+		rtk_hw_cfg.dl_fw_flag = 1;
+	}
+#endif
 
 	/* h4 will do nothing for init */
 	if (proto == HCI_UART_3WIRE) {
 		if (rtk_init_h5(fd, ti) < 0)
 			return -1;;
+		rtk_phase_mark("h5 link");
+	}
+
+	ret = rtk_config(fd, proto, speed, ti);
+#ifdef RTK_SNOOP
+	if (ret < 0)
+		rtk_snoop_dump("attach failed");
+#endif
+	return ret;
+}
+
+#ifdef RTK_LOW_MEMORY
+/* Hand the whole pages of a pool back, they read as zero if used again */
+static void rtk_pool_drop(void *pool, size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (size >= page)
+		madvise(pool, size & ~(page - 1), MADV_DONTNEED);
+}
+
+/**
+* The ldisc owns the uart once attached and rtk_hciattach only waits,
+* so nothing of the setup is needed any more.
+*/
+static void rtk_release_memory(void)
+{
+#ifdef RTK_SNOOP
+	sigset_t set, old;
+#endif
+
+	rtk_free_total_buf();
+	rtk_prefetch_discard();
+
+	if (rtk_hw_cfg.host_last_cmd) {
+		skb_free(rtk_hw_cfg.host_last_cmd);
+		rtk_hw_cfg.host_last_cmd = NULL;
+	}
+	if (rtk_hw_cfg.rx_skb) {
+		skb_free(rtk_hw_cfg.rx_skb);
+		rtk_hw_cfg.rx_skb = NULL;
+	}
+
+#ifdef RTK_SNOOP
+	/* SIGUSR1 dumps the ring, keep it out while it goes */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &set, &old);
+	hci_snoop_free(&rtk_snoop);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+#endif
+
+	rtk_pool_drop(rtk_skb_tx_pool, sizeof(rtk_skb_tx_pool));
+	rtk_pool_drop(rtk_skb_rx_pool, sizeof(rtk_skb_rx_pool));
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+}
+#endif
+
+/* Peak and current resident set size */
+static void rtk_report_rss(void)
+{
+	struct rusage ru;
+	long pages = 0;
+	FILE *f;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return;
+
+	f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%*d %ld", &pages) != 1)
+			pages = 0;
+		fclose(f);
 	}
 
-	return rtk_config(fd, proto, speed, ti);
+	RS_INFO("Peak RSS %ld KB, now %ld KB", ru.ru_maxrss,
+		pages * (sysconf(_SC_PAGESIZE) / 1024));
 }
 
 /**
@@ -3635,8 +5483,16 @@ int rtk_init(int fd, int proto, int speed, struct termios *ti)
 */
 int rtk_post(int fd, int proto, struct termios *ti)
 {
+	int ret = 0;
+
 	if (rtk_hw_cfg.final_speed)
-		return set_speed(fd, ti, rtk_hw_cfg.final_speed);
+		ret = set_speed(fd, ti, rtk_hw_cfg.final_speed);
 
-	return 0;
+#ifdef RTK_LOW_MEMORY
+	if (rtk_low_memory)
+		rtk_release_memory();
+#endif
+	rtk_report_rss();
+
+	return ret;
 }
@@ -0,0 +1,208 @@
+/*
+ *
+ *  HCI core and hci_uart side of the userspace kernel shim, see kshim.h
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdarg.h>
+
+#include "kshim.h"
+
+int kshim_verbose;
+unsigned long kshim_errors;
+unsigned long kshim_allocs;
+unsigned long jiffies;
+struct kshim_stats kshim_stats;
+
+static struct hci_uart_proto *kshim_proto[HCI_UART_MAX_PROTO];
+
+void kshim_skb_overflow(const struct sk_buff *skb, unsigned int len)
+{
+	fprintf(stderr, "skb overflow: len %u room %d\n", len,
+		skb_tailroom(skb));
+	abort();
+}
+
+int seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+	va_list ap;
+
+	(void)m;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	return 0;
+}
+
+int seq_puts(struct seq_file *m, const char *s)
+{
+	(void)m;
+	return fputs(s, stdout);
+}
+
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+		void *data)
+{
+	(void)file;
+	(void)show;
+	(void)data;
+	return -ENOSYS;
+}
+
+ssize_t seq_read(struct file *file, char *buf, size_t size, long long *ppos)
+{
+	(void)file;
+	(void)buf;
+	(void)size;
+	(void)ppos;
+	return -ENOSYS;
+}
+
+long long seq_lseek(struct file *file, long long offset, int whence)
+{
+	(void)file;
+	(void)offset;
+	(void)whence;
+	return -ENOSYS;
+}
+
+int single_release(struct inode *inode, struct file *file)
+{
+	(void)inode;
+	(void)file;
+	return 0;
+}
+
+/* Packets end here instead of the HCI core */
+int hci_recv_frame(struct hci_dev *hdev, struct sk_buff *skb)
+{
+	u8 type = bt_cb(skb)->pkt_type;
+
+	(void)hdev;
+	if (type < sizeof(kshim_stats.rx_pkts) / sizeof(kshim_stats.rx_pkts[0]))
+		kshim_stats.rx_pkts[type]++;
+	kshim_stats.rx_bytes += skb->len;
+	kfree_skb(skb);
+	return 0;
+}
+
+/* The H4 stream reassembly of the 2.6.36 - 4.2 HCI core, hci_h4 hands it
+ * everything but whole SCO frames. There is a single hdev. */
+int hci_recv_stream_fragment(struct hci_dev *hdev, void *data, int count)
+{
+	static struct sk_buff *skb;
+	static int need, have_hdr;
+	u8 *ptr = data;
+	int len;
+
+	while (count) {
+		if (!skb) {
+			switch (*ptr) {
+			case HCI_EVENT_PKT:
+				need = HCI_EVENT_HDR_SIZE;
+				break;
+			case HCI_ACLDATA_PKT:
+				need = HCI_ACL_HDR_SIZE;
+				break;
+			case HCI_SCODATA_PKT:
+				need = HCI_SCO_HDR_SIZE;
+				break;
+			default:
+				return -EILSEQ;
+			}
+			skb = bt_skb_alloc(HCI_MAX_FRAME_SIZE, GFP_ATOMIC);
+			if (!skb)
+				return -ENOMEM;
+			bt_cb(skb)->pkt_type = *ptr;
+			have_hdr = 0;
+			ptr++;
+			count--;
+			continue;
+		}
+
+		len = need < count ? need : count;
+		memcpy(skb_put(skb, len), ptr, len);
+		ptr += len;
+		count -= len;
+		need -= len;
+		if (need)
+			continue;
+
+		if (!have_hdr) {
+			have_hdr = 1;
+			switch (bt_cb(skb)->pkt_type) {
+			case HCI_EVENT_PKT:
+				need = hci_event_hdr(skb)->plen;
+				break;
+			case HCI_ACLDATA_PKT:
+				need = __le16_to_cpu(hci_acl_hdr(skb)->dlen);
+				break;
+			default:
+				need = hci_sco_hdr(skb)->dlen;
+				break;
+			}
+			if (need > skb_tailroom(skb)) {
+				kfree_skb(skb);
+				skb = NULL;
+				return -ENOMEM;
+			}
+			if (need)
+				continue;
+		}
+
+		hci_recv_frame(hdev, skb);
+		skb = NULL;
+	}
+
+	return 0;
+}
+
+int hci_uart_register_proto(struct hci_uart_proto *p)
+{
+	if (p->id >= HCI_UART_MAX_PROTO)
+		return -EINVAL;
+	if (kshim_proto[p->id])
+		return -EEXIST;
+
+	kshim_proto[p->id] = p;
+	return 0;
+}
+
+int hci_uart_unregister_proto(struct hci_uart_proto *p)
+{
+	if (p->id >= HCI_UART_MAX_PROTO || !kshim_proto[p->id])
+		return -EINVAL;
+
+	kshim_proto[p->id] = NULL;
+	return 0;
+}
+
+struct hci_uart_proto *kshim_get_proto(unsigned int id)
+{
+	return id < HCI_UART_MAX_PROTO ? kshim_proto[id] : NULL;
+}
+
+/* Like the ldisc, write out whatever the protocol has right away; the
+ * tty takes everything */
+int hci_uart_tx_wakeup(struct hci_uart *hu)
+{
+	struct sk_buff *skb;
+
+	while ((skb = hu->proto->dequeue(hu)) != NULL) {
+		kshim_stats.tx_frames++;
+		hu->hdev->stat.byte_tx += skb->len;
+		kfree_skb(skb);
+	}
+
+	return 0;
+}
@@ -0,0 +1,593 @@
+/*
+ *
+ *  Userspace stand-ins for the kernel API used by hci_rtk_h5.c and hci_h4.c
+ *
+ *  Just enough of skbuff, the HCI core and hci_uart to run the receive
+ *  state machines of the kernel drivers unmodified in h5_replay. The file
+ *  is force-included (-include kshim.h) and every kernel header the
+ *  drivers pull in is generated by the Makefile: empty, except for the
+ *  few glibc includes as well, which forward with #include_next. There
+ *  is a single thread, so locks are no-ops and timers never fire.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef __KSHIM_H
+#define __KSHIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* The drivers take the >= 3.13 hci_recv_frame() and the old timer API */
+#define KERNEL_VERSION(a, b, c)	(((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE	KERNEL_VERSION(4, 4, 0)
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef uint8_t __u8;
+typedef uint16_t __le16;
+
+#define __init
+#define __exit
+#define THIS_MODULE		NULL
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+
+#define GFP_ATOMIC		0
+#define GFP_KERNEL		0
+
+#define USEC_PER_MSEC		1000L
+#define USEC_PER_SEC		1000000L
+
+#define BIT(n)			(1UL << (n))
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		min((t)(a), (t)(b))
+#define max_t(t, a, b)		max((t)(a), (t)(b))
+#define clamp(v, lo, hi)	min(max(v, lo), hi)
+#define clamp_t(t, v, lo, hi)	clamp((t)(v), (t)(lo), (t)(hi))
+#define container_of(p, type, member) \
+	((type *)((char *)(p) - offsetof(type, member)))
+#define IS_ERR_OR_NULL(p)	(!(p))
+#ifndef __le16_to_cpu
+#define __le16_to_cpu(x)	(x)
+#endif
+
+/* ---- logging ---- */
+
+extern int kshim_verbose;
+extern unsigned long kshim_errors;
+
+#define BT_DBG(fmt, ...) \
+	do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+#define BT_INFO(fmt, ...) \
+	do { if (kshim_verbose) fprintf(stderr, fmt "\n", ##__VA_ARGS__); } while (0)
+#define BT_ERR(fmt, ...) \
+	do { \
+		kshim_errors++; \
+		if (kshim_verbose) \
+			fprintf(stderr, fmt "\n", ##__VA_ARGS__); \
+	} while (0)
+
+/* ---- allocation ---- */
+
+/* Allocations done by the drivers: alloc_skb() and kmalloc() alike */
+extern unsigned long kshim_allocs;
+
+static inline void *kzalloc(size_t size, int gfp)
+{
+	(void)gfp;
+	kshim_allocs++;
+	return calloc(1, size);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+/* ---- time ---- */
+
+typedef s64 ktime_t;
+
+extern unsigned long jiffies;
+
+static inline ktime_t ktime_get(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (s64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define ktime_set(s, ns)	((ktime_t)(s) * 1000000000 + (ns))
+#define ktime_to_ns(k)		(k)
+#define ktime_us_delta(a, b)	(((a) - (b)) / 1000)
+
+static inline unsigned long usecs_to_jiffies(unsigned long us)
+{
+	return us / 4000;
+}
+
+static inline unsigned int jiffies_to_usecs(unsigned long j)
+{
+	return j * 4000;
+}
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+/* ---- locks, timers, work ---- */
+
+typedef int spinlock_t;
+
+#define SINGLE_DEPTH_NESTING	1
+#define spin_lock_init(l)	(*(l) = 0)
+#define spin_lock(l)		((void)(l))
+#define spin_unlock(l)		((void)(l))
+#define spin_lock_irqsave(l, f)	((void)(l), (f) = 0)
+#define spin_lock_irqsave_nested(l, f, n) \
+	((void)(l), (void)(n), (f) = 0)
+#define spin_unlock_irqrestore(l, f) ((void)(l), (void)(f))
+
+struct timer_list {
+	void (*function)(unsigned long);
+	unsigned long data;
+	unsigned long expires;
+	int pending;
+};
+
+#define init_timer(t)		memset(t, 0, sizeof(*(t)))
+
+static inline int mod_timer(struct timer_list *t, unsigned long expires)
+{
+	int pending = t->pending;
+
+	t->expires = expires;
+	t->pending = 1;
+	return pending;
+}
+
+static inline int del_timer(struct timer_list *t)
+{
+	int pending = t->pending;
+
+	t->pending = 0;
+	return pending;
+}
+
+/* Work runs right away, so its allocations count against the packet that
+ * scheduled it */
+struct work_struct {
+	void (*func)(struct work_struct *);
+};
+
+#define INIT_WORK(w, f)		((w)->func = (f))
+
+static inline bool schedule_work(struct work_struct *w)
+{
+	w->func(w);
+	return true;
+}
+
+static inline bool cancel_work_sync(struct work_struct *w)
+{
+	(void)w;
+	return false;
+}
+
+/* ---- skbuff ---- */
+
+struct bt_skb_cb {
+	u8 pkt_type;
+	u8 incoming;
+	u16 expect;
+};
+
+struct sk_buff {
+	/* Must come first, sk_buff_head is used as a list head */
+	struct sk_buff *next;
+	struct sk_buff *prev;
+
+	unsigned char *head;
+	unsigned char *data;
+	unsigned char *tail;
+	unsigned char *end;
+	unsigned int len;
+	int users;
+	ktime_t tstamp;
+	void *dev;
+	char cb[48];
+};
+
+struct sk_buff_head {
+	struct sk_buff *next;
+	struct sk_buff *prev;
+	u32 qlen;
+	spinlock_t lock;
+};
+
+#define bt_cb(skb)		((struct bt_skb_cb *)((skb)->cb))
+#define BT_SKB_RESERVE		8
+
+void kshim_skb_overflow(const struct sk_buff *skb, unsigned int len);
+
+static inline struct sk_buff *alloc_skb(unsigned int size, int gfp)
+{
+	struct sk_buff *skb;
+
+	(void)gfp;
+	kshim_allocs++;
+	skb = malloc(sizeof(*skb) + size);
+	if (!skb)
+		return NULL;
+
+	memset(skb, 0, sizeof(*skb));
+	skb->head = skb->data = skb->tail = (unsigned char *)(skb + 1);
+	skb->end = skb->head + size;
+	skb->users = 1;
+	return skb;
+}
+
+static inline void kfree_skb(struct sk_buff *skb)
+{
+	if (skb && !--skb->users)
+		free(skb);
+}
+
+static inline struct sk_buff *skb_get(struct sk_buff *skb)
+{
+	skb->users++;
+	return skb;
+}
+
+static inline int skb_shared(const struct sk_buff *skb)
+{
+	return skb->users != 1;
+}
+
+static inline void skb_reserve(struct sk_buff *skb, int len)
+{
+	skb->data += len;
+	skb->tail += len;
+}
+
+static inline struct sk_buff *bt_skb_alloc(unsigned int len, int how)
+{
+	struct sk_buff *skb = alloc_skb(len + BT_SKB_RESERVE, how);
+
+	if (skb)
+		skb_reserve(skb, BT_SKB_RESERVE);
+	return skb;
+}
+
+static inline unsigned char *skb_tail_pointer(const struct sk_buff *skb)
+{
+	return skb->tail;
+}
+
+static inline void skb_reset_tail_pointer(struct sk_buff *skb)
+{
+	skb->tail = skb->data;
+}
+
+static inline int skb_tailroom(const struct sk_buff *skb)
+{
+	return skb->end - skb->tail;
+}
+
+static inline unsigned char *skb_put(struct sk_buff *skb, unsigned int len)
+{
+	unsigned char *tmp = skb->tail;
+
+	if (len > (unsigned int)skb_tailroom(skb))
+		kshim_skb_overflow(skb, len);
+	skb->tail += len;
+	skb->len += len;
+	return tmp;
+}
+
+static inline unsigned char *skb_push(struct sk_buff *skb, unsigned int len)
+{
+	if (skb->data - skb->head < (long)len)
+		kshim_skb_overflow(skb, len);
+	skb->data -= len;
+	skb->len += len;
+	return skb->data;
+}
+
+static inline unsigned char *skb_pull(struct sk_buff *skb, unsigned int len)
+{
+	if (len > skb->len)
+		return NULL;
+	skb->len -= len;
+	return skb->data += len;
+}
+
+static inline void skb_trim(struct sk_buff *skb, unsigned int len)
+{
+	if (skb->len > len) {
+		skb->len = len;
+		skb->tail = skb->data + len;
+	}
+}
+
+static inline void skb_queue_head_init(struct sk_buff_head *list)
+{
+	list->next = list->prev = (struct sk_buff *)list;
+	list->qlen = 0;
+	list->lock = 0;
+}
+
+static inline u32 skb_queue_len(const struct sk_buff_head *list)
+{
+	return list->qlen;
+}
+
+static inline int skb_queue_empty(const struct sk_buff_head *list)
+{
+	return list->next == (const struct sk_buff *)list;
+}
+
+static inline void __skb_insert(struct sk_buff *skb, struct sk_buff *prev,
+				struct sk_buff *next, struct sk_buff_head *list)
+{
+	skb->next = next;
+	skb->prev = prev;
+	next->prev = prev->next = skb;
+	list->qlen++;
+}
+
+static inline void __skb_unlink(struct sk_buff *skb, struct sk_buff_head *list)
+{
+	list->qlen--;
+	skb->next->prev = skb->prev;
+	skb->prev->next = skb->next;
+	skb->next = skb->prev = NULL;
+}
+
+static inline void __skb_queue_tail(struct sk_buff_head *list,
+				    struct sk_buff *skb)
+{
+	__skb_insert(skb, list->prev, (struct sk_buff *)list, list);
+}
+
+#define skb_queue_tail		__skb_queue_tail
+
+static inline void skb_queue_head(struct sk_buff_head *list,
+				  struct sk_buff *skb)
+{
+	__skb_insert(skb, (struct sk_buff *)list, list->next, list);
+}
+
+static inline struct sk_buff *skb_dequeue(struct sk_buff_head *list)
+{
+	struct sk_buff *skb = list->next;
+
+	if (skb == (struct sk_buff *)list)
+		return NULL;
+	__skb_unlink(skb, list);
+	return skb;
+}
+
+static inline struct sk_buff *__skb_dequeue_tail(struct sk_buff_head *list)
+{
+	struct sk_buff *skb = list->prev;
+
+	if (skb == (struct sk_buff *)list)
+		return NULL;
+	__skb_unlink(skb, list);
+	return skb;
+}
+
+static inline void skb_queue_purge(struct sk_buff_head *list)
+{
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(list)) != NULL)
+		kfree_skb(skb);
+}
+
+#define skb_queue_walk_safe(queue, skb, tmp) \
+	for (skb = (queue)->next, tmp = skb->next; \
+	     skb != (struct sk_buff *)(queue); \
+	     skb = tmp, tmp = skb->next)
+
+/* ---- bit helpers ---- */
+
+static inline u16 bitrev16(u16 x)
+{
+	u16 r = 0;
+	int i;
+
+	for (i = 0; i < 16; i++, x >>= 1)
+		r = (r << 1) | (x & 1);
+	return r;
+}
+
+static inline u16 get_unaligned_be16(const void *p)
+{
+	const u8 *b = p;
+
+	return b[0] << 8 | b[1];
+}
+
+/* ---- debugfs ---- */
+
+struct module;
+struct dentry;
+struct file;
+
+struct inode {
+	void *i_private;
+};
+
+struct seq_file {
+	void *private;
+};
+
+struct file_operations {
+	struct module *owner;
+	int (*open)(struct inode *, struct file *);
+	ssize_t (*read)(struct file *, char *, size_t, long long *);
+	long long (*llseek)(struct file *, long long, int);
+	int (*release)(struct inode *, struct file *);
+};
+
+int seq_printf(struct seq_file *m, const char *fmt, ...)
+	__attribute__ ((format(printf, 2, 3)));
+int seq_puts(struct seq_file *m, const char *s);
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+		void *data);
+ssize_t seq_read(struct file *file, char *buf, size_t size, long long *ppos);
+long long seq_lseek(struct file *file, long long offset, int whence);
+int single_release(struct inode *inode, struct file *file);
+
+static inline struct dentry *debugfs_create_dir(const char *name,
+						struct dentry *parent)
+{
+	(void)name;
+	(void)parent;
+	return NULL;
+}
+
+static inline struct dentry *debugfs_create_file(const char *name, int mode,
+			struct dentry *parent, void *data,
+			const struct file_operations *fops)
+{
+	(void)name;
+	(void)mode;
+	(void)parent;
+	(void)data;
+	(void)fops;
+	return NULL;
+}
+
+#define debugfs_remove(d)		((void)(d))
+#define debugfs_remove_recursive(d)	((void)(d))
+
+/* ---- HCI core ---- */
+
+#define HCI_COMMAND_PKT		0x01
+#define HCI_ACLDATA_PKT		0x02
+#define HCI_SCODATA_PKT		0x03
+#define HCI_EVENT_PKT		0x04
+
+#define HCI_EVENT_HDR_SIZE	2
+#define HCI_ACL_HDR_SIZE	4
+#define HCI_SCO_HDR_SIZE	3
+#define HCI_MAX_FRAME_SIZE	(1024 + 4)
+
+struct hci_event_hdr {
+	__u8 evt;
+	__u8 plen;
+} __attribute__ ((packed));
+
+struct hci_acl_hdr {
+	__le16 handle;
+	__le16 dlen;
+} __attribute__ ((packed));
+
+struct hci_sco_hdr {
+	__le16 handle;
+	__u8 dlen;
+} __attribute__ ((packed));
+
+static inline struct hci_event_hdr *hci_event_hdr(const struct sk_buff *skb)
+{
+	return (struct hci_event_hdr *)skb->data;
+}
+
+static inline struct hci_acl_hdr *hci_acl_hdr(const struct sk_buff *skb)
+{
+	return (struct hci_acl_hdr *)skb->data;
+}
+
+static inline struct hci_sco_hdr *hci_sco_hdr(const struct sk_buff *skb)
+{
+	return (struct hci_sco_hdr *)skb->data;
+}
+
+struct hci_dev {
+	char name[8];
+	void *driver_data;
+	struct {
+		u32 err_rx;
+		u32 err_tx;
+		u32 byte_rx;
+		u32 byte_tx;
+	} stat;
+};
+
+int hci_recv_frame(struct hci_dev *hdev, struct sk_buff *skb);
+int hci_recv_stream_fragment(struct hci_dev *hdev, void *data, int count);
+
+/* ---- hci_uart ---- */
+
+#define HCI_UART_MAX_PROTO	8
+#define HCI_UART_H4		0
+#define HCI_UART_3WIRE		2
+
+struct tty_struct {
+	char name[64];
+};
+
+struct hci_uart_proto;
+
+struct hci_uart {
+	struct tty_struct *tty;
+	struct hci_dev *hdev;
+	unsigned long flags;
+	unsigned long tx_state;
+	struct hci_uart_proto *proto;
+	void *priv;
+	struct sk_buff *tx_skb;
+	spinlock_t rx_lock;
+};
+
+struct hci_uart_proto {
+	unsigned int id;
+	int (*open)(struct hci_uart *hu);
+	int (*close)(struct hci_uart *hu);
+	int (*flush)(struct hci_uart *hu);
+	int (*recv)(struct hci_uart *hu, void *data, int len);
+	int (*enqueue)(struct hci_uart *hu, struct sk_buff *skb);
+	struct sk_buff *(*dequeue)(struct hci_uart *hu);
+};
+
+int hci_uart_register_proto(struct hci_uart_proto *p);
+int hci_uart_unregister_proto(struct hci_uart_proto *p);
+struct hci_uart_proto *kshim_get_proto(unsigned int id);
+int hci_uart_tx_wakeup(struct hci_uart *hu);
+
+/* What reached the HCI core and the tty */
+struct kshim_stats {
+	unsigned long rx_pkts[5];	/* by HCI packet type */
+	unsigned long rx_bytes;
+	unsigned long tx_frames;
+};
+
+extern struct kshim_stats kshim_stats;
+
+#endif /* __KSHIM_H */
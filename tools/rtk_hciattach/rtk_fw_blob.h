@@ -0,0 +1,97 @@
+/*
+ *
+ *  Prepared Realtek patch blob
+ *
+ *  rtk_fwprep does the patch layout of rtk_get_final_patch() on the build
+ *  host for one chip, eversion and protocol: epatch entry lookup, project
+ *  id check, config parsing and the fw/config merge. The result is this
+ *  header followed by either the merged fw & config, which the download
+ *  splits into PATCH_DATA_FIELD_MAX_SIZE chunks as it goes, or for H4 the
+ *  complete vendor 0xfc20 commands with their final indexes, ready to be
+ *  written to the uart as they are. The config parsing results travel in
+ *  the header. Only the bdaddr is per device, rtk_hciattach patches it in
+ *  at bdaddr_off. Fields are in host order, the blob is built for a
+ *  little endian target. The same header is used by rtk_hciattach and
+ *  rtk_fwprep.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef __RTK_FW_BLOB_H
+#define __RTK_FW_BLOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "h5_codec.h"
+
+#define RTK_FW_BLOB_MAGIC	0x31424652	/* "RFB1" */
+
+/* What follows the header are H4 0xfc20 commands, not the merged data */
+#define RTK_FW_BLOB_H4_CMDS	(1 << 0)
+
+/* H4 type, opcode, parameter length and index in front of each chunk */
+#define RTK_FW_BLOB_CMD_HDR	5
+#define RTK_FW_BLOB_CHUNK	252	/* PATCH_DATA_FIELD_MAX_SIZE */
+
+struct rtk_fw_blob_hdr {
+	uint32_t magic;
+	uint16_t lmp_subver;
+	uint8_t eversion;
+	uint8_t chip_type;	/* of the patch table entry */
+	uint8_t proto;		/* HCI_UART_H4 or HCI_UART_3WIRE */
+	uint8_t flags;
+	/* results of rtk_parse_config_file() */
+	uint8_t hw_flow_control;
+	uint8_t parity_en;
+	uint8_t parity_even;
+	uint8_t pad[3];
+	uint32_t baudrate;
+	uint32_t svn_ver;
+	uint32_t data_len;	/* merged fw & config */
+	uint32_t bdaddr_off;	/* of the bdaddr in the merged data, 0 if none */
+	uint32_t len;		/* of what follows the header */
+	uint16_t n_cmds;	/* with RTK_FW_BLOB_H4_CMDS */
+	uint16_t crc;		/* H5 CRC-CCITT of what follows the header */
+};
+
+/**
+* Validate a blob read or mapped from a file.
+*
+* @return the header, NULL if the blob is not complete and intact
+*/
+static inline const struct rtk_fw_blob_hdr *
+rtk_fw_blob_check(const uint8_t *blob, size_t size)
+{
+	const struct rtk_fw_blob_hdr *hdr = (const void *)blob;
+
+	if (size < sizeof(*hdr) || hdr->magic != RTK_FW_BLOB_MAGIC ||
+	    hdr->len != size - sizeof(*hdr) ||
+	    h5_crc_buf(0xffff, blob + sizeof(*hdr), hdr->len) != hdr->crc)
+		return NULL;
+
+	return hdr;
+}
+
+/* Where byte off of the merged data is in what follows the header */
+static inline size_t rtk_fw_blob_data_off(const struct rtk_fw_blob_hdr *hdr,
+					  size_t off)
+{
+	if (!(hdr->flags & RTK_FW_BLOB_H4_CMDS))
+		return off;
+
+	return off / RTK_FW_BLOB_CHUNK *
+	       (RTK_FW_BLOB_CMD_HDR + RTK_FW_BLOB_CHUNK) +
+	       RTK_FW_BLOB_CMD_HDR + off % RTK_FW_BLOB_CHUNK;
+}
+
+#endif /* __RTK_FW_BLOB_H */
@@ -0,0 +1,334 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  Module Name:
+ *     rtk_fwprep.c
+ *
+ *  Description:
+ *     Build host side of the prepared Realtek patch, see rtk_fw_blob.h.
+ *     hciattach_rtk.c is built in, so the epatch lookup, project id check,
+ *     config parsing and fw/config merge are the ones rtk_hciattach would
+ *     run on the device. The output is loaded with rtk_hciattach -P.
+ */
+
+#include <stdlib.h>
+#include <getopt.h>
+#include <termios.h>
+
+#include "hciattach_rtk.c"
+
+/* Only the uart setup calls it */
+int set_speed(int fd, struct termios *ti, int speed)
+{
+	(void)fd;
+	(void)ti;
+	(void)speed;
+	return 0;
+}
+
+static uint8_t *read_file(const char *dir, const char *name, size_t *len,
+			  size_t room)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	uint8_t *buf;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	buf = malloc(st.st_size + room);
+	if (!buf || read(fd, buf, st.st_size) != st.st_size) {
+		fprintf(stderr, "%s: short read\n", path);
+		free(buf);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	*len = st.st_size;
+	return buf;
+}
+
+/* Offset of the bdaddr in the parsed config, 0 if it has none */
+static uint32_t config_bdaddr_off(const uint8_t *cfg, size_t len)
+{
+	const struct rtk_bt_vendor_config_entry *entry;
+	uint16_t want = rtk_hw_cfg.patch_ent->chip_type > CHIP_BEFORE ?
+			0x0044 : 0x003c;
+	size_t i;
+
+	for (i = sizeof(struct rtk_bt_vendor_config); i + 3 <= len;
+	     i += 3 + entry->entry_len) {
+		entry = (const void *)(cfg + i);
+		if (le16_to_cpu(entry->offset) == want && entry->entry_len == 6 &&
+		    i + 3 + 6 <= len)
+			return i + 3;
+	}
+
+	return 0;
+}
+
+/**
+* Lay out the merged data as the H4 download sends it: a 0xfc20 command
+* per chunk, the padding commands up to a multiple of 8 and the end
+* command, with the index rolling over past 0x7f.
+*
+* @return number of commands written to dst
+*/
+static int build_h4_cmds(uint8_t *dst, size_t *dst_len, const uint8_t *data,
+			 size_t len)
+{
+	int end_index = (len - 1) / PATCH_DATA_FIELD_MAX_SIZE;
+	int last_len = len % PATCH_DATA_FIELD_MAX_SIZE;
+	int total_index, i, j, n;
+	uint8_t *d = dst;
+
+	/* No commands go out before the H4 download */
+	total_index = end_index;
+	if ((end_index + 1) % 8)
+		total_index += 8 - (end_index + 1) % 8;
+	if (!last_len)
+		last_len = PATCH_DATA_FIELD_MAX_SIZE;
+
+	for (i = 0; i <= total_index; i++) {
+		j = i > 0x7f ? (i & 0x7f) + 1 : i;
+		if (i == total_index)
+			j |= 0x80;
+
+		if (i < end_index)
+			n = PATCH_DATA_FIELD_MAX_SIZE;
+		else if (i == end_index)
+			n = last_len;
+		else
+			n = 0;
+
+		d[0] = HCI_COMMAND_PKT;
+		d[1] = 0x20;
+		d[2] = 0xfc;
+		d[3] = n + 1;
+		d[4] = j;
+		if (n)
+			memcpy(d + RTK_FW_BLOB_CMD_HDR,
+			       data + i * PATCH_DATA_FIELD_MAX_SIZE, n);
+		d += RTK_FW_BLOB_CMD_HDR + n;
+	}
+
+	*dst_len = d - dst;
+	return total_index + 1;
+}
+
+static void usage(void)
+{
+	printf("Usage: rtk_fwprep -l lmp_subver -e eversion [options] -o blob\n"
+	       "  -p h4|h5     protocol, h5 by default\n"
+	       "  -c type      chip type, for the entries matching on it\n"
+	       "  -v ver       HCI version, for the entries matching on it\n"
+	       "  -r rev       HCI revision, for the entries matching on it\n"
+	       "  -d dir       firmware and config directory (.)\n"
+	       "  -x file      extra config, as %s on the device\n"
+	       "  -a bdaddr    add a bdaddr to the config; the device replaces\n"
+	       "               it with %s\n"
+	       "  -C           H4 only: store the complete download commands\n",
+	       EXTRA_CONFIG_FILE, BT_ADDR_FILE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct btrtl_info *rtl = &rtk_hw_cfg;
+	struct rtk_fw_blob_hdr hdr;
+	struct patch_info *ent;
+	const char *dir = ".", *out = NULL, *extra = NULL, *addr = NULL;
+	uint8_t bt_addr[6] = { 0x00, 0xe0, 0x4c, 0x88, 0x88, 0x88 };
+	uint8_t *cfg, *payload;
+	uint32_t baudrate = 0, bdaddr_off = 0;
+	size_t fw_len, cfg_len, payload_len;
+	int opt, cmds = 0, n_cmds = 0;
+	int have_lmp = 0, have_ev = 0;
+	int fd, i;
+
+	DBG_ON = 0;
+	rtl->proto = HCI_UART_3WIRE;
+
+	while ((opt = getopt(argc, argv, "l:e:p:c:v:r:d:x:a:Co:h")) != -1) {
+		switch (opt) {
+		case 'l':
+			rtl->lmp_subver = strtoul(optarg, NULL, 16);
+			have_lmp = 1;
+			break;
+		case 'e':
+			rtl->eversion = strtoul(optarg, NULL, 0);
+			have_ev = 1;
+			break;
+		case 'p':
+			if (!strcmp(optarg, "h4")) {
+				rtl->proto = HCI_UART_H4;
+			} else if (strcmp(optarg, "h5")) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'c':
+			rtl->chip_type = strtoul(optarg, NULL, 16);
+			break;
+		case 'v':
+			rtl->hci_ver = strtoul(optarg, NULL, 16);
+			break;
+		case 'r':
+			rtl->hci_rev = strtoul(optarg, NULL, 16);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'x':
+			extra = optarg;
+			break;
+		case 'a':
+			addr = optarg;
+			break;
+		case 'C':
+			cmds = 1;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		default:
+			usage();
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!have_lmp || !have_ev || !out ||
+	    (cmds && rtl->proto != HCI_UART_H4)) {
+		usage();
+		return 1;
+	}
+
+	if (addr) {
+		if (bachk(addr) < 0) {
+			fprintf(stderr, "Invalid bdaddr %s\n", addr);
+			return 1;
+		}
+		for (i = 5; i >= 0; i--, addr += 3)
+			bt_addr[i] = strtoul(addr, NULL, 16);
+		customer_bdaddr = 1;
+	}
+
+	ent = get_patch_entry(rtl);
+	if (!ent->lmp_subver) {
+		fprintf(stderr, "No patch entry for lmp subver %04x\n",
+			rtl->lmp_subver);
+		return 1;
+	}
+	if (ent->chip_type == CHIP_8761BTC || ent->chip_type == CHIP_8761B) {
+		fprintf(stderr, "%s takes no patch\n", ent->ic_name);
+		return 1;
+	}
+	rtl->patch_ent = ent;
+
+	rtl->fw_buf = read_file(dir, ent->patch_file, &fw_len, 0);
+	/* Room for the bdaddr and the extra config entries */
+	cfg = read_file(dir, ent->config_file, &cfg_len, 9 + 7 + 4);
+	if (!rtl->fw_buf || !cfg)
+		return 1;
+
+	config_flags = 0;
+	if (extra) {
+		config_file_proc(extra);
+		if (!xtalset_supported())
+			config_flags &= ~CONFIG_XTAL;
+	}
+
+	rtl->config_buf = rtk_parse_config_file(cfg, &cfg_len, bt_addr,
+						&baudrate);
+	if (!rtl->config_buf) {
+		fprintf(stderr, "Invalid config %s\n", ent->config_file);
+		return 1;
+	}
+	rtl->baudrate = baudrate;
+	rtl->fw_len = fw_len;
+	rtl->config_len = cfg_len;
+
+	bdaddr_off = config_bdaddr_off(rtl->config_buf, cfg_len);
+
+	/* Frees fw_buf and config_buf */
+	rtk_get_final_patch(-1, rtl->proto);
+	if (!rtl->dl_fw_flag || rtl->total_len <= 0) {
+		fprintf(stderr, "Can't lay out %s for %s\n", ent->patch_file,
+			ent->ic_name);
+		return 1;
+	}
+	if (rtl->total_len > RTK_PATCH_LENGTH_MAX) {
+		fprintf(stderr, "Patch of %d bytes is too long\n",
+			rtl->total_len);
+		return 1;
+	}
+	if (bdaddr_off)
+		bdaddr_off += rtl->total_len - cfg_len;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = RTK_FW_BLOB_MAGIC;
+	hdr.lmp_subver = rtl->lmp_subver;
+	hdr.eversion = rtl->eversion;
+	hdr.chip_type = ent->chip_type;
+	hdr.proto = rtl->proto;
+	hdr.hw_flow_control = rtl->hw_flow_control;
+	hdr.parity_en = rtl->parity_en;
+	hdr.parity_even = rtl->parity_even;
+	hdr.baudrate = rtl->baudrate;
+	if (rtl->total_len - cfg_len >= 8)
+		hdr.svn_ver = get_unaligned_le32(rtl->total_buf +
+						 rtl->total_len - cfg_len - 8);
+	hdr.data_len = rtl->total_len;
+	hdr.bdaddr_off = bdaddr_off;
+
+	if (cmds) {
+		/* A header per chunk, at most 7 padding and the end command */
+		payload = malloc(rtl->total_len + 5 * (rtl->total_len /
+			PATCH_DATA_FIELD_MAX_SIZE + 1) + 8 * 5);
+		if (!payload)
+			return 1;
+		n_cmds = build_h4_cmds(payload, &payload_len, rtl->total_buf,
+				       rtl->total_len);
+		hdr.flags |= RTK_FW_BLOB_H4_CMDS;
+		hdr.n_cmds = n_cmds;
+	} else {
+		payload = rtl->total_buf;
+		payload_len = rtl->total_len;
+	}
+	hdr.len = payload_len;
+	hdr.crc = h5_crc_buf(0xffff, payload, payload_len);
+
+	fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, payload, payload_len) != (ssize_t)payload_len) {
+		fprintf(stderr, "Can't write %s, %s\n", out, strerror(errno));
+		return 1;
+	}
+	close(fd);
+
+	printf("%s: %s %s, lmp subver %04x, eversion %u, %s\n", out,
+	       ent->ic_name, ent->patch_file, hdr.lmp_subver, hdr.eversion,
+	       hdr.proto == HCI_UART_H4 ? "h4" : "h5");
+	printf("  fw & config %u bytes, svn %u, baudrate 0x%08x%s\n",
+	       hdr.data_len, hdr.svn_ver, hdr.baudrate,
+	       bdaddr_off ? ", bdaddr patched on the device" : "");
+	if (n_cmds)
+		printf("  %d H4 commands, %zu bytes\n", n_cmds, payload_len);
+
+	return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  Module Name:
+ *     rtk_replay.c
+ *
+ *  Description:
+ *     Build hciattach_rtk.c into h5_replay and give it access to the
+ *     static h5_recv() of the attach path. Allocations of the parser are
+ *     counted by wrapping malloc().
+ */
+
+#include <stdlib.h>
+#include <termios.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "rtk_replay.h"
+
+unsigned long rtk_replay_allocs;
+
+/* stdlib.h and malloc.h are in, so only the calls below see this */
+#define malloc(n)	(rtk_replay_allocs++, malloc(n))
+
+#include "hciattach_rtk.c"
+
+#undef malloc
+
+/* Never called from the receive path, hciattach.c has the real one */
+int set_speed(int fd, struct termios *ti, int speed)
+{
+	(void)fd;
+	(void)ti;
+	(void)speed;
+	return 0;
+}
+
+int rtk_replay_init(int ack_fd, int debug)
+{
+	DBG_ON = debug;
+
+	if (!rtk_snoop.ring && hci_snoop_init(&rtk_snoop, RTK_SNOOP_RECORDS))
+		return -1;
+
+	rtk_replay_reset(ack_fd);
+	return 0;
+}
+
+/* Start over as in the middle of a patch download: events complete the
+ * download commands, anything else is answered with a pure ack on ack_fd */
+void rtk_replay_reset(int ack_fd)
+{
+	if (rtk_hw_cfg.rx_skb)
+		skb_free(rtk_hw_cfg.rx_skb);
+
+	rtk_hw_cfg.rx_skb = NULL;
+	rtk_hw_cfg.rx_state = H5_W4_PKT_DELIMITER;
+	rtk_hw_cfg.rx_esc_state = H5_ESCSTATE_NOESC;
+	rtk_hw_cfg.rx_count = 0;
+	rtk_hw_cfg.rxseq_txack = 0;
+	rtk_hw_cfg.rxack = 0;
+	rtk_hw_cfg.msgq_txseq = 0;
+	rtk_hw_cfg.use_crc = 1;
+	rtk_hw_cfg.link_estab_state = H5_PATCH;
+	rtk_hw_cfg.serial_fd = ack_fd;
+	/* Out-of-order packets must not resync to the sender's seq, that
+	 * only happens once the last patch packet went out */
+	rtk_hw_cfg.tx_index = 0;
+	rtk_hw_cfg.total_num = 1;
+	rtk_snoop.head = 0;
+}
+
+void rtk_replay_feed(const uint8_t *buf, size_t len)
+{
+	h5_recv(&rtk_hw_cfg, (void *)buf, len);
+
+	/* The last download response ends the patch phase */
+	rtk_hw_cfg.link_estab_state = H5_PATCH;
+}
+
+unsigned long rtk_replay_pkts(void)
+{
+	return rtk_snoop.head;
+}
@@ -0,0 +1,42 @@
+/*
+ *
+ *  Access to the rtk_hciattach H5 receive path for h5_replay
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef __RTK_REPLAY_H
+#define __RTK_REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* malloc() calls made by hciattach_rtk.c */
+extern unsigned long rtk_replay_allocs;
+
+/**
+* Set up the parser state of a patch download in progress.
+*
+* @param ack_fd where pure acks are written, e.g. /dev/null
+* @param debug value of DBG_ON, which is on in rtk_hciattach
+* @return #0 on success, -1 if out of memory
+*/
+int rtk_replay_init(int ack_fd, int debug);
+void rtk_replay_reset(int ack_fd);
+
+/* Run bytes from the uart through h5_recv() */
+void rtk_replay_feed(const uint8_t *buf, size_t len);
+
+/* HCI packets passed up since the last reset */
+unsigned long rtk_replay_pkts(void);
+
+#endif /* __RTK_REPLAY_H */